@@ -8,9 +8,9 @@ find_path(LIBNL_INCLUDE_DIR netlink/netlink.h
 find_library(LIBNL_LIBRARY NAMES nl nl-3 REQUIRED)
 find_library(LIBNL_ROUTE_LIBRARY NAMES nl-route nl-route-3 REQUIRED)
 #find_library(LIBNL_NETFILTER_LIBRARY NAMES nl-nf nl-nf-3 REQUIRED)
-#find_library(LIBNL_GENL_LIBRARY NAMES nl-genl nl-genl-3 REQUIRED)
+find_library(LIBNL_GENL_LIBRARY NAMES nl-genl nl-genl-3 REQUIRED)
 
 set(LIBNL_FOUND TRUE)
-set(LIBNL_LIBRARIES ${LIBNL_LIBRARY} ${LIBNL_ROUTE_LIBRARY})
+set(LIBNL_LIBRARIES ${LIBNL_LIBRARY} ${LIBNL_ROUTE_LIBRARY} ${LIBNL_GENL_LIBRARY})
 message("Found netlink includes: ${LIBNL_INCLUDE_DIR}")
 message("Found netlink libraries:  ${LIBNL_LIBRARIES}")
@@ -0,0 +1,69 @@
+/*
+ * inc/mm_capture.h: QMI traffic capture helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_CAPTURE_H
+#define MM_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MM_CAPTURE_MAGIC "MMQC"
+#define MM_CAPTURE_VERSION 1U
+#define MM_CAPTURE_FILE_HEADER_SIZE 16U
+#define MM_CAPTURE_RECORD_HEADER_SIZE 16U
+#define MM_CAPTURE_MAX_PACKET_SIZE 0xFFFFU
+
+enum mm_capture_record_type {
+    MM_CAPTURE_RECORD_REQUEST = 0,
+    MM_CAPTURE_RECORD_RESPONSE = 1,
+    MM_CAPTURE_RECORD_INDICATION = 2,
+};
+
+/*
+ * On-disk layout (all fields little-endian):
+ *
+ *   file header:   magic[4], version u16, reserved u16, realtime_us u64
+ *   record header: monotonic_us u64, message_id u16, length u16,
+ *                  type u8, service u8, client_id u8, modem u8
+ *
+ * ... with each record header immediately followed by 'length' bytes of
+ * the raw QMI message exactly as it was handed to or by the SDK.
+ */
+struct mm_capture_record {
+    uint64_t monotonic_us;
+    uint16_t message_id;
+    uint16_t length;
+    uint8_t type;
+    uint8_t service;
+    uint8_t client_id;
+    uint8_t modem;
+    uint8_t packet[MM_CAPTURE_MAX_PACKET_SIZE];
+};
+
+struct mm_capture_reader {
+    FILE *f;
+    uint64_t realtime_us;
+};
+
+bool mm_capture_is_active(void);
+int mm_capture_open(const char *);
+void mm_capture_close(void);
+
+void mm_capture_record(enum mm_capture_record_type, uint8_t, uint8_t,
+        uint8_t, uint16_t, const uint8_t *, uint16_t);
+
+int mm_capture_reader_open(struct mm_capture_reader *, const char *);
+int mm_capture_reader_next(struct mm_capture_reader *,
+        struct mm_capture_record *);
+
+void mm_capture_reader_close(struct mm_capture_reader *);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * inc/mm_clock.h: System clock seeding from modem network time
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_CLOCK_H
+#define MM_CLOCK_H
+
+#include "mm_qmux.h"
+
+#include <stdbool.h>
+
+/*
+ * Network (NITZ) time only has a resolution of one second, so it's only
+ * used to step the clock when it's wildly off (e.g. after a cold boot with
+ * no RTC); otherwise, it is left to chrony to weigh against NTP sources.
+ */
+#define MM_CLOCK_STEP_THRESHOLD_S 30
+
+/*
+ * Samples are handed to chrony over its SOCK refclock interface, e.g.:
+ *   refclock SOCK /run/chrony/modem-monitor.sock refid NITZ precision 1
+ */
+#define MM_CLOCK_CHRONY_SOCKET "/run/chrony/modem-monitor.sock"
+#define MM_CLOCK_CHRONY_INTERVAL_S 64U
+
+int mm_clock_initialize(struct mm_qmux *);
+int mm_clock_shutdown(struct mm_qmux *);
+int mm_clock_sync_from_modem(bool);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * inc/mm_config.h: Configuration file and hot reload functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_CONFIG_H
+#define MM_CONFIG_H
+
+#include "mm_netlink.h"
+#include "mm_wds.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The config file holds one "<keyword> <value...>" per line:
+ *
+ *   profile <3GPP profile index>
+ *   autoconnect disabled|enabled|paused
+ *   roaming always|home-only
+ *   wg0-address <address>          (source of traffic over the tunnel)
+ *   wg0-gateway <address>          (until a Wireguard peer is selected)
+ *   wg0-route <network>/<prefix>   (any number of them)
+ *   unit <name> [after-tunnel]     (any number of them)
+ *
+ * Anything left out keeps its default. Units are stopped while the modem
+ * is down and started once it's up: "after-tunnel" units only once the
+ * Wireguard tunnel is also up.
+ */
+#define MM_CONFIG_DIRECTORY "/etc/modem-monitor"
+#define MM_CONFIG_FILE_NAME "modem-monitor.conf"
+#define MM_CONFIG_PATH MM_CONFIG_DIRECTORY "/" MM_CONFIG_FILE_NAME
+
+#define MM_CONFIG_MAX_ROUTES MM_NETLINK_MAX_WG0_ROUTES
+#define MM_CONFIG_MAX_UNITS 8U
+#define MM_CONFIG_UNIT_NAME_SIZE 64U
+
+/*
+ * The file is parsed into a snapshot which is never modified once it's
+ * published. It is reloaded on SIGHUP or whenever it is written, and each
+ * modem is told (by MM_EVENT_CONFIG_CHANGED) to diff the new snapshot
+ * against the one it last applied, applying only what changed.
+ */
+enum mm_config_change {
+    MM_CONFIG_CHANGED_PROFILE = 1U << 0,
+    MM_CONFIG_CHANGED_AUTOCONNECT = 1U << 1,
+    MM_CONFIG_CHANGED_WG0 = 1U << 2,
+    MM_CONFIG_CHANGED_UNITS = 1U << 3,
+};
+
+struct mm_config_unit {
+    char name[MM_CONFIG_UNIT_NAME_SIZE];
+    bool after_tunnel;
+};
+
+struct mm_config {
+    uint64_t generation;
+    uint32_t profile;
+
+    enum mm_wds_autoconnect_setting autoconnect;
+    enum mm_wds_autoconnect_roam_setting roaming;
+
+    uint32_t wg0_address, wg0_gateway;
+    struct mm_netlink_route wg0_routes[MM_CONFIG_MAX_ROUTES];
+    unsigned wg0_route_count;
+
+    struct mm_config_unit units[MM_CONFIG_MAX_UNITS];
+    unsigned unit_count;
+};
+
+__attribute__(( pure ))
+unsigned mm_config_diff(const struct mm_config *, const struct mm_config *);
+
+void mm_config_get(struct mm_config *);
+
+__attribute__(( pure ))
+bool mm_config_has_unit(const struct mm_config *,
+        const struct mm_config_unit *);
+
+int mm_config_load(const char *, struct mm_config *);
+
+void mm_config_request_reload(void);
+
+int mm_config_start(void);
+void mm_config_stop(void);
+
+#endif
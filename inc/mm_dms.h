@@ -11,10 +11,13 @@
 #ifndef MM_DMS_H
 #define MM_DMS_H
 
-#include <CtlService.h>
-#include <QmiService.h>
+#include "mm_events.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_qmux.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 enum mm_dms_operation_mode {
     MM_DMS_OPERATION_MODE_ONLINE = 0,
@@ -29,22 +32,48 @@ enum mm_dms_operation_mode {
     MM_DMS_OPERATION_MODE_INVALID = 255,
 };
 
+/* Thermal state as judged by the modem firmware against its own limits. */
+enum mm_dms_thermal_state {
+    MM_DMS_THERMAL_STATE_NORMAL = 0,
+    MM_DMS_THERMAL_STATE_HIGH_WARNING = 1,
+    MM_DMS_THERMAL_STATE_HIGH_CRITICAL = 2,
+    MM_DMS_THERMAL_STATE_LOW_CRITICAL = 3,
+    MM_DMS_THERMAL_STATE_MAX = 4,
+    MM_DMS_THERMAL_STATE_INVALID = 255,
+};
+
 struct mm_dms_service {
-    QmiService dms_service;
-    QmiService swi_dms_service;
+    struct mm_qmi_client dms_service;
+    struct mm_qmi_client swi_dms_service;
     char *model_id;
+
+    /* Last operating mode reported by an event report indication. */
+    enum mm_dms_operation_mode reported_mode;
+
+    /* The event loop of the modem this client belongs to. */
+    struct mm_events *events;
 };
 
 __attribute__(( pure ))
 const char *mm_dms_get_operation_mode_string(enum mm_dms_operation_mode);
 
+__attribute__(( pure ))
+const char *mm_dms_get_thermal_state_string(enum mm_dms_thermal_state);
+
 int mm_dms_get_power_sync(struct mm_dms_service *,
         enum mm_dms_operation_mode *, bool *);
 
+int mm_dms_get_temperature_sync(struct mm_dms_service *, int16_t *,
+        enum mm_dms_thermal_state *);
+
 int mm_dms_set_power_sync(struct mm_dms_service *,
         enum mm_dms_operation_mode, enum mm_dms_operation_mode *);
 
-int mm_dms_initialize(struct mm_dms_service *, CtlService *);
-int mm_dms_shutdown(struct mm_dms_service *, CtlService *, bool);
+void mm_dms_indication_callback(uint8_t *, uint16_t, void *);
+void mm_dms_native_indication_callback(const struct mm_qmi_message *,
+        void *);
+
+int mm_dms_initialize(struct mm_dms_service *, struct mm_qmux *);
+int mm_dms_shutdown(struct mm_dms_service *, struct mm_qmux *, bool);
 
 #endif
@@ -0,0 +1,44 @@
+/*
+ * inc/mm_drift.h: Route, address and link drift guard
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_DRIFT_H
+#define MM_DRIFT_H
+
+#include "mm_netlink.h"
+#include "mm_wds.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Other agents (dhcpcd, NetworkManager, a stray "ip" command) may remove
+ * what we applied to the kernel. A thread watches for links changing and
+ * addresses or routes going away (or default routes being replaced), and
+ * posts MM_EVENT_NETLINK_CHANGED. Each connected modem then compares the
+ * kernel's state against its own (see mm_netlink_restore_drift) and puts
+ * back whatever went missing.
+ *
+ * So as not to fight another agent in a tight loop, a modem makes at most
+ * MM_DRIFT_MAX_CORRECTIONS within MM_DRIFT_WINDOW_S. Beyond that, drift is
+ * left pending until the window ends.
+ */
+#define MM_DRIFT_MAX_CORRECTIONS 10U
+#define MM_DRIFT_WINDOW_S 60U
+
+void mm_drift_check(unsigned, struct mm_netlink *,
+        const struct mm_wds_runtime_settings *);
+
+bool mm_drift_is_pending(unsigned);
+void mm_drift_write_metrics(FILE *, void *);
+
+int mm_drift_start(void);
+void mm_drift_stop(void);
+
+#endif
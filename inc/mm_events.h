@@ -0,0 +1,69 @@
+/*
+ * inc/mm_events.h: Main loop event signaling functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_EVENTS_H
+#define MM_EVENTS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Indication callbacks (and other helper threads) post events here to wake
+ * a modem's event loop immediately, rather than waiting for it to poll. Any
+ * state associated with an event must be written before it is posted.
+ */
+enum mm_event {
+    MM_EVENT_MODEM_HOTPLUG = 1U << 0,
+    MM_EVENT_OPERATING_MODE = 1U << 1,
+    MM_EVENT_SESSION_TEARDOWN = 1U << 2,
+    MM_EVENT_SESSION_TRANSIENT = 1U << 4,
+    MM_EVENT_UPLINK_CHANGED = 1U << 5,
+    MM_EVENT_CONFIG_CHANGED = 1U << 6,
+    MM_EVENT_NETLINK_CHANGED = 1U << 7,
+    MM_EVENT_SUSPEND = 1U << 8,
+    MM_EVENT_RESUME = 1U << 9,
+};
+
+/*
+ * Each modem's event loop waits on its own queue. Events which concern one
+ * modem (e.g. its indications) are posted to its queue alone; host-wide
+ * ones (e.g. an uplink change) are posted to every queue.
+ */
+#define MM_EVENTS_MAX_QUEUES 8U
+
+/*
+ * A queue can also watch one file descriptor (e.g. a QMI device) on behalf
+ * of the thread waiting on it: whenever it's readable, that thread runs the
+ * handler from within mm_events_wait. Should the handler return non-zero,
+ * the descriptor is dropped. Posting events then wakes the waiter through
+ * an eventfd rather than the condition variable.
+ */
+typedef int (*mm_events_io_handler)(void *);
+
+struct mm_events {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned pending;
+
+    int wake_fd;
+    int io_fd;
+    mm_events_io_handler io_handler;
+    void *io_context;
+};
+
+int mm_events_initialize(struct mm_events *);
+void mm_events_destroy(struct mm_events *);
+
+void mm_events_post(unsigned);
+void mm_events_post_to(struct mm_events *, unsigned);
+void mm_events_set_io(struct mm_events *, int, mm_events_io_handler, void *);
+unsigned mm_events_wait(struct mm_events *, uint64_t);
+
+#endif
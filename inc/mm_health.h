@@ -0,0 +1,42 @@
+/*
+ * inc/mm_health.h: Modem health (thermal) tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_HEALTH_H
+#define MM_HEALTH_H
+
+#include "mm_dms.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Temperature is cheap to query, but there's no need to do so often. */
+#define MM_HEALTH_SAMPLE_INTERVAL_S 60U
+
+/*
+ * The modem is considered to be thermally throttling once it says so (its
+ * thermal state leaves Normal), or once it reaches the throttle temperature
+ * regardless. It's only considered recovered once it has cooled below the
+ * recovery temperature, so that we don't flap around the threshold.
+ */
+#define MM_HEALTH_THROTTLE_TEMPERATURE_C 80
+#define MM_HEALTH_RECOVERY_TEMPERATURE_C 75
+
+/* How long to let the modem cool off before reconnecting when throttled. */
+#define MM_HEALTH_COOLDOWN_S 60U
+
+/* Each modem (as numbered by mm_hotplug) is tracked on its own. */
+bool mm_health_is_thermally_throttled(unsigned);
+
+void mm_health_record_error(unsigned);
+void mm_health_record_sample(unsigned, int16_t, enum mm_dms_thermal_state);
+void mm_health_write_metrics(FILE *, void *);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * inc/mm_histogram.h: Compact log-linear histogram functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_HISTOGRAM_H
+#define MM_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Values are bucketed linearly below 2^MM_HISTOGRAM_SUB_BUCKET_BITS, and
+ * then into that many linear sub-buckets per power of two above it. With
+ * 3 bits, any value reported back is within 12.5% of what was recorded.
+ */
+#define MM_HISTOGRAM_SUB_BUCKET_BITS 3U
+#define MM_HISTOGRAM_SUB_BUCKETS (1U << MM_HISTOGRAM_SUB_BUCKET_BITS)
+#define MM_HISTOGRAM_BUCKETS \
+    ((33U - MM_HISTOGRAM_SUB_BUCKET_BITS) * MM_HISTOGRAM_SUB_BUCKETS)
+
+struct mm_histogram {
+    uint32_t buckets[MM_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint32_t max;
+};
+
+void mm_histogram_merge(struct mm_histogram *, const struct mm_histogram *);
+void mm_histogram_record(struct mm_histogram *, uint64_t);
+
+__attribute__(( pure ))
+uint32_t mm_histogram_percentile(const struct mm_histogram *, unsigned);
+
+#endif
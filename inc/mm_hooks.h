@@ -0,0 +1,51 @@
+/*
+ * inc/mm_hooks.h: Site-specific hooks run on connection events
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_HOOKS_H
+#define MM_HOOKS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Every executable in the hooks directory (save for dotfiles) is run on
+ * each event, with the event as its only argument and the details in its
+ * environment:
+ *
+ *   MM_EVENT          connect, disconnect or address-change
+ *   MM_MODEM          the modem's index
+ *   MM_INTERFACE      its WWAN host interface
+ *   MM_ADDRESS, MM_PREFIX_LENGTH, MM_GATEWAY   its IPv4 settings
+ *
+ * Hooks run on a thread of their own, so they never hold up a connect:
+ * the caller only queues the event. Events are handled in order, with an
+ * event's hooks run concurrently (up to MM_HOOKS_MAX_RUNNING at once) and
+ * killed should they outlast MM_HOOKS_TIMEOUT_S. Should events back up past
+ * MM_HOOKS_MAX_QUEUED, the oldest are dropped.
+ */
+#define MM_HOOKS_DIRECTORY "/etc/modem-monitor/hooks.d"
+#define MM_HOOKS_MAX_QUEUED 32U
+#define MM_HOOKS_MAX_RUNNING 4U
+#define MM_HOOKS_TIMEOUT_S 30U
+
+enum mm_hook_event {
+    MM_HOOK_CONNECT = 0,
+    MM_HOOK_DISCONNECT = 1,
+    MM_HOOK_ADDRESS_CHANGE = 2,
+};
+
+void mm_hooks_dispatch(enum mm_hook_event, unsigned, const char *, uint32_t,
+        int, uint32_t);
+
+int mm_hooks_start(void);
+void mm_hooks_stop(void);
+void mm_hooks_write_metrics(FILE *, void *);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * inc/mm_hotplug.h: Modem hotplug tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_HOTPLUG_H
+#define MM_HOTPLUG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The modem is considered present only once both its QMI character device
+ * (via kernel uevents) and its WWAN host interface (via RTNLGRP_LINK) exist.
+ * Every change in presence bumps a generation counter, so anything holding
+ * on to resources of an earlier incarnation of the modem can tell that they
+ * have gone stale, even if the modem has since come back.
+ *
+ * Modems are numbered by their QMI port: modem N is /dev/wwanNqmi0 with
+ * the mhi_hwipN host interface. Each is tracked on its own.
+ */
+#define MM_HOTPLUG_MAX_MODEMS 4U
+
+uint64_t mm_hotplug_get_generation(unsigned);
+unsigned mm_hotplug_get_present_modems(void);
+bool mm_hotplug_is_modem_present(unsigned);
+
+int mm_hotplug_start(void);
+void mm_hotplug_stop(void);
+
+int mm_hotplug_wait_for_modem(unsigned, const bool *, uint64_t *);
+unsigned mm_hotplug_wait_for_new_modems(unsigned);
+
+#endif
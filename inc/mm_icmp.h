@@ -0,0 +1,29 @@
+/*
+ * inc/mm_icmp.h: ICMP echo helpers for latency probes
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_ICMP_H
+#define MM_ICMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Probes are echo requests identified by our PID and a sequence number,
+ * sent over raw sockets (so replies come with their IP header). Headers are
+ * copied in and out of packet buffers, which need not be aligned.
+ */
+__attribute__(( pure ))
+uint16_t mm_icmp_checksum(const void *, size_t);
+
+bool mm_icmp_read_echo_reply(const uint8_t *, size_t, uint16_t, size_t *);
+void mm_icmp_write_echo(uint8_t *, size_t, uint16_t);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * inc/mm_metrics.h: Metrics export helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_METRICS_H
+#define MM_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MM_METRICS_DIRECTORY "/run/modem-monitor"
+#define MM_METRICS_PATH MM_METRICS_DIRECTORY "/metrics.prom"
+#define MM_METRICS_FLUSH_INTERVAL_S 15U
+#define MM_METRICS_MAX_WRITERS 16U
+
+typedef void (*mm_metrics_writer)(FILE *, void *);
+
+int mm_metrics_register(mm_metrics_writer, void *);
+void mm_metrics_unregister(mm_metrics_writer, void *);
+int mm_metrics_flush(void);
+void mm_metrics_write(FILE *);
+
+void mm_metrics_write_seconds(FILE *, uint64_t);
+
+#endif
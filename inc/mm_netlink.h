@@ -12,12 +12,25 @@
 #define MM_NETLINK_H
 
 #include <libnl3/netlink/netlink.h>
+#include <net/if.h>
 #include <netinet/in.h>
 
 #include <stdbool.h>
 #include <stdint.h>
 
+/* The WWAN host interface of modem N; see MM_HOTPLUG_MAX_MODEMS. */
+#define MM_NETLINK_WWAN_INTERFACE_FORMAT "mhi_hwip%u"
+
+/* Routes sent over wg0 (as configured; see mm_config.h). */
+#define MM_NETLINK_MAX_WG0_ROUTES 8U
+
+struct mm_netlink_route {
+    uint32_t address;
+    int prefix_length;
+};
+
 struct mm_netlink {
+    char wwan_ifname[IF_NAMESIZE];
     struct nl_sock *nl;
     struct nl_cache *link_cache_v4;
     struct nl_cache *link_cache_v6;
@@ -42,6 +55,9 @@ struct mm_netlink {
     struct nl_addr *wg0_tgt_address;
     struct rtnl_route *wg0_tgt_route;
     struct rtnl_nexthop *wg0_tgt_nexthop;
+    struct mm_netlink_route wg0_routes[MM_NETLINK_MAX_WG0_ROUTES];
+    unsigned wg0_route_count;
+    bool wg0_routes_applied;
     int wwan_ifindex;
     int wg0_ifindex;
 };
@@ -56,6 +72,8 @@ int mm_netlink_change_v4_default_gateway(struct mm_netlink *, uint32_t,
 int mm_netlink_change_v6_default_gateway(struct mm_netlink *,
         const struct in6_addr *, const struct in6_addr *, int);
 
+int mm_netlink_change_wg0_gateway(struct mm_netlink *, uint32_t);
+
 int mm_netlink_ensure_v4_configuration_is_applied(struct mm_netlink *,
         uint32_t, int, uint32_t);
 
@@ -63,11 +81,20 @@ int mm_netlink_ensure_v4_configuration_is_applied(struct mm_netlink *,
 int mm_netlink_ensure_wg0_interface_state(struct mm_netlink *, bool);
 int mm_netlink_ensure_wg0_routes_are_applied(struct mm_netlink *);
 int mm_netlink_ensure_wwan_interface_state(struct mm_netlink *, bool);
+int mm_netlink_get_wwan_statistics(struct mm_netlink *, uint64_t *,
+        uint64_t *);
+
 int mm_netlink_reload_address_cache(struct mm_netlink *);
 int mm_netlink_reload_link_cache(struct mm_netlink *);
+int mm_netlink_restore_drift(struct mm_netlink *, uint32_t, int, uint32_t,
+        unsigned *);
+
+void mm_netlink_set_v4_default_route_table(struct mm_netlink *, uint32_t);
+int mm_netlink_set_wg0_routes(struct mm_netlink *, uint32_t, uint32_t,
+        const struct mm_netlink_route *, unsigned);
 
 int mm_netlink_addr_flush(struct mm_netlink *);
-int mm_netlink_initialize(struct mm_netlink *);
+int mm_netlink_initialize(struct mm_netlink *, unsigned);
 void mm_netlink_shutdown(struct mm_netlink *);
 
 #endif
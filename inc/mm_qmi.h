@@ -0,0 +1,79 @@
+/*
+ * inc/mm_qmi.h: QMI request helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_QMI_H
+#define MM_QMI_H
+
+#include "mm_qmi_engine.h"
+
+#include <QmiService.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Latency is tracked per modem, so allow for a few modems' worth. */
+#define MM_QMI_MAX_TRACKED_MESSAGES 128U
+
+/* Message IDs of the QMI requests issued by the daemon. */
+enum mm_qmi_message_id {
+    MM_QMI_DMS_SET_EVENT_REPORT = 0x0001,
+    MM_QMI_DMS_GET_MODEL_ID = 0x0022,
+    MM_QMI_DMS_GET_OPERATING_MODE = 0x002D,
+    MM_QMI_DMS_SET_OPERATING_MODE = 0x002E,
+
+    MM_QMI_SWIDMS_GET_TEMPERATURE = 0x0057,
+
+    MM_QMI_NAS_GET_NETWORK_TIME = 0x0069,
+
+    MM_QMI_WDS_START_NETWORK_INTERFACE = 0x0020,
+    MM_QMI_WDS_STOP_NETWORK_INTERFACE = 0x0021,
+    MM_QMI_WDS_GET_PKT_SRVC_STATUS = 0x0022,
+    MM_QMI_WDS_GET_RUNTIME_SETTINGS = 0x002D,
+    MM_QMI_WDS_GET_AUTOCONNECT_SETTING = 0x0034,
+    MM_QMI_WDS_SET_CLIENT_IP_FAMILY_PREF = 0x004D,
+    MM_QMI_WDS_SET_AUTOCONNECT_SETTINGS = 0x0051,
+};
+
+/*
+ * A client of one QMI service. It is served either by the SDK or, where
+ * the modem's transport was opened natively, by the built-in QMI engine.
+ */
+struct mm_qmi_client {
+    QmiService service;
+    struct mm_qmi_engine *engine;
+    bool native;
+
+    uint8_t service_type;
+    uint8_t client_id;
+    uint8_t modem;
+};
+
+typedef void (*mm_qmi_sdk_indication_callback)(uint8_t *, uint16_t, void *);
+
+/* Answers a request in place of the modem by handing over a response. */
+typedef int (*mm_qmi_fake_transport)(void *, uint8_t, uint16_t,
+        uint8_t **, uint16_t *);
+
+int mm_qmi_send_native_request(struct mm_qmi_client *,
+        struct mm_qmi_request *, struct mm_qmi_message *, int);
+
+int mm_qmi_send_sync_request(struct mm_qmi_client *, uint16_t,
+        pack_func, const char *, void *,
+        unpack_func, const char *, void *, int);
+
+int mm_qmi_send_sync_request_no_input(struct mm_qmi_client *, uint16_t,
+        pack_func_no_input, const char *,
+        unpack_func, const char *, void *, int);
+
+void mm_qmi_set_fake_transport(mm_qmi_fake_transport, void *);
+void mm_qmi_write_metrics(FILE *, void *);
+
+#endif
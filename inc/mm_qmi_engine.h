@@ -0,0 +1,127 @@
+/*
+ * inc/mm_qmi_engine.h: Native QMI protocol engine
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_QMI_ENGINE_H
+#define MM_QMI_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Speaks QMUX straight to the modem's QMI character device, in place of
+ * the SDK's transport (and its threads). The device is non-blocking: the
+ * owning modem's event loop polls it alongside its own events, and requests
+ * poll it until their response arrives, dispatching any indications that
+ * turn up in the meantime. An engine belongs to that one thread.
+ *
+ * Messages are decoded where they lie in the receive buffer: a response is
+ * only valid until the next call into the engine.
+ */
+#define MM_QMI_ENGINE_BUFFER_SIZE 16384U
+#define MM_QMI_ENGINE_MAX_CLIENTS 8U
+#define MM_QMI_ENGINE_CTL_TIMEOUT_S 5
+
+#define MM_QMI_QMUX_HEADER_SIZE 6U
+#define MM_QMI_SDU_HEADER_SIZE 7U
+#define MM_QMI_REQUEST_MAX_TLV_SIZE 64U
+
+#define MM_QMI_SERVICE_CTL 0x00U
+#define MM_QMI_BROADCAST_CLIENT_ID 0xFFU
+
+/* Every response carries its result (u16) and error code (u16) here. */
+#define MM_QMI_TLV_RESULT 0x02U
+
+/*
+ * Requests are built in the buffer they are sent from: TLVs are appended
+ * after room for the QMUX and QMI headers, which are filled in on sending.
+ */
+struct mm_qmi_request {
+    uint16_t message_id;
+    uint16_t length;
+    bool overflowed;
+
+    uint8_t frame[MM_QMI_QMUX_HEADER_SIZE + MM_QMI_SDU_HEADER_SIZE +
+            MM_QMI_REQUEST_MAX_TLV_SIZE];
+};
+
+/* A received message; 'sdu' and 'tlvs' point into the receive buffer. */
+struct mm_qmi_message {
+    const uint8_t *sdu;
+    const uint8_t *tlvs;
+    uint16_t sdu_length;
+    uint16_t tlvs_length;
+
+    uint16_t transaction;
+    uint16_t message_id;
+    uint8_t flags;
+};
+
+typedef void (*mm_qmi_engine_indication_callback)(
+        const struct mm_qmi_message *, void *);
+
+struct mm_qmi_engine_client {
+    mm_qmi_engine_indication_callback callback;
+    void *context;
+
+    uint8_t service;
+    uint8_t client_id;
+    bool in_use;
+};
+
+struct mm_qmi_engine {
+    int fd;
+    uint16_t transaction;
+    uint8_t ctl_transaction;
+
+    struct mm_qmi_engine_client clients[MM_QMI_ENGINE_MAX_CLIENTS];
+
+    /* Bytes [rx_start, rx_end) have been read but not yet processed. */
+    size_t rx_start, rx_end;
+    uint8_t rx[MM_QMI_ENGINE_BUFFER_SIZE];
+};
+
+void mm_qmi_request_init(struct mm_qmi_request *, uint16_t);
+void mm_qmi_request_put(struct mm_qmi_request *, uint8_t, const void *,
+        uint16_t);
+
+void mm_qmi_request_put_u8(struct mm_qmi_request *, uint8_t, uint8_t);
+void mm_qmi_request_put_u32(struct mm_qmi_request *, uint8_t, uint32_t);
+
+const uint8_t *mm_qmi_message_find_tlv(const struct mm_qmi_message *,
+        uint8_t, uint16_t *);
+
+bool mm_qmi_message_get_u8(const struct mm_qmi_message *, uint8_t,
+        uint8_t *);
+
+bool mm_qmi_message_get_u16(const struct mm_qmi_message *, uint8_t,
+        uint16_t *);
+
+bool mm_qmi_message_get_u32(const struct mm_qmi_message *, uint8_t,
+        uint32_t *);
+
+__attribute__(( pure ))
+int mm_qmi_message_get_result(const struct mm_qmi_message *);
+
+int mm_qmi_message_parse(struct mm_qmi_message *, const uint8_t *, size_t);
+
+int mm_qmi_engine_open(struct mm_qmi_engine *, const char *);
+void mm_qmi_engine_close(struct mm_qmi_engine *);
+
+int mm_qmi_engine_allocate_client(struct mm_qmi_engine *, uint8_t,
+        mm_qmi_engine_indication_callback, void *, uint8_t *);
+
+int mm_qmi_engine_release_client(struct mm_qmi_engine *, uint8_t, uint8_t);
+
+int mm_qmi_engine_dispatch(void *);
+int mm_qmi_engine_request(struct mm_qmi_engine *, uint8_t, uint8_t,
+        struct mm_qmi_request *, struct mm_qmi_message *, int);
+
+#endif
@@ -11,13 +11,39 @@
 #ifndef MM_QMUX_H
 #define MM_QMUX_H
 
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+
 #include <CtlService.h>
 #include <QmuxTransport.h>
 
-int mm_ctl_initialize(CtlService *, QmuxTransport *);
-void mm_ctl_shutdown(CtlService *);
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The QMI port of modem N; see MM_HOTPLUG_MAX_MODEMS. */
+#define MM_QMUX_DEVICE_NAME_FORMAT "wwan%uqmi0"
+
+/*
+ * A modem's QMI transport: either the SDK's (with its CTL client), or the
+ * built-in engine when opened natively. Clients are opened through it so
+ * that the rest of the daemon need not care which.
+ */
+struct mm_qmux {
+    QmuxTransport transport;
+    CtlService ctl;
+
+    struct mm_qmi_engine engine;
+    bool native;
+    unsigned modem;
+};
+
+int mm_qmux_initialize(struct mm_qmux *, unsigned, bool);
+void mm_qmux_shutdown(struct mm_qmux *);
+
+int mm_qmux_open_client(struct mm_qmux *, struct mm_qmi_client *, uint8_t,
+        mm_qmi_sdk_indication_callback, mm_qmi_engine_indication_callback,
+        void *);
 
-int mm_qmux_transport_initialize(QmuxTransport *);
-void mm_qmux_transport_shutdown(QmuxTransport *);
+int mm_qmux_close_client(struct mm_qmux *, struct mm_qmi_client *);
 
 #endif
@@ -0,0 +1,57 @@
+/*
+ * inc/mm_refresh.h: Proactive refresh ahead of carrier session lifetimes
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_REFRESH_H
+#define MM_REFRESH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Some carriers tear down sessions once they reach a fixed age. The ages at
+ * which the network ended IPv4 sessions (those of MM_REFRESH_MIN_LIFETIME_S
+ * or more; anything shorter is more likely coverage) are remembered, seeded
+ * from the history store at startup. Once MM_REFRESH_MIN_AGREEING of the
+ * last MM_REFRESH_SAMPLES agree to within MM_REFRESH_TOLERANCE_PERCENT, the
+ * shortest of them is taken as the lifetime.
+ *
+ * From MM_REFRESH_WINDOW_S before that lifetime, a session is refreshed
+ * (make-before-break) as soon as its traffic goes quiet: under
+ * MM_REFRESH_QUIET_BYTES_PER_S, or under a quarter of its recent average.
+ * Should it never go quiet, it is refreshed MM_REFRESH_MARGIN_S before the
+ * lifetime regardless. Should the refresh not take, it is tried again
+ * after MM_REFRESH_RETRY_S. Should the network still end the replacement
+ * at the old session's lifetime, the refresh is reported as failed.
+ */
+#define MM_REFRESH_LOOKBACK_S (30U * 86400U)
+#define MM_REFRESH_MARGIN_S 120U
+#define MM_REFRESH_MIN_AGREEING 3U
+#define MM_REFRESH_MIN_LIFETIME_S 3600U
+#define MM_REFRESH_QUIET_BYTES_PER_S 4096U
+#define MM_REFRESH_RETRY_S 300U
+#define MM_REFRESH_SAMPLE_INTERVAL_S 10U
+#define MM_REFRESH_SAMPLES 8U
+#define MM_REFRESH_TOLERANCE_PERCENT 5U
+#define MM_REFRESH_WINDOW_S 1800U
+
+/* Follows one session's traffic; see mm_refresh_is_due. */
+struct mm_refresh_tracker {
+    uint64_t started_us, requested_us;
+    uint64_t last_bytes, last_sample_us;
+    uint64_t average_bytes_per_s;
+    bool have_sample;
+};
+
+bool mm_refresh_get_lifetime(uint64_t *);
+bool mm_refresh_is_due(struct mm_refresh_tracker *, uint64_t, uint64_t);
+int mm_refresh_load(const char *);
+bool mm_refresh_record_session(uint16_t, uint64_t, uint64_t);
+
+#endif
@@ -12,19 +12,50 @@
 #define MM_RUN_HELPERS_H
 
 #include "mm_netlink.h"
+#include "mm_qmux.h"
+#include "mm_sdbus.h"
+#include "mm_tasks.h"
 #include "mm_wds.h"
 
+#include <sd-bus.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
 #include <stdint.h>
 
+/*
+ * Tasks (see mm_tasks.h) run around a connect. Unit tasks start or stop a
+ * systemd unit; the others take the mm_netlink (wg0) or nothing at all.
+ */
+struct mm_unit_task {
+    sd_bus *bus;
+    const char *method;
+    const char *name;
+    struct mm_sdbus_call call;
+};
+
+struct mm_wireguard_setconf_task {
+    pid_t child;
+    int pidfd;
+};
+
+extern const struct mm_task_ops mm_unit_task_ops;
+extern const struct mm_task_ops mm_wg0_up_task_ops;
+extern const struct mm_task_ops mm_wireguard_refresh_task_ops;
+extern const struct mm_task_ops mm_wireguard_setconf_task_ops;
+
 int mm_apply_ipv4_runtime_settings(struct mm_netlink *,
         const struct mm_wds_runtime_settings *, bool refresh);
 
 int mm_apply_ipv6_runtime_settings(struct mm_netlink *,
         const struct mm_wds_runtime_settings *, bool refresh);
 
-int mm_configure_autoconnect_and_roaming(CtlService *);
+int mm_configure_autoconnect_and_roaming(struct mm_qmux *,
+        enum mm_wds_autoconnect_setting, enum mm_wds_autoconnect_roam_setting);
 
 int mm_exec_wireguard_setconf(void);
+int mm_reap_wireguard_setconf(pid_t, bool);
+int mm_spawn_wireguard_setconf(pid_t *);
 
 int mm_start_session(struct mm_wds_session *, unsigned,
         enum mm_wds_ip_family_preference);
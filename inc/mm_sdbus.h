@@ -13,7 +13,25 @@
 
 #include <sd-bus.h>
 
+#include <stdbool.h>
+
+/*
+ * A method call left outstanding, so that several can be in flight on one
+ * bus at once. The caller polls the bus (and calls mm_sdbus_poll_call) until
+ * it's done; status is then 0 on success.
+ */
+struct mm_sdbus_call {
+    sd_bus_slot *slot;
+    bool done;
+    int status;
+};
+
+void mm_sdbus_cancel_call(struct mm_sdbus_call *);
 int mm_sdbus_manage_service(sd_bus *, const char *, const char *);
+int mm_sdbus_manage_service_async(sd_bus *, const char *, const char *,
+        struct mm_sdbus_call *);
+
+int mm_sdbus_poll_call(sd_bus *, struct mm_sdbus_call *, short *);
 
 #endif
 
@@ -0,0 +1,40 @@
+/*
+ * inc/mm_slo.h: Rolling availability and time to recover objectives
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_SLO_H
+#define MM_SLO_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Each modem's data sessions are tracked, per family, over rolling windows
+ * of an hour, a day and a week. Every window is a ring of MM_SLO_SLOTS
+ * slots holding the time up and down, the drops and the time each outage
+ * took to recover. Window totals are kept up as slots fill and expire, so
+ * an event costs the same however long the window; a window is accurate to
+ * within one slot (5 minutes for the hour, 2 hours for the day, ...).
+ *
+ * Time is only counted from a family's first connect, and not while the
+ * system is suspended or the daemon is going down (see mm_slo_session_down).
+ */
+#define MM_SLO_SLOTS 12U
+
+enum mm_slo_family {
+    MM_SLO_FAMILY_IPV4 = 0,
+    MM_SLO_FAMILY_IPV6 = 1,
+    MM_SLO_FAMILIES = 2,
+};
+
+void mm_slo_session_down(unsigned, enum mm_slo_family, bool);
+void mm_slo_session_up(unsigned, enum mm_slo_family);
+void mm_slo_write_metrics(FILE *, void *);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * inc/mm_suspend.h: System suspend/resume tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_SUSPEND_H
+#define MM_SUSPEND_H
+
+#include <stdbool.h>
+
+/*
+ * Data sessions don't survive a suspend. We hold a logind "delay" inhibitor
+ * lock, and on PrepareForSleep post MM_EVENT_SUSPEND so that each connected
+ * modem takes its sessions down cleanly. The lock is released once every
+ * modem holding off the suspend has done so, or after
+ * MM_SUSPEND_QUIESCE_TIMEOUT_MS (logind itself only waits so long: see
+ * InhibitDelayMaxSec, 5s by default).
+ *
+ * On resume, MM_EVENT_RESUME is posted and the lock taken again. Modems
+ * reconnect right away, rather than waiting out any pause between attempts.
+ */
+#define MM_SUSPEND_QUIESCE_TIMEOUT_MS 4000U
+
+void mm_suspend_hold(unsigned, bool);
+bool mm_suspend_is_pending(void);
+
+int mm_suspend_start(void);
+void mm_suspend_stop(void);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * inc/mm_tasks.h: Dependency graph executor for connect/disconnect work
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_TASKS_H
+#define MM_TASKS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Work done around a connect (starting units, bringing up the tunnel, ...)
+ * is described as a graph of tasks, each naming the tasks it depends on.
+ * A task starts as soon as its dependencies are done, so independent tasks
+ * run concurrently: the graph takes only as long as its longest chain.
+ *
+ * A task either completes from its start function or hands back a file
+ * descriptor (e.g. a bus or pidfd) to be polled by the calling thread. Its
+ * poll function is then called after every wakeup, readable or not, since
+ * tasks may share a descriptor (e.g. one bus connection).
+ */
+#define MM_TASKS_MAX 32U
+#define MM_TASK_IN_PROGRESS 1
+
+#define MM_TASK_BIT(task) (UINT32_C(1) << ((task) % MM_TASKS_MAX))
+
+/* What a failed task means for the caller; dependents are always skipped. */
+enum mm_task_policy {
+    MM_TASK_POLICY_IGNORE = 0,
+    MM_TASK_POLICY_RESTART = 1,
+    MM_TASK_POLICY_EXIT = 2,
+};
+
+enum mm_task_state {
+    MM_TASK_PENDING = 0,
+    MM_TASK_RUNNING = 1,
+    MM_TASK_DONE = 2,
+    MM_TASK_FAILED = 3,
+    MM_TASK_SKIPPED = 4,
+};
+
+struct mm_task;
+
+/* Return 0 when done, MM_TASK_IN_PROGRESS to wait, anything else on error. */
+typedef int (*mm_task_function)(struct mm_task *);
+
+struct mm_task_ops {
+    mm_task_function start;
+    mm_task_function poll;
+    void (*cancel)(struct mm_task *);
+};
+
+struct mm_task {
+    const char *name;
+    const struct mm_task_ops *ops;
+    void *context;
+
+    uint32_t dependencies;
+    unsigned timeout_ms;
+    enum mm_task_policy policy;
+
+    /* Maintained by the executor; start/poll set fd/events as needed. */
+    enum mm_task_state state;
+    int fd;
+    short events;
+    uint64_t started_us, finished_us;
+};
+
+struct mm_task_graph {
+    const char *name;
+    struct mm_task tasks[MM_TASKS_MAX];
+    unsigned count;
+    bool overflowed;
+    uint32_t done, failed;
+};
+
+unsigned mm_task_graph_add(struct mm_task_graph *, const char *,
+        const struct mm_task_ops *, void *, uint32_t, enum mm_task_policy,
+        unsigned);
+
+void mm_task_graph_init(struct mm_task_graph *, const char *);
+enum mm_task_policy mm_task_graph_run(struct mm_task_graph *);
+
+#endif
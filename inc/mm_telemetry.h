@@ -0,0 +1,45 @@
+/*
+ * inc/mm_telemetry.h: Batched telemetry export functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_TELEMETRY_H
+#define MM_TELEMETRY_H
+
+#include <stddef.h>
+
+/* Collector reached across the Wireguard tunnel (see src/netlink.c). */
+#define MM_TELEMETRY_COLLECTOR_ADDRESS "10.10.2.2"
+#define MM_TELEMETRY_COLLECTOR_PORT 8086U
+#define MM_TELEMETRY_COLLECTOR_PATH "/ingest/modem-monitor"
+#define MM_TELEMETRY_INTERFACE "wg0"
+
+/*
+ * Events are accumulated in memory and shipped, along with a snapshot of
+ * all metrics, as one gzip-compressed batch per hour -- or sooner, should
+ * the events alone outgrow the size trigger. That keeps steady-state cost
+ * to a few KB/hour on a metered link.
+ */
+#define MM_TELEMETRY_BATCH_INTERVAL_S 3600U
+#define MM_TELEMETRY_BATCH_BYTES (16U * 1024U)
+#define MM_TELEMETRY_MAX_EVENT_BYTES (64U * 1024U)
+#define MM_TELEMETRY_IO_TIMEOUT_S 15U
+
+/* Failed uploads back off exponentially and are spooled to disk. */
+#define MM_TELEMETRY_MIN_BACKOFF_S 60U
+#define MM_TELEMETRY_MAX_BACKOFF_S 3600U
+#define MM_TELEMETRY_SPOOL_DIRECTORY "/var/lib/modem-monitor/spool"
+#define MM_TELEMETRY_MAX_SPOOLED_BATCHES 64U
+
+__attribute__(( format(printf, 1, 2) ))
+void mm_telemetry_event(const char *, ...);
+
+int mm_telemetry_start(void);
+void mm_telemetry_stop(void);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * inc/mm_time.h: Clock helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_TIME_H
+#define MM_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Timers run off CLOCK_BOOTTIME: it is just as monotonic, but it also keeps
+ * counting while the system is suspended, so that nothing (e.g. a session
+ * age, or the time left to wait) comes out short after a resume.
+ */
+static inline uint64_t mm_time_monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000U + (uint64_t) ts.tv_nsec / 1000U;
+}
+
+/*
+ * Condition variables can't wait on CLOCK_BOOTTIME: converts a deadline on
+ * it into one on CLOCK_MONOTONIC (for a condvar set up with that clock).
+ */
+static inline void mm_time_cond_deadline(uint64_t deadline_us,
+        struct timespec *deadline) {
+    uint64_t now_us, monotonic_us;
+    struct timespec ts;
+
+    now_us = mm_time_monotonic_us();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    monotonic_us = (uint64_t) ts.tv_sec * 1000000U +
+        (uint64_t) ts.tv_nsec / 1000U;
+
+    if (deadline_us > now_us) {
+        monotonic_us += deadline_us - now_us;
+    }
+
+    deadline->tv_sec = (time_t) (monotonic_us / 1000000U);
+    deadline->tv_nsec = (long) (monotonic_us % 1000000U) * 1000L;
+}
+
+/* For comparing against kernel timestamps, which are on CLOCK_REALTIME. */
+static inline uint64_t mm_time_realtime_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000U + (uint64_t) ts.tv_nsec / 1000U;
+}
+
+static inline uint64_t mm_time_realtime_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000U + (uint64_t) ts.tv_nsec / 1000000U;
+}
+
+#endif
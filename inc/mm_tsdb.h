@@ -0,0 +1,95 @@
+/*
+ * inc/mm_tsdb.h: Append-only on-disk time-series store
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_TSDB_H
+#define MM_TSDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MM_TSDB_DIRECTORY "/var/lib/modem-monitor/history"
+#define MM_TSDB_MAGIC 0x53544D4DU
+#define MM_TSDB_VERSION 1U
+
+/*
+ * History is kept in fixed-size segment files of fixed-size records. With
+ * 16 byte records, each 256 KiB segment holds 16383 records (a few days of
+ * history at typical rates) and the whole store is bounded to 8 MiB.
+ */
+#define MM_TSDB_SEGMENT_SIZE (256U * 1024U)
+#define MM_TSDB_MAX_SEGMENTS 32U
+#define MM_TSDB_PAGE_SIZE 4096U
+
+/*
+ * Records are staged in memory and only copied into the mapped segment in
+ * whole pages, so each flash page is (nearly always) written exactly once.
+ * A partial page is written out anyway once staged records get this old.
+ */
+#define MM_TSDB_MAX_STAGING_AGE_S 3600U
+
+enum mm_tsdb_series {
+    MM_TSDB_SERIES_NONE = 0,
+    MM_TSDB_SERIES_SESSION = 1,
+    MM_TSDB_SERIES_RECONNECT = 2,
+    MM_TSDB_SERIES_RX_BYTES = 3,
+    MM_TSDB_SERIES_TX_BYTES = 4,
+    MM_TSDB_SERIES_SIGNAL = 5,
+    MM_TSDB_SERIES_TEMPERATURE = 6,
+    MM_TSDB_SERIES_MAX = 7,
+};
+
+/* Tags of MM_TSDB_SERIES_SESSION records: the session's IP version. */
+#define MM_TSDB_TAG_IPV4 4U
+#define MM_TSDB_TAG_IPV6 6U
+
+/*
+ * Segment layout (host byte order): a header occupying the first record
+ * slot, then records whose timestamps are millisecond deltas against the
+ * header's base time. An all-zero slot marks the end of written records.
+ */
+struct mm_tsdb_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t base_ms;
+};
+
+struct mm_tsdb_record {
+    uint32_t delta_ms;
+    uint8_t series;
+    uint8_t tag;
+    uint16_t aux;
+    int64_t value;
+};
+
+#define MM_TSDB_RECORDS_PER_SEGMENT \
+    (MM_TSDB_SEGMENT_SIZE / sizeof(struct mm_tsdb_record) - 1U)
+
+struct mm_tsdb_sample {
+    uint64_t realtime_ms;
+    enum mm_tsdb_series series;
+    uint8_t tag;
+    uint16_t aux;
+    int64_t value;
+};
+
+typedef int (*mm_tsdb_visitor)(const struct mm_tsdb_sample *, void *);
+
+__attribute__(( pure ))
+const char *mm_tsdb_get_series_string(enum mm_tsdb_series);
+
+int mm_tsdb_open(const char *);
+void mm_tsdb_close(void);
+int mm_tsdb_append(enum mm_tsdb_series, uint8_t, uint16_t, int64_t);
+int mm_tsdb_flush(bool);
+
+int mm_tsdb_query(const char *, uint64_t, uint64_t, mm_tsdb_visitor, void *);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * inc/mm_uplink.h: Multi-uplink failover functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_UPLINK_H
+#define MM_UPLINK_H
+
+#include <net/if.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Multi-uplink mode is enabled by listing uplinks, in order of preference,
+ * in the config file (one "uplink <interface> <table>" per line; at least
+ * one modem's WWAN interface must be among them). An optional "probe
+ * <address>" line sets the address pinged out of each uplink to judge its
+ * health.
+ */
+#define MM_UPLINK_CONFIG_PATH "/etc/modem-monitor/uplinks"
+#define MM_UPLINK_DEFAULT_PROBE_ADDRESS "1.1.1.1"
+#define MM_UPLINK_MAX_UPLINKS 4U
+
+/*
+ * Each uplink gets a default route in its own table and a rule sending
+ * traffic sourced from its address there, so it can always be probed (and
+ * used) on its own. The main default route follows the most preferred
+ * healthy uplink: a failure moves it right away, but moving back to a more
+ * preferred uplink waits until that has stayed healthy for a while.
+ */
+#define MM_UPLINK_PROBE_INTERVAL_S 2U
+#define MM_UPLINK_LOST_PROBES 2U
+#define MM_UPLINK_RECOVERY_S 30U
+#define MM_UPLINK_RULE_PRIORITY 1000U
+
+/* Marks routes as our own, so they aren't mistaken for anyone else's. */
+#define MM_UPLINK_ROUTE_PROTOCOL 99U
+
+/*
+ * With "mode multipath" in the config, the main default route instead spans
+ * every healthy uplink, each weighted by its capacity over its probe
+ * latency. Capacity is the one given in Mbit/s after an uplink's table (as
+ * in "uplink wlan0 102 50"), else its recent peak rate, with a floor. Each
+ * healthy uplink keeps a minimum weight regardless: an uplink only shows
+ * its peak if it carries flows, so it must never be starved of them. A
+ * resilient nexthop group is used, so members leaving or weights shifting
+ * only move the flows that must move; kernels without them get a plain
+ * weighted multipath route.
+ */
+#define MM_UPLINK_MAX_WEIGHT 64U
+#define MM_UPLINK_MIN_WEIGHT 8U
+#define MM_UPLINK_MIN_CAPACITY_BYTES_S 12500U
+#define MM_UPLINK_NEXTHOP_ID 0x4D4D0000U
+#define MM_UPLINK_RESILIENT_BUCKETS 128U
+#define MM_UPLINK_RESILIENT_IDLE_S 60U
+
+struct mm_uplink {
+    char ifname[IF_NAMESIZE];
+    uint32_t table;
+    int ifindex;
+
+    /* A modem's WWAN interface is only usable while its session is up. */
+    bool wwan, session_down;
+
+    /* As learned from the kernel; zero if not (yet) known. */
+    uint32_t address, gateway;
+    uint32_t rule_address;
+    bool table_route_installed;
+
+    int probe_fd;
+    uint16_t probe_seq;
+    bool probe_outstanding, replied;
+    unsigned lost_probes;
+
+    /* Inputs to (and the last programmed) multipath weight. */
+    uint64_t probe_sent_us, rtt_us;
+    uint64_t last_bytes, last_bytes_us, capacity_bytes_s;
+    uint64_t configured_bytes_s;
+    unsigned weight;
+
+    bool healthy;
+    uint64_t healthy_since_us;
+};
+
+bool mm_uplink_is_enabled(void);
+bool mm_uplink_is_failed_over(const char *);
+uint32_t mm_uplink_get_wwan_table(const char *);
+void mm_uplink_set_wwan_session_up(const char *, bool);
+
+int mm_uplink_start(void);
+void mm_uplink_stop(void);
+
+void mm_uplink_write_metrics(FILE *, void *);
+
+#endif
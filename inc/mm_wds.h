@@ -11,8 +11,11 @@
 #ifndef MM_WDS_H
 #define MM_WDS_H
 
-#include <CtlService.h>
-#include <QmiService.h>
+#include "mm_events.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_qmux.h"
+
 #include <wds.h>
 
 #include <netinet/in.h>
@@ -34,6 +37,21 @@ enum mm_wds_autoconnect_roam_setting {
     MM_WDS_AUTOCONNECT_ROAM_SETTING_INVALID = 255,
 };
 
+enum mm_wds_connection_status {
+    MM_WDS_CONNECTION_STATUS_DISCONNECTED = 1,
+    MM_WDS_CONNECTION_STATUS_CONNECTED = 2,
+    MM_WDS_CONNECTION_STATUS_SUSPENDED = 3,
+    MM_WDS_CONNECTION_STATUS_AUTHENTICATING = 4,
+};
+
+/*
+ * Suspended/authenticating sessions (e.g. during handovers or brief fades)
+ * get this long to come back on their own before being torn down. Should
+ * traffic still be moving when it expires, it's extended, up to a limit.
+ */
+#define MM_WDS_TRANSIENT_GRACE_S 15U
+#define MM_WDS_TRANSIENT_MAX_GRACE_S 60U
+
 enum mm_wds_ip_family_preference {
     MM_WDS_IP_FAMILY_PREFERENCE_IPV4 = PACK_WDS_IPV4,
     MM_WDS_IP_FAMILY_PREFERENCE_IPV6 = PACK_WDS_IPV6,
@@ -54,17 +72,31 @@ struct mm_wds_runtime_settings {
 };
 
 struct mm_wds_session {
-    QmiService wds;
+    struct mm_qmi_client wds;
     struct mm_wds_runtime_settings last_runtime_settings;
 
     uint32_t session_id;
     uint32_t profile;
     int family;
 
+    uint64_t started_us;
+    uint16_t last_end_reason;
     bool teardown_requested;
+
+    /* Age of the session this one replaced (see mm_refresh.h), or zero. */
+    uint64_t replaced_age_ms;
+
+    /*
+     * When the session went suspended/authenticating, or zero if not. Set
+     * from the indication thread: only access it with __atomic builtins.
+     */
+    uint64_t transient_since_us;
+
+    /* The event loop of the modem this session belongs to. */
+    struct mm_events *events;
 };
 
-int mm_wds_get_autoconnect_settings(QmiService *,
+int mm_wds_get_autoconnect_settings(struct mm_qmi_client *,
         enum mm_wds_autoconnect_setting *,
         enum mm_wds_autoconnect_roam_setting *);
 
@@ -73,11 +105,11 @@ int mm_wds_get_runtime_settings(struct mm_wds_session *,
 
 int mm_wds_get_session_state(struct mm_wds_session *, uint32_t *);
 
-int mm_wds_set_autoconnect_settings(QmiService *,
+int mm_wds_set_autoconnect_settings(struct mm_qmi_client *,
         enum mm_wds_autoconnect_setting,
         enum mm_wds_autoconnect_roam_setting);
 
-int mm_wds_set_ip_family_preference(QmiService *,
+int mm_wds_set_ip_family_preference(struct mm_qmi_client *,
         enum mm_wds_ip_family_preference);
 
 int mm_wds_start_data_session(struct mm_wds_session *, uint32_t, int,
@@ -85,7 +117,13 @@ int mm_wds_start_data_session(struct mm_wds_session *, uint32_t, int,
 
 int mm_wds_stop_data_session(struct mm_wds_session *);
 
-int mm_wds_initialize(QmiService *, CtlService *, struct mm_wds_session *);
-int mm_wds_shutdown(QmiService *, CtlService *);
+void mm_wds_indication_callback(uint8_t *, uint16_t, void *);
+void mm_wds_native_indication_callback(const struct mm_qmi_message *,
+        void *);
+
+int mm_wds_initialize(struct mm_qmi_client *, struct mm_qmux *,
+        struct mm_wds_session *);
+
+int mm_wds_shutdown(struct mm_qmi_client *, struct mm_qmux *);
 
 #endif
@@ -0,0 +1,124 @@
+/*
+ * inc/mm_wireguard.h: Wireguard (generic netlink) helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_WIREGUARD_H
+#define MM_WIREGUARD_H
+
+#include <linux/wireguard.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MM_WIREGUARD_INTERFACE "wg0"
+#define MM_WIREGUARD_CONFIG_PATH "/etc/wireguard/wireguard.conf"
+#define MM_WIREGUARD_MAX_PEERS 8U
+
+/*
+ * Endpoint hostnames are re-resolved whenever the tunnel is brought up, but
+ * DNS may not be usable yet at that point (it often goes over the tunnel).
+ * The last good resolution of each is kept here to fall back on.
+ */
+#define MM_WIREGUARD_ENDPOINT_CACHE_PATH \
+    "/var/lib/modem-monitor/wireguard-endpoints"
+
+/*
+ * Sending anything towards the far end of the tunnel makes the kernel
+ * initiate a handshake right away if it has no current session, rather
+ * than waiting on its own keepalive/rekey timers.
+ */
+#define MM_WIREGUARD_PROBE_ADDRESS "10.10.1.1"
+#define MM_WIREGUARD_PROBE_PORT 9U
+
+/*
+ * Tunnel liveness is judged off the kernel's per-peer counters: a peer is
+ * faulted when we're sending but it hasn't completed a handshake within
+ * Wireguard's own reject-after time, or when we're sending but receiving
+ * nothing back. A fault first gets a forced handshake; should it persist,
+ * the config is pushed again. Neither touches the WWAN session.
+ */
+#define MM_WIREGUARD_CHECK_INTERVAL_S 30U
+#define MM_WIREGUARD_STALE_HANDSHAKE_S 180
+#define MM_WIREGUARD_REPUSH_AFTER_FAULTS 3U
+
+/*
+ * Several peers (concentrators in different regions) may be configured as
+ * candidates: each must lead its AllowedIPs with a /32 tunnel address of its
+ * own, and may list the networks it can route for. Candidates are pinged
+ * through the tunnel and the routed networks moved to the best of them, but
+ * only once a challenger has clearly (by a margin) won several rounds in a
+ * row; an unreachable selection is abandoned straight away.
+ */
+#define MM_WIREGUARD_MAX_ALLOWED_IPS 8U
+#define MM_WIREGUARD_PROBE_INTERVAL_S 5U
+#define MM_WIREGUARD_PROBE_WINDOW 12U
+#define MM_WIREGUARD_PROBE_MIN_SAMPLES 4U
+#define MM_WIREGUARD_LOSS_PENALTY_US 1000000U
+#define MM_WIREGUARD_SWITCH_MARGIN_US 20000U
+#define MM_WIREGUARD_SWITCH_MARGIN_PCT 20U
+#define MM_WIREGUARD_SWITCH_ROUNDS 3U
+
+enum mm_wireguard_fault {
+    MM_WIREGUARD_FAULT_NONE = 0,
+    MM_WIREGUARD_FAULT_STALE_HANDSHAKE = 1,
+    MM_WIREGUARD_FAULT_ONE_WAY = 2,
+    MM_WIREGUARD_FAULT_MAX = 3,
+};
+
+struct mm_wireguard_allowed_ip {
+    uint32_t s_addr;
+    uint8_t prefixlen;
+};
+
+struct mm_wireguard_peer {
+    uint8_t public_key[WG_KEY_LEN];
+    char host[256];
+    char port[8];
+
+    struct sockaddr_storage endpoint;
+    socklen_t endpoint_length;
+
+    /* IPv4 AllowedIPs; tunnel_address is zero if not a candidate. */
+    struct mm_wireguard_allowed_ip allowed_ips[MM_WIREGUARD_MAX_ALLOWED_IPS];
+    size_t allowed_ip_count;
+    uint32_t tunnel_address;
+
+    /*
+     * Round trip times of the last probes, UINT32_MAX marking a loss. Sends
+     * are timed on CLOCK_REALTIME, as are the kernel's receive timestamps.
+     */
+    uint32_t probe_rtt_us[MM_WIREGUARD_PROBE_WINDOW];
+    unsigned probe_next, probe_count;
+    uint64_t probe_sent_us;
+    bool probe_outstanding;
+
+    /* As last read back from the kernel (see mm_wireguard_check()). */
+    int64_t last_handshake_s;
+    uint64_t rx_bytes, tx_bytes;
+    uint64_t last_rx_bytes, last_tx_bytes;
+    enum mm_wireguard_fault fault;
+    bool have_stats;
+};
+
+__attribute__(( pure ))
+const char *mm_wireguard_get_fault_string(enum mm_wireguard_fault);
+
+int mm_wireguard_initialize(void);
+void mm_wireguard_shutdown(void);
+
+enum mm_wireguard_fault mm_wireguard_check(void);
+int mm_wireguard_probe_peers(uint32_t *);
+int mm_wireguard_refresh_peers(void);
+int mm_wireguard_rehome(void);
+int mm_wireguard_trigger_handshake(void);
+void mm_wireguard_write_metrics(FILE *, void *);
+
+#endif
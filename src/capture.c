@@ -0,0 +1,202 @@
+/*
+ * src/capture.c: QMI traffic capture helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_capture.h"
+#include "mm_log.h"
+#include "mm_time.h"
+
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file;
+
+static uint16_t get_le16(const uint8_t *);
+static uint64_t get_le64(const uint8_t *);
+static void put_le16(uint8_t *, uint16_t);
+static void put_le64(uint8_t *, uint64_t);
+
+uint16_t get_le16(const uint8_t *buf) {
+    return (uint16_t) (buf[0] | buf[1] << 8);
+}
+
+uint64_t get_le64(const uint8_t *buf) {
+    uint64_t value = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        value = value << 8 | buf[i];
+    }
+
+    return value;
+}
+
+void put_le16(uint8_t *buf, uint16_t value) {
+    buf[0] = (uint8_t) value;
+    buf[1] = (uint8_t) (value >> 8);
+}
+
+void put_le64(uint8_t *buf, uint64_t value) {
+    unsigned i;
+
+    for (i = 0; i < 8; i++) {
+        buf[i] = (uint8_t) (value >> (i * 8));
+    }
+}
+
+bool mm_capture_is_active(void) {
+    return __atomic_load_n(&capture_file, __ATOMIC_ACQUIRE) != NULL;
+}
+
+int mm_capture_open(const char *path) {
+    uint8_t header[MM_CAPTURE_FILE_HEADER_SIZE];
+    struct timeval now;
+    FILE *f;
+
+    if ((f = fopen(path, "wb")) == NULL) {
+        MM_LOG("%smm_capture_open: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    gettimeofday(&now, NULL);
+    memset(header, 0, sizeof(header));
+    memcpy(header, MM_CAPTURE_MAGIC, 4);
+    put_le16(header + 4, MM_CAPTURE_VERSION);
+    put_le64(header + 8, (uint64_t) now.tv_sec * 1000000U +
+            (uint64_t) now.tv_usec);
+
+    if (fwrite(header, sizeof(header), 1, f) != 1 || fflush(f)) {
+        MM_LOG("%smm_capture_open: %s: %s\n", path, strerror(errno));
+        fclose(f);
+        return -1;
+    }
+
+    __atomic_store_n(&capture_file, f, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mm_capture_close(void) {
+    FILE *f;
+
+    pthread_mutex_lock(&capture_lock);
+    f = capture_file;
+    __atomic_store_n(&capture_file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&capture_lock);
+
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+/*
+ * Records are flushed as they are written: the whole point of a capture is
+ * to see what led up to a failure, and that may well include the daemon
+ * being killed by a watchdog or crashing outright.
+ */
+void mm_capture_record(enum mm_capture_record_type type, uint8_t modem,
+        uint8_t service, uint8_t client_id, uint16_t message_id,
+        const uint8_t *packet, uint16_t length) {
+    uint8_t header[MM_CAPTURE_RECORD_HEADER_SIZE];
+
+    if (!mm_capture_is_active()) {
+        return;
+    }
+
+    memset(header, 0, sizeof(header));
+    put_le64(header, mm_time_monotonic_us());
+    put_le16(header + 8, message_id);
+    put_le16(header + 10, length);
+    header[12] = (uint8_t) type;
+    header[13] = service;
+    header[14] = client_id;
+    header[15] = modem;
+
+    pthread_mutex_lock(&capture_lock);
+
+    if (capture_file != NULL) {
+        if (fwrite(header, sizeof(header), 1, capture_file) != 1 ||
+                fwrite(packet, 1, length, capture_file) != length ||
+                fflush(capture_file)) {
+            MM_LOG("%smm_capture_record: %s; disabling capture\n",
+                    strerror(errno));
+
+            fclose(capture_file);
+            __atomic_store_n(&capture_file, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+int mm_capture_reader_open(struct mm_capture_reader *reader,
+        const char *path) {
+    uint8_t header[MM_CAPTURE_FILE_HEADER_SIZE];
+
+    if ((reader->f = fopen(path, "rb")) == NULL) {
+        MM_LOG("%smm_capture_reader_open: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(header, sizeof(header), 1, reader->f) != 1 ||
+            memcmp(header, MM_CAPTURE_MAGIC, 4) ||
+            get_le16(header + 4) != MM_CAPTURE_VERSION) {
+        MM_LOG("%smm_capture_reader_open: %s: %s\n", path,
+                "Not a supported capture file");
+
+        fclose(reader->f);
+        return -1;
+    }
+
+    reader->realtime_us = get_le64(header + 8);
+    return 0;
+}
+
+/* Returns 1 when a record was read, 0 at the end of the file, or -1. */
+int mm_capture_reader_next(struct mm_capture_reader *reader,
+        struct mm_capture_record *record) {
+    uint8_t header[MM_CAPTURE_RECORD_HEADER_SIZE];
+    size_t count;
+
+    if ((count = fread(header, 1, sizeof(header), reader->f)) == 0 &&
+            feof(reader->f)) {
+        return 0;
+    }
+
+    if (count != sizeof(header)) {
+        MM_LOG("%s%s\n", "mm_capture_reader_next: Truncated record header");
+        return -1;
+    }
+
+    record->monotonic_us = get_le64(header);
+    record->message_id = get_le16(header + 8);
+    record->length = get_le16(header + 10);
+    record->type = header[12];
+    record->service = header[13];
+    record->client_id = header[14];
+    record->modem = header[15];
+
+    if (fread(record->packet, 1, record->length, reader->f) !=
+            record->length) {
+        MM_LOG("%s%s\n", "mm_capture_reader_next: Truncated record");
+        return -1;
+    }
+
+    return 1;
+}
+
+void mm_capture_reader_close(struct mm_capture_reader *reader) {
+    fclose(reader->f);
+}
@@ -0,0 +1,270 @@
+/*
+ * src/clock.c: System clock seeding from modem network time
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_clock.h"
+#include "mm_log.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_qmux.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+
+#include <nas.h>
+#include <qmerrno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* 3GPP network time (year u16, then month through second as u8s). */
+#define NAS_TLV_3GPP_TIME 0x11U
+
+/* As defined by chrony's refclock_sock.c. */
+#define CHRONY_SOCK_MAGIC 0x534f434b
+
+struct chrony_sock_sample {
+    struct timeval tv;
+    double offset;
+    int pulse;
+    int leap;
+    int _pad;
+    int magic;
+};
+
+struct network_time {
+    uint16_t year;
+    uint8_t month, day, hour, minute, second;
+};
+
+static struct mm_qmi_client nas_service;
+static bool nas_initialized;
+
+static int get_network_time_native(struct network_time *);
+static int get_network_time_sync(int64_t *);
+static void send_chrony_sample(int64_t, int64_t);
+
+int get_network_time_native(struct network_time *network_time) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    const uint8_t *tlv;
+    uint16_t length;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_NAS_GET_NETWORK_TIME);
+
+    if ((status = mm_qmi_send_native_request(&nas_service, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    /* The TLV is simply left out when the network hasn't sent NITZ. */
+    if ((tlv = mm_qmi_message_find_tlv(&response, NAS_TLV_3GPP_TIME,
+            &length)) == NULL || length < 7) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    network_time->year = (uint16_t) (tlv[0] | tlv[1] << 8);
+    network_time->month = tlv[2];
+    network_time->day = tlv[3];
+    network_time->hour = tlv[4];
+    network_time->minute = tlv[5];
+    network_time->second = tlv[6];
+    return eQCWWAN_ERR_NONE;
+}
+
+/* Returns network time (UTC) in microseconds since the epoch. */
+int get_network_time_sync(int64_t *network_time_us) {
+    unpack_nas_SLQSNasGetNetworkTime_t resp;
+    struct network_time info;
+    struct tm utc;
+    time_t t;
+    int status;
+
+    memset(&resp, 0, sizeof(resp));
+
+    if (nas_service.native) {
+        if ((status = get_network_time_native(&info)) != eQCWWAN_ERR_NONE) {
+            return status;
+        }
+    }
+
+    else if ((status = mm_qmi_send_sync_request_no_input(&nas_service,
+            MM_QMI_NAS_GET_NETWORK_TIME,
+            (pack_func_no_input) pack_nas_SLQSNasGetNetworkTime,
+            "pack_nas_SLQSNasGetNetworkTime",
+            (unpack_func) unpack_nas_SLQSNasGetNetworkTime,
+            "unpack_nas_SLQSNasGetNetworkTime", &resp,
+            DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    else if (resp.Tlvresult != eQCWWAN_ERR_NONE) {
+        return resp.Tlvresult;
+    }
+
+    /* Not every network sends NITZ; there's nothing to do without it. */
+    else if (!swi_uint256_get_bit(resp.ParamPresenceMask, 17)) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    else {
+        info.year = resp.sThreegppTimeInfo.year;
+        info.month = resp.sThreegppTimeInfo.month;
+        info.day = resp.sThreegppTimeInfo.day;
+        info.hour = resp.sThreegppTimeInfo.hour;
+        info.minute = resp.sThreegppTimeInfo.minute;
+        info.second = resp.sThreegppTimeInfo.second;
+    }
+
+    if (info.year < 2024 || info.month < 1 || info.month > 12 ||
+            info.day < 1 || info.day > 31 || info.hour > 23 ||
+            info.minute > 59 || info.second > 60) {
+        MM_LOG("%s%s\n", "Modem reported a nonsensical network time");
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    memset(&utc, 0, sizeof(utc));
+    utc.tm_year = info.year - 1900;
+    utc.tm_mon = info.month - 1;
+    utc.tm_mday = info.day;
+    utc.tm_hour = info.hour;
+    utc.tm_min = info.minute;
+    utc.tm_sec = info.second;
+
+    if ((t = timegm(&utc)) == (time_t) -1) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    /* Network time is truncated to the second: centre it on the interval. */
+    *network_time_us = (int64_t) t * 1000000 + 500000;
+    return eQCWWAN_ERR_NONE;
+}
+
+void send_chrony_sample(int64_t system_time_us, int64_t offset_us) {
+    struct chrony_sock_sample sample;
+    struct sockaddr_un address;
+    int fd;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.tv.tv_sec = (time_t) (system_time_us / 1000000);
+    sample.tv.tv_usec = (suseconds_t) (system_time_us % 1000000);
+    sample.offset = (double) offset_us / (double) 1000000U;
+    sample.magic = CHRONY_SOCK_MAGIC;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, MM_CLOCK_CHRONY_SOCKET,
+            sizeof(address.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return;
+    }
+
+    /* chrony may well not be running (yet), which is fine. */
+    if (sendto(fd, &sample, sizeof(sample), 0, (struct sockaddr *) &address,
+            sizeof(address)) < 0 && errno != ENOENT && errno != ECONNREFUSED) {
+        perror("sendto");
+    }
+
+    close(fd);
+}
+
+int mm_clock_initialize(struct mm_qmux *qmux) {
+    int status;
+
+    if ((status = mm_qmux_open_client(qmux, &nas_service, eNAS, NULL, NULL,
+            NULL)) == eQCWWAN_ERR_NONE) {
+        nas_initialized = true;
+    }
+
+    return status;
+}
+
+int mm_clock_shutdown(struct mm_qmux *qmux) {
+    if (!nas_initialized) {
+        return eQCWWAN_ERR_NONE;
+    }
+
+    nas_initialized = false;
+    return mm_qmux_close_client(qmux, &nas_service);
+}
+
+/*
+ * Queries network time from the modem and hands it to chrony. When allowed
+ * to and the clock is wildly off, also step the clock right away so that
+ * time-sensitive handshakes (TLS, Wireguard) work before chrony syncs up.
+ */
+int mm_clock_sync_from_modem(bool step_allowed) {
+    int64_t network_time_us, system_time_us, offset_us;
+    uint64_t requested_us, completed_us;
+    struct timespec ts;
+    int status;
+
+    if (!nas_initialized) {
+        return -1;
+    }
+
+    requested_us = mm_time_monotonic_us();
+
+    if ((status = get_network_time_sync(&network_time_us)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    /* Compare against system time as of (roughly) when it was sampled. */
+    completed_us = mm_time_monotonic_us();
+    system_time_us = (int64_t) mm_time_realtime_ms() * 1000 -
+            (int64_t) (completed_us - requested_us) / 2;
+
+    offset_us = network_time_us - system_time_us;
+
+    if (step_allowed && (offset_us > MM_CLOCK_STEP_THRESHOLD_S * 1000000LL ||
+            offset_us < -MM_CLOCK_STEP_THRESHOLD_S * 1000000LL)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t) (offset_us / 1000000);
+        ts.tv_nsec += (long) (offset_us % 1000000) * 1000L;
+
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        else if (ts.tv_nsec < 0) {
+            ts.tv_sec--;
+            ts.tv_nsec += 1000000000L;
+        }
+
+        if (clock_settime(CLOCK_REALTIME, &ts)) {
+            perror("clock_settime");
+        }
+
+        else {
+            MM_LOG("%sStepped the system clock by %"PRId64"s using network "
+                    "time from the modem\n", offset_us / 1000000);
+
+            mm_telemetry_event("clock_step offset_ms=%"PRId64,
+                    offset_us / 1000);
+
+            return eQCWWAN_ERR_NONE;
+        }
+    }
+
+    send_chrony_sample(system_time_us, offset_us);
+    return eQCWWAN_ERR_NONE;
+}
@@ -0,0 +1,470 @@
+/*
+ * src/config.c: Configuration file and hot reload functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_config.h"
+#include "mm_events.h"
+#include "mm_log.h"
+#include "mm_telemetry.h"
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INOTIFY_BUFFER_SIZE 4096U
+
+struct mm_config_state {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+
+    /* The published snapshot: replaced wholesale, never modified. */
+    struct mm_config current;
+
+    int inotify_fd, reload_fd, stop_fd;
+};
+
+static struct mm_config_state config_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+    .reload_fd = -1,
+    .stop_fd = -1,
+};
+
+static void *config_thread_main(void *);
+static bool parse_route(const char *, struct mm_netlink_route *);
+static void reload_config(void);
+static void set_defaults(struct mm_config *);
+
+void *config_thread_main(void *context) {
+    char buf[INOTIFY_BUFFER_SIZE];
+    struct inotify_event event;
+    struct pollfd fds[3];
+    eventfd_t value;
+    ssize_t length;
+    bool reload;
+    char *p;
+
+    (void) context;
+
+    fds[0].fd = config_state.stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = config_state.reload_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = config_state.inotify_fd;
+    fds[2].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        reload = false;
+
+        if ((fds[1].revents & POLLIN) &&
+                !eventfd_read(config_state.reload_fd, &value)) {
+            reload = true;
+        }
+
+        /* Editors tend to write a new file and rename it over the old. */
+        if ((fds[2].revents & POLLIN) && (length = read(
+                config_state.inotify_fd, buf, sizeof(buf))) > 0) {
+            for (p = buf; p < buf + length; p += sizeof(event) +
+                    event.len) {
+                memcpy(&event, p, sizeof(event));
+
+                if (event.len && !strcmp(p + sizeof(event),
+                        MM_CONFIG_FILE_NAME)) {
+                    reload = true;
+                }
+            }
+        }
+
+        if (reload) {
+            reload_config();
+        }
+    }
+
+    return NULL;
+}
+
+/* Parses <network>/<prefix>, clearing any host bits of the network. */
+bool parse_route(const char *value, struct mm_netlink_route *route) {
+    char address[INET_ADDRSTRLEN];
+    const char *slash;
+    unsigned long prefix_length;
+    struct in_addr network;
+    char *end;
+
+    if ((slash = strchr(value, '/')) == NULL ||
+            (size_t) (slash - value) >= sizeof(address) ||
+            !isdigit((unsigned char) slash[1])) {
+        return false;
+    }
+
+    memcpy(address, value, (size_t) (slash - value));
+    address[slash - value] = '\0';
+
+    if (inet_pton(AF_INET, address, &network) != 1 ||
+            (prefix_length = strtoul(slash + 1, &end, 10)) > 32 ||
+            *end != '\0') {
+        return false;
+    }
+
+    memset(route, 0, sizeof(*route));
+    route->prefix_length = (int) prefix_length;
+    route->address = prefix_length ? network.s_addr &
+            htonl(UINT32_MAX << (32 - prefix_length)) : 0;
+
+    return true;
+}
+
+void reload_config(void) {
+    struct mm_config config;
+    unsigned changes;
+
+    if (mm_config_load(MM_CONFIG_PATH, &config)) {
+        perror("mm_config: fopen");
+        return;
+    }
+
+    pthread_mutex_lock(&config_state.lock);
+
+    if ((changes = mm_config_diff(&config_state.current, &config)) != 0) {
+        config.generation = config_state.current.generation + 1;
+        config_state.current = config;
+    }
+
+    pthread_mutex_unlock(&config_state.lock);
+
+    if (!changes) {
+        MM_LOG("%s%s\n", "Configuration reloaded; nothing changed");
+        return;
+    }
+
+    MM_LOG("%sConfiguration reloaded: generation %"PRIu64", changes "
+            "0x%x\n", config.generation, changes);
+
+    mm_telemetry_event("config_reload generation=%"PRIu64" changes=0x%x",
+            config.generation, changes);
+
+    mm_events_post(MM_EVENT_CONFIG_CHANGED);
+}
+
+/* As compiled in before there was a config file. */
+void set_defaults(struct mm_config *config) {
+    memset(config, 0, sizeof(*config));
+    config->profile = 3;
+    config->autoconnect = MM_WDS_AUTOCONNECT_SETTING_DISABLED;
+    config->roaming = MM_WDS_AUTOCONNECT_ROAM_SETTING_HOME_ONLY;
+
+    inet_pton(AF_INET, "10.10.1.2", &config->wg0_address);
+    inet_pton(AF_INET, "10.10.1.1", &config->wg0_gateway);
+
+    /* The apt server, then the vrf-ops network. */
+    inet_pton(AF_INET, "10.10.2.2", &config->wg0_routes[0].address);
+    config->wg0_routes[0].prefix_length = 32;
+    inet_pton(AF_INET, "10.10.3.0", &config->wg0_routes[1].address);
+    config->wg0_routes[1].prefix_length = 24;
+    config->wg0_route_count = 2;
+
+    strcpy(config->units[0].name, "unbound.service");
+    strcpy(config->units[1].name, "chrony.service");
+    config->units[1].after_tunnel = true;
+    config->unit_count = 2;
+}
+
+/*
+ * Returns which parts of the config differ (see enum mm_config_change).
+ * Fields are compared one by one, as padding and whatever follows the NUL
+ * in a unit name are not guaranteed to match between two parses.
+ */
+unsigned mm_config_diff(const struct mm_config *old,
+        const struct mm_config *new) {
+    unsigned changes = 0, i;
+
+    if (old->profile != new->profile) {
+        changes |= MM_CONFIG_CHANGED_PROFILE;
+    }
+
+    if (old->autoconnect != new->autoconnect ||
+            old->roaming != new->roaming) {
+        changes |= MM_CONFIG_CHANGED_AUTOCONNECT;
+    }
+
+    if (old->wg0_address != new->wg0_address ||
+            old->wg0_gateway != new->wg0_gateway ||
+            old->wg0_route_count != new->wg0_route_count) {
+        changes |= MM_CONFIG_CHANGED_WG0;
+    }
+
+    for (i = 0; i < old->wg0_route_count && i < new->wg0_route_count; i++) {
+        if (old->wg0_routes[i].address != new->wg0_routes[i].address ||
+                old->wg0_routes[i].prefix_length !=
+                new->wg0_routes[i].prefix_length) {
+            changes |= MM_CONFIG_CHANGED_WG0;
+        }
+    }
+
+    if (old->unit_count != new->unit_count) {
+        changes |= MM_CONFIG_CHANGED_UNITS;
+    }
+
+    for (i = 0; i < old->unit_count && i < new->unit_count; i++) {
+        if (strcmp(old->units[i].name, new->units[i].name) ||
+                old->units[i].after_tunnel != new->units[i].after_tunnel) {
+            changes |= MM_CONFIG_CHANGED_UNITS;
+        }
+    }
+
+    return changes;
+}
+
+void mm_config_get(struct mm_config *config) {
+    pthread_mutex_lock(&config_state.lock);
+    *config = config_state.current;
+    pthread_mutex_unlock(&config_state.lock);
+}
+
+bool mm_config_has_unit(const struct mm_config *config,
+        const struct mm_config_unit *unit) {
+    unsigned i;
+
+    for (i = 0; i < config->unit_count; i++) {
+        if (!strcmp(config->units[i].name, unit->name) &&
+                config->units[i].after_tunnel == unit->after_tunnel) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Parses a config file over the defaults. Returns -1 if the file exists but
+ * could not be read (a missing file just leaves the defaults).
+ */
+int mm_config_load(const char *path, struct mm_config *config) {
+    char line[256], *keyword, *value, *option, *save, *end;
+    struct mm_netlink_route route;
+    struct in_addr address;
+    bool have_routes, have_units;
+    unsigned long number;
+    FILE *f;
+
+    set_defaults(config);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    /* Listing any routes (or units) replaces the defaults wholesale. */
+    have_routes = have_units = false;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((keyword = strtok_r(line, " \t\r\n", &save)) == NULL ||
+                keyword[0] == '#') {
+            continue;
+        }
+
+        value = strtok_r(NULL, " \t\r\n", &save);
+        option = value != NULL ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+        if (value == NULL) {
+            MM_LOG("%smm_config: Ignoring config line: %s\n", keyword);
+        }
+
+        else if (!strcmp(keyword, "profile") && isdigit((unsigned char)
+                value[0]) && (number = strtoul(value, &end, 10)) > 0 &&
+                number <= UINT8_MAX && *end == '\0') {
+            config->profile = (uint32_t) number;
+        }
+
+        else if (!strcmp(keyword, "autoconnect") &&
+                !strcmp(value, "disabled")) {
+            config->autoconnect = MM_WDS_AUTOCONNECT_SETTING_DISABLED;
+        }
+
+        else if (!strcmp(keyword, "autoconnect") &&
+                !strcmp(value, "enabled")) {
+            config->autoconnect = MM_WDS_AUTOCONNECT_SETTING_ENABLED;
+        }
+
+        else if (!strcmp(keyword, "autoconnect") &&
+                !strcmp(value, "paused")) {
+            config->autoconnect = MM_WDS_AUTOCONNECT_SETTING_PAUSED;
+        }
+
+        else if (!strcmp(keyword, "roaming") && !strcmp(value, "always")) {
+            config->roaming = MM_WDS_AUTOCONNECT_ROAM_SETTING_ALWAYS;
+        }
+
+        else if (!strcmp(keyword, "roaming") &&
+                !strcmp(value, "home-only")) {
+            config->roaming = MM_WDS_AUTOCONNECT_ROAM_SETTING_HOME_ONLY;
+        }
+
+        else if (!strcmp(keyword, "wg0-address") &&
+                inet_pton(AF_INET, value, &address) == 1) {
+            config->wg0_address = address.s_addr;
+        }
+
+        else if (!strcmp(keyword, "wg0-gateway") &&
+                inet_pton(AF_INET, value, &address) == 1) {
+            config->wg0_gateway = address.s_addr;
+        }
+
+        else if (!strcmp(keyword, "wg0-route") && parse_route(value,
+                &route)) {
+            if (!have_routes) {
+                config->wg0_route_count = 0;
+                have_routes = true;
+            }
+
+            if (config->wg0_route_count == MM_CONFIG_MAX_ROUTES) {
+                MM_LOG("%s%s\n", "mm_config: Too many routes; ignoring rest");
+                continue;
+            }
+
+            config->wg0_routes[config->wg0_route_count++] = route;
+        }
+
+        else if (!strcmp(keyword, "unit") && strlen(value) <
+                MM_CONFIG_UNIT_NAME_SIZE && (option == NULL ||
+                !strcmp(option, "after-tunnel"))) {
+            if (!have_units) {
+                config->unit_count = 0;
+                have_units = true;
+            }
+
+            if (config->unit_count == MM_CONFIG_MAX_UNITS) {
+                MM_LOG("%s%s\n", "mm_config: Too many units; ignoring rest");
+                continue;
+            }
+
+            strcpy(config->units[config->unit_count].name, value);
+            config->units[config->unit_count++].after_tunnel =
+                option != NULL;
+        }
+
+        else {
+            MM_LOG("%smm_config: Ignoring config line: %s\n", keyword);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Safe to call from a signal handler. */
+void mm_config_request_reload(void) {
+    if (config_state.reload_fd >= 0) {
+        eventfd_write(config_state.reload_fd, 1);
+    }
+}
+
+/*
+ * Loads the initial snapshot, falling back to the defaults if it can't be
+ * read, then watches for changes. Returns -1 if only the former worked.
+ */
+int mm_config_start(void) {
+    int status;
+
+    if (mm_config_load(MM_CONFIG_PATH, &config_state.current)) {
+        perror("mm_config: fopen");
+        set_defaults(&config_state.current);
+    }
+
+    if ((config_state.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    if ((config_state.reload_fd = eventfd(0, EFD_CLOEXEC |
+            EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        close(config_state.stop_fd);
+        return -1;
+    }
+
+    /* Without the directory, SIGHUP still works. */
+    if ((config_state.inotify_fd = inotify_init1(IN_CLOEXEC |
+            IN_NONBLOCK)) < 0) {
+        perror("inotify_init1");
+    }
+
+    else if (inotify_add_watch(config_state.inotify_fd, MM_CONFIG_DIRECTORY,
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        perror("inotify_add_watch");
+        close(config_state.inotify_fd);
+        config_state.inotify_fd = -1;
+    }
+
+    if ((status = pthread_create(&config_state.thread, NULL,
+            config_thread_main, NULL))) {
+        MM_LOG("%smm_config: pthread_create: %s\n", strerror(status));
+
+        if (config_state.inotify_fd >= 0) {
+            close(config_state.inotify_fd);
+        }
+
+        close(config_state.reload_fd);
+        close(config_state.stop_fd);
+        config_state.reload_fd = -1;
+        return -1;
+    }
+
+    config_state.running = true;
+    return 0;
+}
+
+void mm_config_stop(void) {
+    uint64_t value = 1;
+
+    if (!config_state.running) {
+        return;
+    }
+
+    if (write(config_state.stop_fd, &value, sizeof(value)) !=
+            sizeof(value)) {
+        perror("write");
+    }
+
+    pthread_join(config_state.thread, NULL);
+    config_state.running = false;
+
+    if (config_state.inotify_fd >= 0) {
+        close(config_state.inotify_fd);
+    }
+
+    close(config_state.reload_fd);
+    close(config_state.stop_fd);
+    config_state.reload_fd = -1;
+}
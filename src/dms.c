@@ -8,30 +8,91 @@
  * 'LICENSE', which is part of this source code package.
  */
 
+#include "mm_capture.h"
 #include "mm_dms.h"
+#include "mm_events.h"
+#include "mm_log.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_qmux.h"
 
 #include <dms.h>
 #include <QmiSyncObject.h>
 #include <qmerrno.h>
 #include <swidms.h>
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+/* TLVs picked out of responses and indications on the native path. */
+#define DMS_TLV_MODEL_ID 0x01U
+#define DMS_TLV_OPERATING_MODE 0x01U
+#define DMS_TLV_HARDWARE_RESTRICTED_MODE 0x11U
+#define DMS_TLV_REPORT_OPERATING_MODE 0x14U
+#define SWIDMS_TLV_TEMPERATURE 0x01U
+#define SWIDMS_TLV_TEMPERATURE_STATE 0x10U
+
+static int dms_get_model_native(struct mm_dms_service *, char **);
 static int dms_get_model_sync(struct mm_dms_service *, char **);
-static void dms_indication_callback(uint8_t *, uint16_t, void *);
+static int dms_get_power_native(struct mm_dms_service *,
+        enum mm_dms_operation_mode *, bool *);
+
+static int dms_get_temperature_native(struct mm_dms_service *, int16_t *,
+        enum mm_dms_thermal_state *);
+
+static void dms_handle_operating_mode(struct mm_dms_service *,
+        enum mm_dms_operation_mode);
+
+static int dms_set_event_report_sync(struct mm_dms_service *);
+static int dms_set_power_native(struct mm_dms_service *,
+        enum mm_dms_operation_mode);
+
+int dms_get_model_native(struct mm_dms_service *dms, char **model_id) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    const uint8_t *tlv;
+    uint16_t length;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_DMS_GET_MODEL_ID);
+
+    if ((status = mm_qmi_send_native_request(&dms->dms_service, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    /* The model is not NUL-terminated on the wire. */
+    if ((tlv = mm_qmi_message_find_tlv(&response, DMS_TLV_MODEL_ID,
+            &length)) != NULL) {
+        if ((*model_id = malloc(length + 1U)) == NULL) {
+            return eQCWWAN_ERR_QMI_NO_MEMORY;
+        }
+
+        memcpy(*model_id, tlv, length);
+        (*model_id)[length] = '\0';
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
 
 int dms_get_model_sync(struct mm_dms_service *dms, char **model_id) {
     unpack_dms_GetModelID_t resp;
     int status;
 
-    memset(&resp, 0, sizeof(resp));
     *model_id = NULL;
 
-    if ((status = QmiService_SendSyncRequest(&dms->dms_service,
+    if (dms->dms_service.native) {
+        return dms_get_model_native(dms, model_id);
+    }
+
+    memset(&resp, 0, sizeof(resp));
+
+    if ((status = mm_qmi_send_sync_request(&dms->dms_service,
+            MM_QMI_DMS_GET_MODEL_ID,
             (pack_func) pack_dms_GetModelID, "pack_dms_GetModelID", NULL,
             (unpack_func) unpack_dms_GetModelID, "unpack_dms_GetModelID", &resp,
             DEFAULT_SYNC_REQUEST_TIMEOUT_S)) == eQCWWAN_ERR_NONE) {
@@ -51,8 +112,193 @@ int dms_get_model_sync(struct mm_dms_service *dms, char **model_id) {
     return status;
 }
 
-void dms_indication_callback(uint8_t* qmi_packet,
+int dms_get_power_native(struct mm_dms_service *dms,
+        enum mm_dms_operation_mode *mode, bool *hardware_controlled_mode) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint8_t value;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_DMS_GET_OPERATING_MODE);
+
+    if ((status = mm_qmi_send_native_request(&dms->dms_service, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if (mm_qmi_message_get_u8(&response, DMS_TLV_OPERATING_MODE, &value)) {
+        *mode = (enum mm_dms_operation_mode) value;
+    }
+
+    if (mm_qmi_message_get_u8(&response, DMS_TLV_HARDWARE_RESTRICTED_MODE,
+            &value)) {
+        *hardware_controlled_mode = !!value;
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
+
+int dms_get_temperature_native(struct mm_dms_service *dms,
+        int16_t *temperature, enum mm_dms_thermal_state *state) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint16_t value;
+    uint8_t temperature_state;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_SWIDMS_GET_TEMPERATURE);
+
+    if ((status = mm_qmi_send_native_request(&dms->swi_dms_service,
+            &request, &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if (!mm_qmi_message_get_u16(&response, SWIDMS_TLV_TEMPERATURE, &value)) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    *temperature = (int16_t) value;
+
+    if (mm_qmi_message_get_u8(&response, SWIDMS_TLV_TEMPERATURE_STATE,
+            &temperature_state) && temperature_state <
+            MM_DMS_THERMAL_STATE_MAX) {
+        *state = (enum mm_dms_thermal_state) temperature_state;
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
+
+void dms_handle_operating_mode(struct mm_dms_service *dms,
+        enum mm_dms_operation_mode mode) {
+    if (mode == dms->reported_mode) {
+        return;
+    }
+
+    MM_LOG("%sModem reported operating mode change: %s -> %s\n",
+            mm_dms_get_operation_mode_string(dms->reported_mode),
+            mm_dms_get_operation_mode_string(mode));
+
+    /* Publish the new mode before waking up the main loop. */
+    dms->reported_mode = mode;
+    mm_events_post_to(dms->events, MM_EVENT_OPERATING_MODE);
+}
+
+/* Ask for an indication whenever the operating mode of the modem changes. */
+int dms_set_event_report_sync(struct mm_dms_service *dms) {
+    pack_dms_SetEventReport_t req;
+    unpack_dms_SetEventReport_t resp;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint8_t operating_mode = 1;
+    int status;
+
+    if (dms->dms_service.native) {
+        mm_qmi_request_init(&request, MM_QMI_DMS_SET_EVENT_REPORT);
+        mm_qmi_request_put_u8(&request, DMS_TLV_REPORT_OPERATING_MODE,
+                operating_mode);
+
+        return mm_qmi_send_native_request(&dms->dms_service, &request,
+                &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S);
+    }
+
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
+    req.pOperatingMode = &operating_mode;
+
+    if ((status = mm_qmi_send_sync_request(&dms->dms_service,
+            MM_QMI_DMS_SET_EVENT_REPORT,
+            (pack_func) pack_dms_SetEventReport, "pack_dms_SetEventReport",
+            &req, (unpack_func) unpack_dms_SetEventReport,
+            "unpack_dms_SetEventReport", &resp,
+            DEFAULT_SYNC_REQUEST_TIMEOUT_S)) == eQCWWAN_ERR_NONE) {
+        if (resp.Tlvresult != eQCWWAN_ERR_NONE) {
+            return resp.Tlvresult;
+        }
+    }
+
+    return status;
+}
+
+int dms_set_power_native(struct mm_dms_service *dms,
+        enum mm_dms_operation_mode mode) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+
+    mm_qmi_request_init(&request, MM_QMI_DMS_SET_OPERATING_MODE);
+    mm_qmi_request_put_u8(&request, DMS_TLV_OPERATING_MODE, (uint8_t) mode);
+
+    return mm_qmi_send_native_request(&dms->dms_service, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S);
+}
+
+void mm_dms_indication_callback(uint8_t* qmi_packet,
         uint16_t qmi_packet_size, void* context) {
+    struct mm_dms_service *dms = (struct mm_dms_service *) context;
+    unpack_dms_SetEventReport_ind_t event_report;
+    unpack_qmi_t resp_context;
+    enum mm_dms_operation_mode mode;
+
+    memset(&resp_context, 0, sizeof(resp_context));
+    helper_get_resp_ctx(eDMS, qmi_packet, qmi_packet_size, &resp_context);
+
+    mm_capture_record(MM_CAPTURE_RECORD_INDICATION,
+            dms ? dms->dms_service.modem : 0, eDMS,
+            dms ? dms->dms_service.client_id : 0, resp_context.msgid,
+            qmi_packet, qmi_packet_size);
+
+    switch (resp_context.msgid) {
+    case MM_QMI_DMS_SET_EVENT_REPORT:
+        memset(&event_report, 0, sizeof(event_report));
+
+        if (unpack_dms_SetEventReport_ind(qmi_packet, qmi_packet_size,
+                &event_report) != eQCWWAN_ERR_NONE) {
+            MM_LOG("%s%s\n", "Failed to process DMS event report indication");
+            break;
+        }
+
+        if (!event_report.OperatingModeTlv.TlvPresent || dms == NULL) {
+            break;
+        }
+
+        mode = (enum mm_dms_operation_mode)
+                event_report.OperatingModeTlv.operatingMode;
+
+        dms_handle_operating_mode(dms, mode);
+        break;
+
+    default:
+        MM_LOG("%sUnhandled DMS indication: MessageID=%"PRIu16"\n",
+                resp_context.msgid);
+        break;
+    }
+}
+
+void mm_dms_native_indication_callback(const struct mm_qmi_message *message,
+        void *context) {
+    struct mm_dms_service *dms = (struct mm_dms_service *) context;
+    uint8_t mode;
+
+    mm_capture_record(MM_CAPTURE_RECORD_INDICATION,
+            dms ? dms->dms_service.modem : 0, eDMS,
+            dms ? dms->dms_service.client_id : 0, message->message_id,
+            message->sdu, message->sdu_length);
+
+    switch (message->message_id) {
+    case MM_QMI_DMS_SET_EVENT_REPORT:
+        if (!mm_qmi_message_get_u8(message, DMS_TLV_REPORT_OPERATING_MODE,
+                &mode) || dms == NULL) {
+            break;
+        }
+
+        dms_handle_operating_mode(dms, (enum mm_dms_operation_mode) mode);
+        break;
+
+    default:
+        MM_LOG("%sUnhandled DMS indication: MessageID=%"PRIu16"\n",
+                message->message_id);
+        break;
+    }
 }
 
 const char *mm_dms_get_operation_mode_string(enum mm_dms_operation_mode mode) {
@@ -82,11 +328,17 @@ int mm_dms_get_power_sync(struct mm_dms_service *dms,
     unpack_dms_GetPower_t resp;
     int status;
 
-    memset(&resp, 0, sizeof(resp));
     *hardware_controlled_mode = false;
     *mode = MM_DMS_OPERATION_MODE_INVALID;
 
-    if ((status = QmiService_SendSyncRequest(&dms->dms_service,
+    if (dms->dms_service.native) {
+        return dms_get_power_native(dms, mode, hardware_controlled_mode);
+    }
+
+    memset(&resp, 0, sizeof(resp));
+
+    if ((status = mm_qmi_send_sync_request(&dms->dms_service,
+            MM_QMI_DMS_GET_OPERATING_MODE,
             (pack_func) pack_dms_GetPower, "pack_dms_GetPower", NULL,
             (unpack_func) unpack_dms_GetPower, "unpack_dms_GetPower", &resp,
             DEFAULT_SYNC_REQUEST_TIMEOUT_S)) == eQCWWAN_ERR_NONE) {
@@ -106,22 +358,80 @@ int mm_dms_get_power_sync(struct mm_dms_service *dms,
     return status;
 }
 
-int mm_dms_initialize(struct mm_dms_service *dms, CtlService *ctl) {
+/* Uses the Sierra-specific DMS client, as QMI DMS has no such message. */
+int mm_dms_get_temperature_sync(struct mm_dms_service *dms,
+        int16_t *temperature, enum mm_dms_thermal_state *state) {
+    unpack_swidms_SLQSSwiGetTemperature_t resp;
+    int status;
+
+    *state = MM_DMS_THERMAL_STATE_INVALID;
+    *temperature = 0;
+
+    if (dms->swi_dms_service.native) {
+        return dms_get_temperature_native(dms, temperature, state);
+    }
+
+    memset(&resp, 0, sizeof(resp));
+
+    if ((status = mm_qmi_send_sync_request_no_input(&dms->swi_dms_service,
+            MM_QMI_SWIDMS_GET_TEMPERATURE,
+            (pack_func_no_input) pack_swidms_SLQSSwiGetTemperature,
+            "pack_swidms_SLQSSwiGetTemperature",
+            (unpack_func) unpack_swidms_SLQSSwiGetTemperature,
+            "unpack_swidms_SLQSSwiGetTemperature", &resp,
+            DEFAULT_SYNC_REQUEST_TIMEOUT_S)) == eQCWWAN_ERR_NONE) {
+        if (resp.Tlvresult != eQCWWAN_ERR_NONE) {
+            return resp.Tlvresult;
+        }
+
+        if (!swi_uint256_get_bit(resp.ParamPresenceMask, 1)) {
+            return eQCWWAN_ERR_GENERAL;
+        }
+
+        *temperature = resp.Temperature;
+
+        if (swi_uint256_get_bit(resp.ParamPresenceMask, 16) &&
+                resp.TempState < MM_DMS_THERMAL_STATE_MAX) {
+            *state = (enum mm_dms_thermal_state) resp.TempState;
+        }
+    }
+
+    return status;
+}
+
+const char *mm_dms_get_thermal_state_string(enum mm_dms_thermal_state state) {
+    static const char *mm_dms_thermal_states[] = {
+        "Normal",
+        "High warning",
+        "High critical",
+        "Low critical",
+    };
+
+    const size_t entries = sizeof(mm_dms_thermal_states) /
+            sizeof(*mm_dms_thermal_states);
+
+    if (state >= entries) {
+        return "Invalid";
+    }
+
+    return mm_dms_thermal_states[state];
+}
+
+int mm_dms_initialize(struct mm_dms_service *dms, struct mm_qmux *qmux) {
     int status, check;
 
-    memset(&dms->dms_service, 0, sizeof(dms->dms_service));
-    memset(&dms->swi_dms_service, 0, sizeof(dms->swi_dms_service));
+    dms->reported_mode = MM_DMS_OPERATION_MODE_INVALID;
     status = eQCWWAN_ERR_NONE;
 
     /* There is no SWI DMS notification from firmware. */
-    if ((status = CtlService_InitializeRegularServiceEx(ctl,
-            &dms->swi_dms_service, eSWIDMS, NULL, NULL, 0)) !=
-            eQCWWAN_ERR_NONE) {
+    if ((status = mm_qmux_open_client(qmux, &dms->swi_dms_service, eSWIDMS,
+            NULL, NULL, NULL)) != eQCWWAN_ERR_NONE) {
         return status;
     }
 
-    if ((check = CtlService_InitializeRegularServiceEx(ctl, &dms->dms_service,
-            eDMS, dms_indication_callback, dms, 0)) != eQCWWAN_ERR_NONE) {
+    if ((check = mm_qmux_open_client(qmux, &dms->dms_service, eDMS,
+            mm_dms_indication_callback, mm_dms_native_indication_callback,
+            dms)) != eQCWWAN_ERR_NONE) {
         status = check;
     }
 
@@ -134,18 +444,23 @@ int mm_dms_initialize(struct mm_dms_service *dms, CtlService *ctl) {
             }
         }
 
+        if (status == eQCWWAN_ERR_NONE && (check =
+                dms_set_event_report_sync(dms)) != eQCWWAN_ERR_NONE) {
+            status = check;
+        }
+
         if (status == eQCWWAN_ERR_NONE) {
             return status;
         }
 
-        if ((check = CtlService_ShutDownRegularService(ctl,
-                &dms->dms_service)) != eQCWWAN_ERR_NONE) {
+        if ((check = mm_qmux_close_client(qmux, &dms->dms_service)) !=
+                eQCWWAN_ERR_NONE) {
             status = check;
         }
     }
 
-    if ((check = CtlService_ShutDownRegularService(ctl,
-            &dms->swi_dms_service)) != eQCWWAN_ERR_NONE) {
+    if ((check = mm_qmux_close_client(qmux, &dms->swi_dms_service)) !=
+            eQCWWAN_ERR_NONE) {
         status = check;
     }
 
@@ -179,18 +494,26 @@ int mm_dms_set_power_sync(struct mm_dms_service *dms,
         return eQCWWAN_ERR_NONE;
     }
 
-    memset(&req, 0, sizeof(req));
-    memset(&resp, 0, sizeof(resp));
-    req.mode = requested_mode;
+    if (dms->dms_service.native) {
+        status = dms_set_power_native(dms, requested_mode);
+    }
 
-    if ((status = QmiService_SendSyncRequest(&dms->dms_service,
-            (pack_func) pack_dms_SetPower, "pack_dms_SetPower", &req,
-            (unpack_func) unpack_dms_SetPower, "unpack_dms_SetPower", &resp,
-            DEFAULT_SYNC_REQUEST_TIMEOUT_S)) == eQCWWAN_ERR_NONE) {
-        if (resp.Tlvresult != eQCWWAN_ERR_NONE) {
-            return resp.Tlvresult;
+    else {
+        memset(&req, 0, sizeof(req));
+        memset(&resp, 0, sizeof(resp));
+        req.mode = requested_mode;
+
+        if ((status = mm_qmi_send_sync_request(&dms->dms_service,
+                MM_QMI_DMS_SET_OPERATING_MODE,
+                (pack_func) pack_dms_SetPower, "pack_dms_SetPower", &req,
+                (unpack_func) unpack_dms_SetPower, "unpack_dms_SetPower",
+                &resp, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) ==
+                eQCWWAN_ERR_NONE) {
+            status = resp.Tlvresult;
         }
+    }
 
+    if (status == eQCWWAN_ERR_NONE) {
         /* Read the power state back out to see if it really changed. */
         if ((status = mm_dms_get_power_sync(dms, &current_mode,
                 &hardware_controlled_mode)) != eQCWWAN_ERR_NONE) {
@@ -208,7 +531,7 @@ int mm_dms_set_power_sync(struct mm_dms_service *dms,
 }
 
 int mm_dms_shutdown(struct mm_dms_service *dms,
-        CtlService *ctl, bool deallocate_cached_fields) {
+        struct mm_qmux *qmux, bool deallocate_cached_fields) {
     int status, check;
 
     if (deallocate_cached_fields) {
@@ -217,11 +540,10 @@ int mm_dms_shutdown(struct mm_dms_service *dms,
     }
 
     /* If either DMS service shutdown raises an error, return it. */
-    status = CtlService_ShutDownRegularService(ctl,
-            &dms->swi_dms_service);
+    status = mm_qmux_close_client(qmux, &dms->swi_dms_service);
 
-    if ((check = CtlService_ShutDownRegularService(ctl,
-            &dms->dms_service)) != eQCWWAN_ERR_NONE) {
+    if ((check = mm_qmux_close_client(qmux, &dms->dms_service)) !=
+            eQCWWAN_ERR_NONE) {
         status = check;
     }
 
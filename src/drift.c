@@ -0,0 +1,287 @@
+/*
+ * src/drift.c: Route, address and link drift guard
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_drift.h"
+#include "mm_events.h"
+#include "mm_hotplug.h"
+#include "mm_log.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+
+#include <libnl3/netlink/msg.h>
+#include <libnl3/netlink/netlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+struct mm_drift_guard {
+    uint64_t window_started_us;
+    unsigned window_corrections;
+    uint64_t corrections, failures;
+    bool pending;
+};
+
+struct mm_drift_state {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+
+    struct mm_drift_guard guards[MM_HOTPLUG_MAX_MODEMS];
+
+    struct nl_sock *route_sock;
+    int stop_fd;
+};
+
+static struct mm_drift_state drift = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stop_fd = -1,
+};
+
+static void *drift_thread_main(void *);
+static int handle_route_message(struct nl_msg *, void *);
+
+void *drift_thread_main(void *context) {
+    struct pollfd fds[2];
+    int status;
+
+    (void) context;
+
+    fds[0].fd = drift.stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = nl_socket_get_fd(drift.route_sock);
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        /* ENOBUFS means we missed something: have everything checked. */
+        if ((fds[1].revents & POLLIN) && (status = nl_recvmsgs_default(
+                drift.route_sock)) < 0 && status != -NLE_AGAIN) {
+            MM_LOG("%smm_drift: nl_recvmsgs: %s\n", nl_geterror(status));
+            mm_events_post(MM_EVENT_NETLINK_CHANGED);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Only what could undo our work is of interest: new addresses and routes
+ * are not, save for default routes (which may have replaced ours).
+ */
+int handle_route_message(struct nl_msg *msg, void *context) {
+    struct nlmsghdr *hdr = nlmsg_hdr(msg);
+    const struct rtmsg *rtm;
+
+    (void) context;
+
+    switch (hdr->nlmsg_type) {
+    case RTM_NEWROUTE:
+        rtm = nlmsg_data(hdr);
+
+        if (rtm->rtm_family != AF_INET || rtm->rtm_dst_len != 0) {
+            break;
+        }
+
+        /* Fall through. */
+
+    case RTM_DELADDR:
+    case RTM_DELROUTE:
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        mm_events_post(MM_EVENT_NETLINK_CHANGED);
+        break;
+
+    default:
+        break;
+    }
+
+    return NL_OK;
+}
+
+/*
+ * Restores whatever drifted from the modem's applied IPv4 settings (and
+ * wg0, if it brought that up), unless the rate limit has been reached.
+ * Whatever can't be restored now stays pending, to be retried.
+ */
+void mm_drift_check(unsigned modem, struct mm_netlink *mm_nl,
+        const struct mm_wds_runtime_settings *settings) {
+    struct mm_drift_guard *guard = drift.guards + modem;
+    unsigned restored;
+    uint64_t now_us;
+    int status;
+
+    now_us = mm_time_monotonic_us();
+
+    pthread_mutex_lock(&drift.lock);
+
+    if (now_us - guard->window_started_us >=
+            MM_DRIFT_WINDOW_S * 1000000ULL) {
+        guard->window_started_us = now_us;
+        guard->window_corrections = 0;
+    }
+
+    if (guard->window_corrections >= MM_DRIFT_MAX_CORRECTIONS) {
+        if (!guard->pending) {
+            MM_LOG("%sDrift keeps recurring on modem %u; holding off\n",
+                    modem);
+        }
+
+        guard->pending = true;
+        pthread_mutex_unlock(&drift.lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&drift.lock);
+
+    status = mm_netlink_restore_drift(mm_nl, settings->address.in.s_addr,
+            settings->prefix_length, settings->gateway.in.s_addr, &restored);
+
+    pthread_mutex_lock(&drift.lock);
+    guard->window_corrections += restored;
+    guard->corrections += restored;
+    guard->failures += status != 0;
+    guard->pending = status != 0;
+    pthread_mutex_unlock(&drift.lock);
+
+    if (status) {
+        MM_LOG("%sFailed to restore drifted state on modem %u\n", modem);
+    }
+
+    if (restored) {
+        mm_telemetry_event("drift_restored modem=%u count=%u failed=%d",
+                modem, restored, status != 0);
+    }
+}
+
+bool mm_drift_is_pending(unsigned modem) {
+    bool pending;
+
+    pthread_mutex_lock(&drift.lock);
+    pending = drift.guards[modem].pending;
+    pthread_mutex_unlock(&drift.lock);
+
+    return pending;
+}
+
+int mm_drift_start(void) {
+    int status;
+
+    if ((drift.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    if ((drift.route_sock = nl_socket_alloc()) == NULL) {
+        perror("nl_socket_alloc");
+        close(drift.stop_fd);
+        return -1;
+    }
+
+    nl_socket_disable_seq_check(drift.route_sock);
+    nl_socket_modify_cb(drift.route_sock, NL_CB_VALID, NL_CB_CUSTOM,
+            handle_route_message, NULL);
+
+    if ((status = nl_connect(drift.route_sock, NETLINK_ROUTE)) ||
+            (status = nl_socket_add_memberships(drift.route_sock,
+            RTNLGRP_LINK, RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV4_ROUTE, 0))) {
+        MM_LOG("%smm_drift: %s\n", nl_geterror(status));
+        nl_socket_free(drift.route_sock);
+        close(drift.stop_fd);
+        return -1;
+    }
+
+    if ((status = pthread_create(&drift.thread, NULL, drift_thread_main,
+            NULL))) {
+        MM_LOG("%smm_drift: pthread_create: %s\n", strerror(status));
+        nl_socket_free(drift.route_sock);
+        close(drift.stop_fd);
+        return -1;
+    }
+
+    drift.running = true;
+    return 0;
+}
+
+void mm_drift_stop(void) {
+    uint64_t value = 1;
+
+    if (!drift.running) {
+        return;
+    }
+
+    if (write(drift.stop_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+
+    pthread_join(drift.thread, NULL);
+    drift.running = false;
+
+    nl_socket_free(drift.route_sock);
+    close(drift.stop_fd);
+}
+
+void mm_drift_write_metrics(FILE *f, void *context) {
+    const struct mm_drift_guard *guard;
+    unsigned modem;
+
+    (void) context;
+
+    pthread_mutex_lock(&drift.lock);
+
+    if (!drift.running) {
+        pthread_mutex_unlock(&drift.lock);
+        return;
+    }
+
+    fprintf(f, "# HELP modem_monitor_drift_corrections_total "
+            "Addresses, routes and link states put back after others "
+            "removed them.\n"
+            "# TYPE modem_monitor_drift_corrections_total counter\n");
+
+    for (modem = 0, guard = drift.guards; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, guard++) {
+        fprintf(f, "modem_monitor_drift_corrections_total{modem=\"%u\"} "
+                "%"PRIu64"\n", modem, guard->corrections);
+    }
+
+    fprintf(f, "# HELP modem_monitor_drift_failures_total "
+            "Checks which failed to put everything back.\n"
+            "# TYPE modem_monitor_drift_failures_total counter\n");
+
+    for (modem = 0, guard = drift.guards; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, guard++) {
+        fprintf(f, "modem_monitor_drift_failures_total{modem=\"%u\"} "
+                "%"PRIu64"\n", modem, guard->failures);
+    }
+
+    pthread_mutex_unlock(&drift.lock);
+}
@@ -0,0 +1,204 @@
+/*
+ * src/events.c: Main loop event signaling functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_events.h"
+#include "mm_time.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_events *queues[MM_EVENTS_MAX_QUEUES];
+
+static unsigned take_pending(struct mm_events *);
+static unsigned wait_with_io(struct mm_events *, uint64_t);
+
+unsigned take_pending(struct mm_events *queue) {
+    unsigned events;
+
+    pthread_mutex_lock(&queue->lock);
+    events = queue->pending;
+    queue->pending = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    return events;
+}
+
+/* The handler runs without the queue locked: it may well post events. */
+unsigned wait_with_io(struct mm_events *queue, uint64_t deadline_us) {
+    struct pollfd fds[2];
+    eventfd_t value;
+    uint64_t now_us, timeout_ms;
+    unsigned events;
+
+    while (queue->io_fd >= 0) {
+        now_us = mm_time_monotonic_us();
+
+        if ((events = take_pending(queue)) != 0 || now_us >= deadline_us) {
+            return events;
+        }
+
+        timeout_ms = (deadline_us - now_us + 999U) / 1000U;
+
+        fds[0].fd = queue->wake_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = queue->io_fd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, timeout_ms > INT_MAX ? INT_MAX : (int) timeout_ms)
+                < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                return take_pending(queue);
+            }
+
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            eventfd_read(queue->wake_fd, &value);
+        }
+
+        if (fds[1].revents && queue->io_handler(queue->io_context)) {
+            mm_events_set_io(queue, -1, NULL, NULL);
+        }
+    }
+
+    return 0;
+}
+
+/* Returns -1 if there are already as many queues as we have room for. */
+int mm_events_initialize(struct mm_events *events) {
+    pthread_condattr_t attr;
+    size_t i;
+
+    pthread_mutex_lock(&queues_lock);
+
+    for (i = 0; i < MM_EVENTS_MAX_QUEUES; i++) {
+        if (queues[i] == NULL) {
+            break;
+        }
+    }
+
+    if (i == MM_EVENTS_MAX_QUEUES) {
+        pthread_mutex_unlock(&queues_lock);
+        return -1;
+    }
+
+    if ((events->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        pthread_mutex_unlock(&queues_lock);
+        return -1;
+    }
+
+    pthread_mutex_init(&events->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&events->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    events->pending = 0;
+    mm_events_set_io(events, -1, NULL, NULL);
+
+    queues[i] = events;
+    pthread_mutex_unlock(&queues_lock);
+    return 0;
+}
+
+void mm_events_destroy(struct mm_events *events) {
+    size_t i;
+
+    pthread_mutex_lock(&queues_lock);
+
+    for (i = 0; i < MM_EVENTS_MAX_QUEUES; i++) {
+        if (queues[i] == events) {
+            queues[i] = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&queues_lock);
+
+    pthread_cond_destroy(&events->cond);
+    pthread_mutex_destroy(&events->lock);
+    close(events->wake_fd);
+}
+
+/* Wakes up every event loop. */
+void mm_events_post(unsigned events) {
+    size_t i;
+
+    pthread_mutex_lock(&queues_lock);
+
+    for (i = 0; i < MM_EVENTS_MAX_QUEUES; i++) {
+        if (queues[i] != NULL) {
+            mm_events_post_to(queues[i], events);
+        }
+    }
+
+    pthread_mutex_unlock(&queues_lock);
+}
+
+/* Wakes up one event loop (or, given no queue, every one of them). */
+void mm_events_post_to(struct mm_events *queue, unsigned events) {
+    if (queue == NULL) {
+        mm_events_post(events);
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->pending |= events;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    eventfd_write(queue->wake_fd, 1);
+}
+
+/* Only to be called by the thread which waits on the queue. */
+void mm_events_set_io(struct mm_events *queue, int fd,
+        mm_events_io_handler handler, void *context) {
+    queue->io_fd = fd;
+    queue->io_handler = handler;
+    queue->io_context = context;
+}
+
+/*
+ * Waits until either an event is posted or the deadline (in microseconds,
+ * as per mm_time_monotonic_us) passes, and returns (and clears) any pending
+ * events.
+ */
+unsigned mm_events_wait(struct mm_events *queue, uint64_t deadline_us) {
+    struct timespec deadline;
+    unsigned events;
+
+    if (queue->io_fd >= 0 && (events = wait_with_io(queue, deadline_us))) {
+        return events;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->pending == 0 && mm_time_monotonic_us() < deadline_us) {
+        mm_time_cond_deadline(deadline_us, &deadline);
+        pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline);
+    }
+
+    events = queue->pending;
+    queue->pending = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    return events;
+}
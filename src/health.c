@@ -0,0 +1,183 @@
+/*
+ * src/health.c: Modem health (thermal) tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_dms.h"
+#include "mm_health.h"
+#include "mm_hotplug.h"
+#include "mm_log.h"
+#include "mm_telemetry.h"
+#include "mm_tsdb.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct mm_health_modem {
+    bool have_sample, throttled;
+    int16_t temperature_c;
+    enum mm_dms_thermal_state thermal_state;
+    uint64_t samples, sample_errors, throttle_events;
+};
+
+struct mm_health_state {
+    pthread_mutex_t lock;
+    struct mm_health_modem modems[MM_HOTPLUG_MAX_MODEMS];
+};
+
+static struct mm_health_state health = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+bool mm_health_is_thermally_throttled(unsigned modem) {
+    bool throttled;
+
+    pthread_mutex_lock(&health.lock);
+    throttled = health.modems[modem].throttled;
+    pthread_mutex_unlock(&health.lock);
+
+    return throttled;
+}
+
+void mm_health_record_error(unsigned modem) {
+    pthread_mutex_lock(&health.lock);
+    health.modems[modem].sample_errors++;
+    pthread_mutex_unlock(&health.lock);
+}
+
+void mm_health_record_sample(unsigned modem, int16_t temperature_c,
+        enum mm_dms_thermal_state thermal_state) {
+    struct mm_health_modem *state = health.modems + modem;
+    bool was_throttled, throttled;
+
+    pthread_mutex_lock(&health.lock);
+
+    was_throttled = state->throttled;
+
+    if (thermal_state != MM_DMS_THERMAL_STATE_NORMAL &&
+            thermal_state != MM_DMS_THERMAL_STATE_INVALID) {
+        throttled = true;
+    }
+
+    else if (temperature_c >= MM_HEALTH_THROTTLE_TEMPERATURE_C) {
+        throttled = true;
+    }
+
+    else if (temperature_c < MM_HEALTH_RECOVERY_TEMPERATURE_C) {
+        throttled = false;
+    }
+
+    else {
+        throttled = was_throttled;
+    }
+
+    state->have_sample = true;
+    state->temperature_c = temperature_c;
+    state->thermal_state = thermal_state;
+    state->throttled = throttled;
+    state->samples++;
+
+    if (throttled && !was_throttled) {
+        state->throttle_events++;
+    }
+
+    pthread_mutex_unlock(&health.lock);
+
+    /* The aux field tells the modems' samples apart. */
+    mm_tsdb_append(MM_TSDB_SERIES_TEMPERATURE, (uint8_t) thermal_state,
+            (uint16_t) modem, temperature_c);
+
+    if (throttled != was_throttled) {
+        MM_LOG("%sModem %u is %s thermal throttling: %"PRId16"C (%s)\n",
+                modem, throttled ? "entering" : "leaving", temperature_c,
+                mm_dms_get_thermal_state_string(thermal_state));
+
+        mm_telemetry_event("thermal_throttle modem=%u active=%d "
+                "temperature_c=%"PRId16" state=%u", modem, throttled,
+                temperature_c, (unsigned) thermal_state);
+    }
+}
+
+/* Only modems which have ever been sampled are reported. */
+void mm_health_write_metrics(FILE *f, void *context) {
+    const struct mm_health_modem *state;
+    unsigned modem;
+
+    pthread_mutex_lock(&health.lock);
+
+    fprintf(f, "# HELP modem_monitor_modem_temperature_celsius "
+            "Last sampled modem temperature.\n"
+            "# TYPE modem_monitor_modem_temperature_celsius gauge\n");
+
+    for (modem = 0, state = health.modems; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, state++) {
+        if (state->have_sample) {
+            fprintf(f, "modem_monitor_modem_temperature_celsius"
+                    "{modem=\"%u\"} %"PRId16"\n", modem,
+                    state->temperature_c);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_modem_thermal_state "
+            "Modem-reported thermal state (0 is normal).\n"
+            "# TYPE modem_monitor_modem_thermal_state gauge\n");
+
+    for (modem = 0, state = health.modems; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, state++) {
+        if (state->have_sample) {
+            fprintf(f, "modem_monitor_modem_thermal_state{modem=\"%u\"} "
+                    "%u\n", modem, (unsigned) state->thermal_state);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_modem_thermally_throttled "
+            "Whether the modem is considered to be thermally throttling.\n"
+            "# TYPE modem_monitor_modem_thermally_throttled gauge\n");
+
+    for (modem = 0, state = health.modems; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, state++) {
+        if (state->samples || state->sample_errors) {
+            fprintf(f, "modem_monitor_modem_thermally_throttled"
+                    "{modem=\"%u\"} %d\n", modem, state->throttled);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_modem_thermal_throttle_events_total "
+            "Number of times the modem started thermally throttling.\n"
+            "# TYPE modem_monitor_modem_thermal_throttle_events_total "
+            "counter\n");
+
+    for (modem = 0, state = health.modems; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, state++) {
+        if (state->samples || state->sample_errors) {
+            fprintf(f, "modem_monitor_modem_thermal_throttle_events_total"
+                    "{modem=\"%u\"} %"PRIu64"\n", modem,
+                    state->throttle_events);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_modem_health_samples_total "
+            "Modem health samples taken, by outcome.\n"
+            "# TYPE modem_monitor_modem_health_samples_total counter\n");
+
+    for (modem = 0, state = health.modems; modem < MM_HOTPLUG_MAX_MODEMS;
+            modem++, state++) {
+        if (state->samples || state->sample_errors) {
+            fprintf(f, "modem_monitor_modem_health_samples_total"
+                    "{modem=\"%u\",result=\"ok\"} %"PRIu64"\n"
+                    "modem_monitor_modem_health_samples_total"
+                    "{modem=\"%u\",result=\"error\"} %"PRIu64"\n",
+                    modem, state->samples, modem, state->sample_errors);
+        }
+    }
+
+    pthread_mutex_unlock(&health.lock);
+}
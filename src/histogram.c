@@ -0,0 +1,103 @@
+/*
+ * src/histogram.c: Compact log-linear histogram functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_histogram.h"
+
+#include <stdint.h>
+
+static unsigned get_bucket_index(uint32_t);
+static uint32_t get_bucket_upper_bound(unsigned);
+
+unsigned get_bucket_index(uint32_t value) {
+    unsigned msb, shift;
+
+    if (value < MM_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    msb = 31U - (unsigned) __builtin_clz(value);
+    shift = msb - MM_HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * MM_HISTOGRAM_SUB_BUCKETS +
+            ((value >> shift) & (MM_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint32_t get_bucket_upper_bound(unsigned index) {
+    uint64_t lower;
+    unsigned shift;
+
+    if (index < MM_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / MM_HISTOGRAM_SUB_BUCKETS - 1;
+    lower = (uint64_t) (MM_HISTOGRAM_SUB_BUCKETS +
+            index % MM_HISTOGRAM_SUB_BUCKETS) << shift;
+
+    return (uint32_t) (lower + (1ULL << shift) - 1);
+}
+
+/* Folds the samples of one histogram into another. */
+void mm_histogram_merge(struct mm_histogram *histogram,
+        const struct mm_histogram *other) {
+    unsigned i;
+
+    for (i = 0; i < MM_HISTOGRAM_BUCKETS; i++) {
+        histogram->buckets[i] += other->buckets[i];
+    }
+
+    histogram->count += other->count;
+    histogram->sum += other->sum;
+
+    if (other->max > histogram->max) {
+        histogram->max = other->max;
+    }
+}
+
+void mm_histogram_record(struct mm_histogram *histogram, uint64_t value) {
+    uint32_t clamped;
+
+    clamped = value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+    histogram->buckets[get_bucket_index(clamped)]++;
+    histogram->count++;
+    histogram->sum += clamped;
+
+    if (clamped > histogram->max) {
+        histogram->max = clamped;
+    }
+}
+
+/*
+ * Returns the upper bound of the bucket holding the requested percentile,
+ * which is expressed in per-mille (i.e., 500 for p50, 990 for p99). The
+ * result is capped at the true maximum so that p100 is always exact.
+ */
+uint32_t mm_histogram_percentile(const struct mm_histogram *histogram,
+        unsigned permille) {
+    uint64_t rank, seen;
+    uint32_t bound;
+    unsigned i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    rank = (histogram->count * permille + 999) / 1000;
+    rank = rank ? rank : 1;
+
+    for (i = 0, seen = 0; i < MM_HISTOGRAM_BUCKETS; i++) {
+        if ((seen += histogram->buckets[i]) >= rank) {
+            break;
+        }
+    }
+
+    bound = get_bucket_upper_bound(i);
+    return bound < histogram->max ? bound : histogram->max;
+}
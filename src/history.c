@@ -0,0 +1,203 @@
+/*
+ * src/history.c: Link quality and session history query tool
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_time.h"
+#include "mm_tsdb.h"
+
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct history_aggregate {
+    uint64_t count;
+    int64_t min, max, sum;
+};
+
+struct history_query {
+    enum mm_tsdb_series series;
+    bool aggregate;
+    struct history_aggregate aggregates[MM_TSDB_SERIES_MAX];
+};
+
+static int parse_series(const char *, enum mm_tsdb_series *);
+static int parse_time(const char *, uint64_t, uint64_t *);
+static int visit_sample(const struct mm_tsdb_sample *, void *);
+
+int parse_series(const char *name, enum mm_tsdb_series *series) {
+    unsigned i;
+
+    for (i = MM_TSDB_SERIES_NONE + 1; i < MM_TSDB_SERIES_MAX; i++) {
+        if (!strcmp(name, mm_tsdb_get_series_string(
+                (enum mm_tsdb_series) i))) {
+            *series = (enum mm_tsdb_series) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Accepts either UNIX epoch seconds, or a relative age like 90m or 7d. */
+int parse_time(const char *spec, uint64_t now_ms, uint64_t *time_ms) {
+    unsigned long long value;
+    uint64_t scale;
+    char *end;
+
+    value = strtoull(spec, &end, 10);
+
+    if (end == spec) {
+        return -1;
+    }
+
+    switch (*end) {
+    case '\0': *time_ms = value * 1000U; return 0;
+    case 's': scale = 1000U; break;
+    case 'm': scale = 60U * 1000U; break;
+    case 'h': scale = 3600U * 1000U; break;
+    case 'd': scale = 86400U * 1000U; break;
+    default: return -1;
+    }
+
+    if (end[1] != '\0') {
+        return -1;
+    }
+
+    *time_ms = value * scale < now_ms ? now_ms - value * scale : 0;
+    return 0;
+}
+
+int visit_sample(const struct mm_tsdb_sample *sample, void *context) {
+    struct history_query *query = (struct history_query *) context;
+    struct history_aggregate *aggregate;
+    char buf[32];
+    struct tm *tm;
+    time_t t;
+
+    if (query->series != MM_TSDB_SERIES_NONE &&
+            query->series != sample->series) {
+        return 0;
+    }
+
+    if (query->aggregate) {
+        if (sample->series < MM_TSDB_SERIES_MAX) {
+            aggregate = query->aggregates + sample->series;
+
+            if (aggregate->count++ == 0) {
+                aggregate->min = aggregate->max = sample->value;
+            }
+
+            aggregate->min = sample->value < aggregate->min
+                ? sample->value : aggregate->min;
+            aggregate->max = sample->value > aggregate->max
+                ? sample->value : aggregate->max;
+            aggregate->sum += sample->value;
+        }
+
+        return 0;
+    }
+
+    t = (time_t) (sample->realtime_ms / 1000U);
+    buf[0] = 0;
+
+    if ((tm = localtime(&t)) != NULL) {
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tm);
+    }
+
+    printf("%s.%03"PRIu64" %-9s tag=%"PRIu8" aux=%"PRIu16" value=%"PRId64"\n",
+            buf, sample->realtime_ms % 1000U,
+            mm_tsdb_get_series_string(sample->series), sample->tag,
+            sample->aux, sample->value);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct history_query query;
+    const char *directory;
+    uint64_t now_ms, from_ms, to_ms;
+    int option;
+    unsigned i;
+
+    memset(&query, 0, sizeof(query));
+    directory = MM_TSDB_DIRECTORY;
+    now_ms = mm_time_realtime_ms();
+    from_ms = 0;
+    to_ms = UINT64_MAX;
+
+    while ((option = getopt(argc, argv, "ad:f:s:t:")) != -1) {
+        switch (option) {
+        case 'a':
+            query.aggregate = true;
+            break;
+
+        case 'd':
+            directory = optarg;
+            break;
+
+        case 'f':
+            if (parse_time(optarg, now_ms, &from_ms)) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+
+            break;
+
+        case 's':
+            if (parse_series(optarg, &query.series)) {
+                fprintf(stderr, "Unknown series: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+
+            break;
+
+        case 't':
+            if (parse_time(optarg, now_ms, &to_ms)) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-a] [-d directory] [-s series] "
+                    "[-f from] [-t to]\n"
+                    "  -a: print per-series aggregates instead of samples\n"
+                    "  from/to: UNIX time, or an age such as 90m, 24h, 7d\n",
+                    argv[0]);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (mm_tsdb_query(directory, from_ms, to_ms, visit_sample, &query)) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; query.aggregate && i < MM_TSDB_SERIES_MAX; i++) {
+        const struct history_aggregate *aggregate = query.aggregates + i;
+
+        if (aggregate->count) {
+            printf("%-9s count=%"PRIu64" min=%"PRId64" max=%"PRId64" "
+                    "sum=%"PRId64" mean=%"PRId64"\n",
+                    mm_tsdb_get_series_string((enum mm_tsdb_series) i),
+                    aggregate->count, aggregate->min, aggregate->max,
+                    aggregate->sum,
+                    aggregate->sum / (int64_t) aggregate->count);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
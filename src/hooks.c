@@ -0,0 +1,463 @@
+/*
+ * src/hooks.c: Site-specific hooks run on connection events
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_hooks.h"
+#include "mm_log.h"
+#include "mm_time.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOOK_ENV_VARS 7U
+#define HOOK_ENV_SIZE 64U
+
+/* Without pidfds, children are checked on at this interval instead. */
+#define HOOK_REAP_INTERVAL_MS 100
+
+struct mm_hook_context {
+    enum mm_hook_event event;
+    unsigned modem;
+    char ifname[IF_NAMESIZE];
+    uint32_t address, gateway;
+    int prefix_length;
+};
+
+struct mm_hook_child {
+    char name[NAME_MAX + 1];
+    pid_t pid;
+    int pidfd;
+    uint64_t deadline_us;
+    bool killed;
+};
+
+struct mm_hooks_state {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running, stop_requested;
+
+    /* Events waiting to be handled: [head, head + count) of a ring. */
+    struct mm_hook_context queue[MM_HOOKS_MAX_QUEUED];
+    unsigned head, count;
+    uint64_t dropped;
+
+    /* Counters, as reported by mm_hooks_write_metrics. */
+    uint64_t runs, failures, timeouts;
+
+    int wake_fd;
+};
+
+static struct mm_hooks_state hooks = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_fd = -1,
+};
+
+static const char *event_name(enum mm_hook_event);
+static int filter_hook(const struct dirent *);
+static void *hooks_thread_main(void *);
+static int open_pidfd(pid_t);
+static void reap_child(struct mm_hook_child *, bool);
+static void run_event_hooks(const struct mm_hook_context *);
+static int spawn_hook(const struct mm_hook_context *, const char *,
+        struct mm_hook_child *);
+
+const char *event_name(enum mm_hook_event event) {
+    static const char *names[] = {
+        "connect",
+        "disconnect",
+        "address-change",
+    };
+
+    return names[event];
+}
+
+int filter_hook(const struct dirent *entry) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", MM_HOOKS_DIRECTORY,
+            entry->d_name);
+
+    return entry->d_name[0] != '.' && !stat(path, &st) &&
+        S_ISREG(st.st_mode) && !access(path, X_OK);
+}
+
+void *hooks_thread_main(void *context) {
+    struct mm_hook_context event;
+    struct pollfd fd;
+    eventfd_t value;
+
+    (void) context;
+
+    fd.fd = hooks.wake_fd;
+    fd.events = POLLIN;
+
+    pthread_mutex_lock(&hooks.lock);
+
+    while (!hooks.stop_requested) {
+        if (hooks.count == 0) {
+            pthread_mutex_unlock(&hooks.lock);
+
+            if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+            }
+
+            else if (fd.revents & POLLIN) {
+                eventfd_read(hooks.wake_fd, &value);
+            }
+
+            pthread_mutex_lock(&hooks.lock);
+            continue;
+        }
+
+        event = hooks.queue[hooks.head];
+        hooks.head = (hooks.head + 1U) % MM_HOOKS_MAX_QUEUED;
+        hooks.count--;
+
+        pthread_mutex_unlock(&hooks.lock);
+        run_event_hooks(&event);
+        pthread_mutex_lock(&hooks.lock);
+    }
+
+    pthread_mutex_unlock(&hooks.lock);
+    return NULL;
+}
+
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+/* Collects a child which has exited (or, given 'wait', will shortly). */
+void reap_child(struct mm_hook_child *child, bool wait) {
+    pid_t pid;
+    int status;
+
+    if ((pid = waitpid(child->pid, &status, wait ? 0 : WNOHANG)) == 0) {
+        return;
+    }
+
+    else if (pid < 0) {
+        perror("waitpid");
+    }
+
+    else if (child->killed) {
+        MM_LOG("%sHook %s timed out after %us\n", child->name,
+                MM_HOOKS_TIMEOUT_S);
+    }
+
+    else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        MM_LOG("%sHook %s failed (status %d)\n", child->name, status);
+
+        pthread_mutex_lock(&hooks.lock);
+        hooks.failures++;
+        pthread_mutex_unlock(&hooks.lock);
+    }
+
+    if (child->pidfd >= 0) {
+        close(child->pidfd);
+    }
+
+    child->pid = 0;
+}
+
+/*
+ * Runs every hook for one event, at most MM_HOOKS_MAX_RUNNING at a time,
+ * and returns once all of them have exited (or been killed).
+ */
+void run_event_hooks(const struct mm_hook_context *event) {
+    struct mm_hook_child children[MM_HOOKS_MAX_RUNNING];
+    struct pollfd fds[MM_HOOKS_MAX_RUNNING];
+    unsigned i, nfds, running;
+    struct dirent **entries;
+    int count, next, timeout_ms;
+    uint64_t now_us, deadline_us;
+    bool polling;
+
+    if ((count = scandir(MM_HOOKS_DIRECTORY, &entries, filter_hook,
+            alphasort)) < 0) {
+        if (errno != ENOENT) {
+            perror("scandir");
+        }
+
+        return;
+    }
+
+    memset(children, 0, sizeof(children));
+
+    for (next = 0, running = 0; next < count || running > 0; ) {
+        /* Fill any free slots with the hooks that are yet to run. */
+        for (i = 0; i < MM_HOOKS_MAX_RUNNING && next < count; i++) {
+            if (children[i].pid == 0 && !spawn_hook(event,
+                    entries[next++]->d_name, children + i)) {
+                running++;
+            }
+        }
+
+        now_us = mm_time_monotonic_us();
+        deadline_us = UINT64_MAX;
+        polling = false;
+
+        for (i = 0, nfds = 0; i < MM_HOOKS_MAX_RUNNING; i++) {
+            if (children[i].pid == 0) {
+                continue;
+            }
+
+            /* The pidfd becomes readable once the child has been killed. */
+            if (!children[i].killed && now_us >= children[i].deadline_us) {
+                kill(children[i].pid, SIGKILL);
+                children[i].killed = true;
+
+                pthread_mutex_lock(&hooks.lock);
+                hooks.timeouts++;
+                pthread_mutex_unlock(&hooks.lock);
+            }
+
+            if (!children[i].killed &&
+                    children[i].deadline_us < deadline_us) {
+                deadline_us = children[i].deadline_us;
+            }
+
+            if (children[i].pidfd >= 0) {
+                fds[nfds].fd = children[i].pidfd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+
+            else {
+                polling = true;
+            }
+        }
+
+        if (running == 0) {
+            continue;
+        }
+
+        timeout_ms = deadline_us == UINT64_MAX
+            ? -1
+            : (int) ((deadline_us - now_us + 999U) / 1000U);
+
+        if (polling && (timeout_ms < 0 || timeout_ms > HOOK_REAP_INTERVAL_MS)) {
+            timeout_ms = HOOK_REAP_INTERVAL_MS;
+        }
+
+        if (poll(fds, nfds, timeout_ms) < 0 && errno != EINTR) {
+            perror("poll");
+        }
+
+        for (i = 0; i < MM_HOOKS_MAX_RUNNING; i++) {
+            if (children[i].pid != 0) {
+                reap_child(children + i, false);
+                running -= children[i].pid == 0;
+            }
+        }
+    }
+
+    for (next = 0; next < count; next++) {
+        free(entries[next]);
+    }
+
+    free(entries);
+}
+
+int spawn_hook(const struct mm_hook_context *event, const char *name,
+        struct mm_hook_child *child) {
+    char env[HOOK_ENV_VARS][HOOK_ENV_SIZE], *envp[HOOK_ENV_VARS + 1];
+    char path[PATH_MAX], address[INET_ADDRSTRLEN], gateway[INET_ADDRSTRLEN];
+    char *argv[3], argument[HOOK_ENV_SIZE];
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    int status;
+    unsigned i;
+
+    snprintf(path, sizeof(path), "%s/%s", MM_HOOKS_DIRECTORY, name);
+    inet_ntop(AF_INET, &event->address, address, sizeof(address));
+    inet_ntop(AF_INET, &event->gateway, gateway, sizeof(gateway));
+
+    snprintf(env[0], HOOK_ENV_SIZE, "MM_EVENT=%s", event_name(event->event));
+    snprintf(env[1], HOOK_ENV_SIZE, "MM_MODEM=%u", event->modem);
+    snprintf(env[2], HOOK_ENV_SIZE, "MM_INTERFACE=%s", event->ifname);
+    snprintf(env[3], HOOK_ENV_SIZE, "MM_ADDRESS=%s", address);
+    snprintf(env[4], HOOK_ENV_SIZE, "MM_PREFIX_LENGTH=%d",
+            event->prefix_length);
+
+    snprintf(env[5], HOOK_ENV_SIZE, "MM_GATEWAY=%s", gateway);
+    snprintf(env[6], HOOK_ENV_SIZE, "PATH=/usr/sbin:/usr/bin:/sbin:/bin");
+
+    for (i = 0; i < HOOK_ENV_VARS; i++) {
+        envp[i] = env[i];
+    }
+
+    envp[HOOK_ENV_VARS] = NULL;
+    argv[0] = path;
+    snprintf(argument, sizeof(argument), "%s", event_name(event->event));
+    argv[1] = argument;
+    argv[2] = NULL;
+
+    /* Hooks start out with default signal handling and nothing blocked. */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigfillset(&signals);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+            POSIX_SPAWN_SETSIGDEF);
+
+    status = posix_spawn(&child->pid, path, NULL, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+
+    if (status) {
+        MM_LOG("%sposix_spawn: %s: %s\n", path, strerror(status));
+        child->pid = 0;
+        return -1;
+    }
+
+    snprintf(child->name, sizeof(child->name), "%s", name);
+    child->pidfd = open_pidfd(child->pid);
+    child->deadline_us = mm_time_monotonic_us() +
+        MM_HOOKS_TIMEOUT_S * 1000000ULL;
+
+    child->killed = false;
+
+    pthread_mutex_lock(&hooks.lock);
+    hooks.runs++;
+    pthread_mutex_unlock(&hooks.lock);
+
+    return 0;
+}
+
+/* Queues an event for the hooks; this never blocks on them. */
+void mm_hooks_dispatch(enum mm_hook_event event, unsigned modem,
+        const char *ifname, uint32_t address, int prefix_length,
+        uint32_t gateway) {
+    struct mm_hook_context *context;
+
+    pthread_mutex_lock(&hooks.lock);
+
+    if (!hooks.running) {
+        pthread_mutex_unlock(&hooks.lock);
+        return;
+    }
+
+    if (hooks.count == MM_HOOKS_MAX_QUEUED) {
+        hooks.head = (hooks.head + 1U) % MM_HOOKS_MAX_QUEUED;
+        hooks.count--;
+        hooks.dropped++;
+    }
+
+    context = hooks.queue + (hooks.head + hooks.count) % MM_HOOKS_MAX_QUEUED;
+    hooks.count++;
+
+    context->event = event;
+    context->modem = modem;
+    snprintf(context->ifname, sizeof(context->ifname), "%s", ifname);
+    context->address = address;
+    context->prefix_length = prefix_length;
+    context->gateway = gateway;
+
+    pthread_mutex_unlock(&hooks.lock);
+
+    if (eventfd_write(hooks.wake_fd, 1)) {
+        perror("eventfd_write");
+    }
+}
+
+int mm_hooks_start(void) {
+    int status;
+
+    if ((hooks.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    hooks.running = true;
+
+    if ((status = pthread_create(&hooks.thread, NULL, hooks_thread_main,
+            NULL))) {
+        MM_LOG("%smm_hooks: pthread_create: %s\n", strerror(status));
+        hooks.running = false;
+        close(hooks.wake_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Waits for the hooks of the event at hand; those still queued are not run. */
+void mm_hooks_stop(void) {
+    if (!hooks.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&hooks.lock);
+    hooks.stop_requested = true;
+    hooks.running = false;
+    pthread_mutex_unlock(&hooks.lock);
+
+    if (eventfd_write(hooks.wake_fd, 1)) {
+        perror("eventfd_write");
+    }
+
+    pthread_join(hooks.thread, NULL);
+    close(hooks.wake_fd);
+}
+
+void mm_hooks_write_metrics(FILE *f, void *context) {
+    (void) context;
+
+    pthread_mutex_lock(&hooks.lock);
+
+    fprintf(f, "# HELP modem_monitor_hook_runs_total "
+            "Hooks started, across all events.\n"
+            "# TYPE modem_monitor_hook_runs_total counter\n"
+            "modem_monitor_hook_runs_total %"PRIu64"\n", hooks.runs);
+
+    fprintf(f, "# HELP modem_monitor_hook_failures_total "
+            "Hooks which exited unsuccessfully.\n"
+            "# TYPE modem_monitor_hook_failures_total counter\n"
+            "modem_monitor_hook_failures_total %"PRIu64"\n", hooks.failures);
+
+    fprintf(f, "# HELP modem_monitor_hook_timeouts_total "
+            "Hooks killed for outlasting their timeout.\n"
+            "# TYPE modem_monitor_hook_timeouts_total counter\n"
+            "modem_monitor_hook_timeouts_total %"PRIu64"\n", hooks.timeouts);
+
+    fprintf(f, "# HELP modem_monitor_hook_events_dropped_total "
+            "Events dropped as the queue was full.\n"
+            "# TYPE modem_monitor_hook_events_dropped_total counter\n"
+            "modem_monitor_hook_events_dropped_total %"PRIu64"\n",
+            hooks.dropped);
+
+    pthread_mutex_unlock(&hooks.lock);
+}
@@ -0,0 +1,469 @@
+/*
+ * src/hotplug.c: Modem hotplug tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_events.h"
+#include "mm_hotplug.h"
+#include "mm_log.h"
+#include "mm_netlink.h"
+#include "mm_qmux.h"
+#include "mm_telemetry.h"
+
+#include <libnl3/netlink/netlink.h>
+#include <libnl3/netlink/route/link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define UEVENT_BUFFER_SIZE 8192U
+
+struct mm_hotplug_modem {
+    bool qmi_device_present, wwan_link_present;
+    uint64_t generation;
+};
+
+struct mm_hotplug_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+
+    struct mm_hotplug_modem modems[MM_HOTPLUG_MAX_MODEMS];
+
+    struct nl_sock *route_sock;
+    int uevent_fd, stop_fd;
+};
+
+static struct mm_hotplug_state hotplug = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .uevent_fd = -1,
+    .stop_fd = -1,
+};
+
+static unsigned find_modem(const char *, bool);
+static void handle_link_object(struct nl_object *, void *);
+static int handle_route_message(struct nl_msg *, void *);
+static void handle_uevent(const char *, size_t);
+static void *hotplug_thread_main(void *);
+static bool is_link_present(unsigned);
+static bool is_qmi_device_present(unsigned);
+static unsigned present_modems(void);
+static void set_presence(unsigned, bool *, bool);
+
+/*
+ * Maps a QMI device (or else WWAN interface) name to its modem; returns
+ * MM_HOTPLUG_MAX_MODEMS if it isn't that of any modem's.
+ */
+unsigned find_modem(const char *name, bool qmi_device) {
+    char expected[32];
+    unsigned modem;
+
+    for (modem = 0; modem < MM_HOTPLUG_MAX_MODEMS; modem++) {
+        if (qmi_device) {
+            snprintf(expected, sizeof(expected), MM_QMUX_DEVICE_NAME_FORMAT,
+                    modem);
+        }
+
+        else {
+            snprintf(expected, sizeof(expected),
+                    MM_NETLINK_WWAN_INTERFACE_FORMAT, modem);
+        }
+
+        if (!strcmp(name, expected)) {
+            break;
+        }
+    }
+
+    return modem;
+}
+
+void handle_link_object(struct nl_object *object, void *context) {
+    struct rtnl_link *link = (struct rtnl_link *) object;
+    const char *name = rtnl_link_get_name(link);
+    int type = *(const int *) context;
+    unsigned modem;
+
+    if (name != NULL && (modem = find_modem(name, false)) <
+            MM_HOTPLUG_MAX_MODEMS) {
+        set_presence(modem, &hotplug.modems[modem].wwan_link_present,
+                type == RTM_NEWLINK);
+    }
+}
+
+int handle_route_message(struct nl_msg *msg, void *context) {
+    int type = nlmsg_hdr(msg)->nlmsg_type;
+
+    if (type == RTM_NEWLINK || type == RTM_DELLINK) {
+        nl_msg_parse(msg, handle_link_object, &type);
+    }
+
+    return NL_OK;
+}
+
+/*
+ * Kernel uevents are an "ACTION@DEVPATH" header followed by a run of
+ * NUL-terminated KEY=VALUE pairs. The QMI port of a modem shows up in the
+ * wwan subsystem under the same name as its device node.
+ */
+void handle_uevent(const char *buf, size_t length) {
+    const char *action, *subsystem, *devname, *p, *end;
+    unsigned modem;
+
+    action = subsystem = devname = NULL;
+
+    for (p = buf, end = buf + length; p < end; p += strlen(p) + 1) {
+        if (!strncmp(p, "ACTION=", 7)) {
+            action = p + 7;
+        }
+
+        else if (!strncmp(p, "SUBSYSTEM=", 10)) {
+            subsystem = p + 10;
+        }
+
+        else if (!strncmp(p, "DEVNAME=", 8)) {
+            devname = p + 8;
+        }
+    }
+
+    if (action == NULL || subsystem == NULL || devname == NULL ||
+            strcmp(subsystem, "wwan") || (modem = find_modem(devname,
+            true)) == MM_HOTPLUG_MAX_MODEMS) {
+        return;
+    }
+
+    if (!strcmp(action, "add")) {
+        set_presence(modem, &hotplug.modems[modem].qmi_device_present, true);
+    }
+
+    else if (!strcmp(action, "remove")) {
+        set_presence(modem, &hotplug.modems[modem].qmi_device_present, false);
+    }
+}
+
+void *hotplug_thread_main(void *context) {
+    char uevent[UEVENT_BUFFER_SIZE];
+    struct pollfd fds[3];
+    unsigned modem;
+    ssize_t length;
+    int status;
+
+    (void) context;
+
+    fds[0].fd = hotplug.stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = hotplug.uevent_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = nl_socket_get_fd(hotplug.route_sock);
+    fds[2].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if ((length = recv(hotplug.uevent_fd, uevent,
+                    sizeof(uevent) - 1, MSG_DONTWAIT)) > 0) {
+                uevent[length] = '\0';
+                handle_uevent(uevent, (size_t) length);
+            }
+        }
+
+        /* ENOBUFS means we missed something: fall back to checking. */
+        if ((fds[2].revents & POLLIN) && (status = nl_recvmsgs_default(
+                hotplug.route_sock)) < 0 && status != -NLE_AGAIN) {
+            MM_LOG("%smm_hotplug: nl_recvmsgs: %s\n", nl_geterror(status));
+
+            for (modem = 0; modem < MM_HOTPLUG_MAX_MODEMS; modem++) {
+                set_presence(modem, &hotplug.modems[modem].wwan_link_present,
+                        is_link_present(modem));
+            }
+        }
+    }
+
+    return NULL;
+}
+
+bool is_link_present(unsigned modem) {
+    char name[IF_NAMESIZE];
+
+    snprintf(name, sizeof(name), MM_NETLINK_WWAN_INTERFACE_FORMAT, modem);
+    return if_nametoindex(name) != 0;
+}
+
+bool is_qmi_device_present(unsigned modem) {
+    char path[32];
+
+    snprintf(path, sizeof(path), "/dev/" MM_QMUX_DEVICE_NAME_FORMAT, modem);
+    return !access(path, F_OK);
+}
+
+/* Returns a bitmask of the modems which are present; hold the lock. */
+unsigned present_modems(void) {
+    unsigned modem, modems;
+
+    for (modem = 0, modems = 0; modem < MM_HOTPLUG_MAX_MODEMS; modem++) {
+        if (hotplug.modems[modem].qmi_device_present &&
+                hotplug.modems[modem].wwan_link_present) {
+            modems |= 1U << modem;
+        }
+    }
+
+    return modems;
+}
+
+void set_presence(unsigned modem, bool *which, bool present) {
+    struct mm_hotplug_modem *state = hotplug.modems + modem;
+    bool was_present, is_present;
+
+    pthread_mutex_lock(&hotplug.lock);
+
+    if (*which == present) {
+        pthread_mutex_unlock(&hotplug.lock);
+        return;
+    }
+
+    was_present = state->qmi_device_present && state->wwan_link_present;
+    *which = present;
+    is_present = state->qmi_device_present && state->wwan_link_present;
+
+    if (was_present != is_present) {
+        state->generation++;
+        pthread_cond_broadcast(&hotplug.cond);
+    }
+
+    pthread_mutex_unlock(&hotplug.lock);
+
+    if (was_present != is_present) {
+        mm_events_post(MM_EVENT_MODEM_HOTPLUG);
+    }
+
+    if (was_present && !is_present) {
+        MM_LOG("%sModem %u has disappeared\n", modem);
+        mm_telemetry_event("modem_removed modem=%u", modem);
+    }
+
+    else if (!was_present && is_present) {
+        MM_LOG("%sModem %u has appeared\n", modem);
+        mm_telemetry_event("modem_added modem=%u", modem);
+    }
+}
+
+uint64_t mm_hotplug_get_generation(unsigned modem) {
+    uint64_t generation;
+
+    pthread_mutex_lock(&hotplug.lock);
+    generation = hotplug.modems[modem].generation;
+    pthread_mutex_unlock(&hotplug.lock);
+
+    return generation;
+}
+
+/* Returns a bitmask of the modems which are present right now. */
+unsigned mm_hotplug_get_present_modems(void) {
+    unsigned modems;
+
+    pthread_mutex_lock(&hotplug.lock);
+    modems = present_modems();
+    pthread_mutex_unlock(&hotplug.lock);
+
+    return modems;
+}
+
+bool mm_hotplug_is_modem_present(unsigned modem) {
+    bool present;
+
+    pthread_mutex_lock(&hotplug.lock);
+    present = hotplug.modems[modem].qmi_device_present &&
+        hotplug.modems[modem].wwan_link_present;
+
+    pthread_mutex_unlock(&hotplug.lock);
+    return present;
+}
+
+int mm_hotplug_start(void) {
+    struct sockaddr_nl address;
+    pthread_condattr_t attr;
+    unsigned modem;
+    int status;
+
+    /* Should tracking fail to start, carry on as if modem 0 is present. */
+    hotplug.modems[0].qmi_device_present = true;
+    hotplug.modems[0].wwan_link_present = true;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hotplug.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ((hotplug.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    /* Subscribe to kernel (not udev) uevents. */
+    if ((hotplug.uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+            NETLINK_KOBJECT_UEVENT)) < 0) {
+        perror("socket");
+        close(hotplug.stop_fd);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+
+    if (bind(hotplug.uevent_fd, (struct sockaddr *) &address,
+            sizeof(address))) {
+        perror("bind");
+        close(hotplug.uevent_fd);
+        close(hotplug.stop_fd);
+        return -1;
+    }
+
+    if ((hotplug.route_sock = nl_socket_alloc()) == NULL) {
+        perror("nl_socket_alloc");
+        close(hotplug.uevent_fd);
+        close(hotplug.stop_fd);
+        return -1;
+    }
+
+    nl_socket_disable_seq_check(hotplug.route_sock);
+    nl_socket_modify_cb(hotplug.route_sock, NL_CB_VALID, NL_CB_CUSTOM,
+            handle_route_message, NULL);
+
+    if ((status = nl_connect(hotplug.route_sock, NETLINK_ROUTE)) ||
+            (status = nl_socket_add_membership(hotplug.route_sock,
+            RTNLGRP_LINK))) {
+        MM_LOG("%smm_hotplug: %s\n", nl_geterror(status));
+        nl_socket_free(hotplug.route_sock);
+        close(hotplug.uevent_fd);
+        close(hotplug.stop_fd);
+        return -1;
+    }
+
+    /* Only sample current state once subscribed, so nothing is missed. */
+    for (modem = 0; modem < MM_HOTPLUG_MAX_MODEMS; modem++) {
+        hotplug.modems[modem].qmi_device_present =
+            is_qmi_device_present(modem);
+
+        hotplug.modems[modem].wwan_link_present = is_link_present(modem);
+    }
+
+    if ((status = pthread_create(&hotplug.thread, NULL, hotplug_thread_main,
+            NULL))) {
+        MM_LOG("%smm_hotplug: pthread_create: %s\n", strerror(status));
+        nl_socket_free(hotplug.route_sock);
+        close(hotplug.uevent_fd);
+        close(hotplug.stop_fd);
+        return -1;
+    }
+
+    hotplug.running = true;
+    return 0;
+}
+
+void mm_hotplug_stop(void) {
+    uint64_t value = 1;
+
+    if (!hotplug.running) {
+        return;
+    }
+
+    if (write(hotplug.stop_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+
+    pthread_join(hotplug.thread, NULL);
+    hotplug.running = false;
+
+    nl_socket_free(hotplug.route_sock);
+    close(hotplug.uevent_fd);
+    close(hotplug.stop_fd);
+    pthread_cond_destroy(&hotplug.cond);
+}
+
+/*
+ * Blocks until the modem is present or an exit is requested (which is
+ * polled for once a second, as signal handlers cannot wake us up; the flag
+ * is read with __atomic builtins). Returns the generation of the modem
+ * which was found.
+ */
+int mm_hotplug_wait_for_modem(unsigned modem,
+        const bool *exit_requested, uint64_t *generation) {
+    const struct mm_hotplug_modem *state = hotplug.modems + modem;
+    struct timespec deadline;
+    bool logged = false;
+
+    pthread_mutex_lock(&hotplug.lock);
+
+    while (!(state->qmi_device_present && state->wwan_link_present)) {
+        if (__atomic_load_n(exit_requested, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&hotplug.lock);
+            return -1;
+        }
+
+        if (!logged) {
+            MM_LOG("%sWaiting for modem %u to appear...\n", modem);
+            logged = true;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec++;
+
+        pthread_cond_timedwait(&hotplug.cond, &hotplug.lock, &deadline);
+    }
+
+    *generation = state->generation;
+    pthread_mutex_unlock(&hotplug.lock);
+    return 0;
+}
+
+/*
+ * Waits up to a second for any modem outside of the given bitmask to be
+ * present, and returns a bitmask of those which are (zero if none are).
+ */
+unsigned mm_hotplug_wait_for_new_modems(unsigned known) {
+    struct timespec deadline;
+    unsigned modems;
+
+    pthread_mutex_lock(&hotplug.lock);
+
+    if ((modems = present_modems() & ~known) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec++;
+
+        pthread_cond_timedwait(&hotplug.cond, &hotplug.lock, &deadline);
+        modems = present_modems() & ~known;
+    }
+
+    pthread_mutex_unlock(&hotplug.lock);
+    return modems;
+}
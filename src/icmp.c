@@ -0,0 +1,86 @@
+/*
+ * src/icmp.c: ICMP echo helpers for latency probes
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_icmp.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+uint16_t mm_icmp_checksum(const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    uint32_t sum;
+    size_t i;
+
+    for (i = 0, sum = 0; i + 1 < length; i += 2) {
+        sum += (uint32_t) (bytes[i] << 8 | bytes[i + 1]);
+    }
+
+    if (i < length) {
+        sum += (uint32_t) bytes[i] << 8;
+    }
+
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return htons((uint16_t) ~sum);
+}
+
+/*
+ * Returns whether a packet read off a raw socket is a reply to our echo
+ * request with the given sequence number; if so, also where its payload
+ * starts.
+ */
+bool mm_icmp_read_echo_reply(const uint8_t *packet, size_t length,
+        uint16_t sequence, size_t *payload) {
+    struct icmphdr icmp;
+    struct iphdr ip;
+    size_t header_length;
+
+    if (length < sizeof(ip)) {
+        return false;
+    }
+
+    memcpy(&ip, packet, sizeof(ip));
+    header_length = (size_t) ip.ihl * 4U;
+
+    if (length < header_length + sizeof(icmp)) {
+        return false;
+    }
+
+    memcpy(&icmp, packet + header_length, sizeof(icmp));
+    *payload = header_length + sizeof(icmp);
+
+    return icmp.type == ICMP_ECHOREPLY &&
+        icmp.un.echo.id == htons((uint16_t) getpid()) &&
+        icmp.un.echo.sequence == htons(sequence);
+}
+
+/* Fills in the echo header; any payload must already follow it. */
+void mm_icmp_write_echo(uint8_t *packet, size_t length, uint16_t sequence) {
+    struct icmphdr icmp;
+
+    memset(&icmp, 0, sizeof(icmp));
+    icmp.type = ICMP_ECHO;
+    icmp.un.echo.id = htons((uint16_t) getpid());
+    icmp.un.echo.sequence = htons(sequence);
+    memcpy(packet, &icmp, sizeof(icmp));
+
+    icmp.checksum = mm_icmp_checksum(packet, length);
+    memcpy(packet, &icmp, sizeof(icmp));
+}
@@ -8,17 +8,39 @@
  * 'LICENSE', which is part of this source code package.
  */
 
+#include "mm_capture.h"
+#include "mm_clock.h"
+#include "mm_config.h"
 #include "mm_dms.h"
+#include "mm_drift.h"
+#include "mm_events.h"
+#include "mm_health.h"
+#include "mm_hooks.h"
+#include "mm_hotplug.h"
 #include "mm_log.h"
+#include "mm_metrics.h"
 #include "mm_netlink.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
 #include "mm_qmux.h"
+#include "mm_refresh.h"
 #include "mm_run_helpers.h"
 #include "mm_sdbus.h"
+#include "mm_slo.h"
+#include "mm_suspend.h"
+#include "mm_tasks.h"
+#include "mm_time.h"
+#include "mm_telemetry.h"
+#include "mm_tsdb.h"
+#include "mm_uplink.h"
 #include "mm_wds.h"
+#include "mm_wireguard.h"
 
 #include <sd-bus.h>
+#include <net/if.h>
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -26,53 +48,398 @@
 #include <string.h>
 #include <unistd.h>
 
-#define PROFILE_3GPP_VZWINTERNET 3
+#define HISTORY_SAMPLE_INTERVAL_S 60U
 
-static bool exit_requested;
+/* How long tasks run around a connect (see mm_tasks.h) may take. */
+#define UNIT_TASK_TIMEOUT_MS 30000U
+#define WIREGUARD_TASK_TIMEOUT_MS 10000U
+
+/* Returned by run_sessions_up() when a planned restart is due. */
+#define RUN_REPLACE_SESSION 1
+
+/* The QMI side of a modem's startup, run alongside netlink and sd-bus. */
+struct qmux_startup {
+    struct mm_modem *modem;
+    bool initialized;
+    int status;
+};
+
+/* Tracks how a suspended/authenticating session is faring (see mm_wds.h). */
+struct transient_grace {
+    uint64_t window_started_us;
+    uint64_t rx_bytes;
+    bool active, have_rx_bytes;
+};
+
+enum modem_state {
+    MODEM_STATE_ABSENT = 0,
+    MODEM_STATE_STARTING = 1,
+    MODEM_STATE_CONNECTING = 2,
+    MODEM_STATE_CONNECTED = 3,
+};
+
+/*
+ * Everything belonging to one modem. Each modem is driven by a thread (and
+ * event loop) of its own, so that one which is slow to respond or wedged
+ * altogether holds up nobody else.
+ */
+struct mm_modem {
+    unsigned index;
+    char wwan_ifname[IF_NAMESIZE];
+    pthread_t thread;
+    bool started, finished;
+
+    struct mm_events events;
+    struct mm_qmux qmux;
+    struct mm_netlink mm_nl;
+    struct mm_dms_service dms;
+    sd_bus *bus;
+
+    /* The config snapshot as last applied to this modem. */
+    struct mm_config config;
+
+    /* Also set from signal handlers: use the helpers to access them. */
+    bool exit_requested, planned_restart_requested;
+
+    bool operating_mode_lost, owns_clock;
+    uint64_t cycle_started_us, generation;
+    int status;
+
+    /* Traffic on the current IPv4 session, for timing planned refreshes. */
+    struct mm_refresh_tracker refresh;
+
+    /* Reported by write_modem_metrics(); guarded by modems_lock. */
+    enum modem_state state;
+    uint64_t connects;
+};
+
+static bool native_qmi;
+
+/* Set from the signal handler: only access it with __atomic builtins. */
+static bool signal_received;
+static struct mm_modem modems[MM_HOTPLUG_MAX_MODEMS];
+
+/*
+ * Host-wide roles only one modem can fill at a time: network time comes
+ * from one modem's NAS client, and the Wireguard tunnel, metrics and history
+ * are looked after by one connected modem. Whichever gets there first keeps
+ * the role until it lets go of it (i.e. goes down).
+ */
+static pthread_mutex_t modems_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct mm_modem *clock_owner, *host_chores_owner;
+
+static uint32_t add_unit_tasks(struct mm_task_graph *, struct mm_unit_task *,
+        struct mm_modem *, const char *, bool, uint32_t,
+        enum mm_task_policy);
+
+static void apply_config(struct mm_modem *, bool);
+static void check_transient_session(struct mm_netlink *,
+        struct mm_wds_session *, struct transient_grace *);
+
+static bool claim_role(const struct mm_modem **, const struct mm_modem *);
+static void dispatch_hooks(const struct mm_modem *, enum mm_hook_event,
+        const struct mm_wds_session *);
+
+static bool driven_modem_present(void);
 static void handle_signal(int signal);
-static int initialize(CtlService *, struct mm_netlink *, sd_bus *);
+static int initialize(struct mm_modem *);
+static bool is_exit_requested(const struct mm_modem *);
+static bool modem_removed(const struct mm_modem *);
+static void *modem_thread_main(void *);
+static bool modems_running(void);
+static int run_modem(struct mm_modem *);
+static enum mm_task_policy run_post_connect_tasks(struct mm_modem *);
+
+static int run_up_ipv4(struct mm_modem *, struct mm_wds_session *);
+static int run_up_ipv6(struct mm_modem *);
+
+static int run_sessions_up(struct mm_modem *, struct mm_wds_session *,
+        struct mm_wds_session *);
+
+static void record_session_history(const struct mm_wds_session *);
+static void release_role(const struct mm_modem **, const struct mm_modem *);
+static void request_exit(struct mm_modem *);
+static void request_planned_restart(struct mm_modem *);
+static void replace_session_v4(struct mm_modem *, struct mm_wds_session *,
+        struct mm_wds_session **);
+static void rest(struct mm_modem *, unsigned);
+
+static void sample_modem_health(struct mm_modem *);
+static void set_modem_state(struct mm_modem *, enum modem_state);
+static int start_modem(struct mm_modem *);
+static void *start_qmux(void *);
+static int stop_units(struct mm_modem *);
+static void write_modem_metrics(FILE *, void *);
+
+/*
+ * Adds a task per unit in the config (either those which go before the
+ * Wireguard tunnel, or those which go after it) to a graph, returning the
+ * tasks that were added. Each uses the unit context of the same index.
+ */
+uint32_t add_unit_tasks(struct mm_task_graph *graph,
+        struct mm_unit_task *units, struct mm_modem *modem,
+        const char *method, bool after_tunnel, uint32_t dependencies,
+        enum mm_task_policy policy) {
+    const struct mm_config_unit *unit;
+    uint32_t added = 0;
+    unsigned i;
+
+    for (i = 0; i < modem->config.unit_count; i++) {
+        unit = modem->config.units + i;
+
+        if (unit->after_tunnel == after_tunnel) {
+            units[i].bus = modem->bus;
+            units[i].method = method;
+            units[i].name = unit->name;
+
+            added |= MM_TASK_BIT(mm_task_graph_add(graph, unit->name,
+                    &mm_unit_task_ops, units + i, dependencies, policy,
+                    UNIT_TASK_TIMEOUT_MS));
+        }
+    }
+
+    return added;
+}
+
+/*
+ * Applies whatever changed between the config last applied and the current
+ * snapshot. Units and the profile only matter to a connected modem: those
+ * are otherwise taken from the config as the modem comes up. A new profile
+ * is the only change which costs a new session (made before the old one is
+ * broken, as with SIGUSR1).
+ */
+void apply_config(struct mm_modem *modem, bool connected) {
+    struct mm_config config;
+    const struct mm_config_unit *unit;
+    unsigned changes, i;
+
+    mm_config_get(&config);
+
+    if ((changes = mm_config_diff(&modem->config, &config)) == 0) {
+        return;
+    }
+
+    if ((changes & MM_CONFIG_CHANGED_AUTOCONNECT) &&
+            mm_configure_autoconnect_and_roaming(&modem->qmux,
+            config.autoconnect, config.roaming)) {
+        MM_LOG("%s%s\n", "Failed to apply new autoconnect settings");
+    }
+
+    /* Leave the gateway be (it follows the selected peer) unless it moved. */
+    if ((changes & MM_CONFIG_CHANGED_WG0) && mm_netlink_set_wg0_routes(
+            &modem->mm_nl, config.wg0_address, config.wg0_gateway !=
+            modem->config.wg0_gateway ? config.wg0_gateway : 0,
+            config.wg0_routes, config.wg0_route_count)) {
+        MM_LOG("%s%s\n", "Failed to apply new Wireguard routes");
+    }
+
+    for (i = 0; connected && (changes & MM_CONFIG_CHANGED_UNITS) &&
+            i < modem->config.unit_count; i++) {
+        unit = modem->config.units + i;
+
+        if (!mm_config_has_unit(&config, unit) && mm_sdbus_manage_service(
+                modem->bus, "StopUnit", unit->name)) {
+            MM_LOG("%sFailed to stop %s after it was unlisted\n",
+                    unit->name);
+        }
+    }
 
-static int run_up_ipv4(struct mm_dms_service *, struct mm_netlink *,
-        struct mm_wds_session *, sd_bus *, CtlService *);
+    for (i = 0; connected && (changes & MM_CONFIG_CHANGED_UNITS) &&
+            i < config.unit_count; i++) {
+        unit = config.units + i;
 
-static int run_up_ipv6(struct mm_dms_service *, struct mm_netlink *,
-        sd_bus *, CtlService *);
+        if (!mm_config_has_unit(&modem->config, unit) &&
+                mm_sdbus_manage_service(modem->bus, "StartUnit",
+                unit->name)) {
+            MM_LOG("%sFailed to start %s after it was listed\n",
+                    unit->name);
+        }
+    }
+
+    if (connected && (changes & MM_CONFIG_CHANGED_PROFILE)) {
+        MM_LOG("%sRestarting the IPv4 data session on profile %"PRIu32"\n",
+                config.profile);
+
+        request_planned_restart(modem);
+    }
 
-static int run_sessions_up(struct mm_dms_service *, struct mm_netlink *,
-        struct mm_wds_session *, struct mm_wds_session *);
+    modem->config = config;
+}
+
+/*
+ * Gives a session which went suspended/authenticating a grace window to
+ * recover by itself. Once it expires, ask the modem whether the session is
+ * connected again; failing that, extend the window if traffic has moved
+ * over the WWAN interface since it started. Otherwise, tear it down.
+ */
+void check_transient_session(struct mm_netlink *mm_nl,
+        struct mm_wds_session *session, struct transient_grace *grace) {
+    uint64_t since_us, now_us, rx_bytes, tx_bytes;
+    uint32_t connection_status;
+
+    since_us = __atomic_load_n(&session->transient_since_us,
+            __ATOMIC_ACQUIRE);
+    now_us = mm_time_monotonic_us();
+
+    if (!since_us) {
+        if (grace->active) {
+            MM_LOG("%sIPv%d session recovered by itself\n",
+                    session->family == AF_INET ? 4 : 6);
+
+            mm_telemetry_event("session_transient family=%s outcome=recovered",
+                    session->family == AF_INET ? "ipv4" : "ipv6");
+
+            grace->active = false;
+        }
+
+        return;
+    }
+
+    if (!grace->active) {
+        MM_LOG("%sIPv%d session is suspended/authenticating; waiting up to "
+                "%us for it to recover\n", session->family == AF_INET ? 4 : 6,
+                MM_WDS_TRANSIENT_GRACE_S);
+
+        grace->active = true;
+        grace->window_started_us = now_us;
+        grace->have_rx_bytes = !mm_netlink_get_wwan_statistics(mm_nl,
+                &grace->rx_bytes, &tx_bytes);
+
+        return;
+    }
+
+    if (now_us - grace->window_started_us <
+            MM_WDS_TRANSIENT_GRACE_S * 1000000ULL) {
+        return;
+    }
+
+    /* The indication saying that we're back may have simply been lost. */
+    if (mm_wds_get_session_state(session, &connection_status) ==
+            eQCWWAN_ERR_NONE && connection_status ==
+            MM_WDS_CONNECTION_STATUS_CONNECTED) {
+        __atomic_store_n(&session->transient_since_us, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (grace->have_rx_bytes && !mm_netlink_get_wwan_statistics(mm_nl,
+            &rx_bytes, &tx_bytes) && rx_bytes != grace->rx_bytes &&
+            now_us - since_us < MM_WDS_TRANSIENT_MAX_GRACE_S * 1000000ULL) {
+        MM_LOG("%sIPv%d session is still passing traffic; extending its "
+                "grace window\n", session->family == AF_INET ? 4 : 6);
+
+        grace->window_started_us = now_us;
+        grace->rx_bytes = rx_bytes;
+        return;
+    }
+
+    MM_LOG("%sIPv%d session did not recover in time; tearing it down\n",
+            session->family == AF_INET ? 4 : 6);
+
+    mm_telemetry_event("session_transient family=%s outcome=teardown "
+            "duration_ms=%"PRIu64, session->family == AF_INET ? "ipv4" : "ipv6",
+            (now_us - since_us) / 1000U);
+
+    grace->active = false;
+    session->teardown_requested = true;
+}
+
+/* Returns whether the modem holds the role (now, or already did). */
+bool claim_role(const struct mm_modem **owner, const struct mm_modem *modem) {
+    bool claimed;
+
+    pthread_mutex_lock(&modems_lock);
+
+    if (*owner == NULL) {
+        *owner = modem;
+    }
+
+    claimed = *owner == modem;
+    pthread_mutex_unlock(&modems_lock);
+    return claimed;
+}
+
+void dispatch_hooks(const struct mm_modem *modem, enum mm_hook_event event,
+        const struct mm_wds_session *session) {
+    const struct mm_wds_runtime_settings *settings;
+
+    settings = &session->last_runtime_settings;
+    mm_hooks_dispatch(event, modem->index, modem->wwan_ifname,
+            settings->address.in.s_addr, settings->prefix_length,
+            settings->gateway.in.s_addr);
+}
+
+/* Whether any modem which has a thread of its own is present right now. */
+bool driven_modem_present(void) {
+    bool present = false;
+    size_t i;
+
+    pthread_mutex_lock(&modems_lock);
+
+    for (i = 0; i < MM_HOTPLUG_MAX_MODEMS; i++) {
+        present |= modems[i].started && mm_hotplug_is_modem_present(
+                modems[i].index);
+    }
+
+    pthread_mutex_unlock(&modems_lock);
+    return present;
+}
 
 void handle_signal(int signal) {
-    if (signal == SIGINT) {
-        exit_requested = true;
+    size_t i;
+
+    if (signal == SIGINT || signal == SIGTERM) {
+        __atomic_store_n(&signal_received, true, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < MM_HOTPLUG_MAX_MODEMS; i++) {
+        if (signal == SIGINT || signal == SIGTERM) {
+            request_exit(modems + i);
+        }
+
+        else if (signal == SIGUSR1) {
+            request_planned_restart(modems + i);
+        }
+    }
+
+    if (signal == SIGHUP) {
+        mm_config_request_reload();
     }
 }
 
-static int initialize(CtlService *ctl, struct mm_netlink *mm_nl, sd_bus *bus) {
-    struct mm_dms_service dms;
+static int initialize(struct mm_modem *modem) {
+    struct mm_netlink *mm_nl = &modem->mm_nl;
+    struct mm_qmux *qmux = &modem->qmux;
     enum mm_dms_operation_mode mode;
+    bool failed_over;
     int status, check;
 
-    /* Wireguard interface should start link down; we'll up it later. */
-    if ((status = mm_netlink_ensure_wg0_interface_state(mm_nl, false))) {
+    /*
+     * Wireguard interface should start link down; we'll up it later. That
+     * is, unless another uplink is carrying traffic for the time being.
+     */
+    if (!mm_uplink_is_failed_over(modem->wwan_ifname) &&
+            (status = mm_netlink_ensure_wg0_interface_state(mm_nl, false))) {
         MM_LOG("%s%s\n", "Failed to put down the Wireguard interface");
         return status;
     }
 
     /* Indicate that any cached fields in DMS need to be generated first. */
-    memset(&dms, 0, sizeof(dms));
-
-    if ((status = mm_configure_autoconnect_and_roaming(ctl))) {
-        return status;
-    }
+    memset(&modem->dms, 0, sizeof(modem->dms));
+    modem->dms.events = &modem->events;
 
     /*
      * Core initialization loop which calls into main loop:
      *
      * So long as an exit has not been signaled, the core loop can return with
      * exit_requested=false to reinitialize the WWAN host inteface and modem
-     * services to serve as a reset mechanism if needed.
+     * services to serve as a reset mechanism if needed. Should the modem go
+     * away, we drop out so that it can be brought up again once it returns.
      */
-    while (!exit_requested) {
+    while (!is_exit_requested(modem) && !modem_removed(modem)) {
+        modem->cycle_started_us = mm_time_monotonic_us();
+        modem->operating_mode_lost = false;
+        apply_config(modem, false);
+
         if ((status = mm_netlink_reload_link_cache(mm_nl))) {
             MM_LOG("%s%s\n", "Failed to reload the netlink link cache");
             break;
@@ -84,16 +451,12 @@ static int initialize(CtlService *ctl, struct mm_netlink *mm_nl, sd_bus *bus) {
          * presumably sourced from nonsense? In flushing the DNS cache, we can
          * also validate connectivity by ensuring that name resolution works
          * after the modem comes up (and restart the connection if it fails).
+         * None of that applies while another uplink is carrying traffic.
          */
-        if ((status = mm_sdbus_manage_service(bus, "StopUnit",
-                "chrony.service"))) {
-            MM_LOG("%s%s\n", "Failed to stop chrony before starting up");
-            break;
-        }
+        failed_over = mm_uplink_is_failed_over(modem->wwan_ifname);
 
-        if ((status = mm_sdbus_manage_service(bus, "StopUnit",
-                "unbound.service"))) {
-            MM_LOG("%s%s\n", "Failed to stop unbound before starting up");
+        if (!failed_over && (status = stop_units(modem))) {
+            MM_LOG("%s%s\n", "Failed to stop units before starting up");
             break;
         }
 
@@ -109,12 +472,13 @@ static int initialize(CtlService *ctl, struct mm_netlink *mm_nl, sd_bus *bus) {
         }
 
         /* Ensure that the modem is in an online state. */
-        if ((status = mm_dms_initialize(&dms, ctl)) != eQCWWAN_ERR_NONE) {
+        if ((status = mm_dms_initialize(&modem->dms, qmux)) !=
+                eQCWWAN_ERR_NONE) {
             MM_LOG("%s%s\n", "Failed to initialize the DMS service object");
             break;
         }
 
-        if ((status = mm_dms_set_power_sync(&dms,
+        if ((status = mm_dms_set_power_sync(&modem->dms,
                 MM_DMS_OPERATION_MODE_ONLINE, &mode)) != eQCWWAN_ERR_NONE) {
             MM_LOG("%s%s\n", "Failed to query/adjust modem operating state");
             break;
@@ -126,11 +490,35 @@ static int initialize(CtlService *ctl, struct mm_netlink *mm_nl, sd_bus *bus) {
             break;
         }
 
+        sample_modem_health(modem);
+
+        /*
+         * Network time is only used opportunistically; carry on without. It
+         * is only taken from one modem at a time.
+         */
+        if ((modem->owns_clock = claim_role(&clock_owner, modem)) &&
+                (check = mm_clock_initialize(qmux)) != eQCWWAN_ERR_NONE) {
+            MM_LOG("%sFailed to initialize a NAS client (%d); continuing\n",
+                    check);
+        }
+
+        set_modem_state(modem, MODEM_STATE_CONNECTING);
+
         /* Successfully initialized; proceed to bring up data sessions. */
-        status = run_up_ipv6(&dms, mm_nl, bus, ctl);
+        status = run_up_ipv6(modem);
+
+        set_modem_state(modem, MODEM_STATE_STARTING);
+
+        if (modem->owns_clock && (check = mm_clock_shutdown(qmux)) !=
+                eQCWWAN_ERR_NONE) {
+            MM_LOG("%s%s\n", "Failed to shutdown the NAS service object");
+        }
 
-        if ((check = mm_dms_shutdown(&dms, ctl,
-                exit_requested)) != eQCWWAN_ERR_NONE) {
+        release_role(&clock_owner, modem);
+        modem->owns_clock = false;
+
+        if ((check = mm_dms_shutdown(&modem->dms, qmux,
+                is_exit_requested(modem))) != eQCWWAN_ERR_NONE) {
             MM_LOG("%s%s\n", "Failed to shutdown the DMS service object");
             status = check;
             break;
@@ -149,135 +537,513 @@ static int initialize(CtlService *ctl, struct mm_netlink *mm_nl, sd_bus *bus) {
             break;
         }
 
-        if ((check = mm_netlink_ensure_wg0_interface_state(mm_nl, false))) {
+        /* If another uplink has taken over, keep the tunnel (and DNS) up. */
+        failed_over = mm_uplink_is_failed_over(modem->wwan_ifname);
+
+        if (failed_over && mm_wireguard_rehome()) {
+            MM_LOG("%s%s\n", "Failed to move Wireguard to another uplink");
+        }
+
+        if (!failed_over && (check = mm_netlink_ensure_wg0_interface_state(
+                mm_nl, false))) {
             MM_LOG("%s%s\n", "Failed to put down the Wireguard interface");
             status = check;
             break;
         }
 
-        /* Stop chrony/unbound (as per above) now that we have no internet. */
-        if ((check = mm_sdbus_manage_service(bus, "StopUnit",
-                "chrony.service"))) {
-            MM_LOG("%s%s\n", "Failed to stop chrony when shutting down");
-            exit_requested = true;
+        /* Stop the units (as per above) now that we have no internet. */
+        if (!failed_over && (check = stop_units(modem))) {
+            MM_LOG("%s%s\n", "Failed to stop units when shutting down");
+            request_exit(modem);
             status = check;
         }
 
-        if ((check = mm_sdbus_manage_service(bus, "StopUnit",
-                "unbound.service"))) {
-            MM_LOG("%s%s\n", "Failed to stop unbound when shutting down");
-            exit_requested = true;
-            status = check;
-        }
+        /* Everything is down: a suspend need not wait on us any longer. */
+        mm_suspend_hold(modem->index, false);
+
+        /* Publish the latencies of whatever the modem did this cycle. */
+        mm_metrics_flush();
+        mm_tsdb_flush(false);
 
         /*
          * If the run function ever terminates early due to it failing its
-         * own setup, we sleep here to e.g. avoid excessive modem operations
-         * that might upset the network operator.
+         * own setup, we rest here to e.g. avoid excessive modem operations
+         * that might upset the network operator. If the modem left online
+         * mode on its own, though, put it straight back. Either way, wait
+         * out a suspend, and reconnect as soon as the system resumes.
          */
-        if (!exit_requested) {
-            sleep(10);
+        if (!is_exit_requested(modem) && !modem_removed(modem)) {
+            rest(modem, modem->operating_mode_lost ? 0 : 10U);
+        }
+
+        /* A throttling modem gets time to cool off before trying again. */
+        if (!is_exit_requested(modem) && !modem_removed(modem) &&
+                mm_health_is_thermally_throttled(modem->index)) {
+            MM_LOG("%s%s\n", "Letting the modem cool off before reconnecting");
+            rest(modem, MM_HEALTH_COOLDOWN_S);
         }
     }
 
+    mm_suspend_hold(modem->index, false);
     return status;
 }
 
+bool is_exit_requested(const struct mm_modem *modem) {
+    return __atomic_load_n(&modem->exit_requested, __ATOMIC_ACQUIRE);
+}
+
 int main(int argc, char **argv) {
+    const char *capture_path;
+    struct mm_modem *modem;
+    unsigned present, known;
     struct sigaction sa;
-    int status;
-
-    CtlService ctl;
-    QmuxTransport qmux;
-    struct mm_netlink mm_nl;
-    sd_bus *bus;
+    int status, option;
+    size_t i;
 
-    /* Register a handler for SIGINT and clear the exit flag. */
+    /*
+     * Register a handler for SIGINT and SIGTERM. Both shut down cleanly, so
+     * that staged history is written out when the service is stopped.
+     */
     memset(&sa, 0, sizeof(sa));
-    exit_requested = false;
 
     sa.sa_handler = &handle_signal;
     sigemptyset(&sa.sa_mask);
     sigaddset(&sa.sa_mask, SIGINT);
+    sigaddset(&sa.sa_mask, SIGTERM);
 
-    if (sigaction(SIGINT, &sa, NULL)) {
+    if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGTERM, &sa, NULL)) {
         perror("sigaction");
         return EXIT_FAILURE;
     }
 
-    /* Initialize the Qmux transport and CtlService. */
-    if (mm_qmux_transport_initialize(&qmux) != eQCWWAN_ERR_NONE) {
-        MM_LOG("%s%s\n", "Failed to initialize the QMI transport");
+    /* SIGUSR1 asks for a planned (make-before-break) session restart. */
+    if (sigaction(SIGUSR1, &sa, NULL)) {
+        perror("sigaction");
         return EXIT_FAILURE;
     }
 
-    if (mm_ctl_initialize(&ctl, &qmux) != eQCWWAN_ERR_NONE) {
-        MM_LOG("%s%s\n", "Failed to initialize a CtlService client");
-        status = EXIT_FAILURE;
+    /* SIGHUP asks for the config file to be reloaded. */
+    if (sigaction(SIGHUP, &sa, NULL)) {
+        perror("sigaction");
+        return EXIT_FAILURE;
     }
 
-    /* Initialize netlink, sd-bus interfaces and continue startup. */
-    else {
-        if (mm_netlink_initialize(&mm_nl)) {
-            MM_LOG("%s%s\n", "Failed to initialize netlink layer");
-            status = EXIT_FAILURE;
+    /*
+     * Optionally record all QMI traffic for later use by the replay tool,
+     * and/or speak QMI through the built-in engine instead of the SDK.
+     */
+    capture_path = NULL;
+
+    while ((option = getopt(argc, argv, "c:n")) != -1) {
+        switch (option) {
+        case 'c':
+            capture_path = optarg;
+            break;
+
+        case 'n':
+            native_qmi = true;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-c capture-file] [-n]\n", argv[0]);
+            return EXIT_FAILURE;
         }
+    }
 
-        else {
-            if (sd_bus_open_system(&bus) < 0) {
-                perror("sd_bus_open_system");
-                status = EXIT_FAILURE;
+    if (mm_metrics_register(mm_qmi_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register QMI metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_health_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register modem health metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_wireguard_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register Wireguard metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_drift_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register drift guard metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_hooks_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register hook metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_slo_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register SLO metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(mm_uplink_write_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register uplink metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (mm_metrics_register(write_modem_metrics, NULL)) {
+        MM_LOG("%s%s\n", "Failed to register modem metrics");
+        return EXIT_FAILURE;
+    }
+
+    if (capture_path != NULL && mm_capture_open(capture_path)) {
+        MM_LOG("%s%s\n", "Failed to open the QMI capture file");
+        return EXIT_FAILURE;
+    }
+
+    /* History is nice to have, but never worth failing to connect over. */
+    if (mm_tsdb_open(MM_TSDB_DIRECTORY)) {
+        MM_LOG("%s%s\n", "Failed to open the history store; continuing");
+    }
+
+    /* Lacking history, session lifetimes are learned as sessions end. */
+    else if (mm_refresh_load(MM_TSDB_DIRECTORY)) {
+        MM_LOG("%s%s\n", "Failed to read session lifetimes from the "
+                "history store; continuing");
+    }
+
+    if (mm_telemetry_start()) {
+        MM_LOG("%s%s\n", "Failed to start telemetry export; continuing");
+    }
+
+    /* The config still applies if it can't be watched; it won't reload. */
+    if (mm_config_start()) {
+        MM_LOG("%s%s\n", "Failed to watch the config file; continuing");
+    }
+
+    if (mm_hotplug_start()) {
+        MM_LOG("%s%s\n", "Failed to start hotplug tracking; continuing");
+    }
+
+    /* Without it, sessions are only found dead some time after a resume. */
+    if (mm_suspend_start()) {
+        MM_LOG("%s%s\n", "Failed to watch for system suspend; continuing");
+    }
+
+    /* Should it fail, the WWAN interface is the only uplink (as usual). */
+    if (mm_uplink_start()) {
+        MM_LOG("%s%s\n", "Failed to start multi-uplink mode; continuing");
+    }
+
+    /* Without it, what others remove stays removed until a reconnect. */
+    if (mm_drift_start()) {
+        MM_LOG("%s%s\n", "Failed to start the drift guard; continuing");
+    }
+
+    /* Hooks are site-specific extras; connecting never depends on them. */
+    if (mm_hooks_start()) {
+        MM_LOG("%s%s\n", "Failed to start the hook runner; continuing");
+    }
+
+    /* Without it, the tunnel just recovers on Wireguard's own timers. */
+    if (mm_wireguard_initialize()) {
+        MM_LOG("%s%s\n", "Failed to initialize Wireguard netlink; continuing");
+    }
+
+    for (i = 0, modem = modems; i < MM_HOTPLUG_MAX_MODEMS; i++, modem++) {
+        modem->index = (unsigned) i;
+        snprintf(modem->wwan_ifname, sizeof(modem->wwan_ifname),
+                MM_NETLINK_WWAN_INTERFACE_FORMAT, modem->index);
+    }
+
+    if (mm_hotplug_get_present_modems() == 0) {
+        MM_LOG("%s%s\n", "Waiting for a modem to appear...");
+    }
+
+    /*
+     * Drive every modem found at startup, and every one which appears later
+     * (e.g. coming back under another index). Each thread then follows its
+     * modem through removals. Without an uplink config to give each modem's
+     * routes a table of their own, they would fight over the main table, so
+     * a modem is only driven then if no other driven modem is present.
+     */
+    status = EXIT_SUCCESS;
+    known = 0;
+
+    while (!__atomic_load_n(&signal_received, __ATOMIC_ACQUIRE) &&
+            (known == 0 || modems_running())) {
+        present = mm_hotplug_wait_for_new_modems(known);
+
+        for (i = 0, modem = modems; i < MM_HOTPLUG_MAX_MODEMS; i++, modem++) {
+            if (!(present & (1U << i))) {
+                continue;
             }
 
-            else {
-                status = initialize(&ctl, &mm_nl, bus)
-                    ? EXIT_FAILURE
-                    : EXIT_SUCCESS;
+            known |= 1U << i;
 
-                sd_bus_close(bus);
-                sd_bus_unref(bus);
+            if (!mm_uplink_is_enabled() && driven_modem_present()) {
+                MM_LOG("%sFound modem %zu, but no uplink config to route it "
+                        "by alongside the others; not driving it\n", i);
             }
 
-            /* Flush the addresses on the WWAN interface and mark it down. */
-            if (mm_netlink_addr_flush(&mm_nl) ||
-                    mm_netlink_reload_link_cache(&mm_nl) ||
-                    mm_netlink_ensure_wwan_interface_state(&mm_nl, false)) {
-                MM_LOG("%s%s\n", "Failed to shutdown the WWAN host interface");
+            else if (start_modem(modem)) {
+                status = EXIT_FAILURE;
             }
+        }
+    }
 
-            mm_netlink_shutdown(&mm_nl);
+    for (i = 0, modem = modems; i < MM_HOTPLUG_MAX_MODEMS; i++, modem++) {
+        if (modem->started) {
+            pthread_join(modem->thread, NULL);
+            mm_events_destroy(&modem->events);
+
+            status = modem->status != EXIT_SUCCESS ? modem->status : status;
         }
+    }
+
+    mm_wireguard_shutdown();
+    mm_hooks_stop();
+    mm_drift_stop();
+    mm_uplink_stop();
+    mm_suspend_stop();
+    mm_hotplug_stop();
+    mm_config_stop();
+    mm_telemetry_stop();
+    mm_tsdb_close();
+    mm_capture_close();
+    return status;
+}
+
+bool modem_removed(const struct mm_modem *modem) {
+    return mm_hotplug_get_generation(modem->index) != modem->generation;
+}
+
+/*
+ * Brings everything up each time the modem appears. If it disappears out
+ * from under us (e.g. a firmware reset), whatever failed along the way is
+ * a consequence of that: wait for it to return instead of giving up.
+ */
+void *modem_thread_main(void *context) {
+    struct mm_modem *modem = context;
+
+    modem->status = EXIT_SUCCESS;
 
-        mm_ctl_shutdown(&ctl);
+    while (!mm_hotplug_wait_for_modem(modem->index, &modem->exit_requested,
+            &modem->generation)) {
+        MM_LOG("%sDriving modem %u (%s)\n", modem->index,
+                modem->wwan_ifname);
+
+        modem->status = run_modem(modem);
+        set_modem_state(modem, MODEM_STATE_ABSENT);
+
+        if (__atomic_load_n(&signal_received, __ATOMIC_ACQUIRE) ||
+                !modem_removed(modem)) {
+            break;
+        }
+
+        __atomic_store_n(&modem->exit_requested, false, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&modems_lock);
+    modem->finished = true;
+    pthread_mutex_unlock(&modems_lock);
+
+    return NULL;
+}
+
+/* Whether any modem thread is still going (the daemon exits otherwise). */
+bool modems_running(void) {
+    bool running = false;
+    size_t i;
+
+    pthread_mutex_lock(&modems_lock);
+
+    for (i = 0; i < MM_HOTPLUG_MAX_MODEMS; i++) {
+        running |= modems[i].started && !modems[i].finished;
+    }
+
+    pthread_mutex_unlock(&modems_lock);
+    return running;
+}
+
+void release_role(const struct mm_modem **owner,
+        const struct mm_modem *modem) {
+    pthread_mutex_lock(&modems_lock);
+
+    if (*owner == modem) {
+        *owner = NULL;
+    }
+
+    pthread_mutex_unlock(&modems_lock);
+}
+
+/* Safe to call from a signal handler (the flag is lock-free). */
+void request_exit(struct mm_modem *modem) {
+    __atomic_store_n(&modem->exit_requested, true, __ATOMIC_RELEASE);
+}
+
+void request_planned_restart(struct mm_modem *modem) {
+    __atomic_store_n(&modem->planned_restart_requested, true,
+            __ATOMIC_RELEASE);
+}
+
+int run_modem(struct mm_modem *modem) {
+    struct qmux_startup startup;
+    bool netlink_ready, bus_ready;
+    pthread_t qmux_thread;
+    uint64_t started_us;
+    int status, check;
+
+    set_modem_state(modem, MODEM_STATE_STARTING);
+    mm_config_get(&modem->config);
+
+    /*
+     * Nothing below depends on anything else until the modem is brought up:
+     * the QMI transport (and the autoconnect settings pushed through it) is
+     * set up on a thread of its own while this one does netlink and sd-bus,
+     * so that startup takes only as long as the slowest of them.
+     */
+    started_us = mm_time_monotonic_us();
+    startup.modem = modem;
+
+    if ((check = pthread_create(&qmux_thread, NULL, start_qmux,
+            &startup))) {
+        MM_LOG("%spthread_create: %s\n", strerror(check));
+        start_qmux(&startup);
+    }
+
+    /* Initialize netlink, sd-bus interfaces and continue startup. */
+    if (!(netlink_ready = !mm_netlink_initialize(&modem->mm_nl,
+            modem->index))) {
+        MM_LOG("%s%s\n", "Failed to initialize netlink layer");
+    }
+
+    else {
+        mm_netlink_set_v4_default_route_table(&modem->mm_nl,
+                mm_uplink_get_wwan_table(modem->wwan_ifname));
+
+        mm_netlink_set_wg0_routes(&modem->mm_nl, modem->config.wg0_address,
+                modem->config.wg0_gateway, modem->config.wg0_routes,
+                modem->config.wg0_route_count);
+    }
+
+    /* Each thread needs a bus connection of its own. */
+    if (!(bus_ready = sd_bus_open_system(&modem->bus) >= 0)) {
+        perror("sd_bus_open_system");
+    }
+
+    if (!check) {
+        pthread_join(qmux_thread, NULL);
+    }
+
+    /*
+     * The built-in engine's device is polled by this modem's event loop. It
+     * belongs to this thread from here on (pthread_join orders the two).
+     */
+    if (startup.initialized && native_qmi) {
+        mm_events_set_io(&modem->events, modem->qmux.engine.fd,
+                mm_qmi_engine_dispatch, &modem->qmux.engine);
+    }
+
+    if (startup.status == 0 && netlink_ready && bus_ready) {
+        MM_LOG("%sModem %u started up in %"PRIu64"ms\n", modem->index,
+                (mm_time_monotonic_us() - started_us) / 1000U);
+
+        status = initialize(modem)
+            ? EXIT_FAILURE
+            : EXIT_SUCCESS;
+    }
+
+    else {
+        status = EXIT_FAILURE;
+    }
+
+    if (bus_ready) {
+        sd_bus_close(modem->bus);
+        sd_bus_unref(modem->bus);
+    }
+
+    /* Flush the addresses on the WWAN interface and mark it down. */
+    if (netlink_ready) {
+        if (mm_netlink_addr_flush(&modem->mm_nl) ||
+                mm_netlink_reload_link_cache(&modem->mm_nl) ||
+                mm_netlink_ensure_wwan_interface_state(&modem->mm_nl,
+                false)) {
+            MM_LOG("%s%s\n", "Failed to shutdown the WWAN host interface");
+        }
+
+        mm_netlink_shutdown(&modem->mm_nl);
+    }
+
+    if (startup.initialized) {
+        mm_events_set_io(&modem->events, -1, NULL, NULL);
+        mm_qmux_shutdown(&modem->qmux);
     }
 
-    mm_qmux_transport_shutdown(&qmux);
     return status;
 }
 
-int run_up_ipv4(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
-        struct mm_wds_session *session_v6, sd_bus *bus, CtlService *ctl) {
+/*
+ * Everything that follows an address being applied, as a graph: units that
+ * go before the tunnel start (together) first, since the tunnel may need
+ * them (e.g. unbound, to resolve its endpoints), and the rest once it's up.
+ * A unit failing to start calls for an exit; the tunnel, for a restart.
+ */
+enum mm_task_policy run_post_connect_tasks(struct mm_modem *modem) {
+    struct mm_unit_task units[MM_CONFIG_MAX_UNITS];
+    struct mm_wireguard_setconf_task setconf;
+    struct mm_task_graph graph;
+    unsigned setconf_task, wg0_task;
+    uint32_t pre_tunnel;
+
+    mm_task_graph_init(&graph, "post_connect");
+    pre_tunnel = add_unit_tasks(&graph, units, modem, "StartUnit", false, 0,
+            MM_TASK_POLICY_EXIT);
+
+    setconf_task = mm_task_graph_add(&graph, "wg-setconf",
+            &mm_wireguard_setconf_task_ops, &setconf, pre_tunnel,
+            MM_TASK_POLICY_RESTART, WIREGUARD_TASK_TIMEOUT_MS);
+
+    wg0_task = mm_task_graph_add(&graph, "wg0-up", &mm_wg0_up_task_ops,
+            &modem->mm_nl, MM_TASK_BIT(setconf_task), MM_TASK_POLICY_RESTART,
+            WIREGUARD_TASK_TIMEOUT_MS);
+
+    add_unit_tasks(&graph, units, modem, "StartUnit", true,
+            MM_TASK_BIT(wg0_task), MM_TASK_POLICY_EXIT);
+
+    mm_task_graph_add(&graph, "wg-refresh-peers",
+            &mm_wireguard_refresh_task_ops, NULL, MM_TASK_BIT(wg0_task),
+            MM_TASK_POLICY_IGNORE, WIREGUARD_TASK_TIMEOUT_MS);
+
+    return mm_task_graph_run(&graph);
+}
+
+int run_up_ipv4(struct mm_modem *modem, struct mm_wds_session *session_v6) {
+    struct mm_netlink *mm_nl = &modem->mm_nl;
+    struct mm_qmux *qmux = &modem->qmux;
+    struct mm_wds_session sessions_v4[2], *session_v4;
+    enum mm_task_policy outcome;
     bool address_present, gateway_present;
-    struct mm_wds_session session_v4;
     int status, check;
 
-    /* Setup a WDS service instance and connect to the network. */
-    memset(&session_v4, 0, sizeof(session_v4));
+    /*
+     * Setup a WDS service instance and connect to the network. A second
+     * instance is kept aside for planned replacements of the session.
+     */
+    session_v4 = sessions_v4;
+    memset(session_v4, 0, sizeof(*session_v4));
+    session_v4->events = &modem->events;
 
-    if ((status = mm_wds_initialize(&session_v4.wds, ctl, &session_v4))) {
+    if ((status = mm_wds_initialize(&session_v4->wds, qmux, session_v4))) {
         MM_LOG("%s%s\n", "Failed to initialize the IPv4 WDS service object");
-        exit_requested = true;
+        request_exit(modem);
         return status;
     }
 
-    if ((status = mm_start_session(&session_v4, PROFILE_3GPP_VZWINTERNET,
+    if ((status = mm_start_session(session_v4, modem->config.profile,
             MM_WDS_IP_FAMILY_PREFERENCE_IPV4)) == eQCWWAN_ERR_NONE) {
         MM_LOG("%sStarted IPv4 data session: CID=%"PRIu8", SID=0x%"PRIx32"\n",
-                session_v4.wds.clientId, session_v4.session_id);
+                session_v4->wds.client_id, session_v4->session_id);
+
+        session_v4->started_us = mm_time_monotonic_us();
 
         /* Query for IPv4 runtime settings, validate and apply them. */
-        if ((status = mm_wds_get_runtime_settings(&session_v4,
-                &session_v4.last_runtime_settings, &address_present,
+        if ((status = mm_wds_get_runtime_settings(session_v4,
+                &session_v4->last_runtime_settings, &address_present,
                 &gateway_present)) != eQCWWAN_ERR_NONE) {
             MM_LOG("%s%s\n", "Failed to get initial IPv4 runtime settings");
         }
@@ -288,21 +1054,31 @@ int run_up_ipv4(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
         }
 
         else if ((status = mm_apply_ipv4_runtime_settings(mm_nl,
-                &session_v4.last_runtime_settings, false)) ==
+                &session_v4->last_runtime_settings, false)) ==
                 eQCWWAN_ERR_NONE) {
 
-            /* Start DNS/NTP daemons and enter the run (monitoring) loop. */
-            if ((status = mm_sdbus_manage_service(bus, "StartUnit",
-                    "unbound.service"))) {
-                MM_LOG("%s%s\n", "Failed to start unbound after modem up");
-                exit_requested = true;
+            /*
+             * Now that the modem is registered, seed the clock off network
+             * time (if it is wildly off) so that the Wireguard handshake and
+             * anything else time-sensitive succeeds before chrony syncs.
+             */
+            if (modem->owns_clock && (check = mm_clock_sync_from_modem(
+                    true)) != eQCWWAN_ERR_NONE) {
+                MM_LOG("%sNo network time available from the modem (%d)\n",
+                        check);
+            }
+
+            /* Start units (e.g. DNS) and the tunnel, then the run loop. */
+            if ((outcome = run_post_connect_tasks(modem)) ==
+                    MM_TASK_POLICY_EXIT) {
+                MM_LOG("%s%s\n", "Failed to start units after modem up");
+                request_exit(modem);
+                status = -1;
             }
 
-            else if ((status = mm_exec_wireguard_setconf()) ||
-                    (status = mm_netlink_ensure_wg0_interface_state(
-                    mm_nl, true)) || mm_netlink_ensure_wg0_routes_are_applied(
-                    mm_nl)) {
+            else if (outcome == MM_TASK_POLICY_RESTART) {
                 MM_LOG("%s%s\n", "Failed to bring up the Wireguard interface");
+                status = -1;
 
                 /*
                  * Do not request an exit, as a failure to bring up Wireguard
@@ -311,20 +1087,28 @@ int run_up_ipv4(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
                  */
             }
 
-            else if ((status = mm_sdbus_manage_service(bus, "StartUnit",
-                    "chrony.service"))) {
-                MM_LOG("%s%s\n", "Failed to start chrony after modem up");
-                exit_requested = true;
-            }
-
             else {
-                status = run_sessions_up(dms, mm_nl, &session_v4, session_v6);
+                mm_uplink_set_wwan_session_up(modem->wwan_ifname, true);
+                dispatch_hooks(modem, MM_HOOK_CONNECT, session_v4);
+                mm_slo_session_up(modem->index, MM_SLO_FAMILY_IPV4);
+
+                /* Planned restarts make the replacement before the break. */
+                while ((status = run_sessions_up(modem, session_v4,
+                        session_v6)) == RUN_REPLACE_SESSION) {
+                    replace_session_v4(modem, sessions_v4, &session_v4);
+                }
+
+                /* Take the WWAN link out of any multipath route right away. */
+                mm_uplink_set_wwan_session_up(modem->wwan_ifname, false);
+                dispatch_hooks(modem, MM_HOOK_DISCONNECT, session_v4);
+                mm_slo_session_down(modem->index, MM_SLO_FAMILY_IPV4,
+                        !is_exit_requested(modem) && !mm_suspend_is_pending());
             }
         }
 
         else {
             MM_LOG("%s%s\n", "Failed to apply IPv4 configuration to the host");
-            exit_requested = true;
+            request_exit(modem);
         }
 
         /*
@@ -333,12 +1117,14 @@ int run_up_ipv4(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
          * shutdown is not clean ("no effect"). Make sure that we do not
          * consider such a case to be an error.
          */
-        if ((check = mm_wds_stop_data_session(&session_v4)) !=
+        if ((check = mm_wds_stop_data_session(session_v4)) !=
                 eQCWWAN_ERR_NONE && check != eQCWWAN_ERR_QMI_NO_EFFECT) {
             MM_LOG("%sFailed to stop the IPv4 data session (%d)\n", status);
-            exit_requested = true;
+            request_exit(modem);
             status = check;
         }
+
+        record_session_history(session_v4);
     }
 
     else {
@@ -346,34 +1132,38 @@ int run_up_ipv4(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
         MM_LOG("%sFailed to start the IPv4 data session (%d)\n", status);
     }
 
-    if ((check = mm_wds_shutdown(&session_v4.wds, ctl))) {
+    if ((check = mm_wds_shutdown(&session_v4->wds, qmux))) {
         MM_LOG("%s%s\n", "Failed to shutdown the IPv4 WDS service object");
-        exit_requested = true;
+        request_exit(modem);
         status = check;
     }
 
     return status;
 }
 
-int run_up_ipv6(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
-        sd_bus *bus, CtlService *ctl) {
+int run_up_ipv6(struct mm_modem *modem) {
+    struct mm_netlink *mm_nl = &modem->mm_nl;
+    struct mm_qmux *qmux = &modem->qmux;
     bool address_present, gateway_present;
     struct mm_wds_session session_v6;
     int status, check;
 
     /* Setup a WDS service instance and connect to the network. */
     memset(&session_v6, 0, sizeof(session_v6));
+    session_v6.events = &modem->events;
 
-    if ((status = mm_wds_initialize(&session_v6.wds, ctl, &session_v6))) {
+    if ((status = mm_wds_initialize(&session_v6.wds, qmux, &session_v6))) {
         MM_LOG("%s%s\n", "Failed to initialize the IPv6 WDS service object");
-        exit_requested = true;
+        request_exit(modem);
         return status;
     }
 
-    if ((status = mm_start_session(&session_v6, PROFILE_3GPP_VZWINTERNET,
+    if ((status = mm_start_session(&session_v6, modem->config.profile,
             MM_WDS_IP_FAMILY_PREFERENCE_IPV6)) == eQCWWAN_ERR_NONE) {
         MM_LOG("%sStarted IPv6 data session: CID=%"PRIu8", SID=0x%"PRIx32"\n",
-                session_v6.wds.clientId, session_v6.session_id);
+                session_v6.wds.client_id, session_v6.session_id);
+
+        session_v6.started_us = mm_time_monotonic_us();
 
         /* Query for IPv6 runtime settings and validate them. */
         if ((status = mm_wds_get_runtime_settings(&session_v6,
@@ -391,12 +1181,15 @@ int run_up_ipv6(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
         else if ((status = mm_apply_ipv6_runtime_settings(mm_nl,
                 &session_v6.last_runtime_settings, false)) ==
                 eQCWWAN_ERR_NONE) {
-            status = run_up_ipv4(dms, mm_nl, &session_v6, bus, ctl);
+            mm_slo_session_up(modem->index, MM_SLO_FAMILY_IPV6);
+            status = run_up_ipv4(modem, &session_v6);
+            mm_slo_session_down(modem->index, MM_SLO_FAMILY_IPV6,
+                    !is_exit_requested(modem) && !mm_suspend_is_pending());
         }
 
         else {
             MM_LOG("%s%s\n", "Failed to apply IPv6 configuration to the host");
-            exit_requested = true;
+            request_exit(modem);
         }
 
         /*
@@ -408,9 +1201,11 @@ int run_up_ipv6(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
         if ((check = mm_wds_stop_data_session(&session_v6)) !=
                 eQCWWAN_ERR_NONE && check != eQCWWAN_ERR_QMI_NO_EFFECT) {
             MM_LOG("%sFailed to stop the IPv6 data session (%d)\n", status);
-            exit_requested = true;
+            request_exit(modem);
             status = check;
         }
+
+        record_session_history(&session_v6);
     }
 
     else {
@@ -418,22 +1213,521 @@ int run_up_ipv6(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
         MM_LOG("%sFailed to start the IPv6 data session (%d)\n", status);
     }
 
-    if ((check = mm_wds_shutdown(&session_v6.wds, ctl))) {
+    if ((check = mm_wds_shutdown(&session_v6.wds, qmux))) {
         MM_LOG("%s%s\n", "Failed to shutdown the IPv6 WDS service object");
-        exit_requested = true;
+        request_exit(modem);
         status = check;
     }
 
     return status;
 }
 
-int run_sessions_up(struct mm_dms_service *dms, struct mm_netlink *mm_nl,
-        struct mm_wds_session *session_v4, struct mm_wds_session *session_v6) {
-    while (!exit_requested && !session_v4->teardown_requested &&
-            !session_v6->teardown_requested) {
-        sleep(1);
+void record_session_history(const struct mm_wds_session *session) {
+    uint64_t duration_us = mm_time_monotonic_us() - session->started_us;
+
+    mm_tsdb_append(MM_TSDB_SERIES_SESSION, session->family == AF_INET
+            ? MM_TSDB_TAG_IPV4 : MM_TSDB_TAG_IPV6, session->last_end_reason,
+            (int64_t) (duration_us / 1000U));
+
+    mm_telemetry_event("session_end family=%s duration_ms=%"PRIu64
+            " reason=%u", session->family == AF_INET ? "ipv4" : "ipv6",
+            duration_us / 1000U, session->last_end_reason);
+
+    if (session->family == AF_INET && mm_refresh_record_session(
+            session->last_end_reason, duration_us / 1000U,
+            session->replaced_age_ms)) {
+        mm_telemetry_event("session_refresh_failed family=ipv4 "
+                "duration_ms=%"PRIu64" replaced_age_ms=%"PRIu64,
+                duration_us / 1000U, session->replaced_age_ms);
+    }
+}
+
+/*
+ * Make-before-break replacement of the IPv4 session for planned restarts:
+ * the replacement comes up on the spare WDS client, the default route is
+ * moved over to it by a single NLM_F_REPLACE (so no packet ever finds it
+ * missing) and only then is the old session stopped and its address let
+ * go. Should the replacement not come up, the old session carries on.
+ *
+ * On the same profile, the modem may just bind the spare client to the
+ * data context already up, handing back the same packet data handle:
+ * nothing was renewed then, and stopping either session would take the
+ * shared context down. The spare client is released and the current
+ * session (with its age) is kept; the reuse is logged and reported.
+ */
+void replace_session_v4(struct mm_modem *modem,
+        struct mm_wds_session *sessions, struct mm_wds_session **session) {
+    struct mm_netlink *mm_nl = &modem->mm_nl;
+    struct mm_qmux *qmux = &modem->qmux;
+    const struct mm_wds_runtime_settings *settings, *old_settings;
+    bool address_present, gateway_present, address_changed;
+    struct mm_wds_session *old, *next;
+    int status;
+
+    old = *session;
+    next = old == sessions ? sessions + 1 : sessions;
+    memset(next, 0, sizeof(*next));
+    next->events = &modem->events;
+
+    MM_LOG("%s%s\n", "Bringing up a replacement IPv4 data session");
+
+    if ((status = mm_wds_initialize(&next->wds, qmux, next))) {
+        MM_LOG("%s%s\n", "Failed to initialize a spare IPv4 WDS object");
+        return;
+    }
+
+    if ((status = mm_start_session(next, modem->config.profile,
+            MM_WDS_IP_FAMILY_PREFERENCE_IPV4)) != eQCWWAN_ERR_NONE) {
+        MM_LOG("%sFailed to start the replacement IPv4 session (%d); "
+                "keeping the current one\n", status);
+
+        mm_wds_shutdown(&next->wds, qmux);
+        return;
+    }
+
+    if (next->profile == old->profile &&
+            next->session_id == old->session_id) {
+        MM_LOG("%s%s\n", "The modem reused the current IPv4 data context; "
+                "nothing to replace");
+
+        mm_telemetry_event("session_replace_reused family=ipv4");
+        mm_wds_shutdown(&next->wds, qmux);
+        return;
+    }
+
+    next->started_us = mm_time_monotonic_us();
+    settings = &next->last_runtime_settings;
+    old_settings = &old->last_runtime_settings;
+
+    if ((status = mm_wds_get_runtime_settings(next,
+            &next->last_runtime_settings, &address_present,
+            &gateway_present)) != eQCWWAN_ERR_NONE || !address_present ||
+            !gateway_present) {
+        MM_LOG("%s%s\n", "No IPv4 settings for the replacement session; "
+                "keeping the current one");
+
+        mm_wds_stop_data_session(next);
+        mm_wds_shutdown(&next->wds, qmux);
+        return;
+    }
+
+    /* Both addresses are up for a moment; the route then flips over. */
+    address_changed = settings->address.in.s_addr !=
+        old_settings->address.in.s_addr ||
+        settings->prefix_length != old_settings->prefix_length;
+
+    if ((address_changed && (status = mm_netlink_add_v4_address(mm_nl,
+            settings->address.in.s_addr, settings->prefix_length))) ||
+            (status = mm_netlink_change_v4_default_gateway(mm_nl,
+            settings->address.in.s_addr, settings->gateway.in.s_addr))) {
+        MM_LOG("%s%s\n", "Failed to move over to the replacement IPv4 "
+                "session; keeping the current one");
+
+        /* Drops the replacement's address (if added) and the route. */
+        if (mm_netlink_reload_address_cache(mm_nl) ||
+                mm_netlink_ensure_v4_configuration_is_applied(mm_nl,
+                old_settings->address.in.s_addr, old_settings->prefix_length,
+                old_settings->gateway.in.s_addr)) {
+            MM_LOG("%s%s\n", "Failed to restore the current IPv4 "
+                    "configuration");
+        }
+
+        mm_wds_stop_data_session(next);
+        mm_wds_shutdown(&next->wds, qmux);
+        return;
+    }
+
+    /* Traffic is going over the replacement now: retire the old one. */
+    if ((status = mm_wds_stop_data_session(old)) != eQCWWAN_ERR_NONE &&
+            status != eQCWWAN_ERR_QMI_NO_EFFECT) {
+        MM_LOG("%sFailed to stop the replaced IPv4 data session (%d)\n",
+                status);
+    }
+
+    record_session_history(old);
+
+    if (mm_wds_shutdown(&old->wds, qmux)) {
+        MM_LOG("%s%s\n", "Failed to shutdown the replaced IPv4 WDS object");
+    }
+
+    if (mm_netlink_reload_address_cache(mm_nl) ||
+            mm_netlink_ensure_v4_configuration_is_applied(mm_nl,
+            settings->address.in.s_addr, settings->prefix_length,
+            settings->gateway.in.s_addr)) {
+        MM_LOG("%s%s\n", "Failed to drop the replaced IPv4 address");
+    }
+
+    if (address_changed && mm_wireguard_rehome()) {
+        MM_LOG("%s%s\n", "Failed to move Wireguard to the new address");
+    }
+
+    if (address_changed) {
+        dispatch_hooks(modem, MM_HOOK_ADDRESS_CHANGE, next);
+    }
+
+    MM_LOG("%sReplaced the IPv4 data session: CID=%"PRIu8", SID=0x%"PRIx32
+            "\n", next->wds.client_id, next->session_id);
+
+    mm_telemetry_event("session_replaced family=ipv4 address_changed=%d",
+            address_changed);
+
+    next->replaced_age_ms = (next->started_us - old->started_us) / 1000U;
+
+    *session = next;
+}
+
+/*
+ * Pauses between connection attempts (and for as long as the system is
+ * suspending). Resuming, an exit or the modem going away cuts it short.
+ * Other events that turn up meanwhile are left for the run loop.
+ */
+void rest(struct mm_modem *modem, unsigned seconds) {
+    uint64_t now_us, deadline_us, wake_us;
+    unsigned events, deferred = 0;
+
+    deadline_us = mm_time_monotonic_us() + seconds * 1000000ULL;
+
+    while (!is_exit_requested(modem) && !modem_removed(modem) &&
+            ((now_us = mm_time_monotonic_us()) < deadline_us ||
+            mm_suspend_is_pending())) {
+        /* Signals can't wake us up: look in on them once a second. */
+        wake_us = now_us + 1000000U;
+
+        if (wake_us > deadline_us && !mm_suspend_is_pending()) {
+            wake_us = deadline_us;
+        }
+
+        /* Time spent suspended doesn't count against availability. */
+        else if (mm_suspend_is_pending()) {
+            mm_slo_session_down(modem->index, MM_SLO_FAMILY_IPV4, false);
+            mm_slo_session_down(modem->index, MM_SLO_FAMILY_IPV6, false);
+        }
+
+        events = mm_events_wait(&modem->events, wake_us);
+        deferred |= events & ~(unsigned) (MM_EVENT_SUSPEND | MM_EVENT_RESUME);
+
+        if (events & MM_EVENT_RESUME) {
+            break;
+        }
+    }
+
+    if (deferred) {
+        mm_events_post_to(&modem->events, deferred);
+    }
+}
+
+int run_sessions_up(struct mm_modem *modem, struct mm_wds_session *session_v4,
+        struct mm_wds_session *session_v6) {
+    struct mm_netlink *mm_nl = &modem->mm_nl;
+    uint64_t rx_bytes, tx_bytes, last_rx_bytes, last_tx_bytes;
+    struct transient_grace grace_v4, grace_v6;
+    uint64_t reconnect_us, next_tick_us, lifetime_ms;
+    uint32_t wg0_gateway;
+    bool have_counters, host_chores;
+    unsigned ticks, events;
+
+    /*
+     * Record how long it took to get from a bare modem to connected (only
+     * the once: coming back after a planned replacement doesn't count).
+     */
+    if (modem->cycle_started_us) {
+        reconnect_us = mm_time_monotonic_us() - modem->cycle_started_us;
+        mm_tsdb_append(MM_TSDB_SERIES_RECONNECT, (uint8_t) modem->index, 0,
+                (int64_t) (reconnect_us / 1000U));
+
+        mm_telemetry_event("sessions_up modem=%u reconnect_ms=%"PRIu64,
+                modem->index, reconnect_us / 1000U);
+
+        modem->cycle_started_us = 0;
+    }
+
+    set_modem_state(modem, MODEM_STATE_CONNECTED);
+    mm_suspend_hold(modem->index, true);
+
+    have_counters = !mm_netlink_get_wwan_statistics(mm_nl,
+            &last_rx_bytes, &last_tx_bytes);
+
+    /*
+     * Housekeeping runs off one second ticks, but indications from the modem
+     * (or hotplug events) wake us up immediately so that we can react.
+     */
+    next_tick_us = mm_time_monotonic_us();
+    memset(&grace_v4, 0, sizeof(grace_v4));
+    memset(&grace_v6, 0, sizeof(grace_v6));
+
+    for (ticks = 0; !is_exit_requested(modem) && !modem_removed(modem) &&
+            !modem->operating_mode_lost && !__atomic_load_n(
+            &modem->planned_restart_requested, __ATOMIC_ACQUIRE) &&
+            !session_v4->teardown_requested &&
+            !session_v6->teardown_requested && !mm_suspend_is_pending(); ) {
+        if (mm_time_monotonic_us() < next_tick_us) {
+            events = mm_events_wait(&modem->events, next_tick_us);
+
+            if ((events & MM_EVENT_OPERATING_MODE) &&
+                    modem->dms.reported_mode != MM_DMS_OPERATION_MODE_ONLINE) {
+                modem->operating_mode_lost = true;
+            }
+
+            if (events & MM_EVENT_SESSION_TRANSIENT) {
+                check_transient_session(mm_nl, session_v4, &grace_v4);
+                check_transient_session(mm_nl, session_v6, &grace_v6);
+            }
+
+            if (events & MM_EVENT_CONFIG_CHANGED) {
+                apply_config(modem, true);
+            }
+
+            /* Put back whatever someone else took away from us. */
+            if (events & MM_EVENT_NETLINK_CHANGED) {
+                mm_drift_check(modem->index, mm_nl,
+                        &session_v4->last_runtime_settings);
+            }
+
+            if ((events & MM_EVENT_UPLINK_CHANGED) &&
+                    claim_role(&host_chores_owner, modem) &&
+                    mm_wireguard_rehome()) {
+                MM_LOG("%s%s\n", "Failed to move Wireguard to another uplink");
+            }
+
+            continue;
+        }
+
+        next_tick_us += 1000000U;
+        check_transient_session(mm_nl, session_v4, &grace_v4);
+
+        if (mm_drift_is_pending(modem->index)) {
+            mm_drift_check(modem->index, mm_nl,
+                    &session_v4->last_runtime_settings);
+        }
+
+        check_transient_session(mm_nl, session_v6, &grace_v6);
+
+        /* The host-wide chores fall to whichever modem got there first. */
+        host_chores = claim_role(&host_chores_owner, modem);
+
+        if (host_chores && ticks % MM_METRICS_FLUSH_INTERVAL_S == 0) {
+            mm_metrics_flush();
+        }
+
+        /* Sample throughput off the WWAN host interface counters. */
+        if (ticks && ticks % HISTORY_SAMPLE_INTERVAL_S == 0) {
+            if (!mm_netlink_get_wwan_statistics(mm_nl, &rx_bytes,
+                    &tx_bytes)) {
+                if (have_counters) {
+                    mm_tsdb_append(MM_TSDB_SERIES_RX_BYTES,
+                            (uint8_t) modem->index, HISTORY_SAMPLE_INTERVAL_S,
+                            (int64_t) (rx_bytes - last_rx_bytes));
+
+                    mm_tsdb_append(MM_TSDB_SERIES_TX_BYTES,
+                            (uint8_t) modem->index, HISTORY_SAMPLE_INTERVAL_S,
+                            (int64_t) (tx_bytes - last_tx_bytes));
+                }
+
+                last_rx_bytes = rx_bytes;
+                last_tx_bytes = tx_bytes;
+                have_counters = true;
+            }
+
+            mm_tsdb_flush(false);
+        }
+
+        if (ticks && ticks % MM_HEALTH_SAMPLE_INTERVAL_S == 0) {
+            sample_modem_health(modem);
+        }
+
+        /*
+         * Refresh the session (make-before-break) at a quiet moment ahead
+         * of the carrier ending it, once we've learned when that will be.
+         */
+        if (ticks % MM_REFRESH_SAMPLE_INTERVAL_S == 0 &&
+                mm_refresh_get_lifetime(&lifetime_ms) &&
+                !mm_netlink_get_wwan_statistics(mm_nl, &rx_bytes,
+                &tx_bytes) && mm_refresh_is_due(&modem->refresh,
+                session_v4->started_us, rx_bytes + tx_bytes)) {
+            MM_LOG("%sRefreshing the IPv4 data session ahead of its %"PRIu64
+                    "s lifetime\n", lifetime_ms / 1000U);
+
+            mm_telemetry_event("session_refresh modem=%u age_ms=%"PRIu64
+                    " lifetime_ms=%"PRIu64, modem->index,
+                    (mm_time_monotonic_us() - session_v4->started_us) / 1000U,
+                    lifetime_ms);
+
+            request_planned_restart(modem);
+        }
+
+        /* Watch the tunnel; it recovers by itself without the WWAN. */
+        if (host_chores && ticks &&
+                ticks % MM_WIREGUARD_CHECK_INTERVAL_S == 0) {
+            mm_wireguard_check();
+        }
+
+        /* Follow the lowest-latency Wireguard concentrator around. */
+        if (host_chores && ticks % MM_WIREGUARD_PROBE_INTERVAL_S == 0 &&
+                mm_wireguard_probe_peers(&wg0_gateway) > 0 &&
+                mm_netlink_change_wg0_gateway(mm_nl, wg0_gateway)) {
+            MM_LOG("%s%s\n", "Failed to steer routes to the Wireguard peer");
+        }
+
+        /* Keep chrony fed with network time as a reference clock. */
+        if (modem->owns_clock && ticks % MM_CLOCK_CHRONY_INTERVAL_S == 0) {
+            mm_clock_sync_from_modem(false);
+        }
+
+        ticks++;
+    }
+
+    release_role(&host_chores_owner, modem);
+
+    if (modem_removed(modem)) {
+        MM_LOG("%s%s\n", "Tearing down the data sessions: modem is gone");
+        return -1;
+    }
+
+    if (modem->operating_mode_lost) {
+        MM_LOG("%sTearing down the data sessions: modem is now %s\n",
+                mm_dms_get_operation_mode_string(modem->dms.reported_mode));
+
+        mm_telemetry_event("operating_mode_lost mode=%u",
+                (unsigned) modem->dms.reported_mode);
+
+        return -1;
+    }
+
+    if (__atomic_exchange_n(&modem->planned_restart_requested, false,
+            __ATOMIC_ACQ_REL)) {
+        return RUN_REPLACE_SESSION;
+    }
+
+    if (mm_suspend_is_pending()) {
+        MM_LOG("%s%s\n", "Tearing down the data sessions: the system is "
+                "about to suspend");
+
+        return 0;
     }
 
     MM_LOG("%s%s\n", "Stopping the modem-monitor due to external request");
     return 0;
 }
+
+void sample_modem_health(struct mm_modem *modem) {
+    enum mm_dms_thermal_state thermal_state;
+    int16_t temperature;
+    int status;
+
+    if ((status = mm_dms_get_temperature_sync(&modem->dms, &temperature,
+            &thermal_state)) != eQCWWAN_ERR_NONE) {
+        MM_LOG("%sFailed to query the modem temperature (%d)\n", status);
+        mm_health_record_error(modem->index);
+        return;
+    }
+
+    mm_health_record_sample(modem->index, temperature, thermal_state);
+}
+
+void set_modem_state(struct mm_modem *modem, enum modem_state state) {
+    pthread_mutex_lock(&modems_lock);
+
+    if (state == MODEM_STATE_CONNECTED && modem->state != state) {
+        modem->connects++;
+    }
+
+    modem->state = state;
+    pthread_mutex_unlock(&modems_lock);
+}
+
+/* Gives a modem a thread (and event loop) of its own. */
+int start_modem(struct mm_modem *modem) {
+    int status;
+
+    if (mm_events_initialize(&modem->events)) {
+        MM_LOG("%sNo event queue left for modem %u\n", modem->index);
+        return -1;
+    }
+
+    if ((status = pthread_create(&modem->thread, NULL, modem_thread_main,
+            modem))) {
+        MM_LOG("%spthread_create: %s\n", strerror(status));
+        mm_events_destroy(&modem->events);
+        return -1;
+    }
+
+    pthread_mutex_lock(&modems_lock);
+    modem->started = true;
+    pthread_mutex_unlock(&modems_lock);
+
+    return 0;
+}
+
+/* Initializes the QMI transport (and its control service client). */
+void *start_qmux(void *context) {
+    struct qmux_startup *startup = context;
+    struct mm_modem *modem = startup->modem;
+
+    startup->initialized = false;
+    startup->status = -1;
+
+    if (mm_qmux_initialize(&modem->qmux, modem->index, native_qmi) !=
+            eQCWWAN_ERR_NONE) {
+        MM_LOG("%s%s\n", "Failed to initialize the QMI transport");
+        return NULL;
+    }
+
+    startup->initialized = true;
+    startup->status = mm_configure_autoconnect_and_roaming(&modem->qmux,
+            modem->config.autoconnect, modem->config.roaming);
+
+    return NULL;
+}
+
+/*
+ * Stops the units listed in the config, all at once, save that those which
+ * go after the Wireguard tunnel are stopped before those which go before.
+ */
+int stop_units(struct mm_modem *modem) {
+    struct mm_unit_task units[MM_CONFIG_MAX_UNITS];
+    struct mm_task_graph graph;
+    uint32_t after_tunnel;
+
+    mm_task_graph_init(&graph, "stop_units");
+    after_tunnel = add_unit_tasks(&graph, units, modem, "StopUnit", true, 0,
+            MM_TASK_POLICY_RESTART);
+
+    add_unit_tasks(&graph, units, modem, "StopUnit", false, after_tunnel,
+            MM_TASK_POLICY_RESTART);
+
+    return mm_task_graph_run(&graph) == MM_TASK_POLICY_IGNORE ? 0 : -1;
+}
+
+void write_modem_metrics(FILE *f, void *context) {
+    const struct mm_modem *modem;
+    size_t i;
+
+    pthread_mutex_lock(&modems_lock);
+
+    fprintf(f, "# HELP modem_monitor_modem_state "
+            "Where each modem is at (0: absent, 1: starting, 2: connecting, "
+            "3: connected).\n"
+            "# TYPE modem_monitor_modem_state gauge\n");
+
+    for (i = 0, modem = modems; i < MM_HOTPLUG_MAX_MODEMS; i++, modem++) {
+        if (modem->started) {
+            fprintf(f, "modem_monitor_modem_state{modem=\"%u\","
+                    "interface=\"%s\"} %u\n", modem->index,
+                    modem->wwan_ifname, (unsigned) modem->state);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_modem_connects_total "
+            "Times each modem got its data sessions up.\n"
+            "# TYPE modem_monitor_modem_connects_total counter\n");
+
+    for (i = 0, modem = modems; i < MM_HOTPLUG_MAX_MODEMS; i++, modem++) {
+        if (modem->started) {
+            fprintf(f, "modem_monitor_modem_connects_total{modem=\"%u\","
+                    "interface=\"%s\"} %"PRIu64"\n", modem->index,
+                    modem->wwan_ifname, modem->connects);
+        }
+    }
+
+    pthread_mutex_unlock(&modems_lock);
+}
@@ -0,0 +1,123 @@
+/*
+ * src/metrics.c: Metrics export helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_metrics.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+struct mm_metrics_registration {
+    mm_metrics_writer writer;
+    void *context;
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t metrics_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_metrics_registration metrics_writers[MM_METRICS_MAX_WRITERS];
+static unsigned metrics_writer_count;
+
+int mm_metrics_register(mm_metrics_writer writer, void *context) {
+    int status = -1;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    if (metrics_writer_count < MM_METRICS_MAX_WRITERS) {
+        metrics_writers[metrics_writer_count].writer = writer;
+        metrics_writers[metrics_writer_count].context = context;
+        metrics_writer_count++;
+        status = 0;
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+    return status;
+}
+
+void mm_metrics_unregister(mm_metrics_writer writer, void *context) {
+    unsigned i;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    for (i = 0; i < metrics_writer_count; i++) {
+        if (metrics_writers[i].writer == writer &&
+                metrics_writers[i].context == context) {
+            metrics_writers[i] = metrics_writers[--metrics_writer_count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * Metrics are published in the Prometheus text exposition format so that
+ * the node_exporter textfile collector can pick them up. The file is written
+ * out under a temporary name and renamed so readers never see a torn copy.
+ * Any thread may flush; flushes are serialized, as they share that name.
+ */
+int mm_metrics_flush(void) {
+    static const char temporary_path[] = MM_METRICS_PATH ".tmp";
+    int status = -1;
+    FILE *f;
+
+    pthread_mutex_lock(&metrics_flush_lock);
+
+    if (mkdir(MM_METRICS_DIRECTORY, 0755) && errno != EEXIST) {
+        MM_LOG("%smm_metrics_flush: mkdir: %s\n", strerror(errno));
+    }
+
+    else if ((f = fopen(temporary_path, "w")) == NULL) {
+        MM_LOG("%smm_metrics_flush: fopen: %s\n", strerror(errno));
+    }
+
+    else {
+        mm_metrics_write(f);
+
+        if (fclose(f)) {
+            MM_LOG("%smm_metrics_flush: fclose: %s\n", strerror(errno));
+        }
+
+        else if (rename(temporary_path, MM_METRICS_PATH)) {
+            MM_LOG("%smm_metrics_flush: rename: %s\n", strerror(errno));
+        }
+
+        else {
+            status = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_flush_lock);
+    return status;
+}
+
+void mm_metrics_write(FILE *f) {
+    unsigned i;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    for (i = 0; i < metrics_writer_count; i++) {
+        metrics_writers[i].writer(f, metrics_writers[i].context);
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* Formats a microsecond count as seconds without involving the FPU. */
+void mm_metrics_write_seconds(FILE *f, uint64_t microseconds) {
+    fprintf(f, "%"PRIu64".%06"PRIu64, microseconds / 1000000U,
+            microseconds % 1000000U);
+}
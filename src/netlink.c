@@ -22,22 +22,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define MAX_NETLINK_ADDRS 126U
-#define WWAN_INTERFACE_NAME "mhi_hwip0"
 
 static int allocate_ipv4_addrs(struct mm_netlink *);
 static int allocate_ipv6_addrs(struct mm_netlink *);
 static int allocate_wg0_resources(struct mm_netlink *);
+static int apply_wg0_route(struct mm_netlink *,
+        const struct mm_netlink_route *, bool);
 
 static void collect_nonlink_addrs(struct nl_object *, void *);
 static int ensure_interface_state(struct nl_sock *, struct rtnl_link *, bool);
+static bool is_link_up(struct nl_sock *, int);
+static void scan_route(struct nl_object *, void *);
 
 struct mm_netlink_addrs {
     struct rtnl_addr *list[MAX_NETLINK_ADDRS];
     size_t count, allocated;
 };
 
+/* What of our own routes turned up in a dump of the kernel's. */
+struct mm_netlink_route_scan {
+    const struct mm_netlink *mm_nl;
+    uint32_t table, gateway;
+    bool default_route_found;
+    uint32_t wg0_routes_found;
+};
+
 int allocate_ipv4_addrs(struct mm_netlink *mm_nl) {
     uint32_t s_addr = 0;
 
@@ -187,10 +199,11 @@ int allocate_ipv6_addrs(struct mm_netlink *mm_nl) {
     return -1;
 }
 
+/* Addresses are filled in by mm_netlink_set_wg0_routes(). */
 int allocate_wg0_resources(struct mm_netlink *mm_nl) {
     uint32_t s_addr;
 
-    s_addr = 0x01010A0A; // 10.10.1.1: wg0 gateway
+    s_addr = 0;
     if ((mm_nl->wg0_gateway_address = nl_addr_build(AF_INET,
             &s_addr, sizeof(s_addr))) == NULL) {
         perror("nl_addr_build");
@@ -199,7 +212,6 @@ int allocate_wg0_resources(struct mm_netlink *mm_nl) {
 
     nl_addr_set_prefixlen(mm_nl->wg0_gateway_address, 32);
 
-    s_addr = 0x02010A0A; // 10.10.1.2: wg0 interface address
     if ((mm_nl->wg0_self_address = nl_addr_build(AF_INET,
             &s_addr, sizeof(s_addr))) == NULL) {
         perror("nl_addr_build");
@@ -209,7 +221,6 @@ int allocate_wg0_resources(struct mm_netlink *mm_nl) {
     else {
         nl_addr_set_prefixlen(mm_nl->wg0_self_address, 32);
 
-        s_addr = 0x02020A0A; // 10.10.2.2: apt server
         if ((mm_nl->wg0_tgt_address = nl_addr_build(AF_INET,
                 &s_addr, sizeof(s_addr))) == NULL) {
             perror("nl_addr_build");
@@ -263,6 +274,30 @@ int allocate_wg0_resources(struct mm_netlink *mm_nl) {
     return -1;
 }
 
+int apply_wg0_route(struct mm_netlink *mm_nl,
+        const struct mm_netlink_route *route, bool add) {
+    int status;
+
+    nl_addr_set_prefixlen(mm_nl->wg0_tgt_address, route->prefix_length);
+    nl_addr_set_binary_addr(mm_nl->wg0_tgt_address, &route->address,
+            sizeof(route->address));
+
+    if (add && (status = rtnl_route_add(mm_nl->nl, mm_nl->wg0_tgt_route,
+            NLM_F_CREATE | NLM_F_REPLACE))) {
+        MM_LOG("%srtnl_route_add: %s\n", nl_geterror(status));
+        return status;
+    }
+
+    /* Already gone (e.g. with the link) is as good as deleted. */
+    if (!add && (status = rtnl_route_delete(mm_nl->nl, mm_nl->wg0_tgt_route,
+            0)) && status != -NLE_OBJ_NOTFOUND) {
+        MM_LOG("%srtnl_route_delete: %s\n", nl_geterror(status));
+        return status;
+    }
+
+    return 0;
+}
+
 void collect_nonlink_addrs(struct nl_object *object, void *data) {
     struct mm_netlink_addrs *addrs = (struct mm_netlink_addrs *) data;
     struct rtnl_addr *addr = (struct rtnl_addr *) object;
@@ -314,6 +349,66 @@ int ensure_interface_state(struct nl_sock *nl, struct rtnl_link *link,
     return status;
 }
 
+/* Treats a link that can't be looked up as up: it's not ours to fix. */
+bool is_link_up(struct nl_sock *nl, int ifindex) {
+    struct rtnl_link *link;
+    bool up;
+
+    if (rtnl_link_get_kernel(nl, ifindex, NULL, &link)) {
+        return true;
+    }
+
+    up = !!(rtnl_link_get_flags(link) & IFF_UP);
+    rtnl_link_put(link);
+    return up;
+}
+
+void scan_route(struct nl_object *object, void *data) {
+    struct mm_netlink_route_scan *scan = data;
+    const struct mm_netlink *mm_nl = scan->mm_nl;
+    struct rtnl_route *route = (struct rtnl_route *) object;
+    struct rtnl_nexthop *nexthop;
+    struct nl_addr *dst, *gateway;
+    uint32_t address = 0, gateway_address = 0;
+    int ifindex, prefix_length;
+    unsigned i;
+
+    if (rtnl_route_get_family(route) != AF_INET ||
+            rtnl_route_get_nnexthops(route) < 1) {
+        return;
+    }
+
+    nexthop = rtnl_route_nexthop_n(route, 0);
+    ifindex = rtnl_route_nh_get_ifindex(nexthop);
+    dst = rtnl_route_get_dst(route);
+    prefix_length = (int) nl_addr_get_prefixlen(dst);
+
+    if (nl_addr_get_len(dst) == sizeof(address)) {
+        memcpy(&address, nl_addr_get_binary_addr(dst), sizeof(address));
+    }
+
+    if ((gateway = rtnl_route_nh_get_gateway(nexthop)) != NULL &&
+            nl_addr_get_len(gateway) == sizeof(gateway_address)) {
+        memcpy(&gateway_address, nl_addr_get_binary_addr(gateway),
+                sizeof(gateway_address));
+    }
+
+    if (rtnl_route_get_table(route) == scan->table && prefix_length == 0 &&
+            ifindex == mm_nl->wwan_ifindex &&
+            gateway_address == scan->gateway) {
+        scan->default_route_found = true;
+    }
+
+    for (i = 0; ifindex == mm_nl->wg0_ifindex &&
+            rtnl_route_get_table(route) == RT_TABLE_MAIN &&
+            i < mm_nl->wg0_route_count; i++) {
+        if (mm_nl->wg0_routes[i].address == address &&
+                mm_nl->wg0_routes[i].prefix_length == prefix_length) {
+            scan->wg0_routes_found |= UINT32_C(1) << i;
+        }
+    }
+}
+
 int mm_netlink_add_v4_address(struct mm_netlink *mm_nl,
         uint32_t s_addr, int prefix_length) {
     int status;
@@ -400,6 +495,15 @@ int mm_netlink_change_v6_default_gateway(struct mm_netlink *mm_nl,
     return status;
 }
 
+/* Re-points the routes over wg0 at another peer's tunnel address. */
+int mm_netlink_change_wg0_gateway(struct mm_netlink *mm_nl,
+        uint32_t gateway_addr) {
+    nl_addr_set_binary_addr(mm_nl->wg0_gateway_address, &gateway_addr,
+            sizeof(gateway_addr));
+
+    return mm_netlink_ensure_wg0_routes_are_applied(mm_nl);
+}
+
 int mm_netlink_ensure_v4_configuration_is_applied(struct mm_netlink *mm_nl,
         uint32_t address, int prefix_length, uint32_t gateway_address) {
     struct mm_netlink_addrs addrs;
@@ -457,37 +561,46 @@ int mm_netlink_ensure_v4_configuration_is_applied(struct mm_netlink *mm_nl,
     return status;
 }
 
+/* Taking wg0 down takes its routes along with it. */
 int mm_netlink_ensure_wg0_interface_state(struct mm_netlink *mm_nl,
         bool request_up) {
+    if (!request_up) {
+        mm_nl->wg0_routes_applied = false;
+    }
+
     return ensure_interface_state(mm_nl->nl, mm_nl->wg0_link, request_up);
 }
 
 int mm_netlink_ensure_wg0_routes_are_applied(struct mm_netlink *mm_nl) {
-    uint32_t s_addr;
+    unsigned i;
     int status;
 
-    s_addr = 0x02020A0A; // 10.10.2.2/32: apt server
-    nl_addr_set_prefixlen(mm_nl->wg0_tgt_address, 32);
-    nl_addr_set_binary_addr(mm_nl->wg0_tgt_address, &s_addr, sizeof(s_addr));
-
-    if ((status = rtnl_route_add(mm_nl->nl, mm_nl->wg0_tgt_route,
-            NLM_F_CREATE | NLM_F_REPLACE))) {
-        MM_LOG("%srtnl_route_add: %s\n", nl_geterror(status));
+    for (i = 0; i < mm_nl->wg0_route_count; i++) {
+        if ((status = apply_wg0_route(mm_nl, mm_nl->wg0_routes + i, true))) {
+            return status;
+        }
     }
 
-    else {
-        s_addr = 0x00030A0A; // 10.10.3.0/24: vrf-ops network
-        nl_addr_set_prefixlen(mm_nl->wg0_tgt_address, 24);
-        nl_addr_set_binary_addr(mm_nl->wg0_tgt_address, &s_addr,
-                sizeof(s_addr));
-
-        if ((status = rtnl_route_add(mm_nl->nl, mm_nl->wg0_tgt_route,
-                NLM_F_CREATE | NLM_F_REPLACE))) {
-            MM_LOG("%srtnl_route_add: %s\n", nl_geterror(status));
-        }
+    mm_nl->wg0_routes_applied = true;
+    return 0;
+}
+
+int mm_netlink_get_wwan_statistics(struct mm_netlink *mm_nl,
+        uint64_t *rx_bytes, uint64_t *tx_bytes) {
+    struct rtnl_link *link;
+    int status;
+
+    if ((status = rtnl_link_get_kernel(mm_nl->nl, mm_nl->wwan_ifindex,
+            NULL, &link))) {
+        MM_LOG("%srtnl_link_get_kernel: %s\n", nl_geterror(status));
+        return status;
     }
 
-    return status;
+    *rx_bytes = rtnl_link_get_stat(link, RTNL_LINK_RX_BYTES);
+    *tx_bytes = rtnl_link_get_stat(link, RTNL_LINK_TX_BYTES);
+
+    rtnl_link_put(link);
+    return 0;
 }
 
 int mm_netlink_ensure_wwan_interface_state(struct mm_netlink *mm_nl,
@@ -533,9 +646,12 @@ int mm_netlink_addr_flush(struct mm_netlink *mm_nl) {
     return status;
 }
 
-int mm_netlink_initialize(struct mm_netlink *mm_nl) {
+int mm_netlink_initialize(struct mm_netlink *mm_nl, unsigned modem) {
     int status;
 
+    snprintf(mm_nl->wwan_ifname, sizeof(mm_nl->wwan_ifname),
+            MM_NETLINK_WWAN_INTERFACE_FORMAT, modem);
+
     if ((mm_nl->nl = nl_socket_alloc()) == NULL) {
         perror("nl_socket_alloc");
         return -1;
@@ -563,9 +679,9 @@ int mm_netlink_initialize(struct mm_netlink *mm_nl) {
     }
 
     if ((mm_nl->wwan_link_v4 = rtnl_link_get_by_name(mm_nl->link_cache_v4,
-            WWAN_INTERFACE_NAME)) == NULL) {
-        MM_LOG("%s%s\n", "rtnl_link_get_by_name: "
-                "No such interface: "WWAN_INTERFACE_NAME);
+            mm_nl->wwan_ifname)) == NULL) {
+        MM_LOG("%srtnl_link_get_by_name: No such interface: %s\n",
+                mm_nl->wwan_ifname);
 
         nl_cache_free(mm_nl->link_cache_v6);
         nl_cache_free(mm_nl->link_cache_v4);
@@ -574,9 +690,9 @@ int mm_netlink_initialize(struct mm_netlink *mm_nl) {
     }
 
     if ((mm_nl->wwan_link_v6 = rtnl_link_get_by_name(mm_nl->link_cache_v6,
-            WWAN_INTERFACE_NAME)) == NULL) {
-        MM_LOG("%s%s\n", "rtnl_link_get_by_name: "
-                "No such interface: "WWAN_INTERFACE_NAME);
+            mm_nl->wwan_ifname)) == NULL) {
+        MM_LOG("%srtnl_link_get_by_name: No such interface: %s\n",
+                mm_nl->wwan_ifname);
 
         rtnl_link_put(mm_nl->wwan_link_v4);
         nl_cache_free(mm_nl->link_cache_v6);
@@ -688,7 +804,7 @@ int mm_netlink_reload_link_cache(struct mm_netlink *mm_nl) {
     }
 
     if ((mm_nl->wwan_link_v4 = rtnl_link_get_by_name(mm_nl->link_cache_v4,
-            WWAN_INTERFACE_NAME)) == NULL) {
+            mm_nl->wwan_ifname)) == NULL) {
         return -1;
     }
 
@@ -701,9 +817,9 @@ int mm_netlink_reload_link_cache(struct mm_netlink *mm_nl) {
     }
 
     if ((mm_nl->wwan_link_v6 = rtnl_link_get_by_name(mm_nl->link_cache_v6,
-            WWAN_INTERFACE_NAME)) == NULL) {
-        MM_LOG("%s%s\n", "rtnl_link_get_by_name: "
-                "No such interface: "WWAN_INTERFACE_NAME);
+            mm_nl->wwan_ifname)) == NULL) {
+        MM_LOG("%srtnl_link_get_by_name: No such interface: %s\n",
+                mm_nl->wwan_ifname);
 
         return -1;
     }
@@ -731,6 +847,199 @@ int mm_netlink_reload_link_cache(struct mm_netlink *mm_nl) {
     return 0;
 }
 
+/* In multi-uplink mode, the WWAN default route lives in its own table. */
+void mm_netlink_set_v4_default_route_table(struct mm_netlink *mm_nl,
+        uint32_t table) {
+    rtnl_route_set_table(mm_nl->default_route4, table);
+}
+
+/*
+ * Compares the kernel's state against what we applied last: the WWAN link,
+ * address and default route, and (if we brought it up) wg0 and its routes.
+ * Anything that someone else took away is put back, one by one, and each
+ * is logged and counted in *restored.
+ */
+int mm_netlink_restore_drift(struct mm_netlink *mm_nl, uint32_t address,
+        int prefix_length, uint32_t gateway, unsigned *restored) {
+    struct mm_netlink_route_scan scan;
+    struct mm_netlink_addrs addrs;
+    struct nl_cache *route_cache;
+    struct nl_addr *local;
+    bool found_address;
+    int status;
+    size_t i;
+
+    *restored = 0;
+
+    if (!is_link_up(mm_nl->nl, mm_nl->wwan_ifindex)) {
+        MM_LOG("%sRestoring link state of %s\n", mm_nl->wwan_ifname);
+        (*restored)++;
+
+        if ((status = mm_netlink_reload_link_cache(mm_nl)) ||
+                (status = mm_netlink_ensure_wwan_interface_state(mm_nl,
+                true))) {
+            return status;
+        }
+    }
+
+    if ((status = mm_netlink_reload_address_cache(mm_nl))) {
+        return status;
+    }
+
+    addrs.count = addrs.allocated = 0;
+    rtnl_addr_set_family(mm_nl->addr_filter, AF_INET);
+    nl_cache_foreach_filter(mm_nl->addr_cache,
+            (struct nl_object *) (mm_nl->addr_filter), collect_nonlink_addrs,
+            &addrs);
+
+    for (i = 0, found_address = false; i < addrs.allocated; i++) {
+        local = rtnl_addr_get_local(addrs.list[i]);
+
+        if (rtnl_addr_get_prefixlen(addrs.list[i]) == prefix_length &&
+                nl_addr_get_len(local) == sizeof(address) &&
+                !memcmp(nl_addr_get_binary_addr(local), &address,
+                sizeof(address))) {
+            found_address = true;
+        }
+    }
+
+    /* The kernel drops the routes sourced from an address along with it. */
+    if (!found_address) {
+        MM_LOG("%sRestoring the address of %s\n", mm_nl->wwan_ifname);
+        (*restored)++;
+
+        if ((status = mm_netlink_add_v4_address(mm_nl, address,
+                prefix_length))) {
+            return status;
+        }
+    }
+
+    if ((status = rtnl_route_alloc_cache(mm_nl->nl, AF_INET, 0,
+            &route_cache))) {
+        MM_LOG("%srtnl_route_alloc_cache: %s\n", nl_geterror(status));
+        return status;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan.mm_nl = mm_nl;
+    scan.table = rtnl_route_get_table(mm_nl->default_route4);
+    scan.gateway = gateway;
+    nl_cache_foreach(route_cache, scan_route, &scan);
+    nl_cache_free(route_cache);
+
+    if (!scan.default_route_found) {
+        MM_LOG("%sRestoring the default route via %s\n", mm_nl->wwan_ifname);
+        (*restored)++;
+
+        if ((status = mm_netlink_change_v4_default_gateway(mm_nl, address,
+                gateway))) {
+            return status;
+        }
+    }
+
+    if (!mm_nl->wg0_routes_applied) {
+        return 0;
+    }
+
+    /* Taking wg0 down will have taken its routes with it. */
+    if (!is_link_up(mm_nl->nl, mm_nl->wg0_ifindex)) {
+        MM_LOG("%s%s\n", "Restoring link state of wg0");
+        (*restored)++;
+
+        return mm_netlink_ensure_wg0_interface_state(mm_nl, true) ||
+            mm_netlink_ensure_wg0_routes_are_applied(mm_nl)
+            ? -1
+            : 0;
+    }
+
+    for (i = 0; i < mm_nl->wg0_route_count; i++) {
+        if (!(scan.wg0_routes_found & (UINT32_C(1) << i))) {
+            MM_LOG("%s%s\n", "Restoring a route over wg0");
+            (*restored)++;
+
+            if ((status = apply_wg0_route(mm_nl, mm_nl->wg0_routes + i,
+                    true))) {
+                return status;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sets the routes to send over wg0, along with the address to source them
+ * from and the gateway (zero keeps the current one, e.g. that of whichever
+ * Wireguard peer is selected). Should routes already be in place, only the
+ * difference is applied: those no longer listed are deleted, and new ones
+ * added. A new address or gateway means replacing all of them.
+ */
+int mm_netlink_set_wg0_routes(struct mm_netlink *mm_nl, uint32_t address,
+        uint32_t gateway, const struct mm_netlink_route *routes,
+        unsigned count) {
+    struct mm_netlink_route old_routes[MM_NETLINK_MAX_WG0_ROUTES];
+    uint32_t old_address, old_gateway;
+    unsigned i, j, old_count;
+    bool replace_all;
+    int status;
+
+    if (count > MM_NETLINK_MAX_WG0_ROUTES) {
+        count = MM_NETLINK_MAX_WG0_ROUTES;
+    }
+
+    old_count = mm_nl->wg0_route_count;
+    memcpy(old_routes, mm_nl->wg0_routes, sizeof(*old_routes) * old_count);
+    memcpy(&old_address, nl_addr_get_binary_addr(mm_nl->wg0_self_address),
+            sizeof(old_address));
+    memcpy(&old_gateway, nl_addr_get_binary_addr(
+            mm_nl->wg0_gateway_address), sizeof(old_gateway));
+
+    for (i = 0, status = 0; mm_nl->wg0_routes_applied && i < old_count;
+            i++) {
+        for (j = 0; j < count; j++) {
+            if (old_routes[i].address == routes[j].address &&
+                    old_routes[i].prefix_length == routes[j].prefix_length) {
+                break;
+            }
+        }
+
+        if (j == count && (status = apply_wg0_route(mm_nl, old_routes + i,
+                false))) {
+            break;
+        }
+    }
+
+    replace_all = address != old_address ||
+        (gateway && gateway != old_gateway);
+
+    nl_addr_set_binary_addr(mm_nl->wg0_self_address, &address,
+            sizeof(address));
+
+    if (gateway) {
+        nl_addr_set_binary_addr(mm_nl->wg0_gateway_address, &gateway,
+                sizeof(gateway));
+    }
+
+    memcpy(mm_nl->wg0_routes, routes, sizeof(*routes) * count);
+    mm_nl->wg0_route_count = count;
+
+    for (i = 0; !status && mm_nl->wg0_routes_applied && i < count; i++) {
+        for (j = 0; !replace_all && j < old_count; j++) {
+            if (old_routes[j].address == routes[i].address &&
+                    old_routes[j].prefix_length == routes[i].prefix_length) {
+                break;
+            }
+        }
+
+        if ((replace_all || j == old_count) && (status =
+                apply_wg0_route(mm_nl, routes + i, true))) {
+            break;
+        }
+    }
+
+    return status;
+}
+
 void mm_netlink_shutdown(struct mm_netlink *mm_nl) {
     rtnl_route_nh_set_gateway(mm_nl->wg0_tgt_nexthop, NULL);
     rtnl_route_remove_nexthop(mm_nl->wg0_tgt_route, mm_nl->wg0_tgt_nexthop);
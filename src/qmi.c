@@ -0,0 +1,402 @@
+/*
+ * src/qmi.c: QMI request helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_capture.h"
+#include "mm_histogram.h"
+#include "mm_metrics.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_time.h"
+
+#include <QmiService.h>
+#include <qmerrno.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct mm_qmi_message_stats {
+    struct mm_histogram latency_us;
+    uint64_t errors;
+    uint16_t message_id;
+    uint8_t service;
+    uint8_t modem;
+};
+
+/*
+ * While a capture is active, requests are packed and responses unpacked
+ * through trampolines that record the raw message bytes. The SDK performs
+ * both steps on the thread which issued the synchronous request, so the
+ * real functions and request identity are stashed in thread-local storage.
+ */
+struct mm_qmi_inflight_request {
+    pack_func pack;
+    pack_func_no_input pack_no_input;
+    unpack_func unpack;
+    uint16_t message_id;
+    uint8_t service;
+    uint8_t client_id;
+    uint8_t modem;
+};
+
+static __thread struct mm_qmi_inflight_request inflight_request;
+
+static mm_qmi_fake_transport fake_transport;
+static void *fake_transport_context;
+
+static pthread_mutex_t qmi_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_qmi_message_stats qmi_stats[MM_QMI_MAX_TRACKED_MESSAGES];
+static unsigned qmi_stats_count;
+
+static int capture_pack(pack_qmi_t *, uint8_t *, uint16_t *, void *);
+static int capture_pack_no_input(pack_qmi_t *, uint8_t *, uint16_t *);
+static int capture_unpack(uint8_t *, uint16_t, void *);
+
+static const char *get_message_name(uint8_t, uint16_t);
+static const char *get_service_name(uint8_t);
+static void record_request(uint8_t, uint8_t, uint16_t, uint64_t, int);
+
+int capture_pack(pack_qmi_t *context, uint8_t *buf, uint16_t *length,
+        void *request) {
+    int status;
+
+    if ((status = inflight_request.pack(context, buf, length, request)) ==
+            eQCWWAN_ERR_NONE) {
+        mm_capture_record(MM_CAPTURE_RECORD_REQUEST, inflight_request.modem,
+                inflight_request.service, inflight_request.client_id,
+                inflight_request.message_id, buf, *length);
+    }
+
+    return status;
+}
+
+int capture_pack_no_input(pack_qmi_t *context, uint8_t *buf,
+        uint16_t *length) {
+    int status;
+
+    if ((status = inflight_request.pack_no_input(context, buf, length)) ==
+            eQCWWAN_ERR_NONE) {
+        mm_capture_record(MM_CAPTURE_RECORD_REQUEST, inflight_request.modem,
+                inflight_request.service, inflight_request.client_id,
+                inflight_request.message_id, buf, *length);
+    }
+
+    return status;
+}
+
+int capture_unpack(uint8_t *buf, uint16_t length, void *response) {
+    mm_capture_record(MM_CAPTURE_RECORD_RESPONSE, inflight_request.modem,
+            inflight_request.service, inflight_request.client_id,
+            inflight_request.message_id, buf, length);
+
+    return inflight_request.unpack(buf, length, response);
+}
+
+const char *get_message_name(uint8_t service, uint16_t message_id) {
+    if (service == eDMS) {
+        switch (message_id) {
+        case MM_QMI_DMS_SET_EVENT_REPORT: return "SetEventReport";
+        case MM_QMI_DMS_GET_MODEL_ID: return "GetModelID";
+        case MM_QMI_DMS_GET_OPERATING_MODE: return "GetOperatingMode";
+        case MM_QMI_DMS_SET_OPERATING_MODE: return "SetOperatingMode";
+        default: break;
+        }
+    }
+
+    else if (service == eNAS) {
+        switch (message_id) {
+        case MM_QMI_NAS_GET_NETWORK_TIME: return "GetNetworkTime";
+        default: break;
+        }
+    }
+
+    else if (service == eSWIDMS) {
+        switch (message_id) {
+        case MM_QMI_SWIDMS_GET_TEMPERATURE: return "GetTemperature";
+        default: break;
+        }
+    }
+
+    else if (service == eWDS) {
+        switch (message_id) {
+        case MM_QMI_WDS_START_NETWORK_INTERFACE: return "StartDataSession";
+        case MM_QMI_WDS_STOP_NETWORK_INTERFACE: return "StopDataSession";
+        case MM_QMI_WDS_GET_PKT_SRVC_STATUS: return "GetSessionState";
+        case MM_QMI_WDS_GET_RUNTIME_SETTINGS: return "GetRuntimeSettings";
+        case MM_QMI_WDS_GET_AUTOCONNECT_SETTING: return "GetAutoconnect";
+        case MM_QMI_WDS_SET_CLIENT_IP_FAMILY_PREF: return "SetIPFamilyPref";
+        case MM_QMI_WDS_SET_AUTOCONNECT_SETTINGS: return "SetAutoconnect";
+        default: break;
+        }
+    }
+
+    return "Unknown";
+}
+
+const char *get_service_name(uint8_t service) {
+    switch (service) {
+    case eDMS: return "dms";
+    case eNAS: return "nas";
+    case eWDS: return "wds";
+    case eSWIDMS: return "swidms";
+    default: return "unknown";
+    }
+}
+
+void record_request(uint8_t modem, uint8_t service, uint16_t message_id,
+        uint64_t elapsed_us, int status) {
+    struct mm_qmi_message_stats *stats;
+    unsigned i;
+
+    pthread_mutex_lock(&qmi_stats_lock);
+
+    for (i = 0, stats = NULL; i < qmi_stats_count; i++) {
+        if (qmi_stats[i].modem == modem && qmi_stats[i].service == service &&
+                qmi_stats[i].message_id == message_id) {
+            stats = qmi_stats + i;
+            break;
+        }
+    }
+
+    if (stats == NULL && qmi_stats_count < MM_QMI_MAX_TRACKED_MESSAGES) {
+        stats = qmi_stats + qmi_stats_count++;
+        stats->modem = modem;
+        stats->service = service;
+        stats->message_id = message_id;
+    }
+
+    if (stats != NULL) {
+        mm_histogram_record(&stats->latency_us, elapsed_us);
+
+        if (status != eQCWWAN_ERR_NONE) {
+            stats->errors++;
+        }
+    }
+
+    pthread_mutex_unlock(&qmi_stats_lock);
+}
+
+/*
+ * The native counterpart of the wrappers below: the response is decoded in
+ * place (see mm_qmi_engine.h) and its result TLV checked, so that callers
+ * only have the TLVs they are after to pick out. Requests and responses are
+ * captured as the same raw QMI messages the SDK would have handled.
+ */
+int mm_qmi_send_native_request(struct mm_qmi_client *client,
+        struct mm_qmi_request *request, struct mm_qmi_message *response,
+        int timeout_s) {
+    uint8_t *packet;
+    uint16_t length;
+    uint64_t start;
+    int status;
+
+    if (fake_transport != NULL) {
+        if ((status = fake_transport(fake_transport_context,
+                client->service_type, request->message_id, &packet,
+                &length)) != eQCWWAN_ERR_NONE) {
+            return status;
+        }
+
+        if (mm_qmi_message_parse(response, packet, length)) {
+            return eQCWWAN_ERR_GENERAL;
+        }
+
+        return mm_qmi_message_get_result(response);
+    }
+
+    start = mm_time_monotonic_us();
+
+    status = mm_qmi_engine_request(client->engine, client->service_type,
+            client->client_id, request, response, timeout_s);
+
+    record_request(client->modem, client->service_type, request->message_id,
+            mm_time_monotonic_us() - start, status);
+
+    mm_capture_record(MM_CAPTURE_RECORD_REQUEST, client->modem,
+            client->service_type, client->client_id, request->message_id,
+            request->frame + MM_QMI_QMUX_HEADER_SIZE,
+            (uint16_t) (MM_QMI_SDU_HEADER_SIZE + request->length));
+
+    if (status != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    mm_capture_record(MM_CAPTURE_RECORD_RESPONSE, client->modem,
+            client->service_type, client->client_id, request->message_id,
+            response->sdu, response->sdu_length);
+
+    return mm_qmi_message_get_result(response);
+}
+
+/*
+ * Thin wrappers around the SDK's synchronous request functions which time
+ * each round trip against the monotonic clock, keyed by modem/service/message.
+ * They also tap requests/responses for captures, and allow a fake transport
+ * (i.e., the replay tool) to stand in for the modem entirely.
+ */
+int mm_qmi_send_sync_request(struct mm_qmi_client *client,
+        uint16_t message_id, pack_func pack, const char *pack_name,
+        void *request, unpack_func unpack, const char *unpack_name,
+        void *response, int timeout_s) {
+    uint8_t *packet;
+    uint16_t length;
+    uint64_t start;
+    int status;
+
+    if (fake_transport != NULL) {
+        if ((status = fake_transport(fake_transport_context,
+                client->service_type, message_id, &packet, &length)) !=
+                eQCWWAN_ERR_NONE) {
+            return status;
+        }
+
+        return unpack(packet, length, response);
+    }
+
+    if (mm_capture_is_active()) {
+        inflight_request.pack = pack;
+        inflight_request.unpack = unpack;
+        inflight_request.message_id = message_id;
+        inflight_request.service = client->service_type;
+        inflight_request.client_id = client->client_id;
+        inflight_request.modem = client->modem;
+
+        pack = capture_pack;
+        unpack = capture_unpack;
+    }
+
+    start = mm_time_monotonic_us();
+
+    status = QmiService_SendSyncRequest(&client->service, pack, pack_name,
+            request, unpack, unpack_name, response, timeout_s);
+
+    record_request(client->modem, client->service_type, message_id,
+            mm_time_monotonic_us() - start, status);
+
+    return status;
+}
+
+int mm_qmi_send_sync_request_no_input(struct mm_qmi_client *client,
+        uint16_t message_id, pack_func_no_input pack, const char *pack_name,
+        unpack_func unpack, const char *unpack_name, void *response,
+        int timeout_s) {
+    uint8_t *packet;
+    uint16_t length;
+    uint64_t start;
+    int status;
+
+    if (fake_transport != NULL) {
+        if ((status = fake_transport(fake_transport_context,
+                client->service_type, message_id, &packet, &length)) !=
+                eQCWWAN_ERR_NONE) {
+            return status;
+        }
+
+        return unpack(packet, length, response);
+    }
+
+    if (mm_capture_is_active()) {
+        inflight_request.pack_no_input = pack;
+        inflight_request.unpack = unpack;
+        inflight_request.message_id = message_id;
+        inflight_request.service = client->service_type;
+        inflight_request.client_id = client->client_id;
+        inflight_request.modem = client->modem;
+
+        pack = capture_pack_no_input;
+        unpack = capture_unpack;
+    }
+
+    start = mm_time_monotonic_us();
+
+    status = QmiService_SendSyncRequestNoInput(&client->service, pack,
+            pack_name, unpack, unpack_name, response, timeout_s);
+
+    record_request(client->modem, client->service_type, message_id,
+            mm_time_monotonic_us() - start, status);
+
+    return status;
+}
+
+void mm_qmi_set_fake_transport(mm_qmi_fake_transport transport,
+        void *context) {
+    fake_transport = transport;
+    fake_transport_context = context;
+}
+
+void mm_qmi_write_metrics(FILE *f, void *context) {
+    static const unsigned percentiles[] = {500, 990};
+    const struct mm_qmi_message_stats *stats;
+    unsigned i, j;
+
+    pthread_mutex_lock(&qmi_stats_lock);
+
+    /* Exposition format requires that each family's samples are grouped. */
+    fprintf(f, "# HELP modem_monitor_qmi_request_seconds "
+            "QMI request round-trip latency.\n"
+            "# TYPE modem_monitor_qmi_request_seconds summary\n");
+
+    for (i = 0, stats = qmi_stats; i < qmi_stats_count; i++, stats++) {
+        for (j = 0; j < sizeof(percentiles) / sizeof(*percentiles); j++) {
+            fprintf(f, "modem_monitor_qmi_request_seconds{modem=\"%"PRIu8"\","
+                    "service=\"%s\",message=\"%s\",quantile=\"0.%u\"} ",
+                    stats->modem, get_service_name(stats->service),
+                    get_message_name(stats->service, stats->message_id),
+                    percentiles[j] / 10);
+
+            mm_metrics_write_seconds(f, mm_histogram_percentile(
+                    &stats->latency_us, percentiles[j]));
+
+            fputc('\n', f);
+        }
+
+        fprintf(f, "modem_monitor_qmi_request_seconds_sum{modem=\"%"PRIu8"\","
+                "service=\"%s\",message=\"%s\"} ", stats->modem,
+                get_service_name(stats->service),
+                get_message_name(stats->service, stats->message_id));
+
+        mm_metrics_write_seconds(f, stats->latency_us.sum);
+
+        fprintf(f, "\nmodem_monitor_qmi_request_seconds_count{"
+                "modem=\"%"PRIu8"\",service=\"%s\",message=\"%s\"} %"PRIu64"\n",
+                stats->modem, get_service_name(stats->service),
+                get_message_name(stats->service, stats->message_id),
+                stats->latency_us.count);
+    }
+
+    fprintf(f, "# HELP modem_monitor_qmi_request_max_seconds "
+            "Slowest observed QMI request round trip.\n"
+            "# TYPE modem_monitor_qmi_request_max_seconds gauge\n");
+
+    for (i = 0, stats = qmi_stats; i < qmi_stats_count; i++, stats++) {
+        fprintf(f, "modem_monitor_qmi_request_max_seconds{modem=\"%"PRIu8"\","
+                "service=\"%s\",message=\"%s\"} ", stats->modem,
+                get_service_name(stats->service),
+                get_message_name(stats->service, stats->message_id));
+
+        mm_metrics_write_seconds(f, stats->latency_us.max);
+        fputc('\n', f);
+    }
+
+    fprintf(f, "# HELP modem_monitor_qmi_request_errors_total "
+            "QMI requests which failed at the transport level.\n"
+            "# TYPE modem_monitor_qmi_request_errors_total counter\n");
+
+    for (i = 0, stats = qmi_stats; i < qmi_stats_count; i++, stats++) {
+        fprintf(f, "modem_monitor_qmi_request_errors_total{modem=\"%"PRIu8"\","
+                "service=\"%s\",message=\"%s\"} %"PRIu64"\n",
+                stats->modem, get_service_name(stats->service),
+                get_message_name(stats->service, stats->message_id),
+                stats->errors);
+    }
+
+    pthread_mutex_unlock(&qmi_stats_lock);
+}
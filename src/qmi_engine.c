@@ -0,0 +1,645 @@
+/*
+ * src/qmi_engine.c: Native QMI protocol engine
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_qmi_engine.h"
+#include "mm_time.h"
+
+#include <qmerrno.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QMUX_MARKER 0x01U
+
+/* CTL has a one byte transaction ID and flags of its own. */
+#define CTL_SDU_HEADER_SIZE 6U
+#define CTL_FLAG_RESPONSE 0x01U
+#define CTL_FLAG_INDICATION 0x02U
+
+#define SDU_FLAG_RESPONSE 0x02U
+#define SDU_FLAG_INDICATION 0x04U
+
+#define CTL_GET_CLIENT_ID 0x0022U
+#define CTL_RELEASE_CLIENT_ID 0x0023U
+#define CTL_SYNC 0x0027U
+#define CTL_TLV_CLIENT 0x01U
+
+/* Leave at least this much room at the end of the buffer for a read. */
+#define MIN_READ_SIZE 4096U
+
+struct pending_request {
+    uint16_t transaction;
+    uint16_t message_id;
+    uint8_t service;
+    uint8_t client_id;
+};
+
+static int ctl_request(struct mm_qmi_engine *, struct mm_qmi_request *,
+        struct mm_qmi_message *);
+
+static void dispatch_indication(struct mm_qmi_engine *, uint8_t, uint8_t,
+        const struct mm_qmi_message *);
+
+static uint16_t get_le16(const uint8_t *);
+static uint32_t get_le32(const uint8_t *);
+
+static int parse_sdu(struct mm_qmi_message *, const uint8_t *, size_t,
+        bool);
+
+static bool process_frames(struct mm_qmi_engine *,
+        const struct pending_request *, struct mm_qmi_message *);
+
+static void put_le16(uint8_t *, uint16_t);
+static int receive(struct mm_qmi_engine *);
+static int send_frame(struct mm_qmi_engine *, const uint8_t *, size_t,
+        uint64_t);
+
+static int wait_for_poll(int, short, uint64_t);
+
+int ctl_request(struct mm_qmi_engine *engine, struct mm_qmi_request *request,
+        struct mm_qmi_message *response) {
+    int status;
+
+    if ((status = mm_qmi_engine_request(engine, MM_QMI_SERVICE_CTL, 0,
+            request, response, MM_QMI_ENGINE_CTL_TIMEOUT_S)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    return mm_qmi_message_get_result(response);
+}
+
+void dispatch_indication(struct mm_qmi_engine *engine, uint8_t service,
+        uint8_t client_id, const struct mm_qmi_message *message) {
+    const struct mm_qmi_engine_client *client;
+    unsigned i;
+
+    for (i = 0; i < MM_QMI_ENGINE_MAX_CLIENTS; i++) {
+        client = engine->clients + i;
+
+        if (client->in_use && client->service == service &&
+                client->callback != NULL && (client->client_id ==
+                client_id || client_id == MM_QMI_BROADCAST_CLIENT_ID)) {
+            client->callback(message, client->context);
+        }
+    }
+}
+
+uint16_t get_le16(const uint8_t *buf) {
+    return (uint16_t) (buf[0] | buf[1] << 8);
+}
+
+uint32_t get_le32(const uint8_t *buf) {
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8 |
+            (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+int parse_sdu(struct mm_qmi_message *message, const uint8_t *sdu,
+        size_t length, bool ctl) {
+    size_t header_size = ctl ? CTL_SDU_HEADER_SIZE : MM_QMI_SDU_HEADER_SIZE;
+
+    if (length < header_size || length > UINT16_MAX) {
+        return -1;
+    }
+
+    message->sdu = sdu;
+    message->sdu_length = (uint16_t) length;
+    message->flags = sdu[0];
+
+    if (ctl) {
+        message->transaction = sdu[1];
+        message->message_id = get_le16(sdu + 2);
+        message->tlvs_length = get_le16(sdu + 4);
+    }
+
+    else {
+        message->transaction = get_le16(sdu + 1);
+        message->message_id = get_le16(sdu + 3);
+        message->tlvs_length = get_le16(sdu + 5);
+    }
+
+    if (message->tlvs_length > length - header_size) {
+        return -1;
+    }
+
+    message->tlvs = sdu + header_size;
+    return 0;
+}
+
+/*
+ * Works through every complete frame in the receive buffer, dispatching
+ * indications as it goes. The response to the pending request (if any) is
+ * decoded in place; nothing is moved until the next read, so it remains
+ * valid for the caller. Anything else, e.g. the late response to a request
+ * which already timed out, is dropped.
+ */
+bool process_frames(struct mm_qmi_engine *engine,
+        const struct pending_request *pending,
+        struct mm_qmi_message *response) {
+    struct mm_qmi_message message;
+    const uint8_t *frame, *marker;
+    size_t available, frame_length;
+    uint8_t service, client_id;
+    bool ctl, found;
+
+    found = false;
+
+    while ((available = engine->rx_end - engine->rx_start) >=
+            MM_QMI_QMUX_HEADER_SIZE) {
+        frame = engine->rx + engine->rx_start;
+        frame_length = 1U + get_le16(frame + 1);
+
+        if (frame[0] != QMUX_MARKER || frame_length <
+                MM_QMI_QMUX_HEADER_SIZE + CTL_SDU_HEADER_SIZE ||
+                frame_length > MM_QMI_ENGINE_BUFFER_SIZE) {
+            /* Skip to the next possible frame rather than the whole lot. */
+            MM_LOG("%s%s\n", "Skipping malformed data from the QMI device");
+            marker = memchr(frame + 1, QMUX_MARKER, available - 1U);
+
+            engine->rx_start = marker != NULL
+                ? (size_t) (marker - engine->rx)
+                : engine->rx_end;
+
+            continue;
+        }
+
+        if (frame_length > available) {
+            break;
+        }
+
+        engine->rx_start += frame_length;
+        service = frame[4];
+        client_id = frame[5];
+        ctl = service == MM_QMI_SERVICE_CTL;
+
+        if (parse_sdu(&message, frame + MM_QMI_QMUX_HEADER_SIZE,
+                frame_length - MM_QMI_QMUX_HEADER_SIZE, ctl)) {
+            MM_LOG("%sDiscarding a malformed QMI message: Service=%"PRIu8
+                    "\n", service);
+            continue;
+        }
+
+        if (message.flags & (ctl ? CTL_FLAG_INDICATION : SDU_FLAG_INDICATION)) {
+            dispatch_indication(engine, service, client_id, &message);
+        }
+
+        else if (pending != NULL && !found &&
+                (message.flags & (ctl ? CTL_FLAG_RESPONSE : SDU_FLAG_RESPONSE))
+                && service == pending->service &&
+                client_id == pending->client_id &&
+                message.transaction == pending->transaction &&
+                message.message_id == pending->message_id) {
+            *response = message;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+void put_le16(uint8_t *buf, uint16_t value) {
+    buf[0] = (uint8_t) value;
+    buf[1] = (uint8_t) (value >> 8);
+}
+
+/* Returns 1 if anything was read, 0 if there was nothing, or -1 on error. */
+int receive(struct mm_qmi_engine *engine) {
+    ssize_t length;
+
+    if (engine->rx_start == engine->rx_end) {
+        engine->rx_start = engine->rx_end = 0;
+    }
+
+    else if (MM_QMI_ENGINE_BUFFER_SIZE - engine->rx_end < MIN_READ_SIZE) {
+        memmove(engine->rx, engine->rx + engine->rx_start,
+                engine->rx_end - engine->rx_start);
+
+        engine->rx_end -= engine->rx_start;
+        engine->rx_start = 0;
+    }
+
+    if ((length = read(engine->fd, engine->rx + engine->rx_end,
+            MM_QMI_ENGINE_BUFFER_SIZE - engine->rx_end)) < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+
+        perror("read");
+        return -1;
+    }
+
+    /* The device went away (e.g. the modem reset). */
+    if (length == 0) {
+        return -1;
+    }
+
+    engine->rx_end += (size_t) length;
+    return 1;
+}
+
+int send_frame(struct mm_qmi_engine *engine, const uint8_t *frame,
+        size_t length, uint64_t deadline_us) {
+    ssize_t written;
+
+    while ((written = write(engine->fd, frame, length)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno != EAGAIN) {
+            perror("write");
+            return eQCWWAN_ERR_GENERAL;
+        }
+
+        if (wait_for_poll(engine->fd, POLLOUT, deadline_us) <= 0) {
+            return eQCWWAN_ERR_GENERAL;
+        }
+    }
+
+    /* The device takes whole messages or nothing. */
+    return (size_t) written == length
+        ? eQCWWAN_ERR_NONE
+        : eQCWWAN_ERR_GENERAL;
+}
+
+/* Returns 1 once the device is ready, 0 on timeout, or -1 on error. */
+int wait_for_poll(int fd, short events, uint64_t deadline_us) {
+    struct pollfd pfd;
+    uint64_t now_us;
+    int ready;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    while ((now_us = mm_time_monotonic_us()) < deadline_us) {
+        if ((ready = poll(&pfd, 1,
+                (int) ((deadline_us - now_us + 999U) / 1000U))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            return -1;
+        }
+
+        if (ready > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void mm_qmi_request_init(struct mm_qmi_request *request,
+        uint16_t message_id) {
+    request->message_id = message_id;
+    request->length = 0;
+    request->overflowed = false;
+}
+
+void mm_qmi_request_put(struct mm_qmi_request *request, uint8_t type,
+        const void *value, uint16_t length) {
+    uint8_t *tlv;
+
+    if (request->length + 3U + length > MM_QMI_REQUEST_MAX_TLV_SIZE) {
+        request->overflowed = true;
+        return;
+    }
+
+    tlv = request->frame + MM_QMI_QMUX_HEADER_SIZE +
+            MM_QMI_SDU_HEADER_SIZE + request->length;
+
+    tlv[0] = type;
+    put_le16(tlv + 1, length);
+    memcpy(tlv + 3, value, length);
+
+    request->length = (uint16_t) (request->length + 3U + length);
+}
+
+void mm_qmi_request_put_u8(struct mm_qmi_request *request, uint8_t type,
+        uint8_t value) {
+    mm_qmi_request_put(request, type, &value, sizeof(value));
+}
+
+void mm_qmi_request_put_u32(struct mm_qmi_request *request, uint8_t type,
+        uint32_t value) {
+    uint8_t buf[4];
+
+    put_le16(buf, (uint16_t) value);
+    put_le16(buf + 2, (uint16_t) (value >> 16));
+    mm_qmi_request_put(request, type, buf, sizeof(buf));
+}
+
+const uint8_t *mm_qmi_message_find_tlv(const struct mm_qmi_message *message,
+        uint8_t type, uint16_t *length) {
+    const uint8_t *tlv;
+    uint16_t tlv_length;
+    size_t remaining;
+
+    tlv = message->tlvs;
+    remaining = message->tlvs_length;
+
+    while (remaining >= 3U) {
+        tlv_length = get_le16(tlv + 1);
+
+        if (tlv_length > remaining - 3U) {
+            break;
+        }
+
+        if (tlv[0] == type) {
+            *length = tlv_length;
+            return tlv + 3;
+        }
+
+        tlv += 3U + tlv_length;
+        remaining -= 3U + tlv_length;
+    }
+
+    return NULL;
+}
+
+bool mm_qmi_message_get_u8(const struct mm_qmi_message *message,
+        uint8_t type, uint8_t *value) {
+    const uint8_t *tlv;
+    uint16_t length;
+
+    if ((tlv = mm_qmi_message_find_tlv(message, type, &length)) == NULL ||
+            length < 1) {
+        return false;
+    }
+
+    *value = tlv[0];
+    return true;
+}
+
+bool mm_qmi_message_get_u16(const struct mm_qmi_message *message,
+        uint8_t type, uint16_t *value) {
+    const uint8_t *tlv;
+    uint16_t length;
+
+    if ((tlv = mm_qmi_message_find_tlv(message, type, &length)) == NULL ||
+            length < 2) {
+        return false;
+    }
+
+    *value = get_le16(tlv);
+    return true;
+}
+
+bool mm_qmi_message_get_u32(const struct mm_qmi_message *message,
+        uint8_t type, uint32_t *value) {
+    const uint8_t *tlv;
+    uint16_t length;
+
+    if ((tlv = mm_qmi_message_find_tlv(message, type, &length)) == NULL ||
+            length < 4) {
+        return false;
+    }
+
+    *value = get_le32(tlv);
+    return true;
+}
+
+/* Maps the result TLV onto the same codes the SDK returns for it. */
+int mm_qmi_message_get_result(const struct mm_qmi_message *message) {
+    const uint8_t *tlv;
+    uint16_t length;
+
+    if ((tlv = mm_qmi_message_find_tlv(message, MM_QMI_TLV_RESULT,
+            &length)) == NULL || length < 4) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    if (get_le16(tlv) == 0) {
+        return eQCWWAN_ERR_NONE;
+    }
+
+    return eQCWWAN_ERR_QMI_OFFSET + get_le16(tlv + 2);
+}
+
+/* Parses a (non-CTL) QMI message, e.g. as recorded in a capture. */
+int mm_qmi_message_parse(struct mm_qmi_message *message, const uint8_t *sdu,
+        size_t length) {
+    return parse_sdu(message, sdu, length, false);
+}
+
+/*
+ * Clients left behind by an earlier run (e.g. one which crashed) are
+ * dropped by a CTL sync before anything else is done, as the SDK does.
+ */
+int mm_qmi_engine_open(struct mm_qmi_engine *engine, const char *path) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    int status;
+
+    memset(engine->clients, 0, sizeof(engine->clients));
+    engine->rx_start = engine->rx_end = 0;
+    engine->transaction = 0;
+    engine->ctl_transaction = 0;
+
+    if ((engine->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        MM_LOG("%sopen: %s: %s\n", path, strerror(errno));
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    mm_qmi_request_init(&request, CTL_SYNC);
+
+    if ((status = ctl_request(engine, &request, &response)) !=
+            eQCWWAN_ERR_NONE) {
+        MM_LOG("%sFailed to synchronize with the QMI device (%d)\n", status);
+        mm_qmi_engine_close(engine);
+    }
+
+    return status;
+}
+
+void mm_qmi_engine_close(struct mm_qmi_engine *engine) {
+    if (engine->fd >= 0) {
+        close(engine->fd);
+        engine->fd = -1;
+    }
+}
+
+int mm_qmi_engine_allocate_client(struct mm_qmi_engine *engine,
+        uint8_t service, mm_qmi_engine_indication_callback callback,
+        void *context, uint8_t *client_id) {
+    struct mm_qmi_engine_client *client;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    const uint8_t *tlv;
+    uint16_t length;
+    unsigned i;
+    int status;
+
+    for (i = 0, client = NULL; i < MM_QMI_ENGINE_MAX_CLIENTS; i++) {
+        if (!engine->clients[i].in_use) {
+            client = engine->clients + i;
+            break;
+        }
+    }
+
+    if (client == NULL) {
+        MM_LOG("%s%s\n", "No room left for another QMI client");
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    mm_qmi_request_init(&request, CTL_GET_CLIENT_ID);
+    mm_qmi_request_put_u8(&request, CTL_TLV_CLIENT, service);
+
+    if ((status = ctl_request(engine, &request, &response)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if ((tlv = mm_qmi_message_find_tlv(&response, CTL_TLV_CLIENT,
+            &length)) == NULL || length < 2 || tlv[0] != service) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    client->callback = callback;
+    client->context = context;
+    client->service = service;
+    client->client_id = tlv[1];
+    client->in_use = true;
+
+    *client_id = client->client_id;
+    return eQCWWAN_ERR_NONE;
+}
+
+int mm_qmi_engine_release_client(struct mm_qmi_engine *engine,
+        uint8_t service, uint8_t client_id) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint8_t client[2];
+    unsigned i;
+
+    for (i = 0; i < MM_QMI_ENGINE_MAX_CLIENTS; i++) {
+        if (engine->clients[i].in_use && engine->clients[i].service ==
+                service && engine->clients[i].client_id == client_id) {
+            engine->clients[i].in_use = false;
+        }
+    }
+
+    client[0] = service;
+    client[1] = client_id;
+
+    mm_qmi_request_init(&request, CTL_RELEASE_CLIENT_ID);
+    mm_qmi_request_put(&request, CTL_TLV_CLIENT, client, sizeof(client));
+    return ctl_request(engine, &request, &response);
+}
+
+/*
+ * Called by the event loop whenever the device is readable. Returns
+ * non-zero once the device has failed, so that it stops being polled.
+ */
+int mm_qmi_engine_dispatch(void *context) {
+    struct mm_qmi_engine *engine = (struct mm_qmi_engine *) context;
+    int status;
+
+    while ((status = receive(engine)) > 0) {
+        process_frames(engine, NULL, NULL);
+    }
+
+    return status < 0;
+}
+
+/*
+ * Sends a request and waits for its response (the result TLV is left to
+ * the caller). The request's headers are written in front of its TLVs, so
+ * it goes out in a single write from where it was built.
+ */
+int mm_qmi_engine_request(struct mm_qmi_engine *engine, uint8_t service,
+        uint8_t client_id, struct mm_qmi_request *request,
+        struct mm_qmi_message *response, int timeout_s) {
+    struct pending_request pending;
+    uint8_t *frame, *sdu;
+    size_t frame_length;
+    uint64_t deadline_us;
+    bool ctl;
+    int status;
+
+    if (request->overflowed) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    /* CTL's header is a byte shorter; start the frame a byte later. */
+    ctl = service == MM_QMI_SERVICE_CTL;
+    frame = request->frame + (ctl ? 1U : 0U);
+    sdu = frame + MM_QMI_QMUX_HEADER_SIZE;
+
+    frame_length = MM_QMI_QMUX_HEADER_SIZE + request->length +
+            (ctl ? CTL_SDU_HEADER_SIZE : MM_QMI_SDU_HEADER_SIZE);
+
+    frame[0] = QMUX_MARKER;
+    put_le16(frame + 1, (uint16_t) (frame_length - 1U));
+    frame[3] = 0;
+    frame[4] = service;
+    frame[5] = client_id;
+    sdu[0] = 0;
+
+    if (ctl) {
+        if (++engine->ctl_transaction == 0) {
+            engine->ctl_transaction = 1;
+        }
+
+        pending.transaction = engine->ctl_transaction;
+        sdu[1] = engine->ctl_transaction;
+        put_le16(sdu + 2, request->message_id);
+        put_le16(sdu + 4, request->length);
+    }
+
+    else {
+        if (++engine->transaction == 0) {
+            engine->transaction = 1;
+        }
+
+        pending.transaction = engine->transaction;
+        put_le16(sdu + 1, engine->transaction);
+        put_le16(sdu + 3, request->message_id);
+        put_le16(sdu + 5, request->length);
+    }
+
+    pending.message_id = request->message_id;
+    pending.service = service;
+    pending.client_id = client_id;
+
+    deadline_us = mm_time_monotonic_us() + (uint64_t) timeout_s * 1000000U;
+
+    if ((status = send_frame(engine, frame, frame_length, deadline_us)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    while (!process_frames(engine, &pending, response)) {
+        if ((status = wait_for_poll(engine->fd, POLLIN, deadline_us)) <= 0) {
+            if (status == 0) {
+                MM_LOG("%sQMI request timed out: Service=%"PRIu8", "
+                        "MessageID=0x%04"PRIx16"\n", service,
+                        request->message_id);
+            }
+
+            return eQCWWAN_ERR_GENERAL;
+        }
+
+        if (receive(engine) < 0) {
+            return eQCWWAN_ERR_GENERAL;
+        }
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
@@ -8,30 +8,90 @@
  * 'LICENSE', which is part of this source code package.
  */
 
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
 #include "mm_qmux.h"
 
+#include <qmerrno.h>
+
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
-int mm_ctl_initialize(CtlService *ctl, QmuxTransport *qmux) {
-    memset(ctl, 0, sizeof(*ctl));
-    return CtlService_InitializeEx(ctl, qmux, false, 0);
+int mm_qmux_close_client(struct mm_qmux *qmux, struct mm_qmi_client *client) {
+    if (client->native) {
+        return mm_qmi_engine_release_client(client->engine,
+                client->service_type, client->client_id);
+    }
+
+    return CtlService_ShutDownRegularService(&qmux->ctl, &client->service);
 }
 
-void mm_ctl_shutdown(CtlService *ctl) {
-    CtlService_ShutDown(ctl);
+int mm_qmux_initialize(struct mm_qmux *qmux, unsigned modem, bool native) {
+    char qmi_device_path[32];
+    int status;
+
+    snprintf(qmi_device_path, sizeof(qmi_device_path),
+            "/dev/" MM_QMUX_DEVICE_NAME_FORMAT, modem);
+
+    qmux->native = native;
+    qmux->modem = modem;
+
+    if (native) {
+        return mm_qmi_engine_open(&qmux->engine, qmi_device_path);
+    }
+
+    memset(&qmux->transport, 0, sizeof(qmux->transport));
+    memset(&qmux->ctl, 0, sizeof(qmux->ctl));
+
+    if ((status = QmuxTransport_InitializeEx2(&qmux->transport,
+            qmi_device_path, QMUX_INTERFACE_DIRECT, NULL, false, false)) !=
+            eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if ((status = CtlService_InitializeEx(&qmux->ctl, &qmux->transport,
+            false, 0)) != eQCWWAN_ERR_NONE) {
+        QmuxTransport_ShutDown(&qmux->transport);
+    }
+
+    return status;
 }
 
-int mm_qmux_transport_initialize(QmuxTransport *qmux) {
-    char qmi_device_path[15];
-    strncpy(qmi_device_path, "/dev/wwan0qmi0", sizeof(qmi_device_path));
+/* Indications are delivered to whichever callback suits the transport. */
+int mm_qmux_open_client(struct mm_qmux *qmux, struct mm_qmi_client *client,
+        uint8_t service_type, mm_qmi_sdk_indication_callback sdk_callback,
+        mm_qmi_engine_indication_callback native_callback, void *context) {
+    int status;
+
+    memset(client, 0, sizeof(*client));
+    client->service_type = service_type;
+    client->native = qmux->native;
+    client->modem = (uint8_t) qmux->modem;
+
+    if (qmux->native) {
+        client->engine = &qmux->engine;
 
-    memset(qmux, 0, sizeof(*qmux));
-    return QmuxTransport_InitializeEx2(qmux, qmi_device_path,
-                                       QMUX_INTERFACE_DIRECT,
-                                       NULL, false, false);
+        return mm_qmi_engine_allocate_client(&qmux->engine, service_type,
+                native_callback, context, &client->client_id);
+    }
+
+    if ((status = CtlService_InitializeRegularServiceEx(&qmux->ctl,
+            &client->service, service_type, sdk_callback, context, 0)) ==
+            eQCWWAN_ERR_NONE) {
+        client->client_id = client->service.clientId;
+    }
+
+    return status;
 }
 
-void mm_qmux_transport_shutdown(QmuxTransport *qmux) {
-    QmuxTransport_ShutDown(qmux);
+void mm_qmux_shutdown(struct mm_qmux *qmux) {
+    if (qmux->native) {
+        mm_qmi_engine_close(&qmux->engine);
+        return;
+    }
+
+    CtlService_ShutDown(&qmux->ctl);
+    QmuxTransport_ShutDown(&qmux->transport);
 }
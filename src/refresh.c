@@ -0,0 +1,239 @@
+/*
+ * src/refresh.c: Proactive refresh ahead of carrier session lifetimes
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_refresh.h"
+#include "mm_time.h"
+#include "mm_tsdb.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Call end reasons of sessions that we ended (or that never said why). */
+#define REFRESH_REASON_NONE 0U
+#define REFRESH_REASON_CLIENT_END 2U
+
+struct mm_refresh_state {
+    pthread_mutex_t lock;
+
+    /* Ages at which the network ended sessions: a ring, newest last. */
+    uint64_t lifetimes_ms[MM_REFRESH_SAMPLES];
+    unsigned next, count;
+
+    /* Zero until enough of the lifetimes agree. */
+    uint64_t lifetime_ms;
+};
+
+static struct mm_refresh_state refresh = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void add_lifetime(uint16_t, uint64_t);
+static uint64_t estimate_lifetime(void);
+static int visit_session_sample(const struct mm_tsdb_sample *, void *);
+
+/* Takes note of a session's age if it was the network that ended it. */
+void add_lifetime(uint16_t reason, uint64_t duration_ms) {
+    if (reason == REFRESH_REASON_NONE || reason == REFRESH_REASON_CLIENT_END ||
+            duration_ms < MM_REFRESH_MIN_LIFETIME_S * 1000ULL) {
+        return;
+    }
+
+    refresh.lifetimes_ms[refresh.next] = duration_ms;
+    refresh.next = (refresh.next + 1U) % MM_REFRESH_SAMPLES;
+
+    if (refresh.count < MM_REFRESH_SAMPLES) {
+        refresh.count++;
+    }
+
+    refresh.lifetime_ms = estimate_lifetime();
+}
+
+/*
+ * Finds the largest group of lifetimes agreeing with one another, and
+ * returns the shortest of them (or zero, should no group be big enough).
+ */
+uint64_t estimate_lifetime(void) {
+    uint64_t center_ms, tolerance_ms, shortest_ms, best_ms = 0;
+    unsigned i, j, agreeing, best = 0;
+
+    for (i = 0; i < refresh.count; i++) {
+        center_ms = refresh.lifetimes_ms[i];
+        tolerance_ms = center_ms * MM_REFRESH_TOLERANCE_PERCENT / 100U;
+        shortest_ms = center_ms;
+
+        for (j = 0, agreeing = 0; j < refresh.count; j++) {
+            if (refresh.lifetimes_ms[j] + tolerance_ms >= center_ms &&
+                    refresh.lifetimes_ms[j] <= center_ms + tolerance_ms) {
+                agreeing++;
+
+                if (refresh.lifetimes_ms[j] < shortest_ms) {
+                    shortest_ms = refresh.lifetimes_ms[j];
+                }
+            }
+        }
+
+        if (agreeing > best || (agreeing == best && shortest_ms < best_ms)) {
+            best = agreeing;
+            best_ms = shortest_ms;
+        }
+    }
+
+    return best >= MM_REFRESH_MIN_AGREEING ? best_ms : 0;
+}
+
+int visit_session_sample(const struct mm_tsdb_sample *sample, void *context) {
+    (void) context;
+
+    if (sample->series == MM_TSDB_SERIES_SESSION &&
+            sample->tag == MM_TSDB_TAG_IPV4 && sample->value > 0) {
+        add_lifetime(sample->aux, (uint64_t) sample->value);
+    }
+
+    return 0;
+}
+
+bool mm_refresh_get_lifetime(uint64_t *lifetime_ms) {
+    pthread_mutex_lock(&refresh.lock);
+    *lifetime_ms = refresh.lifetime_ms;
+    pthread_mutex_unlock(&refresh.lock);
+
+    return *lifetime_ms != 0;
+}
+
+/*
+ * Called every MM_REFRESH_SAMPLE_INTERVAL_S or so with the WWAN interface's
+ * byte counters: returns whether the session started at started_us should
+ * be refreshed now.
+ */
+bool mm_refresh_is_due(struct mm_refresh_tracker *tracker,
+        uint64_t started_us, uint64_t bytes) {
+    uint64_t now_us, elapsed_us, rate, lifetime_ms, age_ms;
+    bool had_sample, due;
+
+    /* A new session starts over (e.g. after a refresh took). */
+    if (tracker->started_us != started_us) {
+        memset(tracker, 0, sizeof(*tracker));
+        tracker->started_us = started_us;
+    }
+
+    now_us = mm_time_monotonic_us();
+    elapsed_us = now_us - tracker->last_sample_us;
+    had_sample = tracker->have_sample && elapsed_us > 0 &&
+        bytes >= tracker->last_bytes;
+
+    rate = had_sample
+        ? (bytes - tracker->last_bytes) * 1000000U / elapsed_us
+        : 0;
+
+    /* A rough moving average: each sample moves it an eighth of the way. */
+    if (had_sample) {
+        tracker->average_bytes_per_s = tracker->average_bytes_per_s
+            ? tracker->average_bytes_per_s - tracker->average_bytes_per_s / 8U +
+                rate / 8U
+            : rate;
+    }
+
+    tracker->last_bytes = bytes;
+    tracker->last_sample_us = now_us;
+    tracker->have_sample = true;
+
+    if (!mm_refresh_get_lifetime(&lifetime_ms) ||
+            lifetime_ms <= MM_REFRESH_WINDOW_S * 1000ULL || (
+            tracker->requested_us && now_us - tracker->requested_us <
+            MM_REFRESH_RETRY_S * 1000000ULL)) {
+        return false;
+    }
+
+    age_ms = (now_us - started_us) / 1000U;
+
+    if (age_ms < lifetime_ms - MM_REFRESH_WINDOW_S * 1000ULL) {
+        return false;
+    }
+
+    else if (age_ms >= lifetime_ms - MM_REFRESH_MARGIN_S * 1000ULL) {
+        MM_LOG("%sSession is %"PRIu64"s old and never went quiet; "
+                "refreshing it anyway\n", age_ms / 1000U);
+
+        due = true;
+    }
+
+    else {
+        due = had_sample && (rate < MM_REFRESH_QUIET_BYTES_PER_S ||
+                rate < tracker->average_bytes_per_s / 4U);
+    }
+
+    if (due) {
+        tracker->requested_us = now_us;
+    }
+
+    return due;
+}
+
+/* Seeds the lifetimes with those of sessions in the history store. */
+int mm_refresh_load(const char *directory) {
+    uint64_t now_ms, lifetime_ms;
+    int status;
+
+    now_ms = mm_time_realtime_ms();
+
+    pthread_mutex_lock(&refresh.lock);
+    status = mm_tsdb_query(directory, now_ms - MM_REFRESH_LOOKBACK_S *
+            1000ULL, now_ms, visit_session_sample, NULL);
+
+    lifetime_ms = refresh.lifetime_ms;
+    pthread_mutex_unlock(&refresh.lock);
+
+    if (lifetime_ms) {
+        MM_LOG("%sSessions appear to be ended by the network after %"PRIu64
+                "s; refreshing them ahead of that\n", lifetime_ms / 1000U);
+    }
+
+    return status;
+}
+
+/*
+ * Takes note of a session having ended. Should it be a replacement that the
+ * network ended about when the one it replaced was due to end, the refresh
+ * didn't take (e.g. the modem kept the same data context): this returns
+ * true, and the lifetime is counted from the replaced session's start.
+ */
+bool mm_refresh_record_session(uint16_t reason, uint64_t duration_ms,
+        uint64_t replaced_age_ms) {
+    uint64_t age_ms, tolerance_ms;
+    bool failed = false;
+
+    pthread_mutex_lock(&refresh.lock);
+    age_ms = replaced_age_ms + duration_ms;
+    tolerance_ms = refresh.lifetime_ms * MM_REFRESH_TOLERANCE_PERCENT / 100U;
+
+    if (replaced_age_ms && reason != REFRESH_REASON_NONE &&
+            reason != REFRESH_REASON_CLIENT_END && refresh.lifetime_ms &&
+            age_ms + tolerance_ms >= refresh.lifetime_ms &&
+            age_ms <= refresh.lifetime_ms + tolerance_ms) {
+        failed = true;
+        duration_ms = age_ms;
+    }
+
+    add_lifetime(reason, duration_ms);
+    pthread_mutex_unlock(&refresh.lock);
+
+    if (failed) {
+        MM_LOG("%sThe network ended a refreshed session %"PRIu64"s after "
+                "the refresh; the refresh didn't take\n", (age_ms -
+                replaced_age_ms) / 1000U);
+    }
+
+    return failed;
+}
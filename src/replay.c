@@ -0,0 +1,617 @@
+/*
+ * src/replay.c: QMI capture replay tool
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_capture.h"
+#include "mm_dms.h"
+#include "mm_histogram.h"
+#include "mm_hotplug.h"
+#include "mm_log.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_time.h"
+#include "mm_wds.h"
+
+#include <netinet/in.h>
+#include <qmerrno.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_CLIENTS 256U
+
+/*
+ * The replay tool stands in for the modem: responses in the capture are
+ * served to the daemon's own request helpers through a fake transport, and
+ * indications are fed to the daemon's own indication callbacks. This lets
+ * the decode paths and teardown decisions be exercised (and timed) against
+ * traces from the field, at original or accelerated speed.
+ *
+ * When validating, every response and indication is also decoded by both
+ * the SDK's decoders and the built-in engine's (on scratch copies of the
+ * client state), and any disagreement between the two is reported.
+ */
+struct replay_state {
+    struct mm_capture_record record;
+    bool response_armed, validate;
+
+    /*
+     * Client IDs are only unique per modem, so state is keyed by both (and
+     * reported as "wds[modem:client]").
+     */
+    struct mm_wds_session wds_sessions[MM_HOTPLUG_MAX_MODEMS]
+            [REPLAY_MAX_CLIENTS];
+    struct mm_dms_service dms_services[MM_HOTPLUG_MAX_MODEMS]
+            [REPLAY_MAX_CLIENTS];
+
+    struct mm_histogram processing_us[3];
+    uint64_t unhandled, failed, decisions, mismatches;
+};
+
+/* Everything a WDS response decodes to, for comparing decoders. */
+struct wds_decoded {
+    int status;
+    uint32_t session_id;
+    uint32_t failure_reason, verbose_type, verbose_failure_reason;
+    bool reason, verbose_reason;
+    uint32_t connection_status;
+    enum mm_wds_autoconnect_setting autoconnect;
+    enum mm_wds_autoconnect_roam_setting roam;
+
+    int v4_status, v6_status;
+    struct mm_wds_runtime_settings v4_settings, v6_settings;
+    bool v4_address, v4_gateway, v6_address, v6_gateway;
+};
+
+static struct replay_state replay;
+
+static void decode_wds_response(struct replay_state *,
+        struct mm_wds_session *, struct wds_decoded *);
+
+__attribute__(( noinline ))
+static uint64_t now_us(void);
+
+static void report_mismatch(struct replay_state *, const char *);
+static int replay_transport(void *, uint8_t, uint16_t, uint8_t **,
+        uint16_t *);
+
+static int replay_dms_response(struct replay_state *);
+static int replay_wds_response(struct replay_state *);
+static int replay_indication(struct replay_state *, uint64_t);
+static void sleep_until(uint64_t);
+static void validate_indication(struct replay_state *);
+static void validate_response(struct replay_state *);
+
+/* Each request re-serves the record, as both decoders need a look at it. */
+void decode_wds_response(struct replay_state *state,
+        struct mm_wds_session *session, struct wds_decoded *decoded) {
+    memset(decoded, 0, sizeof(*decoded));
+    state->response_armed = true;
+
+    switch (state->record.message_id) {
+    case MM_QMI_WDS_START_NETWORK_INTERFACE:
+        decoded->status = mm_wds_start_data_session(session,
+                session->profile, session->family, &decoded->failure_reason,
+                &decoded->verbose_type, &decoded->verbose_failure_reason,
+                &decoded->reason, &decoded->verbose_reason);
+
+        decoded->session_id = session->session_id;
+        break;
+
+    case MM_QMI_WDS_STOP_NETWORK_INTERFACE:
+        decoded->status = mm_wds_stop_data_session(session);
+        break;
+
+    case MM_QMI_WDS_GET_PKT_SRVC_STATUS:
+        decoded->status = mm_wds_get_session_state(session,
+                &decoded->connection_status);
+        break;
+
+    case MM_QMI_WDS_GET_AUTOCONNECT_SETTING:
+        decoded->status = mm_wds_get_autoconnect_settings(&session->wds,
+                &decoded->autoconnect, &decoded->roam);
+        break;
+
+    case MM_QMI_WDS_GET_RUNTIME_SETTINGS:
+        session->family = AF_INET;
+        decoded->v4_status = mm_wds_get_runtime_settings(session,
+                &decoded->v4_settings, &decoded->v4_address,
+                &decoded->v4_gateway);
+
+        session->family = AF_INET6;
+        state->response_armed = true;
+        decoded->v6_status = mm_wds_get_runtime_settings(session,
+                &decoded->v6_settings, &decoded->v6_address,
+                &decoded->v6_gateway);
+        break;
+
+    default:
+        break;
+    }
+
+    state->response_armed = false;
+}
+
+/* main() is cold, so it reads the clock through here rather than inline. */
+uint64_t now_us(void) {
+    return mm_time_monotonic_us();
+}
+
+void report_mismatch(struct replay_state *state, const char *what) {
+    printf("  %s[%"PRIu8":%"PRIu8"]: MISMATCH: SDK and native decoders "
+            "disagree on %s (message 0x%04"PRIx16")\n",
+            state->record.service == eDMS ? "dms" : "wds",
+            state->record.modem, state->record.client_id, what,
+            state->record.message_id);
+
+    state->mismatches++;
+}
+
+int replay_transport(void *context, uint8_t service, uint16_t message_id,
+        uint8_t **packet, uint16_t *length) {
+    struct replay_state *state = (struct replay_state *) context;
+
+    if (!state->response_armed || state->record.service != service ||
+            state->record.message_id != message_id) {
+        return eQCWWAN_ERR_GENERAL;
+    }
+
+    state->response_armed = false;
+    *packet = state->record.packet;
+    *length = state->record.length;
+    return eQCWWAN_ERR_NONE;
+}
+
+int replay_dms_response(struct replay_state *state) {
+    struct mm_dms_service *dms;
+    enum mm_dms_operation_mode mode;
+    bool hardware_controlled_mode;
+    int status;
+
+    dms = &state->dms_services[state->record.modem]
+            [state->record.client_id];
+
+    switch (state->record.message_id) {
+    case MM_QMI_DMS_GET_OPERATING_MODE:
+        if ((status = mm_dms_get_power_sync(dms, &mode,
+                &hardware_controlled_mode)) == eQCWWAN_ERR_NONE) {
+            printf("  dms[%"PRIu8":%"PRIu8"]: operating mode: %s%s\n",
+                    state->record.modem, state->record.client_id,
+                    mm_dms_get_operation_mode_string(mode),
+                    hardware_controlled_mode ? " (hardware controlled)" : "");
+        }
+
+        return status;
+
+    default:
+        state->unhandled++;
+        return eQCWWAN_ERR_NONE;
+    }
+}
+
+int replay_wds_response(struct replay_state *state) {
+    struct mm_wds_session *session;
+    struct mm_wds_runtime_settings settings;
+    enum mm_wds_autoconnect_setting autoconnect;
+    enum mm_wds_autoconnect_roam_setting roam;
+    bool address_present, gateway_present, reason, verbose_reason;
+    uint32_t failure_reason, verbose_type, verbose_failure_reason;
+    uint32_t connection_status;
+    int status;
+
+    session = &state->wds_sessions[state->record.modem]
+            [state->record.client_id];
+
+    switch (state->record.message_id) {
+    case MM_QMI_WDS_START_NETWORK_INTERFACE:
+        session->teardown_requested = false;
+        session->transient_since_us = 0;
+
+        if ((status = mm_wds_start_data_session(session, session->profile,
+                session->family, &failure_reason, &verbose_type,
+                &verbose_failure_reason, &reason, &verbose_reason)) ==
+                eQCWWAN_ERR_NONE) {
+            printf("  wds[%"PRIu8":%"PRIu8"]: session started: "
+                    "SID=0x%"PRIx32"\n", state->record.modem,
+                    state->record.client_id, session->session_id);
+        }
+
+        return status;
+
+    case MM_QMI_WDS_STOP_NETWORK_INTERFACE:
+        if ((status = mm_wds_stop_data_session(session)) ==
+                eQCWWAN_ERR_NONE) {
+            printf("  wds[%"PRIu8":%"PRIu8"]: session stopped\n",
+                    state->record.modem, state->record.client_id);
+        }
+
+        session->session_id = 0;
+        return status;
+
+    case MM_QMI_WDS_GET_PKT_SRVC_STATUS:
+        return mm_wds_get_session_state(session, &connection_status);
+
+    case MM_QMI_WDS_GET_AUTOCONNECT_SETTING:
+        return mm_wds_get_autoconnect_settings(&session->wds,
+                &autoconnect, &roam);
+
+    /*
+     * The capture does not say which IP family the client was bound to, so
+     * try IPv4 first and fall back to IPv6 by re-serving the same response.
+     */
+    case MM_QMI_WDS_GET_RUNTIME_SETTINGS:
+        session->family = AF_INET;
+
+        if ((status = mm_wds_get_runtime_settings(session, &settings,
+                &address_present, &gateway_present)) != eQCWWAN_ERR_NONE) {
+            return status;
+        }
+
+        if (!address_present) {
+            session->family = AF_INET6;
+            state->response_armed = true;
+
+            if ((status = mm_wds_get_runtime_settings(session, &settings,
+                    &address_present, &gateway_present)) !=
+                    eQCWWAN_ERR_NONE) {
+                return status;
+            }
+        }
+
+        printf("  wds[%"PRIu8":%"PRIu8"]: runtime settings: family=%s, "
+                "address=%s, gateway=%s, prefix=/%d\n",
+                state->record.modem, state->record.client_id,
+                session->family == AF_INET ? "IPv4" : "IPv6",
+                address_present ? "yes" : "no",
+                gateway_present ? "yes" : "no",
+                settings.prefix_length);
+
+        session->last_runtime_settings = settings;
+        return eQCWWAN_ERR_NONE;
+
+    default:
+        state->unhandled++;
+        return eQCWWAN_ERR_NONE;
+    }
+}
+
+int replay_indication(struct replay_state *state, uint64_t offset_us) {
+    enum mm_dms_operation_mode reported_mode;
+    struct mm_wds_session *session;
+    struct mm_dms_service *dms;
+    uint64_t transient_since_us;
+    bool teardown_requested;
+
+    switch (state->record.service) {
+    case eWDS:
+        session = &state->wds_sessions[state->record.modem]
+                [state->record.client_id];
+        teardown_requested = session->teardown_requested;
+        transient_since_us = session->transient_since_us;
+
+        mm_wds_indication_callback(state->record.packet,
+                state->record.length, session);
+
+        if (!transient_since_us && session->transient_since_us) {
+            printf("  wds[%"PRIu8":%"PRIu8"]: +%"PRIu64".%06"PRIu64"s: "
+                    "DECISION: grace window started (transient state)\n",
+                    state->record.modem, state->record.client_id,
+                    offset_us / 1000000U, offset_us % 1000000U);
+
+            state->decisions++;
+        }
+
+        if (!teardown_requested && session->teardown_requested) {
+            printf("  wds[%"PRIu8":%"PRIu8"]: +%"PRIu64".%06"PRIu64"s: "
+                    "DECISION: session teardown requested\n",
+                    state->record.modem, state->record.client_id,
+                    offset_us / 1000000U, offset_us % 1000000U);
+
+            state->decisions++;
+        }
+
+        return eQCWWAN_ERR_NONE;
+
+    case eDMS:
+        dms = &state->dms_services[state->record.modem]
+                [state->record.client_id];
+        reported_mode = dms->reported_mode;
+
+        mm_dms_indication_callback(state->record.packet,
+                state->record.length, dms);
+
+        if (reported_mode != dms->reported_mode &&
+                dms->reported_mode != MM_DMS_OPERATION_MODE_ONLINE) {
+            printf("  dms[%"PRIu8":%"PRIu8"]: +%"PRIu64".%06"PRIu64"s: "
+                    "DECISION: sessions torn down (modem is now %s)\n",
+                    state->record.modem, state->record.client_id,
+                    offset_us / 1000000U, offset_us % 1000000U,
+                    mm_dms_get_operation_mode_string(dms->reported_mode));
+
+            state->decisions++;
+        }
+
+        return eQCWWAN_ERR_NONE;
+
+    default:
+        state->unhandled++;
+        return eQCWWAN_ERR_NONE;
+    }
+}
+
+void validate_indication(struct replay_state *state) {
+    struct mm_wds_session wds_scratch[2];
+    struct mm_dms_service dms_scratch[2];
+    struct mm_qmi_message message;
+
+    if (mm_qmi_message_parse(&message, state->record.packet,
+            state->record.length)) {
+        report_mismatch(state, "framing");
+        return;
+    }
+
+    switch (state->record.service) {
+    case eWDS:
+        wds_scratch[0] = state->wds_sessions[state->record.modem]
+                [state->record.client_id];
+        wds_scratch[1] = wds_scratch[0];
+
+        mm_wds_indication_callback(state->record.packet,
+                state->record.length, wds_scratch);
+
+        mm_wds_native_indication_callback(&message, wds_scratch + 1);
+
+        if (wds_scratch[0].teardown_requested !=
+                wds_scratch[1].teardown_requested ||
+                !wds_scratch[0].transient_since_us !=
+                !wds_scratch[1].transient_since_us ||
+                wds_scratch[0].last_end_reason !=
+                wds_scratch[1].last_end_reason) {
+            report_mismatch(state, "packet service status");
+        }
+
+        break;
+
+    case eDMS:
+        dms_scratch[0] = state->dms_services[state->record.modem]
+                [state->record.client_id];
+        dms_scratch[1] = dms_scratch[0];
+
+        mm_dms_indication_callback(state->record.packet,
+                state->record.length, dms_scratch);
+
+        mm_dms_native_indication_callback(&message, dms_scratch + 1);
+
+        if (dms_scratch[0].reported_mode != dms_scratch[1].reported_mode) {
+            report_mismatch(state, "operating mode");
+        }
+
+        break;
+
+    default:
+        break;
+    }
+}
+
+void validate_response(struct replay_state *state) {
+    struct mm_wds_session wds_scratch;
+    struct mm_dms_service dms_scratch;
+    struct wds_decoded decoded[2];
+    enum mm_dms_operation_mode mode[2];
+    bool hardware_controlled_mode[2];
+    int status[2];
+    unsigned i;
+
+    switch (state->record.service) {
+    case eWDS:
+        for (i = 0; i < 2; i++) {
+            wds_scratch = state->wds_sessions[state->record.modem]
+                    [state->record.client_id];
+            wds_scratch.wds.native = i;
+            decode_wds_response(state, &wds_scratch, decoded + i);
+        }
+
+        if (memcmp(decoded, decoded + 1, sizeof(*decoded))) {
+            report_mismatch(state, "response");
+        }
+
+        break;
+
+    case eDMS:
+        if (state->record.message_id != MM_QMI_DMS_GET_OPERATING_MODE) {
+            break;
+        }
+
+        for (i = 0; i < 2; i++) {
+            dms_scratch = state->dms_services[state->record.modem]
+                    [state->record.client_id];
+            dms_scratch.dms_service.native = i;
+            mode[i] = MM_DMS_OPERATION_MODE_INVALID;
+            hardware_controlled_mode[i] = false;
+
+            state->response_armed = true;
+            status[i] = mm_dms_get_power_sync(&dms_scratch, mode + i,
+                    hardware_controlled_mode + i);
+        }
+
+        state->response_armed = false;
+
+        if (status[0] != status[1] || mode[0] != mode[1] ||
+                hardware_controlled_mode[0] != hardware_controlled_mode[1]) {
+            report_mismatch(state, "operating mode");
+        }
+
+        break;
+
+    default:
+        break;
+    }
+}
+
+void sleep_until(uint64_t deadline_us) {
+    struct timespec deadline;
+
+    deadline.tv_sec = (time_t) (deadline_us / 1000000U);
+    deadline.tv_nsec = (long) (deadline_us % 1000000U) * 1000L;
+
+    while (clock_nanosleep(CLOCK_BOOTTIME, TIMER_ABSTIME, &deadline,
+            NULL) != 0);
+}
+
+int main(int argc, char **argv) {
+    static const char *type_names[] = {"request", "response", "indication"};
+    struct mm_capture_reader reader;
+    uint64_t first_us, start_us, offset_us, elapsed_us, records;
+    unsigned long speed;
+    char *end;
+    int option, status;
+    unsigned i;
+
+    speed = 1;
+
+    while ((option = getopt(argc, argv, "s:v")) != -1) {
+        switch (option) {
+        case 's':
+            speed = strtoul(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "Invalid speed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+
+            break;
+
+        case 'v':
+            replay.validate = true;
+            break;
+
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-s speed] [-v] capture-file\n"
+                "  -s N: replay at N times the original speed "
+                "(0: as fast as possible)\n"
+                "  -v: check the native QMI decoders against the SDK's\n",
+                argv[0]);
+
+        return EXIT_FAILURE;
+    }
+
+    if (mm_capture_reader_open(&reader, argv[optind])) {
+        return EXIT_FAILURE;
+    }
+
+    mm_qmi_set_fake_transport(replay_transport, &replay);
+    first_us = 0;
+    records = 0;
+
+    start_us = now_us();
+
+    while ((status = mm_capture_reader_next(&reader, &replay.record)) > 0) {
+        if (records++ == 0) {
+            first_us = replay.record.monotonic_us;
+        }
+
+        offset_us = replay.record.monotonic_us - first_us;
+
+        if (speed) {
+            sleep_until(start_us + offset_us / speed);
+        }
+
+        elapsed_us = now_us();
+
+        /* Not from any modem the daemon could have driven. */
+        if (replay.record.modem >= MM_HOTPLUG_MAX_MODEMS) {
+            replay.unhandled++;
+            continue;
+        }
+
+        switch (replay.record.type) {
+        case MM_CAPTURE_RECORD_RESPONSE:
+            if (replay.validate) {
+                validate_response(&replay);
+            }
+
+            replay.response_armed = true;
+
+            if (replay.record.service == eDMS) {
+                status = replay_dms_response(&replay);
+            }
+
+            else if (replay.record.service == eWDS) {
+                status = replay_wds_response(&replay);
+            }
+
+            else {
+                replay.unhandled++;
+                status = eQCWWAN_ERR_NONE;
+            }
+
+            replay.response_armed = false;
+            break;
+
+        case MM_CAPTURE_RECORD_INDICATION:
+            if (replay.validate) {
+                validate_indication(&replay);
+            }
+
+            status = replay_indication(&replay, offset_us);
+            break;
+
+        default:
+            status = eQCWWAN_ERR_NONE;
+            break;
+        }
+
+        if (replay.record.type < sizeof(type_names) / sizeof(*type_names)) {
+            mm_histogram_record(replay.processing_us + replay.record.type,
+                    now_us() - elapsed_us);
+        }
+
+        if (status != eQCWWAN_ERR_NONE) {
+            replay.failed++;
+        }
+    }
+
+    mm_capture_reader_close(&reader);
+    elapsed_us = now_us() - start_us;
+
+    printf("Replayed %"PRIu64" records in %"PRIu64".%06"PRIu64"s: "
+            "%"PRIu64" failed to decode, %"PRIu64" unhandled, "
+            "%"PRIu64" teardown decisions\n", records,
+            elapsed_us / 1000000U, elapsed_us % 1000000U,
+            replay.failed, replay.unhandled, replay.decisions);
+
+    if (replay.validate) {
+        printf("  %"PRIu64" decoder mismatches\n", replay.mismatches);
+    }
+
+    for (i = 0; i < sizeof(type_names) / sizeof(*type_names); i++) {
+        const struct mm_histogram *histogram = replay.processing_us + i;
+
+        if (histogram->count) {
+            printf("  %-10s processing: n=%"PRIu64", p50=%"PRIu32"us, "
+                    "p99=%"PRIu32"us, max=%"PRIu32"us\n", type_names[i],
+                    histogram->count, mm_histogram_percentile(histogram, 500),
+                    mm_histogram_percentile(histogram, 990), histogram->max);
+        }
+    }
+
+    return status < 0 || replay.mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,17 +10,154 @@
 
 #include "mm_log.h"
 #include "mm_run_helpers.h"
+#include "mm_wireguard.h"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <qmerrno.h>
+#include <spawn.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <inttypes.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void cancel_unit_task(struct mm_task *);
+static void cancel_wireguard_setconf_task(struct mm_task *);
+static int poll_unit_task(struct mm_task *);
+static int poll_wireguard_setconf_task(struct mm_task *);
+static int start_unit_task(struct mm_task *);
+static int start_wg0_up_task(struct mm_task *);
+static int start_wireguard_refresh_task(struct mm_task *);
+static int start_wireguard_setconf_task(struct mm_task *);
+
+const struct mm_task_ops mm_unit_task_ops = {
+    start_unit_task,
+    poll_unit_task,
+    cancel_unit_task,
+};
+
+const struct mm_task_ops mm_wg0_up_task_ops = {
+    start_wg0_up_task,
+    NULL,
+    NULL,
+};
+
+const struct mm_task_ops mm_wireguard_refresh_task_ops = {
+    start_wireguard_refresh_task,
+    NULL,
+    NULL,
+};
+
+const struct mm_task_ops mm_wireguard_setconf_task_ops = {
+    start_wireguard_setconf_task,
+    poll_wireguard_setconf_task,
+    cancel_wireguard_setconf_task,
+};
+
+void cancel_unit_task(struct mm_task *task) {
+    struct mm_unit_task *unit = task->context;
+
+    mm_sdbus_cancel_call(&unit->call);
+}
+
+void cancel_wireguard_setconf_task(struct mm_task *task) {
+    struct mm_wireguard_setconf_task *setconf = task->context;
+
+    kill(setconf->child, SIGKILL);
+    mm_reap_wireguard_setconf(setconf->child, true);
+    close(setconf->pidfd);
+}
+
+int poll_unit_task(struct mm_task *task) {
+    struct mm_unit_task *unit = task->context;
+    int status;
+
+    if ((status = mm_sdbus_poll_call(unit->bus, &unit->call,
+            &task->events)) < 0) {
+        MM_LOG("%s%s %s failed\n", unit->method, unit->name);
+    }
+
+    return status;
+}
+
+int poll_wireguard_setconf_task(struct mm_task *task) {
+    struct mm_wireguard_setconf_task *setconf = task->context;
+    int status;
+
+    if ((status = mm_reap_wireguard_setconf(setconf->child, false)) ==
+            MM_TASK_IN_PROGRESS) {
+        return status;
+    }
+
+    close(setconf->pidfd);
+    return status;
+}
+
+int start_unit_task(struct mm_task *task) {
+    struct mm_unit_task *unit = task->context;
+
+    if (mm_sdbus_manage_service_async(unit->bus, unit->method, unit->name,
+            &unit->call)) {
+        MM_LOG("%s%s %s failed\n", unit->method, unit->name);
+        return -1;
+    }
+
+    task->fd = sd_bus_get_fd(unit->bus);
+    return poll_unit_task(task);
+}
+
+int start_wg0_up_task(struct mm_task *task) {
+    int status;
+
+    if ((status = mm_netlink_ensure_wg0_interface_state(task->context,
+            true)) == 0) {
+        status = mm_netlink_ensure_wg0_routes_are_applied(task->context);
+    }
+
+    return status ? -1 : 0;
+}
+
+int start_wireguard_refresh_task(struct mm_task *task) {
+    (void) task;
+
+    /* Our address just changed: don't wait on Wireguard timers. */
+    return mm_wireguard_refresh_peers() ? -1 : 0;
+}
+
+/*
+ * wg exits once it has pushed the config; its pidfd becomes readable then.
+ * Without pidfds (older kernels) the task just waits for it in place.
+ */
+int start_wireguard_setconf_task(struct mm_task *task) {
+    struct mm_wireguard_setconf_task *setconf = task->context;
+
+    if (mm_spawn_wireguard_setconf(&setconf->child)) {
+        return -1;
+    }
+
+#ifdef SYS_pidfd_open
+    setconf->pidfd = (int) syscall(SYS_pidfd_open, setconf->child, 0);
+#else
+    setconf->pidfd = -1;
+#endif
+
+    if (setconf->pidfd < 0) {
+        return mm_reap_wireguard_setconf(setconf->child, true);
+    }
+
+    task->fd = setconf->pidfd;
+    task->events = POLLIN;
+    return poll_wireguard_setconf_task(task);
+}
 
 int mm_apply_ipv4_runtime_settings(struct mm_netlink *mm_nl,
         const struct mm_wds_runtime_settings *settings, bool refresh) {
@@ -92,25 +229,26 @@ int mm_apply_ipv6_runtime_settings(struct mm_netlink *mm_nl,
     return eQCWWAN_ERR_NONE;
 }
 
-int mm_configure_autoconnect_and_roaming(CtlService *ctl) {
-    QmiService wds;
+int mm_configure_autoconnect_and_roaming(struct mm_qmux *qmux,
+        enum mm_wds_autoconnect_setting autoconnect_setting,
+        enum mm_wds_autoconnect_roam_setting autoconnect_roam_setting) {
+    struct mm_qmi_client wds;
     int status, check;
 
-    if ((status = mm_wds_initialize(&wds, ctl, NULL)) != eQCWWAN_ERR_NONE) {
+    if ((status = mm_wds_initialize(&wds, qmux, NULL)) != eQCWWAN_ERR_NONE) {
         MM_LOG("%s%s\n", "Failed to initialize the WDS service for setup");
         return status;
     }
 
     else {
         if ((status = mm_wds_set_autoconnect_settings(&wds,
-                MM_WDS_AUTOCONNECT_SETTING_DISABLED,
-                MM_WDS_AUTOCONNECT_ROAM_SETTING_HOME_ONLY)) !=
+                autoconnect_setting, autoconnect_roam_setting)) !=
                 eQCWWAN_ERR_NONE) {
             MM_LOG("%s%s\n", "Failed to set WDS autoconnect settings");
         }
     }
 
-    if ((check = mm_wds_shutdown(&wds, ctl)) != eQCWWAN_ERR_NONE) {
+    if ((check = mm_wds_shutdown(&wds, qmux)) != eQCWWAN_ERR_NONE) {
         MM_LOG("%s%s\n", "Failed to shutdown the WDS service after setup");
         status = check;
     }
@@ -120,31 +258,52 @@ int mm_configure_autoconnect_and_roaming(CtlService *ctl) {
 
 int mm_exec_wireguard_setconf(void) {
     pid_t child;
-    int status;
-
-    if ((child = fork()) == 0) {
-        execl("/usr/bin/wg", "/usr/bin/wg", "setconf", "wg0",
-                "/etc/wireguard/wireguard.conf", NULL);
-
-        perror("execl");
-        exit(255);
-    }
 
-    else if (child < 0) {
-        perror("fork");
+    if (mm_spawn_wireguard_setconf(&child)) {
         return 1;
     }
 
-    if (waitpid(child, &status, 0) < 0) {
+    return mm_reap_wireguard_setconf(child, true);
+}
+
+/*
+ * Returns 0 once wg has exited successfully, or MM_TASK_IN_PROGRESS if it
+ * has not exited yet (and the caller would rather not wait).
+ */
+int mm_reap_wireguard_setconf(pid_t child, bool wait) {
+    pid_t pid;
+    int status;
+
+    if ((pid = waitpid(child, &status, wait ? 0 : WNOHANG)) < 0) {
         perror("waitpid");
         return -1;
     }
 
-    else if (!WIFEXITED(status)) {
+    else if (pid == 0) {
+        return MM_TASK_IN_PROGRESS;
+    }
+
+    else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        MM_LOG("%swg setconf failed (status %d)\n", status);
         return -1;
     }
 
-    return WEXITSTATUS(status);
+    return 0;
+}
+
+int mm_spawn_wireguard_setconf(pid_t *child) {
+    char wg[] = "/usr/bin/wg", setconf[] = "setconf", wg0[] = "wg0";
+    char config[] = "/etc/wireguard/wireguard.conf";
+    char *argv[] = {wg, setconf, wg0, config, NULL};
+    int status;
+
+    /* posix_spawn avoids copying the page tables of a threaded daemon. */
+    if ((status = posix_spawn(child, argv[0], NULL, NULL, argv, environ))) {
+        MM_LOG("%sposix_spawn: %s: %s\n", argv[0], strerror(status));
+        return 1;
+    }
+
+    return 0;
 }
 
 int mm_start_session(struct mm_wds_session *session, unsigned profile_id,
@@ -13,6 +13,33 @@
 
 #include <sd-bus.h>
 
+#include <stdbool.h>
+#include <string.h>
+
+static int handle_call_reply(sd_bus_message *, void *, sd_bus_error *);
+
+int handle_call_reply(sd_bus_message *message, void *context,
+        sd_bus_error *unused) {
+    struct mm_sdbus_call *call = context;
+    const sd_bus_error *error;
+
+    (void) unused;
+
+    if (sd_bus_message_is_method_error(message, NULL)) {
+        error = sd_bus_message_get_error(message);
+        MM_LOG("%smm_sdbus_manage_service_async: %s\n", error->message);
+        call->status = -1;
+    }
+
+    call->slot = sd_bus_slot_unref(call->slot);
+    call->done = true;
+    return 0;
+}
+
+void mm_sdbus_cancel_call(struct mm_sdbus_call *call) {
+    call->slot = sd_bus_slot_unref(call->slot);
+}
+
 int mm_sdbus_manage_service(sd_bus *bus, const char *method,
         const char *service) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
@@ -34,3 +61,55 @@ int mm_sdbus_manage_service(sd_bus *bus, const char *method,
 
     return 0;
 }
+
+int mm_sdbus_manage_service_async(sd_bus *bus, const char *method,
+        const char *service, struct mm_sdbus_call *call) {
+    int status;
+
+    call->slot = NULL;
+    call->done = false;
+    call->status = 0;
+
+    if ((status = sd_bus_call_method_async(bus, &call->slot,
+            "org.freedesktop.systemd1",         /* service */
+            "/org/freedesktop/systemd1",        /* path */
+            "org.freedesktop.systemd1.Manager", /* interface */
+            method, handle_call_reply, call,    /* callback */
+            "ss", service, "replace")) < 0) {   /* signature */
+        MM_LOG("%smm_sdbus_manage_service_async: %s\n", strerror(-status));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Processes whatever is pending on the bus, which may complete other calls
+ * than this one. Returns 1 while the call is still outstanding (with the
+ * events to poll the bus for), or else its status.
+ */
+int mm_sdbus_poll_call(sd_bus *bus, struct mm_sdbus_call *call,
+        short *events) {
+    int status = 0;
+
+    while (!call->done && (status = sd_bus_process(bus, NULL)) > 0);
+
+    if (call->done) {
+        return call->status;
+    }
+
+    else if (status < 0) {
+        MM_LOG("%ssd_bus_process: %s\n", strerror(-status));
+        mm_sdbus_cancel_call(call);
+        return -1;
+    }
+
+    else if ((status = sd_bus_get_events(bus)) < 0) {
+        MM_LOG("%ssd_bus_get_events: %s\n", strerror(-status));
+        mm_sdbus_cancel_call(call);
+        return -1;
+    }
+
+    *events = (short) status;
+    return 1;
+}
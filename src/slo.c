@@ -0,0 +1,371 @@
+/*
+ * src/slo.c: Rolling availability and time to recover objectives
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_histogram.h"
+#include "mm_hotplug.h"
+#include "mm_metrics.h"
+#include "mm_slo.h"
+#include "mm_time.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SLO_WINDOWS 3U
+
+enum slo_metric {
+    SLO_METRIC_AVAILABILITY = 0,
+    SLO_METRIC_DROPS = 1,
+    SLO_METRIC_DROPS_PER_DAY = 2,
+    SLO_METRIC_MTTR = 3,
+    SLO_METRIC_RECOVERY = 4,
+};
+
+enum slo_state {
+    SLO_STATE_IDLE = 0,
+    SLO_STATE_UP = 1,
+    SLO_STATE_DOWN = 2,
+};
+
+struct mm_slo_slot {
+    uint64_t up_us, down_us;
+    uint64_t drops;
+    struct mm_histogram recovery_ms;
+};
+
+/* Totals are those of the slots, kept up as slots fill and expire. */
+struct mm_slo_window {
+    struct mm_slo_slot slots[MM_SLO_SLOTS];
+    uint64_t index;
+
+    uint64_t up_us, down_us;
+    uint64_t drops, recoveries, recovery_ms;
+};
+
+struct mm_slo_series {
+    enum slo_state state;
+    bool tracked;
+    uint64_t updated_us, down_since_us;
+    struct mm_slo_window windows[SLO_WINDOWS];
+};
+
+static const struct {
+    const char *name;
+    uint64_t span_s;
+} slo_windows[SLO_WINDOWS] = {
+    {"1h", 3600U},
+    {"24h", 86400U},
+    {"7d", 604800U},
+};
+
+static const char *slo_family_names[MM_SLO_FAMILIES] = {"ipv4", "ipv6"};
+
+static pthread_mutex_t slo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_slo_series slo_series[MM_HOTPLUG_MAX_MODEMS][MM_SLO_FAMILIES];
+
+static void accrue(struct mm_slo_series *, uint64_t);
+static struct mm_slo_slot *rotate(struct mm_slo_window *, uint64_t);
+static void write_metric(FILE *, const char *, enum slo_metric);
+
+/* Accounts for the time since the last update, in every window. */
+void accrue(struct mm_slo_series *series, uint64_t now_us) {
+    struct mm_slo_window *window;
+    struct mm_slo_slot *slot;
+    uint64_t span_us, slot_us, time_us, end_us;
+    unsigned i;
+
+    for (i = 0; i < SLO_WINDOWS; i++) {
+        window = series->windows + i;
+        span_us = slo_windows[i].span_s * 1000000ULL;
+        slot_us = span_us / MM_SLO_SLOTS;
+
+        /* Whatever came before the window has expired anyway. */
+        time_us = now_us - series->updated_us > span_us
+            ? now_us - span_us
+            : series->updated_us;
+
+        while (series->state != SLO_STATE_IDLE && time_us < now_us) {
+            end_us = (time_us / slot_us + 1U) * slot_us;
+            end_us = end_us < now_us ? end_us : now_us;
+            slot = rotate(window, time_us / slot_us);
+
+            if (series->state == SLO_STATE_UP) {
+                slot->up_us += end_us - time_us;
+                window->up_us += end_us - time_us;
+            }
+
+            else {
+                slot->down_us += end_us - time_us;
+                window->down_us += end_us - time_us;
+            }
+
+            time_us = end_us;
+        }
+
+        rotate(window, now_us / slot_us);
+    }
+
+    series->updated_us = now_us;
+}
+
+/* Moves the window on to the given slot, expiring those it passes over. */
+struct mm_slo_slot *rotate(struct mm_slo_window *window, uint64_t index) {
+    struct mm_slo_slot *slot;
+    uint64_t i, count;
+
+    count = index - window->index;
+    count = count < MM_SLO_SLOTS ? count : MM_SLO_SLOTS;
+
+    for (i = 1; i <= count; i++) {
+        slot = window->slots + (window->index + i) % MM_SLO_SLOTS;
+
+        window->up_us -= slot->up_us;
+        window->down_us -= slot->down_us;
+        window->drops -= slot->drops;
+        window->recoveries -= slot->recovery_ms.count;
+        window->recovery_ms -= slot->recovery_ms.sum;
+        memset(slot, 0, sizeof(*slot));
+    }
+
+    window->index = index;
+    return window->slots + index % MM_SLO_SLOTS;
+}
+
+void write_metric(FILE *f, const char *name, enum slo_metric metric) {
+    static const unsigned percentiles[] = {500, 950};
+    const struct mm_slo_window *window;
+    struct mm_histogram recovery_ms;
+    uint64_t total_us;
+    unsigned i, j, k, l;
+
+    for (i = 0; i < MM_HOTPLUG_MAX_MODEMS; i++) {
+        for (j = 0; j < MM_SLO_FAMILIES; j++) {
+            for (k = 0; k < SLO_WINDOWS; k++) {
+                window = slo_series[i][j].windows + k;
+
+                if (!slo_series[i][j].tracked ||
+                        (total_us = window->up_us + window->down_us) == 0) {
+                    continue;
+                }
+
+                switch (metric) {
+                case SLO_METRIC_AVAILABILITY:
+                    fprintf(f, "%s{modem=\"%u\",family=\"%s\",window=\"%s\"} "
+                            "%.6f\n", name, i, slo_family_names[j],
+                            slo_windows[k].name,
+                            (double) window->up_us / (double) total_us);
+                    break;
+
+                case SLO_METRIC_DROPS:
+                    fprintf(f, "%s{modem=\"%u\",family=\"%s\",window=\"%s\"} "
+                            "%"PRIu64"\n", name, i, slo_family_names[j],
+                            slo_windows[k].name, window->drops);
+                    break;
+
+                case SLO_METRIC_DROPS_PER_DAY:
+                    fprintf(f, "%s{modem=\"%u\",family=\"%s\",window=\"%s\"} "
+                            "%.3f\n", name, i, slo_family_names[j],
+                            slo_windows[k].name, (double) window->drops *
+                            (double) (UINT64_C(86400) * 1000000U) /
+                            (double) total_us);
+                    break;
+
+                case SLO_METRIC_MTTR:
+                    if (window->recoveries == 0) {
+                        break;
+                    }
+
+                    fprintf(f, "%s{modem=\"%u\",family=\"%s\",window=\"%s\"} ",
+                            name, i, slo_family_names[j], slo_windows[k].name);
+
+                    mm_metrics_write_seconds(f, window->recovery_ms * 1000U /
+                            window->recoveries);
+
+                    fputc('\n', f);
+                    break;
+
+                /* Percentiles alone need the slots: merge them on demand. */
+                case SLO_METRIC_RECOVERY:
+                    memset(&recovery_ms, 0, sizeof(recovery_ms));
+
+                    for (l = 0; l < MM_SLO_SLOTS; l++) {
+                        mm_histogram_merge(&recovery_ms,
+                                &window->slots[l].recovery_ms);
+                    }
+
+                    for (l = 0; l < sizeof(percentiles) /
+                            sizeof(*percentiles); l++) {
+                        fprintf(f, "%s{modem=\"%u\",family=\"%s\","
+                                "window=\"%s\",quantile=\"0.%u\"} ", name, i,
+                                slo_family_names[j], slo_windows[k].name,
+                                percentiles[l] / 10);
+
+                        mm_metrics_write_seconds(f, mm_histogram_percentile(
+                                &recovery_ms, percentiles[l]) * 1000ULL);
+
+                        fputc('\n', f);
+                    }
+
+                    fprintf(f, "%s_sum{modem=\"%u\",family=\"%s\","
+                            "window=\"%s\"} ", name, i, slo_family_names[j],
+                            slo_windows[k].name);
+
+                    mm_metrics_write_seconds(f, window->recovery_ms * 1000U);
+
+                    fprintf(f, "\n%s_count{modem=\"%u\",family=\"%s\","
+                            "window=\"%s\"} %"PRIu64"\n", name, i,
+                            slo_family_names[j], slo_windows[k].name,
+                            window->recoveries);
+                    break;
+
+                default:
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Marks a family's session as having gone down. An outage counts as a drop
+ * (and as downtime until the next connect); otherwise, e.g. for a suspend
+ * or the daemon exiting, the time until the next connect isn't counted.
+ */
+void mm_slo_session_down(unsigned modem, enum mm_slo_family family,
+        bool outage) {
+    struct mm_slo_series *series;
+    struct mm_slo_window *window;
+    uint64_t now_us, slot_us;
+    unsigned i;
+
+    if (modem >= MM_HOTPLUG_MAX_MODEMS) {
+        return;
+    }
+
+    pthread_mutex_lock(&slo_lock);
+
+    series = slo_series[modem] + family;
+    now_us = mm_time_monotonic_us();
+    accrue(series, now_us);
+
+    if (!outage) {
+        series->state = SLO_STATE_IDLE;
+    }
+
+    else if (series->state == SLO_STATE_UP) {
+        series->state = SLO_STATE_DOWN;
+        series->down_since_us = now_us;
+
+        for (i = 0; i < SLO_WINDOWS; i++) {
+            window = series->windows + i;
+            slot_us = slo_windows[i].span_s * 1000000ULL / MM_SLO_SLOTS;
+
+            rotate(window, now_us / slot_us)->drops++;
+            window->drops++;
+        }
+    }
+
+    pthread_mutex_unlock(&slo_lock);
+}
+
+/* Marks a family's session as up; ending an outage records its length. */
+void mm_slo_session_up(unsigned modem, enum mm_slo_family family) {
+    struct mm_slo_series *series;
+    struct mm_slo_window *window;
+    uint64_t now_us, slot_us, recovery_ms;
+    unsigned i;
+
+    if (modem >= MM_HOTPLUG_MAX_MODEMS) {
+        return;
+    }
+
+    pthread_mutex_lock(&slo_lock);
+
+    series = slo_series[modem] + family;
+    now_us = mm_time_monotonic_us();
+    accrue(series, now_us);
+
+    if (series->state == SLO_STATE_DOWN) {
+        recovery_ms = (now_us - series->down_since_us) / 1000U;
+        recovery_ms = recovery_ms < UINT32_MAX ? recovery_ms : UINT32_MAX;
+
+        for (i = 0; i < SLO_WINDOWS; i++) {
+            window = series->windows + i;
+            slot_us = slo_windows[i].span_s * 1000000ULL / MM_SLO_SLOTS;
+
+            mm_histogram_record(&rotate(window, now_us / slot_us)->recovery_ms,
+                    recovery_ms);
+
+            window->recoveries++;
+            window->recovery_ms += recovery_ms;
+        }
+    }
+
+    series->state = SLO_STATE_UP;
+    series->tracked = true;
+    pthread_mutex_unlock(&slo_lock);
+}
+
+void mm_slo_write_metrics(FILE *f, void *context) {
+    uint64_t now_us;
+    unsigned i, j;
+
+    (void) context;
+
+    pthread_mutex_lock(&slo_lock);
+    now_us = mm_time_monotonic_us();
+
+    /* Bring every window up to date (and expire what has aged out). */
+    for (i = 0; i < MM_HOTPLUG_MAX_MODEMS; i++) {
+        for (j = 0; j < MM_SLO_FAMILIES; j++) {
+            if (slo_series[i][j].tracked) {
+                accrue(&slo_series[i][j], now_us);
+            }
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_slo_availability_ratio "
+            "Share of the window each data session was up.\n"
+            "# TYPE modem_monitor_slo_availability_ratio gauge\n");
+
+    write_metric(f, "modem_monitor_slo_availability_ratio",
+            SLO_METRIC_AVAILABILITY);
+
+    fprintf(f, "# HELP modem_monitor_slo_drops "
+            "Data sessions lost within the window.\n"
+            "# TYPE modem_monitor_slo_drops gauge\n");
+
+    write_metric(f, "modem_monitor_slo_drops", SLO_METRIC_DROPS);
+
+    fprintf(f, "# HELP modem_monitor_slo_drops_per_day "
+            "Data sessions lost within the window, as a daily rate.\n"
+            "# TYPE modem_monitor_slo_drops_per_day gauge\n");
+
+    write_metric(f, "modem_monitor_slo_drops_per_day",
+            SLO_METRIC_DROPS_PER_DAY);
+
+    fprintf(f, "# HELP modem_monitor_slo_mttr_seconds "
+            "Mean time to recover from outages ending within the window.\n"
+            "# TYPE modem_monitor_slo_mttr_seconds gauge\n");
+
+    write_metric(f, "modem_monitor_slo_mttr_seconds", SLO_METRIC_MTTR);
+
+    fprintf(f, "# HELP modem_monitor_slo_recovery_seconds "
+            "Time to recover from outages ending within the window.\n"
+            "# TYPE modem_monitor_slo_recovery_seconds summary\n");
+
+    write_metric(f, "modem_monitor_slo_recovery_seconds",
+            SLO_METRIC_RECOVERY);
+
+    pthread_mutex_unlock(&slo_lock);
+}
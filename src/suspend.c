@@ -0,0 +1,326 @@
+/*
+ * src/suspend.c: System suspend/resume tracking functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_events.h"
+#include "mm_log.h"
+#include "mm_suspend.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+
+#include <fcntl.h>
+#include <sd-bus.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+struct mm_suspend_state {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+
+    /* Modems holding off a suspend until they've quiesced (a bitmask). */
+    unsigned holds;
+    bool pending;
+    uint64_t prepared_us, quiesce_deadline_us;
+
+    sd_bus *bus;
+    sd_bus_slot *slot;
+    int inhibit_fd, stop_fd, wake_fd;
+};
+
+static struct mm_suspend_state suspend = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inhibit_fd = -1,
+    .stop_fd = -1,
+    .wake_fd = -1,
+};
+
+static int handle_prepare_for_sleep(sd_bus_message *, void *, sd_bus_error *);
+static void release_inhibitor(void);
+static void *suspend_thread_main(void *);
+static int take_inhibitor(void);
+
+int handle_prepare_for_sleep(sd_bus_message *message, void *context,
+        sd_bus_error *unused) {
+    int sleeping, status;
+    uint64_t now_us;
+
+    (void) context;
+    (void) unused;
+
+    if ((status = sd_bus_message_read(message, "b", &sleeping)) < 0) {
+        MM_LOG("%smm_suspend: sd_bus_message_read: %s\n",
+                strerror(-status));
+        return 0;
+    }
+
+    now_us = mm_time_monotonic_us();
+
+    pthread_mutex_lock(&suspend.lock);
+    suspend.pending = sleeping;
+
+    if (sleeping) {
+        suspend.prepared_us = now_us;
+        suspend.quiesce_deadline_us = now_us +
+            MM_SUSPEND_QUIESCE_TIMEOUT_MS * 1000ULL;
+    }
+
+    pthread_mutex_unlock(&suspend.lock);
+
+    if (sleeping) {
+        MM_LOG("%s%s\n", "System is suspending; taking sessions down");
+        mm_events_post(MM_EVENT_SUSPEND);
+    }
+
+    else {
+        MM_LOG("%s%s\n", "System has resumed; reconnecting");
+        mm_telemetry_event("resumed suspended_ms=%"PRIu64,
+                (now_us - suspend.prepared_us) / 1000U);
+
+        mm_events_post(MM_EVENT_RESUME);
+
+        if (take_inhibitor()) {
+            MM_LOG("%s%s\n", "Failed to take the sleep inhibitor again");
+        }
+    }
+
+    return 0;
+}
+
+void release_inhibitor(void) {
+    if (suspend.inhibit_fd >= 0) {
+        close(suspend.inhibit_fd);
+        suspend.inhibit_fd = -1;
+    }
+}
+
+void *suspend_thread_main(void *context) {
+    uint64_t now_us, timeout_ms;
+    struct pollfd fds[3];
+    eventfd_t value;
+    int status;
+    bool release;
+
+    (void) context;
+
+    fds[0].fd = suspend.stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = suspend.wake_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = sd_bus_get_fd(suspend.bus);
+
+    while (true) {
+        while ((status = sd_bus_process(suspend.bus, NULL)) > 0);
+
+        if (status < 0) {
+            MM_LOG("%smm_suspend: sd_bus_process: %s\n", strerror(-status));
+            break;
+        }
+
+        /* Let the suspend go ahead once everyone has quiesced. */
+        now_us = mm_time_monotonic_us();
+        timeout_ms = UINT64_MAX;
+
+        pthread_mutex_lock(&suspend.lock);
+
+        release = suspend.pending && suspend.inhibit_fd >= 0 &&
+            (suspend.holds == 0 || now_us >= suspend.quiesce_deadline_us);
+
+        if (suspend.pending && suspend.inhibit_fd >= 0 && !release) {
+            timeout_ms = (suspend.quiesce_deadline_us - now_us + 999U) /
+                1000U;
+        }
+
+        if (release && suspend.holds) {
+            MM_LOG("%s%s\n", "Timed out taking sessions down; suspending");
+        }
+
+        pthread_mutex_unlock(&suspend.lock);
+
+        if (release) {
+            release_inhibitor();
+        }
+
+        fds[2].events = (short) sd_bus_get_events(suspend.bus);
+
+        if (poll(fds, 3, timeout_ms > INT_MAX ? -1 : (int) timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            eventfd_read(suspend.wake_fd, &value);
+        }
+    }
+
+    return NULL;
+}
+
+int take_inhibitor(void) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    int status, fd;
+
+    if (suspend.inhibit_fd >= 0) {
+        return 0;
+    }
+
+    if ((status = sd_bus_call_method(suspend.bus,
+            "org.freedesktop.login1",           /* service */
+            "/org/freedesktop/login1",          /* path */
+            "org.freedesktop.login1.Manager",   /* interface */
+            "Inhibit", &error, &reply, "ssss",  /* signature */
+            "sleep", "modem-monitor", "Taking WWAN data sessions down",
+            "delay")) < 0) {
+        MM_LOG("%smm_suspend: Inhibit: %s\n", error.message);
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return -1;
+    }
+
+    /* The descriptor belongs to the reply; keep a copy of our own. */
+    if ((status = sd_bus_message_read(reply, "h", &fd)) < 0 ||
+            (suspend.inhibit_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+        MM_LOG("%s%s\n", "mm_suspend: Failed to take the inhibitor fd");
+        sd_bus_message_unref(reply);
+        return -1;
+    }
+
+    sd_bus_message_unref(reply);
+    return 0;
+}
+
+/*
+ * A connected modem holds off any suspend until it has taken its sessions
+ * down (and lets go once it has, or once it's no longer connected).
+ */
+void mm_suspend_hold(unsigned modem, bool hold) {
+    bool wake;
+
+    pthread_mutex_lock(&suspend.lock);
+
+    if (hold) {
+        suspend.holds |= 1U << modem;
+    }
+
+    else {
+        suspend.holds &= ~(1U << modem);
+    }
+
+    wake = !hold && suspend.pending && suspend.holds == 0;
+    pthread_mutex_unlock(&suspend.lock);
+
+    if (wake && eventfd_write(suspend.wake_fd, 1)) {
+        perror("eventfd_write");
+    }
+}
+
+bool mm_suspend_is_pending(void) {
+    bool pending;
+
+    pthread_mutex_lock(&suspend.lock);
+    pending = suspend.pending;
+    pthread_mutex_unlock(&suspend.lock);
+
+    return pending;
+}
+
+int mm_suspend_start(void) {
+    int status;
+
+    if ((suspend.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    if ((suspend.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        close(suspend.stop_fd);
+        return -1;
+    }
+
+    /* The watch has a connection (and thread) of its own. */
+    if ((status = sd_bus_open_system(&suspend.bus)) < 0) {
+        MM_LOG("%smm_suspend: sd_bus_open_system: %s\n", strerror(-status));
+        close(suspend.wake_fd);
+        close(suspend.stop_fd);
+        return -1;
+    }
+
+    if ((status = sd_bus_match_signal(suspend.bus, &suspend.slot,
+            "org.freedesktop.login1",           /* service */
+            "/org/freedesktop/login1",          /* path */
+            "org.freedesktop.login1.Manager",   /* interface */
+            "PrepareForSleep",                  /* member */
+            handle_prepare_for_sleep, NULL)) < 0) {
+        MM_LOG("%smm_suspend: sd_bus_match_signal: %s\n", strerror(-status));
+        sd_bus_flush_close_unref(suspend.bus);
+        close(suspend.wake_fd);
+        close(suspend.stop_fd);
+        return -1;
+    }
+
+    /* Without the lock, sessions are simply found dead after resuming. */
+    if (take_inhibitor()) {
+        MM_LOG("%s%s\n", "mm_suspend: Continuing without a sleep inhibitor");
+    }
+
+    if ((status = pthread_create(&suspend.thread, NULL, suspend_thread_main,
+            NULL))) {
+        MM_LOG("%smm_suspend: pthread_create: %s\n", strerror(status));
+        release_inhibitor();
+        sd_bus_slot_unref(suspend.slot);
+        sd_bus_flush_close_unref(suspend.bus);
+        close(suspend.wake_fd);
+        close(suspend.stop_fd);
+        return -1;
+    }
+
+    suspend.running = true;
+    return 0;
+}
+
+void mm_suspend_stop(void) {
+    uint64_t value = 1;
+
+    if (!suspend.running) {
+        return;
+    }
+
+    if (write(suspend.stop_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+
+    pthread_join(suspend.thread, NULL);
+    suspend.running = false;
+
+    release_inhibitor();
+    sd_bus_slot_unref(suspend.slot);
+    sd_bus_flush_close_unref(suspend.bus);
+    close(suspend.wake_fd);
+    close(suspend.stop_fd);
+}
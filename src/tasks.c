@@ -0,0 +1,244 @@
+/*
+ * src/tasks.c: Dependency graph executor for connect/disconnect work
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_tasks.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+
+#include <errno.h>
+#include <poll.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static void finish_task(struct mm_task_graph *, struct mm_task *, int,
+        enum mm_task_policy *);
+
+static bool start_ready_tasks(struct mm_task_graph *, enum mm_task_policy *);
+static const char *state_name(enum mm_task_state);
+
+void finish_task(struct mm_task_graph *graph, struct mm_task *task,
+        int status, enum mm_task_policy *outcome) {
+    uint32_t bit = MM_TASK_BIT(task - graph->tasks);
+
+    if (status == MM_TASK_IN_PROGRESS) {
+        task->state = MM_TASK_RUNNING;
+        return;
+    }
+
+    task->finished_us = mm_time_monotonic_us();
+
+    if (status == 0) {
+        task->state = MM_TASK_DONE;
+        graph->done |= bit;
+        return;
+    }
+
+    MM_LOG("%s%s: %s failed (%d)\n", graph->name, task->name, status);
+    task->state = MM_TASK_FAILED;
+    graph->failed |= bit;
+
+    if (task->policy > *outcome) {
+        *outcome = task->policy;
+    }
+}
+
+/*
+ * Starts every pending task whose dependencies are done, and skips those
+ * which depend on a failure. Returns whether anything changed, as a task
+ * finishing from its start function may have readied others.
+ */
+bool start_ready_tasks(struct mm_task_graph *graph,
+        enum mm_task_policy *outcome) {
+    struct mm_task *task;
+    bool progress = false;
+    unsigned i;
+
+    for (i = 0; i < graph->count; i++) {
+        task = graph->tasks + i;
+
+        if (task->state != MM_TASK_PENDING) {
+            continue;
+        }
+
+        else if (task->dependencies & graph->failed) {
+            MM_LOG("%s%s: %s skipped\n", graph->name, task->name);
+            task->state = MM_TASK_SKIPPED;
+            graph->failed |= MM_TASK_BIT(i);
+            progress = true;
+        }
+
+        else if ((task->dependencies & graph->done) == task->dependencies) {
+            task->started_us = mm_time_monotonic_us();
+            task->fd = -1;
+            task->events = POLLIN;
+
+            finish_task(graph, task, task->ops->start(task), outcome);
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+const char *state_name(enum mm_task_state state) {
+    switch (state) {
+    case MM_TASK_DONE: return "done";
+    case MM_TASK_FAILED: return "failed";
+    case MM_TASK_SKIPPED: return "skipped";
+    case MM_TASK_RUNNING: return "running";
+    default: return "pending";
+    }
+}
+
+unsigned mm_task_graph_add(struct mm_task_graph *graph, const char *name,
+        const struct mm_task_ops *ops, void *context, uint32_t dependencies,
+        enum mm_task_policy policy, unsigned timeout_ms) {
+    struct mm_task *task;
+
+    if (graph->count == MM_TASKS_MAX) {
+        graph->overflowed = true;
+        return MM_TASKS_MAX - 1;
+    }
+
+    task = graph->tasks + graph->count;
+    memset(task, 0, sizeof(*task));
+
+    task->name = name;
+    task->ops = ops;
+    task->context = context;
+    task->dependencies = dependencies;
+    task->policy = policy;
+    task->timeout_ms = timeout_ms;
+    task->fd = -1;
+
+    return graph->count++;
+}
+
+void mm_task_graph_init(struct mm_task_graph *graph, const char *name) {
+    memset(graph, 0, sizeof(*graph));
+    graph->name = name;
+}
+
+/*
+ * Runs the graph to completion on the calling thread, returning the most
+ * severe policy of any task that failed (MM_TASK_POLICY_IGNORE if none).
+ */
+enum mm_task_policy mm_task_graph_run(struct mm_task_graph *graph) {
+    enum mm_task_policy outcome = MM_TASK_POLICY_IGNORE;
+    struct pollfd fds[MM_TASKS_MAX];
+    uint64_t started_us, now_us, deadline_us, next_deadline_us;
+    unsigned i, nfds, failed;
+    struct mm_task *task;
+    int timeout_ms;
+
+    if (graph->overflowed) {
+        MM_LOG("%s%s: too many tasks\n", graph->name);
+        return MM_TASK_POLICY_EXIT;
+    }
+
+    started_us = mm_time_monotonic_us();
+
+    for (;;) {
+        while (start_ready_tasks(graph, &outcome));
+
+        /* Poll whatever is still running, until the earliest deadline. */
+        next_deadline_us = UINT64_MAX;
+
+        for (i = 0, nfds = 0; i < graph->count; i++) {
+            task = graph->tasks + i;
+
+            if (task->state != MM_TASK_RUNNING) {
+                continue;
+            }
+
+            deadline_us = task->started_us + task->timeout_ms * 1000ULL;
+
+            if (deadline_us < next_deadline_us) {
+                next_deadline_us = deadline_us;
+            }
+
+            if (task->fd >= 0) {
+                fds[nfds].fd = task->fd;
+                fds[nfds].events = task->events;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+
+        if (next_deadline_us == UINT64_MAX) {
+            break;
+        }
+
+        now_us = mm_time_monotonic_us();
+        timeout_ms = next_deadline_us > now_us
+            ? (int) ((next_deadline_us - now_us + 999U) / 1000U)
+            : 0;
+
+        if (poll(fds, nfds, timeout_ms) < 0 && errno != EINTR) {
+            perror("poll");
+        }
+
+        now_us = mm_time_monotonic_us();
+
+        for (i = 0; i < graph->count; i++) {
+            task = graph->tasks + i;
+
+            if (task->state != MM_TASK_RUNNING) {
+                continue;
+            }
+
+            else if (now_us >= task->started_us +
+                    task->timeout_ms * 1000ULL) {
+                MM_LOG("%s%s: %s timed out after %ums\n", graph->name,
+                        task->name, task->timeout_ms);
+
+                if (task->ops->cancel) {
+                    task->ops->cancel(task);
+                }
+
+                finish_task(graph, task, -1, &outcome);
+            }
+
+            else {
+                finish_task(graph, task, task->ops->poll(task), &outcome);
+            }
+        }
+    }
+
+    /* Record how long each task took, and the graph as a whole. */
+    for (i = 0, failed = 0; i < graph->count; i++) {
+        task = graph->tasks + i;
+
+        if (task->state == MM_TASK_DONE || task->state == MM_TASK_FAILED) {
+            mm_telemetry_event("task graph=%s name=%s state=%s "
+                    "start_ms=%"PRIu64" duration_ms=%"PRIu64, graph->name,
+                    task->name, state_name(task->state),
+                    (task->started_us - started_us) / 1000U,
+                    (task->finished_us - task->started_us) / 1000U);
+        }
+
+        failed += task->state != MM_TASK_DONE;
+    }
+
+    now_us = mm_time_monotonic_us();
+    MM_LOG("%s%s: %u tasks finished in %"PRIu64"ms (%u failed/skipped)\n",
+            graph->name, graph->count, (now_us - started_us) / 1000U, failed);
+
+    mm_telemetry_event("task_graph graph=%s tasks=%u failed=%u "
+            "duration_ms=%"PRIu64, graph->name, graph->count, failed,
+            (now_us - started_us) / 1000U);
+
+    return outcome;
+}
@@ -0,0 +1,567 @@
+/*
+ * src/telemetry.c: Batched telemetry export functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_metrics.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct mm_telemetry_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running, stop_requested;
+
+    char events[MM_TELEMETRY_MAX_EVENT_BYTES];
+    size_t events_length;
+    uint64_t dropped_events;
+
+    /* Only touched by the exporter thread. */
+    uint64_t next_attempt_us;
+    unsigned backoff_s;
+    bool spool_pending;
+};
+
+static struct mm_telemetry_state telemetry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void back_off(uint64_t);
+static int build_batch(const char *, size_t, uint64_t, uint8_t **, size_t *);
+static int drain_spool(void);
+static int filter_spool_entry(const struct dirent *);
+static int read_file(const char *, uint8_t **, size_t *);
+static int send_all(int, const void *, size_t);
+static void ship_batch(const uint8_t *, size_t);
+static int spool_batch(const uint8_t *, size_t);
+static void *telemetry_thread_main(void *);
+static int upload_batch(const uint8_t *, size_t);
+
+/* Holds off further uploads, doubling the wait each time up to a cap. */
+void back_off(uint64_t now_us) {
+    telemetry.next_attempt_us = now_us + telemetry.backoff_s * 1000000ULL;
+    telemetry.backoff_s = telemetry.backoff_s * 2 > MM_TELEMETRY_MAX_BACKOFF_S
+        ? MM_TELEMETRY_MAX_BACKOFF_S
+        : telemetry.backoff_s * 2;
+}
+
+/*
+ * A batch is the pending event log followed by a snapshot of every metric
+ * in Prometheus text format, gzip-compressed as a single stream.
+ */
+int build_batch(const char *events, size_t events_length, uint64_t dropped,
+        uint8_t **batch, size_t *batch_length) {
+    char hostname[HOST_NAME_MAX + 1];
+    char *text;
+    size_t text_length;
+    z_stream stream;
+    uLong bound;
+    FILE *f;
+    int status;
+
+    if (gethostname(hostname, sizeof(hostname))) {
+        strcpy(hostname, "unknown");
+    }
+
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    if ((f = open_memstream(&text, &text_length)) == NULL) {
+        MM_LOG("%smm_telemetry: open_memstream: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# modem-monitor telemetry v1 host=%s time=%"PRIu64" "
+            "dropped_events=%"PRIu64"\n", hostname, mm_time_realtime_ms(),
+            dropped);
+
+    fwrite(events, 1, events_length, f);
+    fputs("# metrics\n", f);
+    mm_metrics_write(f);
+
+    if (fclose(f)) {
+        MM_LOG("%smm_telemetry: fclose: %s\n", strerror(errno));
+        free(text);
+        return -1;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+
+    /* windowBits of 15 + 16 selects a gzip (rather than zlib) wrapper. */
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        MM_LOG("%s%s\n", "mm_telemetry: deflateInit2 failed");
+        free(text);
+        return -1;
+    }
+
+    bound = deflateBound(&stream, (uLong) text_length);
+
+    if ((*batch = malloc(bound)) == NULL) {
+        deflateEnd(&stream);
+        free(text);
+        return -1;
+    }
+
+    stream.next_in = (Bytef *) text;
+    stream.avail_in = (uInt) text_length;
+    stream.next_out = *batch;
+    stream.avail_out = (uInt) bound;
+
+    status = deflate(&stream, Z_FINISH);
+    *batch_length = stream.total_out;
+    deflateEnd(&stream);
+    free(text);
+
+    if (status != Z_STREAM_END) {
+        MM_LOG("%smm_telemetry: deflate: %d\n", status);
+        free(*batch);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Uploads spooled batches oldest-first, stopping at the first failure. */
+int drain_spool(void) {
+    char path[PATH_MAX];
+    struct dirent **entries;
+    uint8_t *batch;
+    size_t length;
+    int count, i, status;
+
+    if ((count = scandir(MM_TELEMETRY_SPOOL_DIRECTORY, &entries,
+            filter_spool_entry, alphasort)) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    for (i = 0, status = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", MM_TELEMETRY_SPOOL_DIRECTORY,
+                entries[i]->d_name);
+
+        if (status == 0 && read_file(path, &batch, &length) == 0) {
+            if ((status = upload_batch(batch, length)) == 0) {
+                unlink(path);
+            }
+
+            free(batch);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+    return status;
+}
+
+int filter_spool_entry(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 3 && !strcmp(entry->d_name + length - 3, ".gz");
+}
+
+int read_file(const char *path, uint8_t **data, size_t *length) {
+    struct stat st;
+    ssize_t count;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (*data = malloc((size_t) st.st_size + 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    if ((count = read(fd, *data, (size_t) st.st_size)) != st.st_size) {
+        free(*data);
+        close(fd);
+        return -1;
+    }
+
+    *length = (size_t) count;
+    close(fd);
+    return 0;
+}
+
+int send_all(int fd, const void *data, size_t length) {
+    const uint8_t *buf = (const uint8_t *) data;
+    ssize_t count;
+
+    while (length) {
+        if ((count = send(fd, buf, length, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += count;
+        length -= (size_t) count;
+    }
+
+    return 0;
+}
+
+/*
+ * Tries to upload a fresh batch (and then any backlog) unless still backing
+ * off from an earlier failure; on failure or during backoff, spool it.
+ */
+void ship_batch(const uint8_t *batch, size_t length) {
+    uint64_t now_us = mm_time_monotonic_us();
+
+    if (now_us >= telemetry.next_attempt_us && upload_batch(batch,
+            length) == 0) {
+        telemetry.backoff_s = MM_TELEMETRY_MIN_BACKOFF_S;
+
+        if (telemetry.spool_pending) {
+            telemetry.spool_pending = drain_spool() != 0;
+        }
+
+        return;
+    }
+
+    if (now_us >= telemetry.next_attempt_us) {
+        back_off(now_us);
+    }
+
+    if (spool_batch(batch, length) == 0) {
+        telemetry.spool_pending = true;
+    }
+}
+
+int spool_batch(const uint8_t *batch, size_t length) {
+    char path[PATH_MAX], temporary_path[PATH_MAX + sizeof(".tmp")];
+    struct dirent **entries;
+    int count, i, fd;
+
+    if (mkdir(MM_TELEMETRY_SPOOL_DIRECTORY, 0700) && errno != EEXIST) {
+        MM_LOG("%smm_telemetry: mkdir: %s\n", strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%016"PRIx64".gz",
+            MM_TELEMETRY_SPOOL_DIRECTORY, mm_time_realtime_ms());
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+
+    if ((fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0600)) < 0) {
+        MM_LOG("%smm_telemetry: open: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, batch, length) != (ssize_t) length || fsync(fd)) {
+        MM_LOG("%smm_telemetry: write: %s\n", strerror(errno));
+        close(fd);
+        unlink(temporary_path);
+        return -1;
+    }
+
+    close(fd);
+
+    if (rename(temporary_path, path)) {
+        MM_LOG("%smm_telemetry: rename: %s\n", strerror(errno));
+        unlink(temporary_path);
+        return -1;
+    }
+
+    /* Keep the spool bounded by discarding the oldest batches. */
+    if ((count = scandir(MM_TELEMETRY_SPOOL_DIRECTORY, &entries,
+            filter_spool_entry, alphasort)) >= 0) {
+        for (i = 0; i < count; i++) {
+            if ((unsigned) (count - i) > MM_TELEMETRY_MAX_SPOOLED_BATCHES) {
+                snprintf(path, sizeof(path), "%s/%s",
+                        MM_TELEMETRY_SPOOL_DIRECTORY, entries[i]->d_name);
+
+                unlink(path);
+            }
+
+            free(entries[i]);
+        }
+
+        free(entries);
+    }
+
+    return 0;
+}
+
+void *telemetry_thread_main(void *context) {
+    char *events;
+    uint64_t now_us, next_batch_us, deadline_us, dropped;
+    struct timespec deadline;
+    uint8_t *batch;
+    size_t events_length, batch_length;
+    bool stopping;
+
+    (void) context;
+
+    if ((events = malloc(MM_TELEMETRY_MAX_EVENT_BYTES)) == NULL) {
+        return NULL;
+    }
+
+    next_batch_us = mm_time_monotonic_us() +
+            MM_TELEMETRY_BATCH_INTERVAL_S * 1000000ULL;
+
+    pthread_mutex_lock(&telemetry.lock);
+
+    for (stopping = false; !stopping; ) {
+        now_us = mm_time_monotonic_us();
+        deadline_us = next_batch_us;
+
+        if (telemetry.spool_pending &&
+                telemetry.next_attempt_us < deadline_us) {
+            deadline_us = telemetry.next_attempt_us;
+        }
+
+        /* Wait for a size or time trigger (or a request to stop). */
+        if (!telemetry.stop_requested && now_us < deadline_us &&
+                telemetry.events_length < MM_TELEMETRY_BATCH_BYTES) {
+            mm_time_cond_deadline(deadline_us, &deadline);
+            pthread_cond_timedwait(&telemetry.cond, &telemetry.lock,
+                    &deadline);
+
+            continue;
+        }
+
+        stopping = telemetry.stop_requested;
+
+        if (!stopping && now_us < next_batch_us &&
+                telemetry.events_length < MM_TELEMETRY_BATCH_BYTES) {
+            pthread_mutex_unlock(&telemetry.lock);
+            telemetry.spool_pending = drain_spool() != 0;
+
+            if (telemetry.spool_pending) {
+                back_off(mm_time_monotonic_us());
+            }
+
+            else {
+                telemetry.backoff_s = MM_TELEMETRY_MIN_BACKOFF_S;
+            }
+
+            pthread_mutex_lock(&telemetry.lock);
+            continue;
+        }
+
+        memcpy(events, telemetry.events, telemetry.events_length);
+        events_length = telemetry.events_length;
+        dropped = telemetry.dropped_events;
+        telemetry.events_length = 0;
+        telemetry.dropped_events = 0;
+        pthread_mutex_unlock(&telemetry.lock);
+
+        /* On the way out, don't hold up shutdown: just spool the batch. */
+        if (build_batch(events, events_length, dropped, &batch,
+                &batch_length) == 0) {
+            if (stopping) {
+                spool_batch(batch, batch_length);
+            }
+
+            else {
+                ship_batch(batch, batch_length);
+            }
+
+            free(batch);
+        }
+
+        next_batch_us = mm_time_monotonic_us() +
+                MM_TELEMETRY_BATCH_INTERVAL_S * 1000000ULL;
+
+        pthread_mutex_lock(&telemetry.lock);
+    }
+
+    pthread_mutex_unlock(&telemetry.lock);
+    free(events);
+    return NULL;
+}
+
+/* POSTs a batch to the collector over plain HTTP bound to the tunnel. */
+int upload_batch(const uint8_t *batch, size_t length) {
+    struct sockaddr_in address;
+    struct timeval timeout;
+    char request[512], response[64];
+    ssize_t count;
+    int fd, header_length;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(MM_TELEMETRY_COLLECTOR_PORT);
+    inet_pton(AF_INET, MM_TELEMETRY_COLLECTOR_ADDRESS, &address.sin_addr);
+
+    timeout.tv_sec = MM_TELEMETRY_IO_TIMEOUT_S;
+    timeout.tv_usec = 0;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        MM_LOG("%smm_telemetry: socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, MM_TELEMETRY_INTERFACE,
+            sizeof(MM_TELEMETRY_INTERFACE)) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+            sizeof(timeout)) ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout))) {
+        MM_LOG("%smm_telemetry: setsockopt: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+        MM_LOG("%smm_telemetry: connect: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    header_length = snprintf(request, sizeof(request),
+            "POST " MM_TELEMETRY_COLLECTOR_PATH " HTTP/1.1\r\n"
+            "Host: " MM_TELEMETRY_COLLECTOR_ADDRESS "\r\n"
+            "Content-Type: text/plain; charset=utf-8\r\n"
+            "Content-Encoding: gzip\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", length);
+
+    if (send_all(fd, request, (size_t) header_length) ||
+            send_all(fd, batch, length)) {
+        MM_LOG("%smm_telemetry: send: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Only the status line matters: anything 2xx means it was accepted. */
+    if ((count = recv(fd, response, sizeof(response) - 1, 0)) < 12) {
+        MM_LOG("%s%s\n", "mm_telemetry: No response from the collector");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    response[count] = '\0';
+
+    if (strncmp(response, "HTTP/1.", 7) || response[9] != '2') {
+        MM_LOG("%smm_telemetry: Collector rejected batch: %.12s\n",
+                response);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void mm_telemetry_event(const char *fmt, ...) {
+    size_t available;
+    va_list ap;
+    int length, prefix;
+
+    pthread_mutex_lock(&telemetry.lock);
+
+    if (!telemetry.running) {
+        pthread_mutex_unlock(&telemetry.lock);
+        return;
+    }
+
+    available = sizeof(telemetry.events) - telemetry.events_length;
+    prefix = snprintf(telemetry.events + telemetry.events_length, available,
+            "%"PRIu64" ", mm_time_realtime_ms());
+
+    va_start(ap, fmt);
+    length = prefix < 0 || (size_t) prefix >= available ? -1 : vsnprintf(
+            telemetry.events + telemetry.events_length + (size_t) prefix,
+            available - (size_t) prefix, fmt, ap);
+    va_end(ap);
+
+    /* Events which don't fit (with their newline) are dropped, counted. */
+    if (length < 0 || (size_t) (prefix + length) + 1 >= available) {
+        telemetry.dropped_events++;
+    }
+
+    else {
+        telemetry.events_length += (size_t) (prefix + length);
+        telemetry.events[telemetry.events_length++] = '\n';
+
+        if (telemetry.events_length >= MM_TELEMETRY_BATCH_BYTES) {
+            pthread_cond_signal(&telemetry.cond);
+        }
+    }
+
+    pthread_mutex_unlock(&telemetry.lock);
+}
+
+int mm_telemetry_start(void) {
+    pthread_condattr_t attr;
+    struct stat st;
+    int status;
+
+    /* The exporter paces itself off the monotonic clock. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&telemetry.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    telemetry.events_length = 0;
+    telemetry.dropped_events = 0;
+    telemetry.stop_requested = false;
+    telemetry.next_attempt_us = 0;
+    telemetry.backoff_s = MM_TELEMETRY_MIN_BACKOFF_S;
+    telemetry.spool_pending = !stat(MM_TELEMETRY_SPOOL_DIRECTORY, &st);
+    telemetry.running = true;
+
+    if ((status = pthread_create(&telemetry.thread, NULL,
+            telemetry_thread_main, NULL))) {
+        MM_LOG("%smm_telemetry: pthread_create: %s\n", strerror(status));
+        telemetry.running = false;
+        pthread_cond_destroy(&telemetry.cond);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mm_telemetry_stop(void) {
+    pthread_mutex_lock(&telemetry.lock);
+
+    if (!telemetry.running) {
+        pthread_mutex_unlock(&telemetry.lock);
+        return;
+    }
+
+    telemetry.stop_requested = true;
+    pthread_cond_signal(&telemetry.cond);
+    pthread_mutex_unlock(&telemetry.lock);
+
+    pthread_join(telemetry.thread, NULL);
+
+    pthread_mutex_lock(&telemetry.lock);
+    telemetry.running = false;
+    pthread_mutex_unlock(&telemetry.lock);
+
+    pthread_cond_destroy(&telemetry.cond);
+}
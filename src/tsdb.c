@@ -0,0 +1,540 @@
+/*
+ * src/tsdb.c: Append-only on-disk time-series store
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_log.h"
+#include "mm_time.h"
+#include "mm_tsdb.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS_PER_PAGE (MM_TSDB_PAGE_SIZE / sizeof(struct mm_tsdb_record))
+
+struct mm_tsdb_writer {
+    char directory[PATH_MAX];
+    struct mm_tsdb_record *map;
+    uint64_t base_ms;
+    uint32_t next_slot;
+    uint32_t last_delta_ms;
+    uint32_t sequence;
+    uint32_t oldest_sequence;
+    unsigned segments;
+
+    struct mm_tsdb_record staging[SLOTS_PER_PAGE];
+    uint64_t staged_since_us;
+    unsigned staged;
+};
+
+struct mm_tsdb_segment_list {
+    uint32_t *sequences;
+    size_t count, allocated;
+};
+
+static pthread_mutex_t tsdb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_tsdb_writer tsdb;
+
+static int compare_sequences(const void *, const void *);
+static int create_segment(uint64_t);
+
+__attribute__(( pure ))
+static uint32_t find_end_of_segment(const struct mm_tsdb_record *, uint32_t);
+
+static int get_segment_path(char *, size_t, const char *, uint32_t);
+static int list_segments(const char *, struct mm_tsdb_segment_list *);
+static struct mm_tsdb_record *map_segment(const char *, int, uint32_t *);
+static int query_segment(const struct mm_tsdb_record *, uint32_t, uint64_t,
+        uint64_t, mm_tsdb_visitor, void *);
+
+static void write_out_staging(bool);
+
+int compare_sequences(const void *a, const void *b) {
+    uint32_t lhs = *(const uint32_t *) a, rhs = *(const uint32_t *) b;
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* Creates, maps and stamps a new segment following the current one. */
+int create_segment(uint64_t base_ms) {
+    char path[PATH_MAX];
+    struct mm_tsdb_header *header;
+    uint32_t slots;
+
+    if (tsdb.map != NULL) {
+        munmap(tsdb.map, MM_TSDB_SEGMENT_SIZE);
+        tsdb.map = NULL;
+        tsdb.sequence++;
+    }
+
+    if (get_segment_path(path, sizeof(path), tsdb.directory, tsdb.sequence) ||
+            (tsdb.map = map_segment(path, O_RDWR | O_CREAT | O_EXCL,
+            &slots)) == NULL) {
+        return -1;
+    }
+
+    header = (struct mm_tsdb_header *) tsdb.map;
+    header->magic = MM_TSDB_MAGIC;
+    header->version = MM_TSDB_VERSION;
+    header->record_size = sizeof(struct mm_tsdb_record);
+    header->base_ms = base_ms;
+
+    tsdb.base_ms = base_ms;
+    tsdb.next_slot = 1;
+    tsdb.last_delta_ms = 0;
+    tsdb.segments++;
+
+    /* Retire the oldest segments to keep the store within its bound. */
+    while (tsdb.segments > MM_TSDB_MAX_SEGMENTS &&
+            tsdb.oldest_sequence < tsdb.sequence) {
+        if (get_segment_path(path, sizeof(path), tsdb.directory,
+                tsdb.oldest_sequence++)) {
+            break;
+        }
+
+        if (unlink(path) == 0) {
+            tsdb.segments--;
+        }
+
+        else if (errno != ENOENT) {
+            MM_LOG("%smm_tsdb: unlink: %s: %s\n", path, strerror(errno));
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Written records form a prefix of the segment; find where it ends. */
+uint32_t find_end_of_segment(const struct mm_tsdb_record *records,
+        uint32_t slots) {
+    uint32_t low = 1, high = slots;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (records[middle].series != MM_TSDB_SERIES_NONE) {
+            low = middle + 1;
+        }
+
+        else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/* Fails rather than hand back a truncated path for an overlong directory. */
+int get_segment_path(char *path, size_t size, const char *directory,
+        uint32_t sequence) {
+    int length = snprintf(path, size, "%s/%08"PRIx32".seg", directory,
+            sequence);
+
+    if (length < 0 || (size_t) length >= size) {
+        MM_LOG("%smm_tsdb: %s: path too long\n", directory);
+        return -1;
+    }
+
+    return 0;
+}
+
+int list_segments(const char *directory, struct mm_tsdb_segment_list *list) {
+    struct dirent *entry;
+    uint32_t sequence;
+    DIR *dir;
+    int length;
+
+    list->sequences = NULL;
+    list->count = list->allocated = 0;
+
+    if ((dir = opendir(directory)) == NULL) {
+        MM_LOG("%smm_tsdb: opendir: %s: %s\n", directory, strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "%8"SCNx32".seg%n", &sequence,
+                &length) != 1 || entry->d_name[length] != '\0') {
+            continue;
+        }
+
+        if (list->count == list->allocated) {
+            size_t allocated = list->allocated ? list->allocated * 2 : 64;
+            uint32_t *sequences;
+
+            if ((sequences = realloc(list->sequences,
+                    allocated * sizeof(*sequences))) == NULL) {
+                free(list->sequences);
+                closedir(dir);
+                return -1;
+            }
+
+            list->sequences = sequences;
+            list->allocated = allocated;
+        }
+
+        list->sequences[list->count++] = sequence;
+    }
+
+    closedir(dir);
+
+    if (list->count) {
+        qsort(list->sequences, list->count, sizeof(*list->sequences),
+                compare_sequences);
+    }
+
+    return 0;
+}
+
+/*
+ * Maps a segment read-only for queries, read-write to resume appending, or
+ * creates it. Segments are always mapped at their full, fixed size.
+ */
+struct mm_tsdb_record *map_segment(const char *path, int flags,
+        uint32_t *slots) {
+    const struct mm_tsdb_header *header;
+    struct mm_tsdb_record *map;
+    struct stat st;
+    bool writable;
+    int fd;
+
+    writable = (flags & O_ACCMODE) != O_RDONLY;
+
+    if ((fd = open(path, flags | O_CLOEXEC, 0644)) < 0) {
+        MM_LOG("%smm_tsdb: open: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if ((flags & O_CREAT) && ftruncate(fd, MM_TSDB_SEGMENT_SIZE)) {
+        MM_LOG("%smm_tsdb: ftruncate: %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || st.st_size != (off_t) MM_TSDB_SEGMENT_SIZE) {
+        MM_LOG("%smm_tsdb: %s: %s\n", path, "Segment has an invalid size");
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, MM_TSDB_SEGMENT_SIZE,
+            writable ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        MM_LOG("%smm_tsdb: mmap: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    header = (const struct mm_tsdb_header *) map;
+    *slots = MM_TSDB_SEGMENT_SIZE / (uint32_t) sizeof(*map);
+
+    if (!(flags & O_CREAT) && (header->magic != MM_TSDB_MAGIC ||
+            header->version != MM_TSDB_VERSION ||
+            header->record_size != sizeof(*map))) {
+        MM_LOG("%smm_tsdb: %s: %s\n", path, "Not a valid segment");
+        munmap(map, MM_TSDB_SEGMENT_SIZE);
+        return NULL;
+    }
+
+    return map;
+}
+
+/* Copies staged records into the mapped segment. */
+void write_out_staging(bool synchronous) {
+    uintptr_t start, end;
+
+    if (tsdb.staged == 0) {
+        return;
+    }
+
+    memcpy(tsdb.map + tsdb.next_slot, tsdb.staging,
+            tsdb.staged * sizeof(*tsdb.staging));
+
+    start = (uintptr_t) (tsdb.map + tsdb.next_slot);
+    end = (uintptr_t) (tsdb.map + tsdb.next_slot + tsdb.staged);
+    start &= ~((uintptr_t) MM_TSDB_PAGE_SIZE - 1);
+
+    if (msync((void *) start, end - start,
+            synchronous ? MS_SYNC : MS_ASYNC)) {
+        MM_LOG("%smm_tsdb: msync: %s\n", strerror(errno));
+    }
+
+    tsdb.next_slot += tsdb.staged;
+    tsdb.staged = 0;
+}
+
+const char *mm_tsdb_get_series_string(enum mm_tsdb_series series) {
+    static const char *mm_tsdb_series_names[] = {
+        "none",
+        "session",
+        "reconnect",
+        "rx_bytes",
+        "tx_bytes",
+        "signal",
+        "temperature",
+    };
+
+    if (series >= MM_TSDB_SERIES_MAX) {
+        return "invalid";
+    }
+
+    return mm_tsdb_series_names[series];
+}
+
+int mm_tsdb_open(const char *directory) {
+    struct mm_tsdb_segment_list list;
+    const struct mm_tsdb_header *header;
+    char path[PATH_MAX];
+    uint32_t slots;
+    int status;
+
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        MM_LOG("%smm_tsdb: mkdir: %s: %s\n", directory, strerror(errno));
+        return -1;
+    }
+
+    if (list_segments(directory, &list)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tsdb_lock);
+    memset(&tsdb, 0, sizeof(tsdb));
+    snprintf(tsdb.directory, sizeof(tsdb.directory), "%s", directory);
+
+    /* Resume appending to the newest segment if it is intact. */
+    if (list.count) {
+        tsdb.oldest_sequence = list.sequences[0];
+        tsdb.sequence = list.sequences[list.count - 1];
+        tsdb.segments = (unsigned) list.count;
+
+        if (get_segment_path(path, sizeof(path), directory,
+                tsdb.sequence) == 0 &&
+                (tsdb.map = map_segment(path, O_RDWR, &slots)) != NULL) {
+            header = (const struct mm_tsdb_header *) tsdb.map;
+
+            tsdb.base_ms = header->base_ms;
+            tsdb.next_slot = find_end_of_segment(tsdb.map, slots);
+            tsdb.last_delta_ms = tsdb.next_slot > 1
+                ? tsdb.map[tsdb.next_slot - 1].delta_ms
+                : 0;
+        }
+    }
+
+    free(list.sequences);
+
+    /* Otherwise, or if the newest segment is full, start on a new one. */
+    status = 0;
+
+    if (tsdb.map == NULL || tsdb.next_slot > MM_TSDB_RECORDS_PER_SEGMENT) {
+        if (list.count) {
+            tsdb.sequence++;
+        }
+
+        if (tsdb.map != NULL) {
+            munmap(tsdb.map, MM_TSDB_SEGMENT_SIZE);
+            tsdb.map = NULL;
+        }
+
+        status = create_segment(mm_time_realtime_ms());
+    }
+
+    pthread_mutex_unlock(&tsdb_lock);
+    return status;
+}
+
+void mm_tsdb_close(void) {
+    pthread_mutex_lock(&tsdb_lock);
+
+    if (tsdb.map != NULL) {
+        write_out_staging(true);
+        munmap(tsdb.map, MM_TSDB_SEGMENT_SIZE);
+        tsdb.map = NULL;
+    }
+
+    pthread_mutex_unlock(&tsdb_lock);
+}
+
+/*
+ * Appends a sample stamped with the current wall-clock time. Should the
+ * clock step backwards, samples are clamped to the last timestamp to keep
+ * segments ordered; large forward steps simply start a new segment. If the
+ * store was never opened (or failed to), samples are silently dropped.
+ */
+int mm_tsdb_append(enum mm_tsdb_series series, uint8_t tag, uint16_t aux,
+        int64_t value) {
+    struct mm_tsdb_record *record;
+    uint64_t now_ms, delta_ms;
+    int status = 0;
+
+    pthread_mutex_lock(&tsdb_lock);
+
+    if (tsdb.map == NULL) {
+        pthread_mutex_unlock(&tsdb_lock);
+        return 0;
+    }
+
+    now_ms = mm_time_realtime_ms();
+    delta_ms = now_ms > tsdb.base_ms ? now_ms - tsdb.base_ms : 0;
+
+    if (delta_ms < tsdb.last_delta_ms) {
+        delta_ms = tsdb.last_delta_ms;
+    }
+
+    if (delta_ms > UINT32_MAX ||
+            tsdb.next_slot + tsdb.staged > MM_TSDB_RECORDS_PER_SEGMENT) {
+        write_out_staging(false);
+
+        if ((status = create_segment(now_ms))) {
+            pthread_mutex_unlock(&tsdb_lock);
+            return status;
+        }
+
+        delta_ms = 0;
+    }
+
+    if (tsdb.staged == 0) {
+        tsdb.staged_since_us = mm_time_monotonic_us();
+    }
+
+    record = tsdb.staging + tsdb.staged++;
+    record->delta_ms = (uint32_t) delta_ms;
+    record->series = (uint8_t) series;
+    record->tag = tag;
+    record->aux = aux;
+    record->value = value;
+    tsdb.last_delta_ms = (uint32_t) delta_ms;
+
+    /* Only copy into the segment once a whole page has been staged. */
+    if ((tsdb.next_slot + tsdb.staged) % SLOTS_PER_PAGE == 0 ||
+            tsdb.next_slot + tsdb.staged > MM_TSDB_RECORDS_PER_SEGMENT) {
+        write_out_staging(false);
+    }
+
+    pthread_mutex_unlock(&tsdb_lock);
+    return status;
+}
+
+/* Writes out a partial page if forced, or if it has been staged too long. */
+int mm_tsdb_flush(bool force) {
+    pthread_mutex_lock(&tsdb_lock);
+
+    if (tsdb.map != NULL && tsdb.staged && (force ||
+            mm_time_monotonic_us() - tsdb.staged_since_us >=
+            MM_TSDB_MAX_STAGING_AGE_S * 1000000ULL)) {
+        write_out_staging(force);
+    }
+
+    pthread_mutex_unlock(&tsdb_lock);
+    return 0;
+}
+
+int query_segment(const struct mm_tsdb_record *records, uint32_t slots,
+        uint64_t from_ms, uint64_t to_ms, mm_tsdb_visitor visitor,
+        void *context) {
+    const struct mm_tsdb_header *header;
+    struct mm_tsdb_sample sample;
+    uint32_t low, high, end;
+    int status;
+
+    header = (const struct mm_tsdb_header *) records;
+    end = find_end_of_segment(records, slots);
+
+    /*
+     * Without an RTC a later segment can start before an earlier one, so
+     * each segment is judged by its own span rather than its neighbours.
+     */
+    if (end <= 1 || header->base_ms > to_ms ||
+            header->base_ms + records[end - 1].delta_ms < from_ms) {
+        return 0;
+    }
+
+    /* Records are time-ordered, so binary search for the first match. */
+    for (low = 1, high = end; low < high; ) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (header->base_ms + records[middle].delta_ms < from_ms) {
+            low = middle + 1;
+        }
+
+        else {
+            high = middle;
+        }
+    }
+
+    for (; low < end; low++) {
+        sample.realtime_ms = header->base_ms + records[low].delta_ms;
+
+        if (sample.realtime_ms > to_ms) {
+            break;
+        }
+
+        sample.series = (enum mm_tsdb_series) records[low].series;
+        sample.tag = records[low].tag;
+        sample.aux = records[low].aux;
+        sample.value = records[low].value;
+
+        if ((status = visitor(&sample, context))) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Visits all samples in [from_ms, to_ms], segment by segment in sequence
+ * order. Only the overlapping records of each segment are touched, so queries
+ * never need to page in the whole history.
+ */
+int mm_tsdb_query(const char *directory, uint64_t from_ms, uint64_t to_ms,
+        mm_tsdb_visitor visitor, void *context) {
+    struct mm_tsdb_segment_list list;
+    struct mm_tsdb_record *records;
+    char path[PATH_MAX];
+    uint32_t slots;
+    size_t i;
+    int status;
+
+    if (list_segments(directory, &list)) {
+        return -1;
+    }
+
+    for (i = 0, status = 0; i < list.count && status == 0; i++) {
+        if (get_segment_path(path, sizeof(path), directory,
+                list.sequences[i]) ||
+                (records = map_segment(path, O_RDONLY, &slots)) == NULL) {
+            continue;
+        }
+
+        status = query_segment(records, slots, from_ms, to_ms, visitor,
+                context);
+
+        munmap(records, MM_TSDB_SEGMENT_SIZE);
+    }
+
+    free(list.sequences);
+    return status < 0 ? status : 0;
+}
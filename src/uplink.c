@@ -0,0 +1,1333 @@
+/*
+ * src/uplink.c: Multi-uplink failover functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_events.h"
+#include "mm_hotplug.h"
+#include "mm_icmp.h"
+#include "mm_log.h"
+#include "mm_netlink.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+#include "mm_uplink.h"
+
+#include <libnl3/netlink/netlink.h>
+#include <libnl3/netlink/route/addr.h>
+#include <libnl3/netlink/route/link.h>
+#include <libnl3/netlink/route/route.h>
+#include <libnl3/netlink/route/rule.h>
+#include <arpa/inet.h>
+#include <linux/fib_rules.h>
+#include <linux/nexthop.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mm_uplink_state {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+    int stop_fd, wake_fd;
+
+    struct nl_sock *nl;
+    struct nl_cache *link_cache, *addr_cache, *route_cache;
+
+    struct mm_uplink uplinks[MM_UPLINK_MAX_UPLINKS];
+    size_t count;
+    uint32_t probe_address;
+
+    /* Uplink carrying the main default route (count if none yet). */
+    size_t active;
+    uint32_t active_address, active_gateway;
+    int active_ifindex;
+    uint64_t switches;
+
+    /* Multipath mode: whether the route is installed (and current). */
+    bool multipath, multipath_installed, multipath_stale;
+    bool legacy_multipath;
+};
+
+static struct mm_uplink_state uplink_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stop_fd = -1,
+    .wake_fd = -1,
+};
+
+/* Carries the uplink being looked for through nl_cache_foreach(). */
+struct mm_uplink_lookup {
+    const struct mm_uplink *uplink;
+    uint32_t address, gateway, table;
+};
+
+static void collect_probe_replies(struct mm_uplink *);
+static void compute_weights(unsigned *);
+static int delete_nexthop(uint32_t);
+static void find_address(struct nl_object *, void *);
+static void find_gateway(struct nl_object *, void *);
+
+__attribute__(( pure ))
+static struct mm_uplink *find_uplink(const char *);
+
+static void flush_stale_rule(struct nl_object *, void *);
+static bool is_wwan_interface(const char *);
+static int load_config(void);
+static int open_probe_socket(struct mm_uplink *);
+static void refresh_uplink(struct mm_uplink *, struct rtnl_link *, uint64_t);
+static void select_multipath(void);
+static void select_uplink(uint64_t);
+static void send_probe(struct mm_uplink *);
+static int set_default_route(uint32_t, const struct mm_uplink *, bool);
+static int set_multipath_route(const unsigned *);
+static int set_nexthop_group(const unsigned *);
+static int set_rule(const struct mm_uplink *, size_t, uint32_t, bool);
+static void *uplink_thread_main(void *);
+
+void collect_probe_replies(struct mm_uplink *uplink) {
+    uint8_t packet[128];
+    size_t payload;
+    uint64_t rtt_us;
+    ssize_t length;
+
+    while ((length = recv(uplink->probe_fd, packet, sizeof(packet), 0)) > 0) {
+        if (mm_icmp_read_echo_reply(packet, (size_t) length,
+                uplink->probe_seq, &payload) && !uplink->replied) {
+            rtt_us = mm_time_monotonic_us() - uplink->probe_sent_us;
+
+            pthread_mutex_lock(&uplink_state.lock);
+            uplink->rtt_us = uplink->rtt_us
+                ? (uplink->rtt_us * 7U + rtt_us) / 8U
+                : rtt_us;
+
+            pthread_mutex_unlock(&uplink_state.lock);
+            uplink->replied = true;
+        }
+    }
+}
+
+/*
+ * Weighs each healthy uplink by capacity over latency, scaled so that the
+ * best gets MM_UPLINK_MAX_WEIGHT (and none less than MM_UPLINK_MIN_WEIGHT).
+ * Unhealthy uplinks get zero, i.e. no place in the route at all.
+ */
+void compute_weights(unsigned *weights) {
+    uint64_t scores[MM_UPLINK_MAX_UPLINKS], best;
+    const struct mm_uplink *uplink;
+    size_t i;
+
+    for (i = 0, best = 0, uplink = uplink_state.uplinks;
+            i < uplink_state.count; i++, uplink++) {
+        scores[i] = 0;
+
+        if (uplink->healthy) {
+            scores[i] = uplink->capacity_bytes_s * 1000U /
+                (uplink->rtt_us > 1000U ? uplink->rtt_us : 1000U);
+
+            best = scores[i] > best ? scores[i] : best;
+        }
+    }
+
+    for (i = 0; i < uplink_state.count; i++) {
+        weights[i] = 0;
+
+        if (uplink_state.uplinks[i].healthy) {
+            weights[i] = best ? (unsigned) (scores[i] *
+                MM_UPLINK_MAX_WEIGHT / best) : MM_UPLINK_MAX_WEIGHT;
+
+            weights[i] = weights[i] > MM_UPLINK_MIN_WEIGHT
+                ? weights[i] : MM_UPLINK_MIN_WEIGHT;
+        }
+    }
+}
+
+int delete_nexthop(uint32_t id) {
+    struct nhmsg nhm;
+    struct nl_msg *msg;
+    int status;
+
+    if ((msg = nlmsg_alloc_simple(RTM_DELNEXTHOP, NLM_F_REQUEST)) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    memset(&nhm, 0, sizeof(nhm));
+    nhm.nh_family = AF_UNSPEC;
+
+    if (nlmsg_append(msg, &nhm, sizeof(nhm), NLMSG_ALIGNTO) ||
+            nla_put_u32(msg, NHA_ID, id)) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    status = nl_send_sync(uplink_state.nl, msg);
+    return status == -NLE_OBJ_NOTFOUND ? 0 : status;
+}
+
+void find_address(struct nl_object *object, void *context) {
+    struct mm_uplink_lookup *lookup = context;
+    struct rtnl_addr *addr = (struct rtnl_addr *) object;
+    struct nl_addr *local;
+
+    if (lookup->address != 0 || rtnl_addr_get_family(addr) != AF_INET ||
+            rtnl_addr_get_ifindex(addr) != lookup->uplink->ifindex ||
+            rtnl_addr_get_scope(addr) != RT_SCOPE_UNIVERSE ||
+            (local = rtnl_addr_get_local(addr)) == NULL ||
+            nl_addr_get_len(local) != sizeof(lookup->address)) {
+        return;
+    }
+
+    memcpy(&lookup->address, nl_addr_get_binary_addr(local),
+            sizeof(lookup->address));
+}
+
+/*
+ * An uplink's gateway comes from a default route out of it: either in its
+ * own table (as installed for the WWAN interface), or one that something
+ * else (e.g. a DHCP client) has left in the main table at a lower priority.
+ */
+void find_gateway(struct nl_object *object, void *context) {
+    struct mm_uplink_lookup *lookup = context;
+    struct rtnl_route *route = (struct rtnl_route *) object;
+    struct rtnl_nexthop *nexthop;
+    struct nl_addr *dst, *gateway;
+    uint32_t table;
+
+    table = rtnl_route_get_table(route);
+
+    if (lookup->gateway != 0 || rtnl_route_get_family(route) != AF_INET ||
+            rtnl_route_get_protocol(route) == MM_UPLINK_ROUTE_PROTOCOL ||
+            (dst = rtnl_route_get_dst(route)) == NULL ||
+            nl_addr_get_prefixlen(dst) != 0 ||
+            rtnl_route_get_nnexthops(route) < 1 ||
+            (table != lookup->uplink->table && (table != RT_TABLE_MAIN ||
+            rtnl_route_get_priority(route) == 0))) {
+        return;
+    }
+
+    nexthop = rtnl_route_nexthop_n(route, 0);
+
+    if (rtnl_route_nh_get_ifindex(nexthop) != lookup->uplink->ifindex ||
+            (gateway = rtnl_route_nh_get_gateway(nexthop)) == NULL ||
+            nl_addr_get_len(gateway) != sizeof(lookup->gateway)) {
+        return;
+    }
+
+    memcpy(&lookup->gateway, nl_addr_get_binary_addr(gateway),
+            sizeof(lookup->gateway));
+
+    lookup->table = table;
+}
+
+struct mm_uplink *find_uplink(const char *ifname) {
+    size_t i;
+
+    for (i = 0; i < uplink_state.count; i++) {
+        if (!strcmp(uplink_state.uplinks[i].ifname, ifname)) {
+            return uplink_state.uplinks + i;
+        }
+    }
+
+    return NULL;
+}
+
+/* Removes rules left behind in our priority range (e.g. after a crash). */
+void flush_stale_rule(struct nl_object *object, void *context) {
+    struct rtnl_rule *rule = (struct rtnl_rule *) object;
+    uint32_t priority;
+    int status;
+
+    priority = rtnl_rule_get_prio(rule);
+
+    if (priority >= MM_UPLINK_RULE_PRIORITY &&
+            priority < MM_UPLINK_RULE_PRIORITY + MM_UPLINK_MAX_UPLINKS &&
+            (status = rtnl_rule_delete(uplink_state.nl, rule, 0))) {
+        MM_LOG("%srtnl_rule_delete: %s\n", nl_geterror(status));
+    }
+}
+
+bool is_wwan_interface(const char *ifname) {
+    char name[IF_NAMESIZE];
+    unsigned modem;
+
+    for (modem = 0; modem < MM_HOTPLUG_MAX_MODEMS; modem++) {
+        snprintf(name, sizeof(name), MM_NETLINK_WWAN_INTERFACE_FORMAT, modem);
+
+        if (!strcmp(name, ifname)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Returns 1 if there is no config (so multi-uplink mode is disabled). */
+int load_config(void) {
+    char line[256], *keyword, *value, *table, *capacity, *save;
+    struct mm_uplink *uplink;
+    struct in_addr address;
+    unsigned long number;
+    size_t i;
+    FILE *f;
+
+    if ((f = fopen(MM_UPLINK_CONFIG_PATH, "r")) == NULL) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    inet_pton(AF_INET, MM_UPLINK_DEFAULT_PROBE_ADDRESS,
+            &uplink_state.probe_address);
+
+    uplink_state.multipath = false;
+    uplink_state.count = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((keyword = strtok_r(line, " \t\r\n", &save)) == NULL ||
+                keyword[0] == '#') {
+            continue;
+        }
+
+        value = strtok_r(NULL, " \t\r\n", &save);
+
+        if (!strcmp(keyword, "probe") && value != NULL &&
+                inet_pton(AF_INET, value, &address) == 1) {
+            uplink_state.probe_address = address.s_addr;
+            continue;
+        }
+
+        if (!strcmp(keyword, "mode") && value != NULL &&
+                (!strcmp(value, "failover") || !strcmp(value, "multipath"))) {
+            uplink_state.multipath = !strcmp(value, "multipath");
+            continue;
+        }
+
+        if (strcmp(keyword, "uplink") || value == NULL ||
+                strlen(value) >= IF_NAMESIZE || (table = strtok_r(NULL,
+                " \t\r\n", &save)) == NULL || !isdigit((unsigned char)
+                table[0]) || (number = strtoul(table, NULL, 10)) == 0 ||
+                number == RT_TABLE_MAIN || number > UINT32_MAX) {
+            MM_LOG("%smm_uplink: Ignoring config line: %s\n", keyword);
+            continue;
+        }
+
+        if (uplink_state.count == MM_UPLINK_MAX_UPLINKS) {
+            MM_LOG("%s%s\n", "mm_uplink: Too many uplinks; ignoring rest");
+            break;
+        }
+
+        /* An optional capacity (in Mbit/s) follows the table. */
+        if ((capacity = strtok_r(NULL, " \t\r\n", &save)) != NULL &&
+                (!isdigit((unsigned char) capacity[0]) ||
+                strtoul(capacity, NULL, 10) == 0)) {
+            MM_LOG("%smm_uplink: Ignoring config line: %s\n", keyword);
+            continue;
+        }
+
+        uplink = uplink_state.uplinks + uplink_state.count++;
+        memset(uplink, 0, sizeof(*uplink));
+
+        if (capacity != NULL) {
+            uplink->configured_bytes_s =
+                (uint64_t) strtoul(capacity, NULL, 10) * 125000U;
+        }
+
+        strcpy(uplink->ifname, value);
+        uplink->table = (uint32_t) number;
+        uplink->wwan = is_wwan_interface(value);
+        uplink->probe_fd = -1;
+    }
+
+    fclose(f);
+
+    for (i = 0; i < uplink_state.count; i++) {
+        if (uplink_state.uplinks[i].wwan) {
+            return 0;
+        }
+    }
+
+    MM_LOG("%s%s\n", "mm_uplink: No WWAN interface is an uplink; "
+            "multi-uplink mode is disabled");
+
+    return 1;
+}
+
+/* Probes go out of an uplink by way of the rule for its source address. */
+int open_probe_socket(struct mm_uplink *uplink) {
+    struct sockaddr_in address;
+
+    if ((uplink->probe_fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK |
+            SOCK_CLOEXEC, IPPROTO_ICMP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = uplink->address;
+
+    if (setsockopt(uplink->probe_fd, SOL_SOCKET, SO_BINDTODEVICE,
+            uplink->ifname, (socklen_t) strlen(uplink->ifname) + 1) ||
+            bind(uplink->probe_fd, (struct sockaddr *) &address,
+            sizeof(address))) {
+        perror("mm_uplink: open_probe_socket");
+        close(uplink->probe_fd);
+        uplink->probe_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Re-learns an uplink's address/gateway and scores the last probe. */
+void refresh_uplink(struct mm_uplink *uplink, struct rtnl_link *link,
+        uint64_t now_us) {
+    struct mm_uplink_lookup lookup;
+    uint64_t bytes, rate;
+    bool usable, was_healthy;
+    size_t i;
+
+    i = (size_t) (uplink - uplink_state.uplinks);
+    usable = false;
+
+    if (link != NULL) {
+        uplink->ifindex = rtnl_link_get_ifindex(link);
+        usable = (rtnl_link_get_flags(link) & (IFF_UP | IFF_RUNNING)) ==
+            (IFF_UP | IFF_RUNNING);
+
+        /* Else, capacity is the recent peak rate, decaying when idle. */
+        bytes = rtnl_link_get_stat(link, RTNL_LINK_RX_BYTES) +
+            rtnl_link_get_stat(link, RTNL_LINK_TX_BYTES);
+
+        if (uplink->configured_bytes_s) {
+            pthread_mutex_lock(&uplink_state.lock);
+            uplink->capacity_bytes_s = uplink->configured_bytes_s;
+            pthread_mutex_unlock(&uplink_state.lock);
+        }
+
+        else if (uplink->last_bytes_us && bytes >= uplink->last_bytes &&
+                now_us > uplink->last_bytes_us) {
+            rate = (bytes - uplink->last_bytes) * 1000000U /
+                (now_us - uplink->last_bytes_us);
+
+            pthread_mutex_lock(&uplink_state.lock);
+            uplink->capacity_bytes_s -= uplink->capacity_bytes_s / 32U;
+            uplink->capacity_bytes_s = rate > uplink->capacity_bytes_s
+                ? rate : uplink->capacity_bytes_s;
+
+            pthread_mutex_unlock(&uplink_state.lock);
+        }
+
+        if (uplink->capacity_bytes_s < MM_UPLINK_MIN_CAPACITY_BYTES_S) {
+            uplink->capacity_bytes_s = MM_UPLINK_MIN_CAPACITY_BYTES_S;
+        }
+
+        uplink->last_bytes = bytes;
+        uplink->last_bytes_us = now_us;
+    }
+
+    memset(&lookup, 0, sizeof(lookup));
+    lookup.uplink = uplink;
+
+    if (usable) {
+        nl_cache_foreach(uplink_state.addr_cache, find_address, &lookup);
+        nl_cache_foreach(uplink_state.route_cache, find_gateway, &lookup);
+    }
+
+    /* Follow the uplink's address with its rule and probe socket. */
+    if (lookup.address != uplink->rule_address) {
+        if (uplink->rule_address != 0) {
+            set_rule(uplink, i, uplink->rule_address, false);
+        }
+
+        uplink->rule_address = 0;
+
+        if (lookup.address != 0 && !set_rule(uplink, i, lookup.address,
+                true)) {
+            uplink->rule_address = lookup.address;
+        }
+    }
+
+    if (lookup.address != uplink->address && uplink->probe_fd >= 0) {
+        close(uplink->probe_fd);
+        uplink->probe_fd = -1;
+    }
+
+    /* Mirror a default route found in the main table into its own table. */
+    if (lookup.gateway != uplink->gateway ||
+            lookup.address != uplink->address ||
+            (lookup.gateway != 0 && lookup.table != uplink->table &&
+            !uplink->table_route_installed)) {
+        if (uplink->table_route_installed) {
+            set_default_route(uplink->table, uplink, false);
+            uplink->table_route_installed = false;
+        }
+
+        uplink->address = lookup.address;
+        uplink->gateway = lookup.gateway;
+        uplink_state.multipath_stale = true;
+
+        if (lookup.gateway != 0 && lookup.table != uplink->table) {
+            uplink->table_route_installed =
+                !set_default_route(uplink->table, uplink, true);
+        }
+    }
+
+    if (uplink->probe_fd >= 0) {
+        collect_probe_replies(uplink);
+    }
+
+    pthread_mutex_lock(&uplink_state.lock);
+    was_healthy = uplink->healthy;
+
+    if (uplink->address == 0 || uplink->gateway == 0 ||
+            (uplink->wwan && uplink->session_down)) {
+        uplink->lost_probes = MM_UPLINK_LOST_PROBES;
+    }
+
+    else if (uplink->replied) {
+        uplink->lost_probes = 0;
+    }
+
+    else if (uplink->probe_outstanding) {
+        uplink->lost_probes++;
+    }
+
+    uplink->healthy = uplink->lost_probes < MM_UPLINK_LOST_PROBES &&
+        (was_healthy || uplink->replied);
+
+    if (uplink->healthy && !was_healthy) {
+        uplink->healthy_since_us = now_us;
+    }
+
+    uplink->probe_outstanding = uplink->replied = false;
+    pthread_mutex_unlock(&uplink_state.lock);
+
+    if (uplink->healthy != was_healthy) {
+        MM_LOG("%sUplink %s is %s\n", uplink->ifname,
+                uplink->healthy ? "healthy" : "down");
+
+        mm_telemetry_event("uplink_%s interface=%s",
+                uplink->healthy ? "up" : "down", uplink->ifname);
+    }
+}
+
+/*
+ * Spreads the main default route over every healthy uplink. The route is
+ * only reprogrammed when an uplink joins or leaves, or when a weight moves
+ * by more than a quarter, so that measurement noise doesn't churn it.
+ */
+void select_multipath(void) {
+    unsigned weights[MM_UPLINK_MAX_UPLINKS], old, delta, members;
+    bool joined_or_left, reweighed;
+    size_t i;
+
+    compute_weights(weights);
+    joined_or_left = reweighed = false;
+
+    for (i = 0, members = 0; i < uplink_state.count; i++) {
+        old = uplink_state.uplinks[i].weight;
+        delta = weights[i] > old ? weights[i] - old : old - weights[i];
+        members += weights[i] != 0;
+
+        if ((old == 0) != (weights[i] == 0)) {
+            joined_or_left = true;
+        }
+
+        else if (delta >= 2 && delta * 4U > old) {
+            reweighed = true;
+        }
+    }
+
+    /* With nothing healthy, leave the route be: the probe may be at fault. */
+    if (members == 0 || (!joined_or_left && !reweighed &&
+            uplink_state.multipath_installed &&
+            !uplink_state.multipath_stale)) {
+        return;
+    }
+
+    if (!uplink_state.legacy_multipath && set_nexthop_group(weights)) {
+        MM_LOG("%s%s\n", "mm_uplink: Nexthop groups are unavailable; "
+                "using a plain multipath route");
+
+        uplink_state.legacy_multipath = true;
+    }
+
+    if (uplink_state.legacy_multipath && set_multipath_route(weights)) {
+        return;
+    }
+
+    pthread_mutex_lock(&uplink_state.lock);
+    uplink_state.multipath_installed = true;
+    uplink_state.multipath_stale = false;
+
+    for (i = 0; i < uplink_state.count; i++) {
+        uplink_state.uplinks[i].weight = weights[i];
+    }
+
+    if (joined_or_left) {
+        uplink_state.switches++;
+    }
+
+    pthread_mutex_unlock(&uplink_state.lock);
+
+    for (i = 0; i < uplink_state.count; i++) {
+        if (weights[i] != 0) {
+            MM_LOG("%sUplink %s carries weight %u\n",
+                    uplink_state.uplinks[i].ifname, weights[i]);
+        }
+    }
+
+    if (joined_or_left) {
+        mm_telemetry_event("uplink_multipath members=%u", members);
+        mm_events_post(MM_EVENT_UPLINK_CHANGED);
+    }
+}
+
+/*
+ * Fails over straight away when the active uplink goes down, but only
+ * returns to a more preferred one after it has been healthy for a while.
+ */
+void select_uplink(uint64_t now_us) {
+    const struct mm_uplink *uplink;
+    size_t active, best, i;
+
+    active = uplink_state.active;
+
+    for (i = 0, best = uplink_state.count; i < uplink_state.count; i++) {
+        if (uplink_state.uplinks[i].healthy) {
+            best = i;
+            break;
+        }
+    }
+
+    /* With nothing healthy, leave the route be: the probe may be at fault. */
+    if (best == uplink_state.count) {
+        return;
+    }
+
+    if (active == uplink_state.count || !uplink_state.uplinks[active].healthy
+            || (best < active && now_us - uplink_state.uplinks[best]
+            .healthy_since_us >= MM_UPLINK_RECOVERY_S * 1000000ULL)) {
+        active = best;
+    }
+
+    uplink = uplink_state.uplinks + active;
+
+    if (active == uplink_state.active &&
+            uplink->address == uplink_state.active_address &&
+            uplink->gateway == uplink_state.active_gateway &&
+            uplink->ifindex == uplink_state.active_ifindex) {
+        return;
+    }
+
+    if (set_default_route(RT_TABLE_MAIN, uplink, true)) {
+        return;
+    }
+
+    uplink_state.active_address = uplink->address;
+    uplink_state.active_gateway = uplink->gateway;
+    uplink_state.active_ifindex = uplink->ifindex;
+
+    if (active == uplink_state.active) {
+        return;
+    }
+
+    MM_LOG("%sSwitching the default route over to uplink %s\n",
+            uplink->ifname);
+
+    mm_telemetry_event("uplink_switch interface=%s", uplink->ifname);
+
+    pthread_mutex_lock(&uplink_state.lock);
+    uplink_state.active = active;
+    uplink_state.switches++;
+    pthread_mutex_unlock(&uplink_state.lock);
+
+    mm_events_post(MM_EVENT_UPLINK_CHANGED);
+}
+
+void send_probe(struct mm_uplink *uplink) {
+    struct sockaddr_in address;
+    uint8_t packet[sizeof(struct icmphdr)];
+
+    if (uplink->address == 0 || uplink->gateway == 0 ||
+            (uplink->probe_fd < 0 && open_probe_socket(uplink))) {
+        return;
+    }
+
+    mm_icmp_write_echo(packet, sizeof(packet), ++uplink->probe_seq);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = uplink_state.probe_address;
+
+    /* A failed send is a lost probe all the same. */
+    uplink->probe_sent_us = mm_time_monotonic_us();
+    sendto(uplink->probe_fd, packet, sizeof(packet), 0,
+            (struct sockaddr *) &address, sizeof(address));
+
+    uplink->probe_outstanding = true;
+}
+
+/* Adds (or removes) a default route out of the uplink in the given table. */
+int set_default_route(uint32_t table, const struct mm_uplink *uplink,
+        bool add) {
+    struct nl_addr *dst, *gateway, *source;
+    struct rtnl_nexthop *nexthop;
+    struct rtnl_route *route;
+    uint32_t any = 0;
+    int status;
+
+    if ((route = rtnl_route_alloc()) == NULL) {
+        perror("rtnl_route_alloc");
+        return -1;
+    }
+
+    if ((dst = nl_addr_build(AF_INET, &any, sizeof(any))) == NULL) {
+        perror("nl_addr_build");
+        rtnl_route_put(route);
+        return -1;
+    }
+
+    nl_addr_set_prefixlen(dst, 0);
+
+    rtnl_route_set_family(route, AF_INET);
+    rtnl_route_set_dst(route, dst);
+    rtnl_route_set_table(route, table);
+    rtnl_route_set_priority(route, 0);
+    rtnl_route_set_protocol(route, MM_UPLINK_ROUTE_PROTOCOL);
+    rtnl_route_set_scope(route, RT_SCOPE_UNIVERSE);
+    rtnl_route_set_type(route, RTN_UNICAST);
+    nl_addr_put(dst);
+
+    if (!add) {
+        if ((status = rtnl_route_delete(uplink_state.nl, route, 0))) {
+            MM_LOG("%srtnl_route_delete: %s\n", nl_geterror(status));
+        }
+
+        rtnl_route_put(route);
+        return status;
+    }
+
+    if ((gateway = nl_addr_build(AF_INET, &uplink->gateway,
+            sizeof(uplink->gateway))) == NULL ||
+            (source = nl_addr_build(AF_INET, &uplink->address,
+            sizeof(uplink->address))) == NULL) {
+        perror("nl_addr_build");
+        nl_addr_put(gateway);
+        rtnl_route_put(route);
+        return -1;
+    }
+
+    if ((nexthop = rtnl_route_nh_alloc()) == NULL) {
+        perror("rtnl_route_nh_alloc");
+        nl_addr_put(source);
+        nl_addr_put(gateway);
+        rtnl_route_put(route);
+        return -1;
+    }
+
+    rtnl_route_nh_set_ifindex(nexthop, uplink->ifindex);
+    rtnl_route_nh_set_gateway(nexthop, gateway);
+    rtnl_route_add_nexthop(route, nexthop);
+    rtnl_route_set_pref_src(route, source);
+
+    if ((status = rtnl_route_add(uplink_state.nl, route,
+            NLM_F_CREATE | NLM_F_REPLACE))) {
+        MM_LOG("%srtnl_route_add: %s\n", nl_geterror(status));
+    }
+
+    /* The route owns the nexthop now. */
+    nl_addr_put(source);
+    nl_addr_put(gateway);
+    rtnl_route_put(route);
+    return status;
+}
+
+/* Fallback for kernels without nexthop objects (before 5.3, or 5.13). */
+int set_multipath_route(const unsigned *weights) {
+    const struct mm_uplink *uplink;
+    struct rtnl_nexthop *nexthop;
+    struct nl_addr *dst, *gateway;
+    struct rtnl_route *route;
+    uint32_t any = 0;
+    int status;
+    size_t i;
+
+    if ((route = rtnl_route_alloc()) == NULL) {
+        perror("rtnl_route_alloc");
+        return -1;
+    }
+
+    if ((dst = nl_addr_build(AF_INET, &any, sizeof(any))) == NULL) {
+        perror("nl_addr_build");
+        rtnl_route_put(route);
+        return -1;
+    }
+
+    nl_addr_set_prefixlen(dst, 0);
+
+    rtnl_route_set_family(route, AF_INET);
+    rtnl_route_set_dst(route, dst);
+    rtnl_route_set_table(route, RT_TABLE_MAIN);
+    rtnl_route_set_priority(route, 0);
+    rtnl_route_set_protocol(route, MM_UPLINK_ROUTE_PROTOCOL);
+    rtnl_route_set_scope(route, RT_SCOPE_UNIVERSE);
+    rtnl_route_set_type(route, RTN_UNICAST);
+    nl_addr_put(dst);
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        if (weights[i] == 0) {
+            continue;
+        }
+
+        if ((gateway = nl_addr_build(AF_INET, &uplink->gateway,
+                sizeof(uplink->gateway))) == NULL ||
+                (nexthop = rtnl_route_nh_alloc()) == NULL) {
+            perror("mm_uplink: set_multipath_route");
+            nl_addr_put(gateway);
+            rtnl_route_put(route);
+            return -1;
+        }
+
+        /* The kernel counts weights from one, as "hops" beyond the first. */
+        rtnl_route_nh_set_ifindex(nexthop, uplink->ifindex);
+        rtnl_route_nh_set_gateway(nexthop, gateway);
+        rtnl_route_nh_set_weight(nexthop, (uint8_t) (weights[i] - 1));
+        rtnl_route_add_nexthop(route, nexthop);
+        nl_addr_put(gateway);
+    }
+
+    if ((status = rtnl_route_add(uplink_state.nl, route,
+            NLM_F_CREATE | NLM_F_REPLACE))) {
+        MM_LOG("%srtnl_route_add: %s\n", nl_geterror(status));
+    }
+
+    rtnl_route_put(route);
+    return status;
+}
+
+/*
+ * Programs a nexthop object per healthy uplink, a resilient group over them
+ * and a main default route through the group. Resilient groups hash flows
+ * into buckets, so reweighing only migrates the buckets that have to move
+ * (and then only once they've gone idle), rather than reshuffling all flows.
+ */
+int set_nexthop_group(const unsigned *weights) {
+    struct nexthop_grp members[MM_UPLINK_MAX_UPLINKS];
+    const struct mm_uplink *uplink;
+    struct nlattr *resilient;
+    struct nl_msg *msg;
+    struct rtmsg rtm;
+    struct nhmsg nhm;
+    size_t i, count;
+    int status;
+
+    for (i = 0, count = 0, uplink = uplink_state.uplinks;
+            i < uplink_state.count; i++, uplink++) {
+        if (weights[i] == 0) {
+            continue;
+        }
+
+        if ((msg = nlmsg_alloc_simple(RTM_NEWNEXTHOP, NLM_F_REQUEST |
+                NLM_F_CREATE | NLM_F_REPLACE)) == NULL) {
+            return -NLE_NOMEM;
+        }
+
+        memset(&nhm, 0, sizeof(nhm));
+        nhm.nh_family = AF_INET;
+        nhm.nh_protocol = MM_UPLINK_ROUTE_PROTOCOL;
+
+        if (nlmsg_append(msg, &nhm, sizeof(nhm), NLMSG_ALIGNTO) ||
+                nla_put_u32(msg, NHA_ID, MM_UPLINK_NEXTHOP_ID + 1 +
+                (uint32_t) i) || nla_put_u32(msg, NHA_OIF, (uint32_t)
+                uplink->ifindex) || nla_put(msg, NHA_GATEWAY,
+                sizeof(uplink->gateway), &uplink->gateway)) {
+            nlmsg_free(msg);
+            return -NLE_MSGSIZE;
+        }
+
+        if ((status = nl_send_sync(uplink_state.nl, msg))) {
+            MM_LOG("%smm_uplink: RTM_NEWNEXTHOP: %s\n", nl_geterror(status));
+            return status;
+        }
+
+        memset(members + count, 0, sizeof(*members));
+        members[count].id = MM_UPLINK_NEXTHOP_ID + 1 + (uint32_t) i;
+        members[count++].weight = (uint8_t) (weights[i] - 1);
+    }
+
+    if ((msg = nlmsg_alloc_simple(RTM_NEWNEXTHOP, NLM_F_REQUEST |
+            NLM_F_CREATE | NLM_F_REPLACE)) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    memset(&nhm, 0, sizeof(nhm));
+    nhm.nh_family = AF_UNSPEC;
+    nhm.nh_protocol = MM_UPLINK_ROUTE_PROTOCOL;
+
+    if (nlmsg_append(msg, &nhm, sizeof(nhm), NLMSG_ALIGNTO) ||
+            nla_put_u32(msg, NHA_ID, MM_UPLINK_NEXTHOP_ID) ||
+            nla_put(msg, NHA_GROUP, (int) (count * sizeof(*members)),
+            members) || nla_put_u16(msg, NHA_GROUP_TYPE,
+            NEXTHOP_GRP_TYPE_RES) || (resilient = nla_nest_start(msg,
+            NHA_RES_GROUP)) == NULL || nla_put_u16(msg,
+            NHA_RES_GROUP_BUCKETS, MM_UPLINK_RESILIENT_BUCKETS) ||
+            nla_put_u32(msg, NHA_RES_GROUP_IDLE_TIMER,
+            MM_UPLINK_RESILIENT_IDLE_S * 100U) ||
+            nla_nest_end(msg, resilient)) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    if ((status = nl_send_sync(uplink_state.nl, msg))) {
+        MM_LOG("%smm_uplink: RTM_NEWNEXTHOP: %s\n", nl_geterror(status));
+        return status;
+    }
+
+    if ((msg = nlmsg_alloc_simple(RTM_NEWROUTE, NLM_F_REQUEST |
+            NLM_F_CREATE | NLM_F_REPLACE)) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = AF_INET;
+    rtm.rtm_table = RT_TABLE_MAIN;
+    rtm.rtm_protocol = MM_UPLINK_ROUTE_PROTOCOL;
+    rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm.rtm_type = RTN_UNICAST;
+
+    if (nlmsg_append(msg, &rtm, sizeof(rtm), NLMSG_ALIGNTO) ||
+            nla_put_u32(msg, RTA_NH_ID, MM_UPLINK_NEXTHOP_ID)) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    if ((status = nl_send_sync(uplink_state.nl, msg))) {
+        MM_LOG("%smm_uplink: RTM_NEWROUTE: %s\n", nl_geterror(status));
+        return status;
+    }
+
+    /* Members that have left the group can go now. */
+    for (i = 0; i < uplink_state.count; i++) {
+        if (weights[i] == 0 && uplink_state.uplinks[i].weight != 0 &&
+                (status = delete_nexthop(MM_UPLINK_NEXTHOP_ID + 1 +
+                (uint32_t) i))) {
+            MM_LOG("%smm_uplink: RTM_DELNEXTHOP: %s\n", nl_geterror(status));
+        }
+    }
+
+    return 0;
+}
+
+/* Adds (or removes) the rule sending an uplink's traffic to its table. */
+int set_rule(const struct mm_uplink *uplink, size_t i, uint32_t address,
+        bool add) {
+    struct rtnl_rule *rule;
+    struct nl_addr *source;
+    int status;
+
+    if ((rule = rtnl_rule_alloc()) == NULL) {
+        perror("rtnl_rule_alloc");
+        return -1;
+    }
+
+    if ((source = nl_addr_build(AF_INET, &address, sizeof(address))) ==
+            NULL) {
+        perror("nl_addr_build");
+        rtnl_rule_put(rule);
+        return -1;
+    }
+
+    nl_addr_set_prefixlen(source, 32);
+
+    rtnl_rule_set_family(rule, AF_INET);
+    rtnl_rule_set_src(rule, source);
+    rtnl_rule_set_table(rule, uplink->table);
+    rtnl_rule_set_prio(rule, MM_UPLINK_RULE_PRIORITY + (uint32_t) i);
+    rtnl_rule_set_action(rule, FR_ACT_TO_TBL);
+
+    if (add && (status = rtnl_rule_add(uplink_state.nl, rule,
+            NLM_F_CREATE | NLM_F_EXCL)) && status != -NLE_EXIST) {
+        MM_LOG("%srtnl_rule_add: %s\n", nl_geterror(status));
+    }
+
+    else if (!add && (status = rtnl_rule_delete(uplink_state.nl, rule, 0))) {
+        MM_LOG("%srtnl_rule_delete: %s\n", nl_geterror(status));
+    }
+
+    else {
+        status = 0;
+    }
+
+    nl_addr_put(source);
+    rtnl_rule_put(rule);
+    return status;
+}
+
+void *uplink_thread_main(void *context) {
+    struct rtnl_link *link;
+    struct pollfd fds[2];
+    uint64_t now_us, value;
+    int status;
+    size_t i;
+
+    (void) context;
+
+    fds[0].fd = uplink_state.stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = uplink_state.wake_fd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if ((status = nl_cache_refill(uplink_state.nl,
+                uplink_state.link_cache)) || (status = nl_cache_refill(
+                uplink_state.nl, uplink_state.addr_cache)) ||
+                (status = nl_cache_refill(uplink_state.nl,
+                uplink_state.route_cache))) {
+            MM_LOG("%smm_uplink: nl_cache_refill: %s\n", nl_geterror(status));
+        }
+
+        else {
+            now_us = mm_time_monotonic_us();
+
+            for (i = 0; i < uplink_state.count; i++) {
+                link = rtnl_link_get_by_name(uplink_state.link_cache,
+                        uplink_state.uplinks[i].ifname);
+
+                refresh_uplink(uplink_state.uplinks + i, link, now_us);
+
+                if (link != NULL) {
+                    rtnl_link_put(link);
+                }
+            }
+
+            if (uplink_state.multipath) {
+                select_multipath();
+            }
+
+            else {
+                select_uplink(now_us);
+            }
+
+            for (i = 0; i < uplink_state.count; i++) {
+                send_probe(uplink_state.uplinks + i);
+            }
+        }
+
+        if ((status = poll(fds, 2, MM_UPLINK_PROBE_INTERVAL_S * 1000)) < 0 &&
+                errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (status > 0 && fds[0].revents) {
+            break;
+        }
+
+        /* The WWAN session came or went: take a look now, probes and all. */
+        if (status > 0 && read(uplink_state.wake_fd, &value,
+                sizeof(value)) < 0) {
+            perror("read");
+        }
+    }
+
+    return NULL;
+}
+
+bool mm_uplink_is_enabled(void) {
+    return uplink_state.running;
+}
+
+/* Whether some uplink other than the WWAN interface is carrying traffic. */
+bool mm_uplink_is_failed_over(const char *wwan_ifname) {
+    const struct mm_uplink *uplink;
+    bool failed_over;
+
+    pthread_mutex_lock(&uplink_state.lock);
+    uplink = find_uplink(wwan_ifname);
+
+    if (uplink_state.multipath) {
+        failed_over = uplink_state.running &&
+            uplink_state.multipath_installed &&
+            (uplink == NULL || uplink->weight == 0);
+    }
+
+    else {
+        failed_over = uplink_state.running &&
+            uplink_state.active != uplink_state.count &&
+            uplink_state.uplinks + uplink_state.active != uplink;
+    }
+
+    pthread_mutex_unlock(&uplink_state.lock);
+    return failed_over;
+}
+
+/* Modems whose WWAN interface isn't an uplink route in the main table. */
+uint32_t mm_uplink_get_wwan_table(const char *wwan_ifname) {
+    const struct mm_uplink *uplink;
+
+    return uplink_state.running &&
+        (uplink = find_uplink(wwan_ifname)) != NULL
+        ? uplink->table
+        : RT_TABLE_MAIN;
+}
+
+/*
+ * Lets the WWAN uplink go the moment its session drops, rather than after
+ * it has lost enough probes, and lets it back in once a session is up.
+ */
+void mm_uplink_set_wwan_session_up(const char *wwan_ifname, bool up) {
+    struct mm_uplink *uplink;
+    uint64_t value = 1;
+
+    if (!uplink_state.running ||
+            (uplink = find_uplink(wwan_ifname)) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&uplink_state.lock);
+    uplink->session_down = !up;
+    pthread_mutex_unlock(&uplink_state.lock);
+
+    if (write(uplink_state.wake_fd, &value, sizeof(value)) !=
+            sizeof(value)) {
+        perror("write");
+    }
+}
+
+int mm_uplink_start(void) {
+    struct nl_cache *rule_cache;
+    int status;
+
+    if ((status = load_config())) {
+        return status > 0 ? 0 : -1;
+    }
+
+    uplink_state.active = uplink_state.count;
+
+    if ((uplink_state.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    if ((uplink_state.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    if ((uplink_state.nl = nl_socket_alloc()) == NULL) {
+        perror("nl_socket_alloc");
+        close(uplink_state.wake_fd);
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    if ((status = nl_connect(uplink_state.nl, NETLINK_ROUTE)) ||
+            (status = rtnl_link_alloc_cache(uplink_state.nl, AF_UNSPEC,
+            &uplink_state.link_cache))) {
+        MM_LOG("%smm_uplink: %s\n", nl_geterror(status));
+        nl_socket_free(uplink_state.nl);
+        close(uplink_state.wake_fd);
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    if ((status = rtnl_addr_alloc_cache(uplink_state.nl,
+            &uplink_state.addr_cache))) {
+        MM_LOG("%smm_uplink: %s\n", nl_geterror(status));
+        nl_cache_free(uplink_state.link_cache);
+        nl_socket_free(uplink_state.nl);
+        close(uplink_state.wake_fd);
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    if ((status = rtnl_route_alloc_cache(uplink_state.nl, AF_INET, 0,
+            &uplink_state.route_cache))) {
+        MM_LOG("%smm_uplink: %s\n", nl_geterror(status));
+        nl_cache_free(uplink_state.addr_cache);
+        nl_cache_free(uplink_state.link_cache);
+        nl_socket_free(uplink_state.nl);
+        close(uplink_state.wake_fd);
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    if (!rtnl_rule_alloc_cache(uplink_state.nl, AF_INET, &rule_cache)) {
+        nl_cache_foreach(rule_cache, flush_stale_rule, NULL);
+        nl_cache_free(rule_cache);
+    }
+
+    if ((status = pthread_create(&uplink_state.thread, NULL,
+            uplink_thread_main, NULL))) {
+        MM_LOG("%smm_uplink: pthread_create: %s\n", strerror(status));
+        nl_cache_free(uplink_state.route_cache);
+        nl_cache_free(uplink_state.addr_cache);
+        nl_cache_free(uplink_state.link_cache);
+        nl_socket_free(uplink_state.nl);
+        close(uplink_state.wake_fd);
+        close(uplink_state.stop_fd);
+        return -1;
+    }
+
+    MM_LOG("%sMulti-uplink mode (%s) enabled with %zu uplinks\n",
+            uplink_state.multipath ? "multipath" : "failover",
+            uplink_state.count);
+
+    uplink_state.running = true;
+    return 0;
+}
+
+/* Takes down our routes and rules; whatever else was there carries on. */
+void mm_uplink_stop(void) {
+    struct mm_uplink *uplink;
+    uint64_t value = 1;
+    size_t i;
+
+    if (!uplink_state.running) {
+        return;
+    }
+
+    if (write(uplink_state.stop_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+
+    pthread_join(uplink_state.thread, NULL);
+
+    if (uplink_state.active != uplink_state.count ||
+            uplink_state.multipath_installed) {
+        set_default_route(RT_TABLE_MAIN, uplink_state.uplinks, false);
+    }
+
+    /* Deleting the group first leaves the members unreferenced. */
+    if (uplink_state.multipath_installed && !uplink_state.legacy_multipath) {
+        delete_nexthop(MM_UPLINK_NEXTHOP_ID);
+
+        for (i = 0; i < uplink_state.count; i++) {
+            if (uplink_state.uplinks[i].weight != 0) {
+                delete_nexthop(MM_UPLINK_NEXTHOP_ID + 1 + (uint32_t) i);
+            }
+        }
+    }
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        if (uplink->table_route_installed) {
+            set_default_route(uplink->table, uplink, false);
+        }
+
+        if (uplink->rule_address != 0) {
+            set_rule(uplink, i, uplink->rule_address, false);
+        }
+
+        if (uplink->probe_fd >= 0) {
+            close(uplink->probe_fd);
+        }
+    }
+
+    pthread_mutex_lock(&uplink_state.lock);
+    uplink_state.running = false;
+    uplink_state.multipath_installed = false;
+    pthread_mutex_unlock(&uplink_state.lock);
+
+    nl_cache_free(uplink_state.route_cache);
+    nl_cache_free(uplink_state.addr_cache);
+    nl_cache_free(uplink_state.link_cache);
+    nl_socket_free(uplink_state.nl);
+    close(uplink_state.wake_fd);
+    close(uplink_state.stop_fd);
+}
+
+void mm_uplink_write_metrics(FILE *f, void *context) {
+    const struct mm_uplink *uplink;
+    size_t i;
+
+    pthread_mutex_lock(&uplink_state.lock);
+
+    if (!uplink_state.running) {
+        pthread_mutex_unlock(&uplink_state.lock);
+        return;
+    }
+
+    fprintf(f, "# HELP modem_monitor_uplink_healthy "
+            "Whether each uplink is answering probes.\n"
+            "# TYPE modem_monitor_uplink_healthy gauge\n");
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        fprintf(f, "modem_monitor_uplink_healthy{interface=\"%s\"} %d\n",
+                uplink->ifname, uplink->healthy);
+    }
+
+    fprintf(f, "# HELP modem_monitor_uplink_active "
+            "Whether each uplink carries the main default route.\n"
+            "# TYPE modem_monitor_uplink_active gauge\n");
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        fprintf(f, "modem_monitor_uplink_active{interface=\"%s\"} %d\n",
+                uplink->ifname, uplink_state.multipath
+                ? uplink->weight != 0 : i == uplink_state.active);
+    }
+
+    if (uplink_state.multipath) {
+        fprintf(f, "# HELP modem_monitor_uplink_weight "
+                "Each uplink's weight in the multipath default route.\n"
+                "# TYPE modem_monitor_uplink_weight gauge\n");
+
+        for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+                i++, uplink++) {
+            fprintf(f, "modem_monitor_uplink_weight{interface=\"%s\"} %u\n",
+                    uplink->ifname, uplink->weight);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_uplink_rtt_seconds "
+            "Smoothed round-trip time of each uplink's probes.\n"
+            "# TYPE modem_monitor_uplink_rtt_seconds gauge\n");
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        fprintf(f, "modem_monitor_uplink_rtt_seconds{interface=\"%s\"} "
+                "%"PRIu64".%06"PRIu64"\n", uplink->ifname,
+                uplink->rtt_us / 1000000U, uplink->rtt_us % 1000000U);
+    }
+
+    fprintf(f, "# HELP modem_monitor_uplink_capacity_bytes_per_second "
+            "Capacity of each uplink (as configured, else its recent "
+            "peak rate).\n"
+            "# TYPE modem_monitor_uplink_capacity_bytes_per_second gauge\n");
+
+    for (i = 0, uplink = uplink_state.uplinks; i < uplink_state.count;
+            i++, uplink++) {
+        fprintf(f, "modem_monitor_uplink_capacity_bytes_per_second"
+                "{interface=\"%s\"} %"PRIu64"\n", uplink->ifname,
+                uplink->capacity_bytes_s);
+    }
+
+    fprintf(f, "# HELP modem_monitor_uplink_switches_total "
+            "Times the main default route moved to another uplink.\n"
+            "# TYPE modem_monitor_uplink_switches_total counter\n"
+            "modem_monitor_uplink_switches_total %"PRIu64"\n",
+            uplink_state.switches);
+
+    pthread_mutex_unlock(&uplink_state.lock);
+}
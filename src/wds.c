@@ -8,21 +8,98 @@
  * 'LICENSE', which is part of this source code package.
  */
 
+#include "mm_capture.h"
+#include "mm_events.h"
 #include "mm_log.h"
+#include "mm_qmi.h"
+#include "mm_qmi_engine.h"
+#include "mm_qmux.h"
+#include "mm_time.h"
 #include "mm_wds.h"
 
 #include <msgid.h>
 #include <QmiSyncObject.h>
 #include <wds.h>
 
+#include <arpa/inet.h>
+
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
+/* TLVs picked out of responses and indications on the native path. */
+#define WDS_TLV_AUTOCONNECT_SETTING 0x01U
+#define WDS_TLV_AUTOCONNECT_ROAM_SETTING 0x10U
+#define WDS_TLV_CONNECTION_STATUS 0x01U
+#define WDS_TLV_IP_FAMILY_PREFERENCE 0x01U
+#define WDS_TLV_PACKET_DATA_HANDLE 0x01U
+#define WDS_TLV_CALL_END_REASON 0x10U
+#define WDS_TLV_VERBOSE_CALL_END_REASON 0x11U
+#define WDS_TLV_REQUESTED_SETTINGS 0x10U
+#define WDS_TLV_IPV4_ADDRESS 0x1EU
+#define WDS_TLV_IPV4_GATEWAY 0x20U
+#define WDS_TLV_IPV4_SUBNET_MASK 0x21U
+#define WDS_TLV_IPV6_ADDRESS 0x25U
+#define WDS_TLV_IPV6_GATEWAY 0x26U
+#define WDS_TLV_PROFILE_INDEX_3GPP 0x31U
+
+/* As decoded from a packet service status indication by either path. */
+struct packet_service_status {
+    uint32_t session_end_reason;
+    uint32_t verbose_session_end_reason_type;
+    uint32_t verbose_session_end_reason;
+
+    uint8_t connection_status;
+    uint8_t host_reconfiguration_required;
+    bool reason_present, verbose_reason_present;
+};
+
+static int get_autoconnect_settings_native(struct mm_qmi_client *,
+        enum mm_wds_autoconnect_setting *,
+        enum mm_wds_autoconnect_roam_setting *);
+
 static const char *get_connection_status_string(uint8_t);
+static uint16_t get_le16(const uint8_t *);
 static const char *get_reconfiguration_string(uint8_t);
-static void wds_indication_callback(uint8_t *, uint16_t, void *);
+
+static int get_runtime_settings_native(struct mm_wds_session *,
+        struct mm_wds_runtime_settings *, bool *, bool *);
+
+static void handle_packet_service_status(struct mm_wds_session *,
+        const struct packet_service_status *);
+
+static int start_data_session_native(struct mm_wds_session *, uint32_t *,
+        uint32_t *, uint32_t *, bool *, bool *);
+
+int get_autoconnect_settings_native(struct mm_qmi_client *wds,
+        enum mm_wds_autoconnect_setting *autoconnect_setting,
+        enum mm_wds_autoconnect_roam_setting *autoconnect_roam_setting) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint8_t value;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_WDS_GET_AUTOCONNECT_SETTING);
+
+    if ((status = mm_qmi_send_native_request(wds, &request, &response,
+            DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if (mm_qmi_message_get_u8(&response, WDS_TLV_AUTOCONNECT_SETTING,
+            &value)) {
+        *autoconnect_setting = (enum mm_wds_autoconnect_setting) value;
+    }
+
+    if (mm_qmi_message_get_u8(&response, WDS_TLV_AUTOCONNECT_ROAM_SETTING,
+            &value)) {
+        *autoconnect_roam_setting =
+                (enum mm_wds_autoconnect_roam_setting) value;
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
 
 const char *get_connection_status_string(uint8_t connection_status) {
     const char *statuses[] = {
@@ -40,12 +117,233 @@ const char *get_connection_status_string(uint8_t connection_status) {
     return statuses[connection_status - 1];
 }
 
+uint16_t get_le16(const uint8_t *buf) {
+    return (uint16_t) (buf[0] | buf[1] << 8);
+}
+
 const char *get_reconfiguration_string(
         uint8_t reconfiguration_required) {
     return !!reconfiguration_required ? "YES" : "NO";
 }
 
-int mm_wds_get_autoconnect_settings(QmiService *wds,
+/* Addresses are decoded straight out of the response as it lies. */
+int get_runtime_settings_native(struct mm_wds_session *session,
+        struct mm_wds_runtime_settings *settings, bool *address_present,
+        bool *gateway_present) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint32_t address, gateway, subnet_mask;
+    const uint8_t *tlv;
+    uint16_t length;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_WDS_GET_RUNTIME_SETTINGS);
+    mm_qmi_request_put_u32(&request, WDS_TLV_REQUESTED_SETTINGS, 0x300);
+
+    if ((status = mm_qmi_send_native_request(&session->wds, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if (session->family == AF_INET) {
+        if (mm_qmi_message_get_u32(&response, WDS_TLV_IPV4_ADDRESS,
+                &address)) {
+            *address_present = true;
+            settings->address.in.s_addr = htonl(address);
+        }
+
+        if (mm_qmi_message_get_u32(&response, WDS_TLV_IPV4_GATEWAY,
+                &gateway) && mm_qmi_message_get_u32(&response,
+                WDS_TLV_IPV4_SUBNET_MASK, &subnet_mask)) {
+            *gateway_present = true;
+            settings->gateway.in.s_addr = htonl(gateway);
+
+            for (settings->prefix_length = 32; settings->prefix_length > 0 &&
+                    !(subnet_mask & 0x1); settings->prefix_length--) {
+                subnet_mask = subnet_mask >> 1;
+            }
+        }
+    }
+
+    else if (session->family == AF_INET6) {
+        if ((tlv = mm_qmi_message_find_tlv(&response, WDS_TLV_IPV6_ADDRESS,
+                &length)) != NULL && length >= 17) {
+            memcpy(settings->address.in6.s6_addr, tlv, 16);
+            *address_present = true;
+            settings->prefix_length = tlv[16];
+        }
+
+        if ((tlv = mm_qmi_message_find_tlv(&response, WDS_TLV_IPV6_GATEWAY,
+                &length)) != NULL && length >= 17) {
+            memcpy(settings->gateway.in6.s6_addr, tlv, 16);
+            *gateway_present = true;
+
+            if (settings->prefix_length &&
+                    settings->prefix_length != tlv[16]) {
+                MM_LOG("%sIPv6 prefix length for address and "
+                        "gateway differ? (/%d /%d)\n",
+                        settings->prefix_length, tlv[16]);
+            }
+
+            else {
+                settings->prefix_length = tlv[16];
+            }
+        }
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
+
+/* Mirrors the SDK path: reasons are only reported alongside a handle. */
+int start_data_session_native(struct mm_wds_session *session,
+        uint32_t *failure_reason, uint32_t *verbose_failure_reason_type,
+        uint32_t *verbose_failure_reason, bool *reason_present,
+        bool *verbose_reason_present) {
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    const uint8_t *tlv;
+    uint16_t length, reason;
+    int status;
+
+    mm_qmi_request_init(&request, MM_QMI_WDS_START_NETWORK_INTERFACE);
+    mm_qmi_request_put_u8(&request, WDS_TLV_PROFILE_INDEX_3GPP,
+            (uint8_t) session->profile);
+
+    if ((status = mm_qmi_send_native_request(&session->wds, &request,
+            &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) != eQCWWAN_ERR_NONE) {
+        return status;
+    }
+
+    if (!mm_qmi_message_get_u32(&response, WDS_TLV_PACKET_DATA_HANDLE,
+            &session->session_id)) {
+        return -1;
+    }
+
+    if (mm_qmi_message_get_u16(&response, WDS_TLV_CALL_END_REASON,
+            &reason)) {
+        *failure_reason = reason;
+        *reason_present = true;
+    }
+
+    if ((tlv = mm_qmi_message_find_tlv(&response,
+            WDS_TLV_VERBOSE_CALL_END_REASON, &length)) != NULL &&
+            length >= 4) {
+        *verbose_failure_reason_type = get_le16(tlv);
+        *verbose_failure_reason = get_le16(tlv + 2);
+        *verbose_reason_present = true;
+    }
+
+    return eQCWWAN_ERR_NONE;
+}
+
+void handle_packet_service_status(struct mm_wds_session *session,
+        const struct packet_service_status *status) {
+    uint8_t connection_status = status->connection_status;
+    uint32_t session_id;
+
+    /* Indications can arrive without a session to attribute them to. */
+    session_id = session ? session->session_id : 0;
+
+    if (session && status->reason_present) {
+        session->last_end_reason = (uint16_t) status->session_end_reason;
+    }
+
+    if (status->verbose_reason_present) {
+        if (status->reason_present) {
+            MM_LOG("%sPacket service signaled session teardown: "
+                "Session=%"PRIx32", "
+                "ConnectionStatus=%s, "
+                "HostReconfigurationRequired=%s, "
+                "VerboseSessionEndReasonType=%"PRIu32", "
+                "VerboseSessionEndReason=%"PRIu32", "
+                "SessionEndReason=%"PRIu32"\n",
+                session_id,
+                get_connection_status_string(connection_status),
+                get_reconfiguration_string(
+                    status->host_reconfiguration_required),
+                status->verbose_session_end_reason_type,
+                status->verbose_session_end_reason,
+                status->session_end_reason);
+        }
+
+        else {
+            MM_LOG("%sPacket service signaled session teardown: "
+                "Session=%"PRIx32", "
+                "ConnectionStatus=%s, "
+                "HostReconfigurationRequired=%s, "
+                "VerboseFailureReasonType=%"PRIu32", "
+                "VerboseFailureReason=%"PRIu32"\n",
+                session_id,
+                get_connection_status_string(connection_status),
+                get_reconfiguration_string(
+                    status->host_reconfiguration_required),
+                status->verbose_session_end_reason_type,
+                status->verbose_session_end_reason);
+        }
+    }
+
+    else if (status->reason_present) {
+        MM_LOG("%sPacket service signaled session teardown: "
+            "Session=%"PRIx32", "
+            "ConnectionStatus=%s, "
+            "HostReconfigurationRequired=%s, "
+            "SessionEndReason=%"PRIu32"\n",
+            session_id,
+            get_connection_status_string(connection_status),
+            get_reconfiguration_string(
+                status->host_reconfiguration_required),
+            status->session_end_reason);
+    }
+
+    else {
+        MM_LOG("%sPacket service indication received: "
+            "Session=%"PRIx32", "
+            "ConnectionStatus=%s, "
+            "HostReconfigurationRequired=%s\n",
+            session_id,
+            get_connection_status_string(connection_status),
+            get_reconfiguration_string(
+                status->host_reconfiguration_required));
+    }
+
+    /*
+     * Transient states are only noted here: the main loop decides if
+     * they've lasted long enough to warrant tearing the session down.
+     */
+    if (session && session->session_id && (connection_status ==
+            MM_WDS_CONNECTION_STATUS_SUSPENDED || connection_status ==
+            MM_WDS_CONNECTION_STATUS_AUTHENTICATING)) {
+        if (!__atomic_load_n(&session->transient_since_us,
+                __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&session->transient_since_us,
+                    mm_time_monotonic_us(), __ATOMIC_RELEASE);
+
+            mm_events_post_to(session->events,
+                    MM_EVENT_SESSION_TRANSIENT);
+        }
+    }
+
+    else if (session && session->session_id && connection_status ==
+            MM_WDS_CONNECTION_STATUS_CONNECTED && __atomic_load_n(
+            &session->transient_since_us, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&session->transient_since_us, 0, __ATOMIC_RELEASE);
+        mm_events_post_to(session->events, MM_EVENT_SESSION_TRANSIENT);
+    }
+
+    /* If we ended the session, then do not signal session teardown. */
+    if (session && session->session_id && connection_status ==
+            MM_WDS_CONNECTION_STATUS_DISCONNECTED && !(
+            (status->reason_present && status->session_end_reason == 2) ||
+            (status->verbose_reason_present &&
+                status->verbose_session_end_reason_type == 3 &&
+                status->verbose_session_end_reason == 2000))) {
+        MM_LOG("%s%s\n", "Requesting main thread to teardown the session");
+        session->teardown_requested = true;
+        mm_events_post_to(session->events, MM_EVENT_SESSION_TEARDOWN);
+    }
+}
+
+int mm_wds_get_autoconnect_settings(struct mm_qmi_client *wds,
         enum mm_wds_autoconnect_setting *autoconnect_setting,
         enum mm_wds_autoconnect_roam_setting *autoconnect_roam_setting) {
     unpack_wds_GetAutoconnectSetting_t resp;
@@ -53,9 +351,16 @@ int mm_wds_get_autoconnect_settings(QmiService *wds,
 
     *autoconnect_setting = MM_WDS_AUTOCONNECT_SETTING_INVALID;
     *autoconnect_roam_setting = MM_WDS_AUTOCONNECT_ROAM_SETTING_INVALID;
+
+    if (wds->native) {
+        return get_autoconnect_settings_native(wds, autoconnect_setting,
+                autoconnect_roam_setting);
+    }
+
     memset(&resp, 0, sizeof(resp));
 
-    if ((status = QmiService_SendSyncRequestNoInput(wds,
+    if ((status = mm_qmi_send_sync_request_no_input(wds,
+            MM_QMI_WDS_GET_AUTOCONNECT_SETTING,
             (pack_func_no_input) pack_wds_GetAutoconnect,
             "pack_wds_GetAutoconnect",
             (unpack_func) unpack_wds_GetAutoconnectExt,
@@ -85,16 +390,22 @@ int mm_wds_get_runtime_settings(struct mm_wds_session *session,
     uint32_t request_settings;
     int status;
 
-    memset(&req, 0, sizeof(req));
-    memset(&resp, 0, sizeof(resp));
     memset(settings, 0, sizeof(*settings));
+    *address_present = false;
+    *gateway_present = false;
+
+    if (session->wds.native) {
+        return get_runtime_settings_native(session, settings,
+                address_present, gateway_present);
+    }
 
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
     request_settings = 0x300;
     req.pReqSettings = &request_settings;
-    *address_present = false;
-    *gateway_present = false;
 
-    if ((status = QmiService_SendSyncRequest(&session->wds,
+    if ((status = mm_qmi_send_sync_request(&session->wds,
+            MM_QMI_WDS_GET_RUNTIME_SETTINGS,
             (pack_func) pack_wds_SLQSGetRuntimeSettings,
             "pack_wds_SLQSGetRuntimeSettings", &req,
             (unpack_func) unpack_wds_SLQSGetRuntimeSettings,
@@ -173,12 +484,35 @@ int mm_wds_get_runtime_settings(struct mm_wds_session *session,
 int mm_wds_get_session_state(struct mm_wds_session *session,
         uint32_t *connection_status) {
     unpack_wds_GetSessionState_t resp;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
+    uint8_t value;
     int status;
 
-    memset(&resp, 0, sizeof(resp));
     *connection_status = 0;
 
-    if ((status = QmiService_SendSyncRequestNoInput(&session->wds,
+    if (session->wds.native) {
+        mm_qmi_request_init(&request, MM_QMI_WDS_GET_PKT_SRVC_STATUS);
+
+        if ((status = mm_qmi_send_native_request(&session->wds, &request,
+                &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S)) !=
+                eQCWWAN_ERR_NONE) {
+            return status;
+        }
+
+        if (!mm_qmi_message_get_u8(&response, WDS_TLV_CONNECTION_STATUS,
+                &value)) {
+            return -1;
+        }
+
+        *connection_status = value;
+        return eQCWWAN_ERR_NONE;
+    }
+
+    memset(&resp, 0, sizeof(resp));
+
+    if ((status = mm_qmi_send_sync_request_no_input(&session->wds,
+            MM_QMI_WDS_GET_PKT_SRVC_STATUS,
             (pack_func_no_input) pack_wds_GetSessionState,
             "pack_wds_GetSessionState",
             (unpack_func) unpack_wds_GetSessionState,
@@ -198,15 +532,13 @@ int mm_wds_get_session_state(struct mm_wds_session *session,
     return status;
 }
 
-int mm_wds_initialize(QmiService *wds, CtlService *ctl,
+int mm_wds_initialize(struct mm_qmi_client *wds, struct mm_qmux *qmux,
         struct mm_wds_session *context) {
-    memset(wds, 0, sizeof(*wds));
-
-    return CtlService_InitializeRegularServiceEx(ctl,
-            wds, eWDS, wds_indication_callback, context, 0);
+    return mm_qmux_open_client(qmux, wds, eWDS, mm_wds_indication_callback,
+            mm_wds_native_indication_callback, context);
 }
 
-int mm_wds_set_autoconnect_settings(QmiService *wds,
+int mm_wds_set_autoconnect_settings(struct mm_qmi_client *wds,
         enum mm_wds_autoconnect_setting autoconnect_setting,
         enum mm_wds_autoconnect_roam_setting autoconnect_roam_setting) {
     enum mm_wds_autoconnect_setting current_autoconnect_setting;
@@ -215,6 +547,8 @@ int mm_wds_set_autoconnect_settings(QmiService *wds,
 
     pack_wds_SetAutoconnect_t req;
     unpack_wds_GetAutoconnectSetting_t resp;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
 
     /*
      * Query the current autoconnect settings and check if the new
@@ -234,12 +568,24 @@ int mm_wds_set_autoconnect_settings(QmiService *wds,
         return eQCWWAN_ERR_NONE;
     }
 
+    if (wds->native) {
+        mm_qmi_request_init(&request, MM_QMI_WDS_SET_AUTOCONNECT_SETTINGS);
+        mm_qmi_request_put_u8(&request, WDS_TLV_AUTOCONNECT_SETTING,
+                (uint8_t) autoconnect_setting);
+        mm_qmi_request_put_u8(&request, WDS_TLV_AUTOCONNECT_ROAM_SETTING,
+                (uint8_t) autoconnect_roam_setting);
+
+        return mm_qmi_send_native_request(wds, &request, &response,
+                DEFAULT_SYNC_REQUEST_TIMEOUT_S);
+    }
+
     memset(&req, 0, sizeof(req));
     memset(&resp, 0, sizeof(resp));
     req.acsetting = autoconnect_setting;
     req.acroamsetting = autoconnect_roam_setting;
 
-    if ((status = QmiService_SendSyncRequest(wds,
+    if ((status = mm_qmi_send_sync_request(wds,
+            MM_QMI_WDS_SET_AUTOCONNECT_SETTINGS,
             (pack_func) pack_wds_SetAutoconnect,
             "pack_wds_SetAutoconnect", &req,
             (unpack_func) unpack_wds_SetAutoconnect,
@@ -253,17 +599,29 @@ int mm_wds_set_autoconnect_settings(QmiService *wds,
     return status;
 }
 
-int mm_wds_set_ip_family_preference(QmiService *wds,
+int mm_wds_set_ip_family_preference(struct mm_qmi_client *wds,
         enum mm_wds_ip_family_preference preference) {
     pack_wds_SLQSSetIPFamilyPreference_t req;
     unpack_wds_SLQSSetIPFamilyPreference_t resp;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
     int status;
 
+    if (wds->native) {
+        mm_qmi_request_init(&request, MM_QMI_WDS_SET_CLIENT_IP_FAMILY_PREF);
+        mm_qmi_request_put_u8(&request, WDS_TLV_IP_FAMILY_PREFERENCE,
+                (uint8_t) preference);
+
+        return mm_qmi_send_native_request(wds, &request, &response,
+                DEFAULT_SYNC_REQUEST_TIMEOUT_S);
+    }
+
     memset(&req, 0, sizeof(req));
     memset(&resp, 0, sizeof(resp));
     req.IPFamilyPreference = preference;
 
-    if ((status = QmiService_SendSyncRequest(wds,
+    if ((status = mm_qmi_send_sync_request(wds,
+            MM_QMI_WDS_SET_CLIENT_IP_FAMILY_PREF,
             (pack_func) pack_wds_SLQSSetIPFamilyPreference,
             "pack_wds_SLQSSetIPFamilyPreference", &req,
             (unpack_func) unpack_wds_SLQSSetIPFamilyPreference,
@@ -277,8 +635,8 @@ int mm_wds_set_ip_family_preference(QmiService *wds,
     return status;
 }
 
-int mm_wds_shutdown(QmiService *wds, CtlService *ctl) {
-    return CtlService_ShutDownRegularService(ctl, wds);
+int mm_wds_shutdown(struct mm_qmi_client *wds, struct mm_qmux *qmux) {
+    return mm_qmux_close_client(qmux, wds);
 }
 
 int mm_wds_start_data_session(struct mm_wds_session *session,
@@ -290,9 +648,6 @@ int mm_wds_start_data_session(struct mm_wds_session *session,
     unpack_wds_SLQSStartDataSession_t resp;
     int status;
 
-    memset(&req, 0, sizeof(req));
-    memset(&resp, 0, sizeof(resp));
-
     session->session_id = 0;
     session->profile = profile;
     session->family = family;
@@ -303,13 +658,22 @@ int mm_wds_start_data_session(struct mm_wds_session *session,
     *reason_present = false;
     *verbose_reason_present = false;
 
+    if (session->wds.native) {
+        return start_data_session_native(session, failure_reason,
+                verbose_failure_reason_type, verbose_failure_reason,
+                reason_present, verbose_reason_present);
+    }
+
+    memset(&req, 0, sizeof(req));
+    memset(&resp, 0, sizeof(resp));
     req.pprofileid3gpp = &session->profile;
     resp.psid = &session->session_id;
     resp.pFailureReason = failure_reason;
     resp.pVerboseFailReasonType = verbose_failure_reason_type;
     resp.pVerboseFailureReason = verbose_failure_reason;
 
-    if ((status = QmiService_SendSyncRequest(&session->wds,
+    if ((status = mm_qmi_send_sync_request(&session->wds,
+            MM_QMI_WDS_START_NETWORK_INTERFACE,
             (pack_func) pack_wds_SLQSStartDataSession,
             "pack_wds_SLQSStartDataSession", &req,
             (unpack_func) unpack_wds_SLQSStartDataSession,
@@ -338,13 +702,25 @@ int mm_wds_start_data_session(struct mm_wds_session *session,
 int mm_wds_stop_data_session(struct mm_wds_session *session) {
     pack_wds_SLQSStopDataSession_t req;
     unpack_wds_SLQSStopDataSession_t resp;
+    struct mm_qmi_request request;
+    struct mm_qmi_message response;
     int status;
 
+    if (session->wds.native) {
+        mm_qmi_request_init(&request, MM_QMI_WDS_STOP_NETWORK_INTERFACE);
+        mm_qmi_request_put_u32(&request, WDS_TLV_PACKET_DATA_HANDLE,
+                session->session_id);
+
+        return mm_qmi_send_native_request(&session->wds, &request,
+                &response, DEFAULT_SYNC_REQUEST_TIMEOUT_S);
+    }
+
     memset(&req, 0, sizeof(req));
     memset(&resp, 0, sizeof(resp));
     req.psid = &session->session_id;
 
-    if ((status = QmiService_SendSyncRequest(&session->wds,
+    if ((status = mm_qmi_send_sync_request(&session->wds,
+            MM_QMI_WDS_STOP_NETWORK_INTERFACE,
             (pack_func) pack_wds_SLQSStopDataSession,
             "pack_wds_SLQSStopDataSession", &req,
             (unpack_func) unpack_wds_SLQSStopDataSession,
@@ -358,7 +734,7 @@ int mm_wds_stop_data_session(struct mm_wds_session *session) {
     return status;
 }
 
-void wds_indication_callback(uint8_t* qmi_packet,
+void mm_wds_indication_callback(uint8_t* qmi_packet,
         uint16_t qmi_packet_size, void* context) {
     struct mm_wds_session *session = (struct mm_wds_session *) context;
     unpack_qmi_t resp_context;
@@ -367,20 +743,21 @@ void wds_indication_callback(uint8_t* qmi_packet,
 
     /* Additional locals for processing indication callbacks */
     unpack_wds_SLQSSetPacketSrvStatusCallback_t packet_srv_status;
-
-    bool reason_present, verbose_reason_present;
-    uint8_t connection_status, host_reconfiguration_required;
-    uint32_t session_end_reason, verbose_session_end_reason_type,
-            verbose_session_end_reason;
+    struct packet_service_status srv_status;
 
     (void) message_str;
     message_str = helper_get_resp_ctx(eWDS, qmi_packet, qmi_packet_size,
             &resp_context);
 
+    mm_capture_record(MM_CAPTURE_RECORD_INDICATION,
+            session ? session->wds.modem : 0, eWDS,
+            session ? session->wds.client_id : 0, resp_context.msgid,
+            qmi_packet, qmi_packet_size);
+
     switch (resp_context.msgid) {
     case eQMI_WDS_PKT_SRVC_STATUS_IND:
         memset(&packet_srv_status, 0, sizeof(packet_srv_status));
-        reason_present = verbose_reason_present = false;
+        memset(&srv_status, 0, sizeof(srv_status));
 
         if ((status = unpack_wds_SLQSSetPacketSrvStatusCallback(qmi_packet,
                 qmi_packet_size, &packet_srv_status) != eQCWWAN_ERR_NONE)) {
@@ -399,102 +776,79 @@ void wds_indication_callback(uint8_t* qmi_packet,
         }
 
         if (swi_uint256_get_bit(packet_srv_status.ParamPresenceMask, 16)) {
-            reason_present = true;
-            session_end_reason = packet_srv_status.sessionEndReason;
-        }
-
-        else {
-            reason_present = false;
-            session_end_reason = 0;
+            srv_status.reason_present = true;
+            srv_status.session_end_reason =
+                    packet_srv_status.sessionEndReason;
         }
 
         if (swi_uint256_get_bit(packet_srv_status.ParamPresenceMask, 17)) {
-            verbose_reason_present = true;
+            srv_status.verbose_reason_present = true;
 
-            verbose_session_end_reason_type =
+            srv_status.verbose_session_end_reason_type =
                     packet_srv_status.verboseSessnEndReasonType;
-            verbose_session_end_reason =
+            srv_status.verbose_session_end_reason =
                     packet_srv_status.verboseSessnEndReason;
         }
 
-        else {
-            verbose_reason_present = false;
-            verbose_session_end_reason_type = 0;
-            verbose_session_end_reason = 0;
-        }
-
-        connection_status = packet_srv_status.conn_status;
-        host_reconfiguration_required = packet_srv_status.reconfigReqd;
-
-        if (verbose_reason_present) {
-            if (reason_present) {
-                MM_LOG("%sPacket service signaled session teardown: "
-                    "Session=%"PRIx32", "
-                    "ConnectionStatus=%s, "
-                    "HostReconfigurationRequired=%s, "
-                    "VerboseSessionEndReasonType=%"PRIu16", "
-                    "VerboseSessionEndReason=%"PRIu16", "
-                    "SessionEndReason=%"PRIu16"\n",
-                    session->session_id,
-                    get_connection_status_string(connection_status),
-                    get_reconfiguration_string(host_reconfiguration_required),
-                    verbose_session_end_reason_type,
-                    verbose_session_end_reason,
-                    session_end_reason);
-            }
+        srv_status.connection_status = packet_srv_status.conn_status;
+        srv_status.host_reconfiguration_required =
+                packet_srv_status.reconfigReqd;
 
-            else {
-                MM_LOG("%sPacket service signaled session teardown: "
-                    "Session=%"PRIx32", "
-                    "ConnectionStatus=%s, "
-                    "HostReconfigurationRequired=%s, "
-                    "VerboseFailureReasonType=%"PRIu32", "
-                    "VerboseFailureReason=%"PRIu32"\n",
-                    session->session_id,
-                    get_connection_status_string(connection_status),
-                    get_reconfiguration_string(host_reconfiguration_required),
-                    verbose_session_end_reason_type,
-                    verbose_session_end_reason);
-            }
-        }
+        handle_packet_service_status(session, &srv_status);
+        break;
 
-        else if (reason_present) {
-            MM_LOG("%sPacket service signaled session teardown: "
-                "Session=%"PRIx32", "
-                "ConnectionStatus=%s, "
-                "HostReconfigurationRequired=%s, "
-                "SessionEndReason=%"PRIu16"\n",
-                session->session_id,
-                get_connection_status_string(connection_status),
-                get_reconfiguration_string(host_reconfiguration_required),
-                session_end_reason);
+    default:
+        MM_LOG("%sUnhandled WDS indication: MessageID=%"PRIu16"\n",
+                resp_context.msgid);
+        break;
+    }
+}
+
+void mm_wds_native_indication_callback(const struct mm_qmi_message *message,
+        void *context) {
+    struct mm_wds_session *session = (struct mm_wds_session *) context;
+    struct packet_service_status srv_status;
+    const uint8_t *tlv;
+    uint16_t length, reason;
+
+    mm_capture_record(MM_CAPTURE_RECORD_INDICATION,
+            session ? session->wds.modem : 0, eWDS,
+            session ? session->wds.client_id : 0, message->message_id,
+            message->sdu, message->sdu_length);
+
+    switch (message->message_id) {
+    case MM_QMI_WDS_GET_PKT_SRVC_STATUS:
+        memset(&srv_status, 0, sizeof(srv_status));
+
+        if ((tlv = mm_qmi_message_find_tlv(message,
+                WDS_TLV_CONNECTION_STATUS, &length)) == NULL || length < 2) {
+            MM_LOG("%s%s\n", "Missing context in packet service indication");
+            break;
         }
 
-        else {
-            MM_LOG("%sPacket service indication received: "
-                "Session=%p, "
-                "ConnectionStatus=%s, "
-                "HostReconfigurationRequired=%s\n",
-                session,
-                get_connection_status_string(connection_status),
-                get_reconfiguration_string(host_reconfiguration_required));
+        srv_status.connection_status = tlv[0];
+        srv_status.host_reconfiguration_required = tlv[1];
+
+        if (mm_qmi_message_get_u16(message, WDS_TLV_CALL_END_REASON,
+                &reason)) {
+            srv_status.reason_present = true;
+            srv_status.session_end_reason = reason;
         }
 
-        /* If we ended the session, then do not signal session teardown. */
-        if (session && session->session_id && connection_status == 1 && !(
-                (reason_present && session_end_reason == 2) ||
-                (verbose_reason_present &&
-                    verbose_session_end_reason_type == 3 &&
-                    verbose_session_end_reason == 2000))) {
-            MM_LOG("%s%s\n", "Requesting main thread to teardown the session");
-            session->teardown_requested = true;
+        if ((tlv = mm_qmi_message_find_tlv(message,
+                WDS_TLV_VERBOSE_CALL_END_REASON, &length)) != NULL &&
+                length >= 4) {
+            srv_status.verbose_reason_present = true;
+            srv_status.verbose_session_end_reason_type = get_le16(tlv);
+            srv_status.verbose_session_end_reason = get_le16(tlv + 2);
         }
 
+        handle_packet_service_status(session, &srv_status);
         break;
 
     default:
         MM_LOG("%sUnhandled WDS indication: MessageID=%"PRIu16"\n",
-                resp_context.msgid);
+                message->message_id);
         break;
     }
 }
@@ -0,0 +1,1369 @@
+/*
+ * src/wireguard.c: Wireguard (generic netlink) helper functions
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_icmp.h"
+#include "mm_log.h"
+#include "mm_run_helpers.h"
+#include "mm_telemetry.h"
+#include "mm_time.h"
+#include "mm_wireguard.h"
+
+#include <libnl3/netlink/genl/ctrl.h>
+#include <libnl3/netlink/genl/genl.h>
+#include <libnl3/netlink/netlink.h>
+#include <linux/time_types.h>
+#include <linux/wireguard.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+struct mm_wireguard_state {
+    /*
+     * Modem threads and the host-chores owner all call in here: this
+     * serializes every use of the (not thread-safe) libnl socket and of
+     * the peer table, so one caller can't consume another's replies.
+     */
+    pthread_mutex_t op_lock;
+    struct nl_sock *sock;
+    int family;
+
+    /* Guards the peers (and counters) against the metrics writer. */
+    pthread_mutex_t lock;
+    struct mm_wireguard_peer peers[MM_WIREGUARD_MAX_PEERS];
+    size_t peer_count;
+
+    unsigned consecutive_faults;
+    uint64_t faults[MM_WIREGUARD_FAULT_MAX];
+    uint64_t handshakes_forced, config_repushes;
+
+    /* A config push still running in the background (or zero). */
+    pid_t repush_child;
+
+    /* Peer selection (MM_WIREGUARD_MAX_PEERS if none is selected). */
+    int probe_fd;
+    uint16_t probe_seq;
+    size_t selected, challenger;
+    unsigned challenger_rounds;
+    uint64_t switches;
+};
+
+static struct mm_wireguard_state wireguard = {
+    .op_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .probe_fd = -1,
+    .selected = MM_WIREGUARD_MAX_PEERS,
+};
+
+static enum mm_wireguard_fault check_tunnel(void);
+static void collect_probe_replies(void);
+static int decode_key(const char *, uint8_t *);
+static void encode_key(const uint8_t *, char *);
+static bool endpoints_equal(const struct mm_wireguard_peer *,
+        const struct sockaddr_storage *, socklen_t);
+
+static int get_device(void);
+static int handle_device_message(struct nl_msg *, void *);
+static int load_cached_endpoint(struct mm_wireguard_peer *);
+static int load_peers(void);
+static void parse_allowed_ips(char *, struct mm_wireguard_peer *);
+static int parse_endpoint(const char *, struct mm_wireguard_peer *);
+static int probe_peers(uint32_t *);
+static uint64_t probe_score(const struct mm_wireguard_peer *);
+static void push_probe_result(struct mm_wireguard_peer *, uint32_t);
+static int refresh_peers(void);
+static int rehome_peers(void);
+static int resolve_endpoint(struct mm_wireguard_peer *,
+        struct sockaddr_storage *, socklen_t *);
+
+static size_t select_peer(void);
+static void send_probes(void);
+static int set_allowed_ips(const struct mm_wireguard_peer *);
+static int set_endpoint(const struct mm_wireguard_peer *);
+static int trigger_handshake(void);
+static char *trim(char *);
+static void write_endpoint_cache(void);
+
+enum mm_wireguard_fault check_tunnel(void) {
+    enum mm_wireguard_fault fault, worst;
+    struct mm_wireguard_peer *peer;
+    bool sending, receiving;
+    int64_t now_s;
+    int status;
+    size_t i;
+
+    /* A config push from an earlier round may have finished meanwhile. */
+    if (wireguard.repush_child > 0 && (status = mm_reap_wireguard_setconf(
+            wireguard.repush_child, false)) != MM_TASK_IN_PROGRESS) {
+        wireguard.repush_child = 0;
+
+        if (status || refresh_peers()) {
+            MM_LOG("%s%s\n", "Failed to push the Wireguard config again");
+        }
+    }
+
+    if (wireguard.sock == NULL || wireguard.peer_count == 0) {
+        return MM_WIREGUARD_FAULT_NONE;
+    }
+
+    if ((status = get_device())) {
+        MM_LOG("%smm_wireguard: Failed to query %s: %s\n",
+                MM_WIREGUARD_INTERFACE, nl_geterror(status));
+
+        return MM_WIREGUARD_FAULT_NONE;
+    }
+
+    now_s = (int64_t) time(NULL);
+    worst = MM_WIREGUARD_FAULT_NONE;
+
+    pthread_mutex_lock(&wireguard.lock);
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        sending = peer->have_stats && peer->tx_bytes != peer->last_tx_bytes;
+        receiving = peer->have_stats && peer->rx_bytes != peer->last_rx_bytes;
+        fault = MM_WIREGUARD_FAULT_NONE;
+
+        /* An idle tunnel is allowed to have a stale handshake. */
+        if (sending && now_s - peer->last_handshake_s >
+                MM_WIREGUARD_STALE_HANDSHAKE_S) {
+            fault = MM_WIREGUARD_FAULT_STALE_HANDSHAKE;
+        }
+
+        else if (sending && !receiving) {
+            fault = MM_WIREGUARD_FAULT_ONE_WAY;
+        }
+
+        if (fault != MM_WIREGUARD_FAULT_NONE) {
+            wireguard.faults[fault]++;
+            worst = fault > worst ? fault : worst;
+        }
+
+        peer->fault = fault;
+        peer->last_rx_bytes = peer->rx_bytes;
+        peer->last_tx_bytes = peer->tx_bytes;
+        peer->have_stats = true;
+    }
+
+    pthread_mutex_unlock(&wireguard.lock);
+
+    if (worst == MM_WIREGUARD_FAULT_NONE) {
+        if (wireguard.consecutive_faults) {
+            MM_LOG("%s%s\n", "Wireguard tunnel has recovered");
+            mm_telemetry_event("wireguard_recovered faults=%u",
+                    wireguard.consecutive_faults);
+        }
+
+        wireguard.consecutive_faults = 0;
+        return worst;
+    }
+
+    MM_LOG("%sWireguard tunnel fault: %s\n",
+            mm_wireguard_get_fault_string(worst));
+
+    mm_telemetry_event("wireguard_fault kind=%s",
+            mm_wireguard_get_fault_string(worst));
+
+    /* Give a config push that is still running the chance to finish. */
+    if (wireguard.repush_child > 0) {
+        return worst;
+    }
+
+    if (++wireguard.consecutive_faults < MM_WIREGUARD_REPUSH_AFTER_FAULTS) {
+        pthread_mutex_lock(&wireguard.lock);
+        wireguard.handshakes_forced++;
+        pthread_mutex_unlock(&wireguard.lock);
+
+        trigger_handshake();
+    }
+
+    /* wg runs in the background; the peers are refreshed once it's done. */
+    else {
+        MM_LOG("%s%s\n", "Fault persists; pushing the Wireguard config again");
+        wireguard.consecutive_faults = 0;
+
+        pthread_mutex_lock(&wireguard.lock);
+        wireguard.config_repushes++;
+        pthread_mutex_unlock(&wireguard.lock);
+
+        if (mm_spawn_wireguard_setconf(&wireguard.repush_child)) {
+            MM_LOG("%s%s\n", "Failed to push the Wireguard config again");
+            wireguard.repush_child = 0;
+        }
+    }
+
+    return worst;
+}
+
+/*
+ * Drains echo replies; whatever didn't make it back by now was lost. Each
+ * reply is timed by when the kernel received it, not when it was drained
+ * (a whole probe interval later).
+ */
+void collect_probe_replies(void) {
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+
+    struct mm_wireguard_peer *peer;
+    uint8_t packet[128];
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    struct msghdr msg;
+    struct iovec iov;
+    uint64_t received_us;
+    size_t payload, i;
+    ssize_t length;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = packet;
+        iov.iov_len = sizeof(packet);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        if ((length = recvmsg(wireguard.probe_fd, &msg, 0)) <= 0) {
+            break;
+        }
+
+        received_us = 0;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                received_us = (uint64_t) ts.tv_sec * 1000000U +
+                    (uint64_t) ts.tv_nsec / 1000U;
+            }
+        }
+
+        /* The payload is the index of the peer that was probed. */
+        if (!mm_icmp_read_echo_reply(packet, (size_t) length,
+                wireguard.probe_seq, &payload) ||
+                payload >= (size_t) length ||
+                (i = packet[payload]) >= wireguard.peer_count) {
+            continue;
+        }
+
+        peer = wireguard.peers + i;
+
+        if (!peer->probe_outstanding) {
+            continue;
+        }
+
+        peer->probe_outstanding = false;
+
+        /* A clock step in between makes for a meaningless sample. */
+        if (received_us >= peer->probe_sent_us) {
+            push_probe_result(peer, (uint32_t) (received_us -
+                    peer->probe_sent_us));
+        }
+    }
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->probe_outstanding) {
+            peer->probe_outstanding = false;
+            push_probe_result(peer, UINT32_MAX);
+        }
+    }
+}
+
+/* Decodes a base64-encoded Wireguard key (44 characters, one pad). */
+int decode_key(const char *encoded, uint8_t *key) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    uint32_t accumulator;
+    unsigned bits, i;
+    size_t length;
+    const char *p;
+
+    if (strlen(encoded) != 44 || encoded[43] != '=') {
+        return -1;
+    }
+
+    for (i = 0, bits = 0, accumulator = 0, length = 0; i < 43; i++) {
+        if ((p = strchr(alphabet, encoded[i])) == NULL || *p == '\0') {
+            return -1;
+        }
+
+        accumulator = (accumulator << 6) | (uint32_t) (p - alphabet);
+        bits += 6;
+
+        if (bits >= 8) {
+            bits -= 8;
+
+            if (length < WG_KEY_LEN) {
+                key[length++] = (uint8_t) (accumulator >> bits);
+            }
+        }
+    }
+
+    return length == WG_KEY_LEN ? 0 : -1;
+}
+
+/* Encodes a Wireguard key as base64 (into 45 bytes, with terminator). */
+void encode_key(const uint8_t *key, char *encoded) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    uint32_t accumulator;
+    unsigned bits, i;
+    char *p;
+
+    for (i = 0, bits = 0, accumulator = 0, p = encoded; i < WG_KEY_LEN; i++) {
+        accumulator = (accumulator << 8) | key[i];
+        bits += 8;
+
+        while (bits >= 6) {
+            bits -= 6;
+            *p++ = alphabet[(accumulator >> bits) & 0x3F];
+        }
+    }
+
+    *p++ = alphabet[(accumulator << (6 - bits)) & 0x3F];
+    *p++ = '=';
+    *p = '\0';
+}
+
+bool endpoints_equal(const struct mm_wireguard_peer *peer,
+        const struct sockaddr_storage *endpoint, socklen_t length) {
+    return peer->endpoint_length == length &&
+        !memcmp(&peer->endpoint, endpoint, length);
+}
+
+/* Dumps wg0 and records each known peer's handshake time and counters. */
+int get_device(void) {
+    struct nl_msg *msg;
+    struct nl_cb *cb;
+    int status;
+
+    if ((msg = nlmsg_alloc()) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    if (genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, wireguard.family, 0,
+            NLM_F_REQUEST | NLM_F_DUMP, WG_CMD_GET_DEVICE,
+            WG_GENL_VERSION) == NULL ||
+            nla_put_string(msg, WGDEVICE_A_IFNAME, MM_WIREGUARD_INTERFACE)) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    if ((cb = nl_cb_alloc(NL_CB_DEFAULT)) == NULL) {
+        nlmsg_free(msg);
+        return -NLE_NOMEM;
+    }
+
+    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, handle_device_message, NULL);
+
+    if ((status = nl_send_auto(wireguard.sock, msg)) >= 0) {
+        status = nl_recvmsgs(wireguard.sock, cb);
+    }
+
+    nl_cb_put(cb);
+    nlmsg_free(msg);
+    return status < 0 ? status : 0;
+}
+
+/* The dump may be split over several messages; each is handled alone. */
+int handle_device_message(struct nl_msg *msg, void *context) {
+    struct nlattr *device_attrs[WGDEVICE_A_MAX + 1];
+    struct nlattr *peer_attrs[WGPEER_A_MAX + 1];
+    struct __kernel_timespec last_handshake;
+    struct mm_wireguard_peer *peer;
+    struct nlattr *attr;
+    size_t i;
+    int remaining;
+
+    if (genlmsg_parse(nlmsg_hdr(msg), 0, device_attrs, WGDEVICE_A_MAX,
+            NULL) || device_attrs[WGDEVICE_A_PEERS] == NULL) {
+        return NL_OK;
+    }
+
+    pthread_mutex_lock(&wireguard.lock);
+
+    nla_for_each_nested(attr, device_attrs[WGDEVICE_A_PEERS], remaining) {
+        if (nla_parse_nested(peer_attrs, WGPEER_A_MAX, attr, NULL) ||
+                peer_attrs[WGPEER_A_PUBLIC_KEY] == NULL ||
+                nla_len(peer_attrs[WGPEER_A_PUBLIC_KEY]) != WG_KEY_LEN) {
+            continue;
+        }
+
+        for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+                i++, peer++) {
+            if (!memcmp(peer->public_key, nla_data(
+                    peer_attrs[WGPEER_A_PUBLIC_KEY]), WG_KEY_LEN)) {
+                break;
+            }
+        }
+
+        if (i == wireguard.peer_count) {
+            continue;
+        }
+
+        if (peer_attrs[WGPEER_A_LAST_HANDSHAKE_TIME] != NULL && nla_len(
+                peer_attrs[WGPEER_A_LAST_HANDSHAKE_TIME]) ==
+                sizeof(last_handshake)) {
+            memcpy(&last_handshake, nla_data(
+                    peer_attrs[WGPEER_A_LAST_HANDSHAKE_TIME]),
+                    sizeof(last_handshake));
+
+            peer->last_handshake_s = last_handshake.tv_sec;
+        }
+
+        if (peer_attrs[WGPEER_A_RX_BYTES] != NULL) {
+            peer->rx_bytes = nla_get_u64(peer_attrs[WGPEER_A_RX_BYTES]);
+        }
+
+        if (peer_attrs[WGPEER_A_TX_BYTES] != NULL) {
+            peer->tx_bytes = nla_get_u64(peer_attrs[WGPEER_A_TX_BYTES]);
+        }
+    }
+
+    pthread_mutex_unlock(&wireguard.lock);
+    return NL_OK;
+}
+
+int load_cached_endpoint(struct mm_wireguard_peer *peer) {
+    char line[512], *host, *address, *save;
+    struct sockaddr_in *in;
+    struct sockaddr_in6 *in6;
+    uint16_t port;
+    FILE *f;
+
+    if ((f = fopen(MM_WIREGUARD_ENDPOINT_CACHE_PATH, "r")) == NULL) {
+        return -1;
+    }
+
+    port = htons((uint16_t) strtoul(peer->port, NULL, 10));
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((host = strtok_r(line, " \n", &save)) == NULL ||
+                (address = strtok_r(NULL, " \n", &save)) == NULL ||
+                strcmp(host, peer->host)) {
+            continue;
+        }
+
+        memset(&peer->endpoint, 0, sizeof(peer->endpoint));
+        in = (struct sockaddr_in *) &peer->endpoint;
+        in6 = (struct sockaddr_in6 *) &peer->endpoint;
+
+        if (inet_pton(AF_INET, address, &in->sin_addr) == 1) {
+            in->sin_family = AF_INET;
+            in->sin_port = port;
+            peer->endpoint_length = sizeof(*in);
+        }
+
+        else if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = port;
+            peer->endpoint_length = sizeof(*in6);
+        }
+
+        else {
+            continue;
+        }
+
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    return -1;
+}
+
+/* Pulls the public keys and endpoints of peers out of the config file. */
+int load_peers(void) {
+    struct mm_wireguard_peer *peer;
+    char line[512], *key, *value;
+    FILE *f;
+
+    if ((f = fopen(MM_WIREGUARD_CONFIG_PATH, "r")) == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    pthread_mutex_lock(&wireguard.lock);
+    wireguard.peer_count = 0;
+    wireguard.selected = MM_WIREGUARD_MAX_PEERS;
+    wireguard.challenger_rounds = 0;
+    peer = NULL;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        key = trim(line);
+
+        if (!strcmp(key, "[Peer]")) {
+            if (wireguard.peer_count == MM_WIREGUARD_MAX_PEERS) {
+                MM_LOG("%s%s\n", "mm_wireguard: Too many peers; ignoring rest");
+                break;
+            }
+
+            peer = wireguard.peers + wireguard.peer_count++;
+            memset(peer, 0, sizeof(*peer));
+            continue;
+        }
+
+        else if (key[0] == '[') {
+            peer = NULL;
+            continue;
+        }
+
+        if (peer == NULL || (value = strchr(key, '=')) == NULL) {
+            continue;
+        }
+
+        *value++ = '\0';
+        key = trim(key);
+        value = trim(value);
+
+        if (!strcasecmp(key, "PublicKey")) {
+            if (decode_key(value, peer->public_key)) {
+                MM_LOG("%smm_wireguard: Bad public key: %s\n", value);
+            }
+        }
+
+        else if (!strcasecmp(key, "Endpoint")) {
+            if (parse_endpoint(value, peer)) {
+                MM_LOG("%smm_wireguard: Bad endpoint: %s\n", value);
+            }
+        }
+
+        else if (!strcasecmp(key, "AllowedIPs")) {
+            parse_allowed_ips(value, peer);
+        }
+    }
+
+    pthread_mutex_unlock(&wireguard.lock);
+    fclose(f);
+    return 0;
+}
+
+/* Keeps the IPv4 entries; the first /32 is taken as the tunnel address. */
+void parse_allowed_ips(char *value, struct mm_wireguard_peer *peer) {
+    char *entry, *prefix, *save;
+    unsigned long prefixlen;
+    struct in_addr address;
+
+    for (entry = strtok_r(value, ",", &save); entry != NULL;
+            entry = strtok_r(NULL, ",", &save)) {
+        entry = trim(entry);
+
+        if ((prefix = strchr(entry, '/')) == NULL) {
+            continue;
+        }
+
+        *prefix++ = '\0';
+        prefixlen = strtoul(prefix, NULL, 10);
+
+        if (inet_pton(AF_INET, entry, &address) != 1 || prefixlen > 32) {
+            continue;
+        }
+
+        if (peer->allowed_ip_count == MM_WIREGUARD_MAX_ALLOWED_IPS) {
+            MM_LOG("%s%s\n", "mm_wireguard: Too many AllowedIPs; ignoring");
+            break;
+        }
+
+        peer->allowed_ips[peer->allowed_ip_count].s_addr = address.s_addr;
+        peer->allowed_ips[peer->allowed_ip_count++].prefixlen =
+            (uint8_t) prefixlen;
+
+        if (prefixlen == 32 && peer->tunnel_address == 0) {
+            peer->tunnel_address = address.s_addr;
+        }
+    }
+}
+
+/* Splits "host:port" or "[v6-address]:port" up. */
+int parse_endpoint(const char *endpoint, struct mm_wireguard_peer *peer) {
+    const char *colon, *host;
+    size_t host_length;
+
+    if ((colon = strrchr(endpoint, ':')) == NULL) {
+        return -1;
+    }
+
+    host = endpoint;
+    host_length = (size_t) (colon - endpoint);
+
+    if (host[0] == '[' && host_length >= 2 && host[host_length - 1] == ']') {
+        host++;
+        host_length -= 2;
+    }
+
+    if (host_length == 0 || host_length >= sizeof(peer->host) ||
+            strlen(colon + 1) == 0 || strlen(colon + 1) >= sizeof(peer->port)) {
+        return -1;
+    }
+
+    memcpy(peer->host, host, host_length);
+    peer->host[host_length] = '\0';
+    strcpy(peer->port, colon + 1);
+    return 0;
+}
+
+int probe_peers(uint32_t *gateway) {
+    struct mm_wireguard_peer *peer;
+    size_t candidates, i, selected;
+    const int one = 1;
+    int status;
+
+    for (i = 0, candidates = 0, peer = wireguard.peers;
+            i < wireguard.peer_count; i++, peer++) {
+        candidates += peer->tunnel_address != 0;
+    }
+
+    if (wireguard.sock == NULL || candidates < 2) {
+        return 0;
+    }
+
+    if (wireguard.probe_fd < 0) {
+        if ((wireguard.probe_fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK |
+                SOCK_CLOEXEC, IPPROTO_ICMP)) < 0) {
+            perror("socket");
+            return -1;
+        }
+
+        if (setsockopt(wireguard.probe_fd, SOL_SOCKET, SO_BINDTODEVICE,
+                MM_WIREGUARD_INTERFACE, sizeof(MM_WIREGUARD_INTERFACE)) ||
+                setsockopt(wireguard.probe_fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                &one, sizeof(one))) {
+            perror("setsockopt");
+            close(wireguard.probe_fd);
+            wireguard.probe_fd = -1;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&wireguard.lock);
+    collect_probe_replies();
+    selected = select_peer();
+    send_probes();
+    pthread_mutex_unlock(&wireguard.lock);
+
+    if (selected == MM_WIREGUARD_MAX_PEERS) {
+        return 0;
+    }
+
+    peer = wireguard.peers + selected;
+
+    if ((status = set_allowed_ips(peer))) {
+        MM_LOG("%smm_wireguard: Failed to set allowed IPs: %s\n",
+                nl_geterror(status));
+
+        return -1;
+    }
+
+    MM_LOG("%sSteering the Wireguard tunnel to %s (score: %"PRIu64" us)\n",
+            peer->host, probe_score(peer));
+
+    mm_telemetry_event("wireguard_peer_switch peer=%s score_us=%"PRIu64,
+            peer->host, probe_score(peer));
+
+    pthread_mutex_lock(&wireguard.lock);
+    wireguard.selected = selected;
+    wireguard.challenger_rounds = 0;
+    wireguard.switches++;
+    pthread_mutex_unlock(&wireguard.lock);
+
+    *gateway = peer->tunnel_address;
+    return 1;
+}
+
+/* Mean round trip time, with a penalty for each probe lost in the window. */
+uint64_t probe_score(const struct mm_wireguard_peer *peer) {
+    uint64_t total_us;
+    unsigned i, lost;
+
+    if (peer->probe_count < MM_WIREGUARD_PROBE_MIN_SAMPLES) {
+        return UINT64_MAX;
+    }
+
+    for (i = 0, lost = 0, total_us = 0; i < peer->probe_count; i++) {
+        if (peer->probe_rtt_us[i] == UINT32_MAX) {
+            lost++;
+        }
+
+        else {
+            total_us += peer->probe_rtt_us[i];
+        }
+    }
+
+    if (lost == peer->probe_count) {
+        return UINT64_MAX;
+    }
+
+    return total_us / (peer->probe_count - lost) +
+        (uint64_t) lost * MM_WIREGUARD_LOSS_PENALTY_US / peer->probe_count;
+}
+
+void push_probe_result(struct mm_wireguard_peer *peer, uint32_t rtt_us) {
+    peer->probe_rtt_us[peer->probe_next] = rtt_us;
+    peer->probe_next = (peer->probe_next + 1) % MM_WIREGUARD_PROBE_WINDOW;
+
+    if (peer->probe_count < MM_WIREGUARD_PROBE_WINDOW) {
+        peer->probe_count++;
+    }
+}
+
+int refresh_peers(void) {
+    uint8_t selected_key[WG_KEY_LEN];
+    struct sockaddr_storage endpoint;
+    struct mm_wireguard_peer *peer;
+    bool changed, had_selection;
+    socklen_t length;
+    int status;
+    size_t i;
+
+    if (wireguard.sock == NULL) {
+        return -1;
+    }
+
+    if ((had_selection = wireguard.selected < wireguard.peer_count)) {
+        memcpy(selected_key, wireguard.peers[wireguard.selected].public_key,
+                sizeof(selected_key));
+    }
+
+    if (load_peers()) {
+        return -1;
+    }
+
+    /* The config hands routed networks back to its last peer; undo that. */
+    for (i = 0, peer = wireguard.peers; had_selection &&
+            i < wireguard.peer_count; i++, peer++) {
+        if (memcmp(peer->public_key, selected_key, sizeof(selected_key))) {
+            continue;
+        }
+
+        if ((status = set_allowed_ips(peer))) {
+            MM_LOG("%smm_wireguard: Failed to set allowed IPs: %s\n",
+                    nl_geterror(status));
+        }
+
+        else {
+            pthread_mutex_lock(&wireguard.lock);
+            wireguard.selected = i;
+            pthread_mutex_unlock(&wireguard.lock);
+        }
+    }
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->host[0] != '\0' && !load_cached_endpoint(peer) &&
+                (status = set_endpoint(peer))) {
+            MM_LOG("%smm_wireguard: Failed to set endpoint: %s\n",
+                    nl_geterror(status));
+        }
+    }
+
+    trigger_handshake();
+
+    for (i = 0, peer = wireguard.peers, changed = false;
+            i < wireguard.peer_count; i++, peer++) {
+        if (peer->host[0] == '\0' || resolve_endpoint(peer, &endpoint,
+                &length) || endpoints_equal(peer, &endpoint, length)) {
+            continue;
+        }
+
+        memcpy(&peer->endpoint, &endpoint, sizeof(endpoint));
+        peer->endpoint_length = length;
+        changed = true;
+
+        if ((status = set_endpoint(peer))) {
+            MM_LOG("%smm_wireguard: Failed to set endpoint: %s\n",
+                    nl_geterror(status));
+        }
+    }
+
+    if (changed) {
+        write_endpoint_cache();
+        trigger_handshake();
+    }
+
+    return 0;
+}
+
+int rehome_peers(void) {
+    struct mm_wireguard_peer *peer;
+    int status, result;
+    size_t i;
+
+    if (wireguard.sock == NULL) {
+        return -1;
+    }
+
+    for (i = 0, result = 0, peer = wireguard.peers;
+            i < wireguard.peer_count; i++, peer++) {
+        if (peer->endpoint_length != 0 && (status = set_endpoint(peer))) {
+            MM_LOG("%smm_wireguard: Failed to set endpoint: %s\n",
+                    nl_geterror(status));
+
+            result = -1;
+        }
+    }
+
+    trigger_handshake();
+    return result;
+}
+
+int resolve_endpoint(struct mm_wireguard_peer *peer,
+        struct sockaddr_storage *endpoint, socklen_t *length) {
+    struct addrinfo hints, *result;
+    int status;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if ((status = getaddrinfo(peer->host, peer->port, &hints, &result))) {
+        MM_LOG("%smm_wireguard: Cannot resolve %s: %s\n", peer->host,
+                gai_strerror(status));
+
+        return -1;
+    }
+
+    memset(endpoint, 0, sizeof(*endpoint));
+    memcpy(endpoint, result->ai_addr, result->ai_addrlen);
+    *length = result->ai_addrlen;
+
+    freeaddrinfo(result);
+    return 0;
+}
+
+/*
+ * Returns the peer that routed networks should move to, if any. Switching
+ * away from a reachable peer needs a challenger to beat it by the margin
+ * for several rounds running, so that jitter doesn't flap the tunnel.
+ */
+size_t select_peer(void) {
+    uint64_t best_score, current_score, margin_us, score;
+    struct mm_wireguard_peer *peer;
+    size_t best, i;
+
+    for (i = 0, best = MM_WIREGUARD_MAX_PEERS, best_score = UINT64_MAX,
+            peer = wireguard.peers; i < wireguard.peer_count; i++, peer++) {
+        if (peer->tunnel_address != 0 &&
+                (score = probe_score(peer)) < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    if (best == MM_WIREGUARD_MAX_PEERS || best == wireguard.selected) {
+        wireguard.challenger_rounds = 0;
+        return MM_WIREGUARD_MAX_PEERS;
+    }
+
+    if (wireguard.selected == MM_WIREGUARD_MAX_PEERS || (current_score =
+            probe_score(wireguard.peers + wireguard.selected)) == UINT64_MAX) {
+        return best;
+    }
+
+    margin_us = current_score * MM_WIREGUARD_SWITCH_MARGIN_PCT / 100U;
+
+    if (margin_us < MM_WIREGUARD_SWITCH_MARGIN_US) {
+        margin_us = MM_WIREGUARD_SWITCH_MARGIN_US;
+    }
+
+    if (best_score + margin_us >= current_score) {
+        wireguard.challenger_rounds = 0;
+        return MM_WIREGUARD_MAX_PEERS;
+    }
+
+    if (best != wireguard.challenger) {
+        wireguard.challenger = best;
+        wireguard.challenger_rounds = 0;
+    }
+
+    return ++wireguard.challenger_rounds >= MM_WIREGUARD_SWITCH_ROUNDS ?
+        best : MM_WIREGUARD_MAX_PEERS;
+}
+
+/* Pings each candidate's tunnel address; replies are collected next round. */
+void send_probes(void) {
+    struct mm_wireguard_peer *peer;
+    struct sockaddr_in address;
+    uint8_t packet[sizeof(struct icmphdr) + 8];
+    size_t i;
+
+    wireguard.probe_seq++;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->tunnel_address == 0) {
+            continue;
+        }
+
+        memset(packet, 0, sizeof(packet));
+        packet[sizeof(struct icmphdr)] = (uint8_t) i;
+        mm_icmp_write_echo(packet, sizeof(packet), wireguard.probe_seq);
+
+        address.sin_addr.s_addr = peer->tunnel_address;
+        peer->probe_sent_us = mm_time_realtime_us();
+
+        if (sendto(wireguard.probe_fd, packet, sizeof(packet), 0,
+                (struct sockaddr *) &address, sizeof(address)) < 0) {
+            push_probe_result(peer, UINT32_MAX);
+            continue;
+        }
+
+        peer->probe_outstanding = true;
+    }
+}
+
+/* Claims the peer's AllowedIPs; the kernel takes them off other peers. */
+int set_allowed_ips(const struct mm_wireguard_peer *peer) {
+    struct nlattr *peers, *attrs, *allowed_ips, *allowed_ip;
+    struct nl_msg *msg;
+    int status;
+    size_t i;
+
+    if ((msg = nlmsg_alloc()) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    if (genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, wireguard.family, 0,
+            NLM_F_REQUEST | NLM_F_ACK, WG_CMD_SET_DEVICE,
+            WG_GENL_VERSION) == NULL ||
+            nla_put_string(msg, WGDEVICE_A_IFNAME, MM_WIREGUARD_INTERFACE) ||
+            (peers = nla_nest_start(msg, WGDEVICE_A_PEERS)) == NULL ||
+            (attrs = nla_nest_start(msg, 0)) == NULL ||
+            nla_put(msg, WGPEER_A_PUBLIC_KEY, WG_KEY_LEN, peer->public_key) ||
+            nla_put_u32(msg, WGPEER_A_FLAGS, WGPEER_F_UPDATE_ONLY) ||
+            (allowed_ips = nla_nest_start(msg, WGPEER_A_ALLOWEDIPS)) == NULL) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    for (i = 0; i < peer->allowed_ip_count; i++) {
+        if ((allowed_ip = nla_nest_start(msg, 0)) == NULL ||
+                nla_put_u16(msg, WGALLOWEDIP_A_FAMILY, AF_INET) ||
+                nla_put(msg, WGALLOWEDIP_A_IPADDR, sizeof(uint32_t),
+                &peer->allowed_ips[i].s_addr) ||
+                nla_put_u8(msg, WGALLOWEDIP_A_CIDR_MASK,
+                peer->allowed_ips[i].prefixlen)) {
+            nlmsg_free(msg);
+            return -NLE_MSGSIZE;
+        }
+
+        nla_nest_end(msg, allowed_ip);
+    }
+
+    nla_nest_end(msg, allowed_ips);
+    nla_nest_end(msg, attrs);
+    nla_nest_end(msg, peers);
+
+    if ((status = nl_send_auto(wireguard.sock, msg)) >= 0) {
+        status = nl_wait_for_ack(wireguard.sock);
+    }
+
+    nlmsg_free(msg);
+    return status < 0 ? status : 0;
+}
+
+int set_endpoint(const struct mm_wireguard_peer *peer) {
+    struct nlattr *peers, *attrs;
+    struct nl_msg *msg;
+    int status;
+
+    if ((msg = nlmsg_alloc()) == NULL) {
+        return -NLE_NOMEM;
+    }
+
+    if (genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, wireguard.family, 0,
+            NLM_F_REQUEST | NLM_F_ACK, WG_CMD_SET_DEVICE,
+            WG_GENL_VERSION) == NULL ||
+            nla_put_string(msg, WGDEVICE_A_IFNAME, MM_WIREGUARD_INTERFACE) ||
+            (peers = nla_nest_start(msg, WGDEVICE_A_PEERS)) == NULL ||
+            (attrs = nla_nest_start(msg, 0)) == NULL ||
+            nla_put(msg, WGPEER_A_PUBLIC_KEY, WG_KEY_LEN, peer->public_key) ||
+            nla_put_u32(msg, WGPEER_A_FLAGS, WGPEER_F_UPDATE_ONLY) ||
+            nla_put(msg, WGPEER_A_ENDPOINT, (int) peer->endpoint_length,
+            &peer->endpoint)) {
+        nlmsg_free(msg);
+        return -NLE_MSGSIZE;
+    }
+
+    nla_nest_end(msg, attrs);
+    nla_nest_end(msg, peers);
+
+    if ((status = nl_send_auto(wireguard.sock, msg)) >= 0) {
+        status = nl_wait_for_ack(wireguard.sock);
+    }
+
+    nlmsg_free(msg);
+    return status < 0 ? status : 0;
+}
+
+int trigger_handshake(void) {
+    struct sockaddr_in address;
+    const char probe = 0;
+    bool have_candidates;
+    int fd, status;
+    size_t i;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(MM_WIREGUARD_PROBE_PORT);
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, MM_WIREGUARD_INTERFACE,
+            sizeof(MM_WIREGUARD_INTERFACE))) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0, status = 0, have_candidates = false;
+            i < wireguard.peer_count; i++) {
+        if (wireguard.peers[i].tunnel_address == 0) {
+            continue;
+        }
+
+        address.sin_addr.s_addr = wireguard.peers[i].tunnel_address;
+        have_candidates = true;
+
+        if (sendto(fd, &probe, sizeof(probe), 0,
+                (struct sockaddr *) &address, sizeof(address)) < 0) {
+            perror("mm_wireguard_trigger_handshake");
+            status = -1;
+        }
+    }
+
+    if (!have_candidates) {
+        inet_pton(AF_INET, MM_WIREGUARD_PROBE_ADDRESS, &address.sin_addr);
+
+        if (sendto(fd, &probe, sizeof(probe), 0,
+                (struct sockaddr *) &address, sizeof(address)) < 0) {
+            perror("mm_wireguard_trigger_handshake");
+            status = -1;
+        }
+    }
+
+    close(fd);
+    return status;
+}
+
+char *trim(char *s) {
+    char *end;
+
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+
+    for (end = s + strlen(s); end > s && isspace((unsigned char) end[-1]);
+            end--);
+
+    *end = '\0';
+    return s;
+}
+
+void write_endpoint_cache(void) {
+    char address[INET6_ADDRSTRLEN];
+    const struct mm_wireguard_peer *peer;
+    const void *raw;
+    FILE *f;
+    size_t i;
+
+    if ((f = fopen(MM_WIREGUARD_ENDPOINT_CACHE_PATH ".tmp", "w")) == NULL) {
+        perror("fopen");
+        return;
+    }
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->endpoint_length == 0) {
+            continue;
+        }
+
+        raw = peer->endpoint.ss_family == AF_INET
+            ? (const void *) &((const struct sockaddr_in *)
+                    &peer->endpoint)->sin_addr
+            : (const void *) &((const struct sockaddr_in6 *)
+                    &peer->endpoint)->sin6_addr;
+
+        if (inet_ntop(peer->endpoint.ss_family, raw, address,
+                sizeof(address)) != NULL) {
+            fprintf(f, "%s %s\n", peer->host, address);
+        }
+    }
+
+    if (fclose(f) || rename(MM_WIREGUARD_ENDPOINT_CACHE_PATH ".tmp",
+            MM_WIREGUARD_ENDPOINT_CACHE_PATH)) {
+        perror("rename");
+    }
+}
+
+/*
+ * Reads back per-peer state from the kernel and judges whether the tunnel
+ * is alive. Meant to be called every MM_WIREGUARD_CHECK_INTERVAL_S; takes
+ * care of recovering from faults itself.
+ */
+enum mm_wireguard_fault mm_wireguard_check(void) {
+    enum mm_wireguard_fault fault;
+
+    pthread_mutex_lock(&wireguard.op_lock);
+    fault = check_tunnel();
+    pthread_mutex_unlock(&wireguard.op_lock);
+
+    return fault;
+}
+
+const char *mm_wireguard_get_fault_string(enum mm_wireguard_fault fault) {
+    static const char *mm_wireguard_faults[] = {
+        "none",
+        "stale_handshake",
+        "one_way",
+    };
+
+    if (fault >= MM_WIREGUARD_FAULT_MAX) {
+        return "invalid";
+    }
+
+    return mm_wireguard_faults[fault];
+}
+
+int mm_wireguard_initialize(void) {
+    int status;
+
+    if ((wireguard.sock = nl_socket_alloc()) == NULL) {
+        perror("nl_socket_alloc");
+        return -1;
+    }
+
+    if ((status = genl_connect(wireguard.sock))) {
+        MM_LOG("%sgenl_connect: %s\n", nl_geterror(status));
+        nl_socket_free(wireguard.sock);
+        wireguard.sock = NULL;
+        return status;
+    }
+
+    if ((wireguard.family = genl_ctrl_resolve(wireguard.sock,
+            WG_GENL_NAME)) < 0) {
+        MM_LOG("%sgenl_ctrl_resolve: %s\n", nl_geterror(wireguard.family));
+        nl_socket_free(wireguard.sock);
+        wireguard.sock = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Called every MM_WIREGUARD_PROBE_INTERVAL_S: scores the last round of
+ * probes, moves routed networks over to a better peer if warranted and then
+ * sends the next round. Returns 1 on a switch, in which case the tunnel
+ * routes should be pointed at the given (new peer's) tunnel address.
+ */
+int mm_wireguard_probe_peers(uint32_t *gateway) {
+    int status;
+
+    pthread_mutex_lock(&wireguard.op_lock);
+    status = probe_peers(gateway);
+    pthread_mutex_unlock(&wireguard.op_lock);
+
+    return status;
+}
+
+/*
+ * Re-points each peer at its endpoint and kicks off a handshake, so that a
+ * tunnel recovers as soon as the WWAN link does (rather than on the next
+ * keepalive/rekey timer). Cached resolutions are used first, as DNS may not
+ * work yet; then names are resolved afresh and peers updated if changed.
+ */
+int mm_wireguard_refresh_peers(void) {
+    int status;
+
+    pthread_mutex_lock(&wireguard.op_lock);
+    status = refresh_peers();
+    pthread_mutex_unlock(&wireguard.op_lock);
+
+    return status;
+}
+
+/*
+ * Once traffic moves to another uplink, setting each endpoint again drops
+ * the source address the kernel has cached for it, so that the tunnel
+ * follows along rather than sticking with the old uplink.
+ */
+int mm_wireguard_rehome(void) {
+    int status;
+
+    pthread_mutex_lock(&wireguard.op_lock);
+    status = rehome_peers();
+    pthread_mutex_unlock(&wireguard.op_lock);
+
+    return status;
+}
+
+void mm_wireguard_shutdown(void) {
+    pthread_mutex_lock(&wireguard.op_lock);
+
+    if (wireguard.repush_child > 0) {
+        mm_reap_wireguard_setconf(wireguard.repush_child, true);
+        wireguard.repush_child = 0;
+    }
+
+    if (wireguard.probe_fd >= 0) {
+        close(wireguard.probe_fd);
+        wireguard.probe_fd = -1;
+    }
+
+    if (wireguard.sock != NULL) {
+        nl_socket_free(wireguard.sock);
+        wireguard.sock = NULL;
+    }
+
+    pthread_mutex_unlock(&wireguard.op_lock);
+}
+
+/* Candidates each get poked, so that a standby tunnel is ready to go. */
+int mm_wireguard_trigger_handshake(void) {
+    int status;
+
+    pthread_mutex_lock(&wireguard.op_lock);
+    status = trigger_handshake();
+    pthread_mutex_unlock(&wireguard.op_lock);
+
+    return status;
+}
+
+void mm_wireguard_write_metrics(FILE *f, void *context) {
+    const struct mm_wireguard_peer *peer;
+    char keys[MM_WIREGUARD_MAX_PEERS][45];
+    unsigned fault;
+    size_t i;
+
+    pthread_mutex_lock(&wireguard.lock);
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        encode_key(peer->public_key, keys[i]);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_last_handshake_seconds "
+            "Time of the last completed handshake with each peer.\n"
+            "# TYPE modem_monitor_wireguard_last_handshake_seconds gauge\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        fprintf(f, "modem_monitor_wireguard_last_handshake_seconds"
+                "{peer=\"%s\"} %"PRId64"\n", keys[i], peer->last_handshake_s);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_rx_bytes "
+            "Bytes received from each peer.\n"
+            "# TYPE modem_monitor_wireguard_rx_bytes counter\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        fprintf(f, "modem_monitor_wireguard_rx_bytes{peer=\"%s\"} "
+                "%"PRIu64"\n", keys[i], peer->rx_bytes);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_tx_bytes "
+            "Bytes sent to each peer.\n"
+            "# TYPE modem_monitor_wireguard_tx_bytes counter\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        fprintf(f, "modem_monitor_wireguard_tx_bytes{peer=\"%s\"} "
+                "%"PRIu64"\n", keys[i], peer->tx_bytes);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_peer_fault "
+            "Current fault (0 is none) of each peer.\n"
+            "# TYPE modem_monitor_wireguard_peer_fault gauge\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        fprintf(f, "modem_monitor_wireguard_peer_fault{peer=\"%s\"} %u\n",
+                keys[i], (unsigned) peer->fault);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_probe_rtt_microseconds "
+            "Scored round trip time (with loss penalty) of each candidate.\n"
+            "# TYPE modem_monitor_wireguard_probe_rtt_microseconds gauge\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->tunnel_address != 0 && probe_score(peer) != UINT64_MAX) {
+            fprintf(f, "modem_monitor_wireguard_probe_rtt_microseconds"
+                    "{peer=\"%s\"} %"PRIu64"\n", keys[i], probe_score(peer));
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_peer_selected "
+            "Whether each candidate currently carries routed networks.\n"
+            "# TYPE modem_monitor_wireguard_peer_selected gauge\n");
+
+    for (i = 0, peer = wireguard.peers; i < wireguard.peer_count;
+            i++, peer++) {
+        if (peer->tunnel_address != 0) {
+            fprintf(f, "modem_monitor_wireguard_peer_selected{peer=\"%s\"} "
+                    "%d\n", keys[i], i == wireguard.selected);
+        }
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_peer_switches_total "
+            "Times routed networks moved to another peer.\n"
+            "# TYPE modem_monitor_wireguard_peer_switches_total counter\n"
+            "modem_monitor_wireguard_peer_switches_total %"PRIu64"\n",
+            wireguard.switches);
+
+    fprintf(f, "# HELP modem_monitor_wireguard_faults_total "
+            "Tunnel faults detected, by kind.\n"
+            "# TYPE modem_monitor_wireguard_faults_total counter\n");
+
+    for (fault = 1; fault < MM_WIREGUARD_FAULT_MAX; fault++) {
+        fprintf(f, "modem_monitor_wireguard_faults_total{kind=\"%s\"} "
+                "%"PRIu64"\n", mm_wireguard_get_fault_string(
+                (enum mm_wireguard_fault) fault), wireguard.faults[fault]);
+    }
+
+    fprintf(f, "# HELP modem_monitor_wireguard_recoveries_total "
+            "Tunnel recovery actions taken, by action.\n"
+            "# TYPE modem_monitor_wireguard_recoveries_total counter\n"
+            "modem_monitor_wireguard_recoveries_total{action=\"handshake\"} "
+            "%"PRIu64"\n"
+            "modem_monitor_wireguard_recoveries_total{action=\"setconf\"} "
+            "%"PRIu64"\n", wireguard.handshakes_forced,
+            wireguard.config_repushes);
+
+    pthread_mutex_unlock(&wireguard.lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * tests/mm_test.h: Minimal helpers shared by the unit tests
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#ifndef MM_TEST_H
+#define MM_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Failed checks are reported, but don't stop the rest of the test. */
+#define MM_TEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #condition); \
+            mm_test_failures++; \
+        } \
+    } while (0)
+
+#define MM_TEST_RESULT() (mm_test_failures ? EXIT_FAILURE : EXIT_SUCCESS)
+
+static unsigned mm_test_failures;
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * tests/test_config.c: Tests for config file parsing and diffing
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_config.h"
+#include "mm_telemetry.h"
+#include "mm_test.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t get_address(const char *);
+static void load_text(const char *, struct mm_config *);
+
+static void test_defaults(void);
+static void test_diff(void);
+static void test_has_unit(void);
+static void test_parse(void);
+static void test_rejects_bad_values(void);
+
+uint32_t get_address(const char *text) {
+    struct in_addr address;
+
+    MM_TEST_CHECK(inet_pton(AF_INET, text, &address) == 1);
+    return address.s_addr;
+}
+
+void load_text(const char *text, struct mm_config *config) {
+    char path[] = "/tmp/mm-config-test.XXXXXX";
+    FILE *f;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        perror("mkstemp");
+        mm_test_failures++;
+        return;
+    }
+
+    fputs(text, f);
+    fclose(f);
+
+    MM_TEST_CHECK(mm_config_load(path, config) == 0);
+    unlink(path);
+}
+
+/* Telemetry is not under test; config.c only reports reloads to it. */
+void mm_telemetry_event(const char *format, ...) {
+    (void) format;
+}
+
+void test_defaults(void) {
+    struct mm_config config;
+
+    memset(&config, 0xA5, sizeof(config));
+    MM_TEST_CHECK(mm_config_load("/nonexistent/modem-monitor.conf",
+            &config) == 0);
+
+    MM_TEST_CHECK(config.profile == 3);
+    MM_TEST_CHECK(config.autoconnect == MM_WDS_AUTOCONNECT_SETTING_DISABLED);
+    MM_TEST_CHECK(config.roaming ==
+            MM_WDS_AUTOCONNECT_ROAM_SETTING_HOME_ONLY);
+    MM_TEST_CHECK(config.wg0_route_count == 2);
+    MM_TEST_CHECK(config.unit_count == 2);
+    MM_TEST_CHECK(!strcmp(config.units[0].name, "unbound.service"));
+    MM_TEST_CHECK(config.units[1].after_tunnel);
+}
+
+void test_diff(void) {
+    struct mm_config old, new;
+
+    load_text("", &old);
+    new = old;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == 0);
+
+    /* Bytes past a name's NUL, or past the last route, aren't config. */
+    memset(new.units[0].name + strlen(new.units[0].name) + 1, 'x', 4);
+    new.wg0_routes[new.wg0_route_count].address = 1;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == 0);
+
+    new.generation++;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == 0);
+
+    new = old;
+    new.profile = 4;
+    new.roaming = MM_WDS_AUTOCONNECT_ROAM_SETTING_ALWAYS;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) ==
+            (MM_CONFIG_CHANGED_PROFILE | MM_CONFIG_CHANGED_AUTOCONNECT));
+
+    new = old;
+    new.wg0_routes[1].prefix_length = 16;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == MM_CONFIG_CHANGED_WG0);
+
+    new = old;
+    new.wg0_route_count--;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == MM_CONFIG_CHANGED_WG0);
+
+    new = old;
+    new.units[1].after_tunnel = false;
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == MM_CONFIG_CHANGED_UNITS);
+
+    new = old;
+    strcpy(new.units[0].name, "unbound.socket");
+    MM_TEST_CHECK(mm_config_diff(&old, &new) == MM_CONFIG_CHANGED_UNITS);
+}
+
+void test_has_unit(void) {
+    struct mm_config config;
+    struct mm_config_unit unit;
+
+    load_text("", &config);
+    memset(&unit, 0, sizeof(unit));
+
+    strcpy(unit.name, "chrony.service");
+    unit.after_tunnel = true;
+    MM_TEST_CHECK(mm_config_has_unit(&config, &unit));
+
+    unit.after_tunnel = false;
+    MM_TEST_CHECK(!mm_config_has_unit(&config, &unit));
+
+    strcpy(unit.name, "sshd.service");
+    MM_TEST_CHECK(!mm_config_has_unit(&config, &unit));
+}
+
+void test_parse(void) {
+    struct mm_config config;
+
+    load_text("# A comment, then some blank space\n"
+            "\n"
+            "profile 5\n"
+            "autoconnect paused\n"
+            "roaming always\n"
+            "wg0-address 10.20.0.2\n"
+            "wg0-gateway 10.20.0.1\n"
+            "wg0-route 192.168.7.77/24\n"
+            "wg0-route 0.0.0.0/0\n"
+            "unit sshd.service\n"
+            "unit telegraf.service after-tunnel\n", &config);
+
+    MM_TEST_CHECK(config.profile == 5);
+    MM_TEST_CHECK(config.autoconnect == MM_WDS_AUTOCONNECT_SETTING_PAUSED);
+    MM_TEST_CHECK(config.roaming == MM_WDS_AUTOCONNECT_ROAM_SETTING_ALWAYS);
+    MM_TEST_CHECK(config.wg0_address == get_address("10.20.0.2"));
+    MM_TEST_CHECK(config.wg0_gateway == get_address("10.20.0.1"));
+
+    /* Listed routes replace the defaults, with host bits cleared. */
+    MM_TEST_CHECK(config.wg0_route_count == 2);
+    MM_TEST_CHECK(config.wg0_routes[0].address ==
+            get_address("192.168.7.0"));
+    MM_TEST_CHECK(config.wg0_routes[0].prefix_length == 24);
+    MM_TEST_CHECK(config.wg0_routes[1].address == 0);
+    MM_TEST_CHECK(config.wg0_routes[1].prefix_length == 0);
+
+    MM_TEST_CHECK(config.unit_count == 2);
+    MM_TEST_CHECK(!strcmp(config.units[0].name, "sshd.service"));
+    MM_TEST_CHECK(!config.units[0].after_tunnel);
+    MM_TEST_CHECK(!strcmp(config.units[1].name, "telegraf.service"));
+    MM_TEST_CHECK(config.units[1].after_tunnel);
+}
+
+/* Malformed lines are skipped, leaving the defaults in place. */
+void test_rejects_bad_values(void) {
+    struct mm_config config;
+
+    load_text("profile 0\n"
+            "profile 256\n"
+            "profile 5x\n"
+            "autoconnect sometimes\n"
+            "wg0-address 10.20.0\n"
+            "wg0-route 10.0.0.0/33\n"
+            "wg0-route 10.0.0.0\n"
+            "wg0-route 10.0.0.0/\n"
+            "unit sshd.service before-tunnel\n"
+            "bogus keyword\n"
+            "profile\n", &config);
+
+    MM_TEST_CHECK(config.profile == 3);
+    MM_TEST_CHECK(config.autoconnect == MM_WDS_AUTOCONNECT_SETTING_DISABLED);
+    MM_TEST_CHECK(config.wg0_address == get_address("10.10.1.2"));
+    MM_TEST_CHECK(config.wg0_route_count == 2);
+    MM_TEST_CHECK(config.unit_count == 2);
+}
+
+int main(void) {
+    test_defaults();
+    test_diff();
+    test_has_unit();
+    test_parse();
+    test_rejects_bad_values();
+
+    return MM_TEST_RESULT();
+}
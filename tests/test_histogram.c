@@ -0,0 +1,108 @@
+/*
+ * tests/test_histogram.c: Tests for the log-linear histogram
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_histogram.h"
+#include "mm_test.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static void test_bucket_precision(void);
+static void test_clamping(void);
+static void test_empty(void);
+static void test_merge(void);
+static void test_small_values(void);
+
+/* Above the linear range, a reported value is at most 1/8th too high. */
+void test_bucket_precision(void) {
+    struct mm_histogram histogram;
+    uint32_t value, bound;
+
+    for (value = 1; value < UINT32_MAX / 2; value = value * 3 + 1) {
+        memset(&histogram, 0, sizeof(histogram));
+        mm_histogram_record(&histogram, value);
+
+        /* A larger sample keeps the result from being capped at the max. */
+        mm_histogram_record(&histogram, UINT32_MAX);
+        bound = mm_histogram_percentile(&histogram, 500);
+
+        MM_TEST_CHECK(bound >= value);
+        MM_TEST_CHECK(bound - value <= value / MM_HISTOGRAM_SUB_BUCKETS);
+    }
+}
+
+void test_clamping(void) {
+    struct mm_histogram histogram;
+
+    memset(&histogram, 0, sizeof(histogram));
+    mm_histogram_record(&histogram, UINT64_MAX);
+
+    MM_TEST_CHECK(histogram.count == 1);
+    MM_TEST_CHECK(histogram.max == UINT32_MAX);
+    MM_TEST_CHECK(histogram.sum == UINT32_MAX);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 1000) == UINT32_MAX);
+}
+
+void test_empty(void) {
+    struct mm_histogram histogram;
+
+    memset(&histogram, 0, sizeof(histogram));
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 500) == 0);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 1000) == 0);
+}
+
+void test_merge(void) {
+    struct mm_histogram histogram, other;
+    unsigned i;
+
+    memset(&histogram, 0, sizeof(histogram));
+    memset(&other, 0, sizeof(other));
+
+    for (i = 0; i < 4; i++) {
+        mm_histogram_record(&histogram, i);
+        mm_histogram_record(&other, i + 4);
+    }
+
+    mm_histogram_merge(&histogram, &other);
+
+    MM_TEST_CHECK(histogram.count == 8);
+    MM_TEST_CHECK(histogram.sum == 28);
+    MM_TEST_CHECK(histogram.max == 7);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 500) == 3);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 1000) == 7);
+}
+
+/* Values below the sub-bucket count each get a bucket of their own. */
+void test_small_values(void) {
+    struct mm_histogram histogram;
+    unsigned i;
+
+    memset(&histogram, 0, sizeof(histogram));
+
+    for (i = 0; i < MM_HISTOGRAM_SUB_BUCKETS; i++) {
+        mm_histogram_record(&histogram, i);
+    }
+
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 0) == 0);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 500) ==
+            MM_HISTOGRAM_SUB_BUCKETS / 2 - 1);
+    MM_TEST_CHECK(mm_histogram_percentile(&histogram, 1000) ==
+            MM_HISTOGRAM_SUB_BUCKETS - 1);
+}
+
+int main(void) {
+    test_bucket_precision();
+    test_clamping();
+    test_empty();
+    test_merge();
+    test_small_values();
+
+    return MM_TEST_RESULT();
+}
@@ -0,0 +1,213 @@
+/*
+ * tests/test_qmi_engine.c: Tests for the built-in QMI framing and TLVs
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_qmi_engine.h"
+#include "mm_test.h"
+
+#include <qmerrno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TEST_SERVICE 0x01U
+#define TEST_CLIENT_ID 0x05U
+#define TEST_INDICATION 0x0022U
+
+static struct mm_qmi_engine engine;
+
+static size_t build_indication(uint8_t *, uint16_t);
+static void count_indication(const struct mm_qmi_message *, void *);
+
+static void test_find_tlv(void);
+static void test_parse_rejects_bad_lengths(void);
+static void test_request_encoding(void);
+static void test_result_codes(void);
+static void test_resync_after_bad_frame(void);
+
+/* A QMUX frame holding a single indication with no TLVs. */
+size_t build_indication(uint8_t *frame, uint16_t message_id) {
+    static const uint8_t template[] = {
+        0x01, 0x0C, 0x00, 0x80, TEST_SERVICE, TEST_CLIENT_ID,
+        0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+
+    memcpy(frame, template, sizeof(template));
+    frame[9] = (uint8_t) message_id;
+    frame[10] = (uint8_t) (message_id >> 8);
+    return sizeof(template);
+}
+
+void count_indication(const struct mm_qmi_message *message, void *context) {
+    unsigned *count = context;
+
+    if (message->message_id == TEST_INDICATION) {
+        (*count)++;
+    }
+}
+
+void test_find_tlv(void) {
+    static const uint8_t sdu[] = {
+        0x02, 0x01, 0x00, 0x2D, 0x00, 0x18, 0x00,
+        0x01, 0x01, 0x00, 0xAB,
+        0x10, 0x02, 0x00, 0x34, 0x12,
+        0x11, 0x04, 0x00, 0x78, 0x56, 0x34, 0x12,
+        0x12, 0x01, 0x00, 0xFF,
+        0x13, 0x10, 0x00, 0x00,
+    };
+
+    struct mm_qmi_message message;
+    uint32_t u32;
+    uint16_t u16;
+    uint8_t u8;
+
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, sdu, sizeof(sdu)) == 0);
+    MM_TEST_CHECK(message.message_id == 0x002D);
+    MM_TEST_CHECK(message.transaction == 1);
+    MM_TEST_CHECK(message.tlvs_length ==
+            sizeof(sdu) - MM_QMI_SDU_HEADER_SIZE);
+
+    MM_TEST_CHECK(mm_qmi_message_get_u8(&message, 0x01, &u8) && u8 == 0xAB);
+    MM_TEST_CHECK(mm_qmi_message_get_u16(&message, 0x10, &u16) &&
+            u16 == 0x1234);
+    MM_TEST_CHECK(mm_qmi_message_get_u32(&message, 0x11, &u32) &&
+            u32 == 0x12345678);
+
+    /* Too short for the type asked for, absent, or running off the end. */
+    MM_TEST_CHECK(!mm_qmi_message_get_u16(&message, 0x12, &u16));
+    MM_TEST_CHECK(!mm_qmi_message_get_u8(&message, 0x20, &u8));
+    MM_TEST_CHECK(!mm_qmi_message_get_u8(&message, 0x13, &u8));
+}
+
+void test_parse_rejects_bad_lengths(void) {
+    static const uint8_t short_header[] = {0x02, 0x01, 0x00, 0x2D, 0x00};
+    static const uint8_t overlong_tlvs[] = {
+        0x02, 0x01, 0x00, 0x2D, 0x00, 0x08, 0x00,
+        0x01, 0x01, 0x00, 0xAB,
+    };
+
+    struct mm_qmi_message message;
+
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, short_header,
+            sizeof(short_header)) != 0);
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, overlong_tlvs,
+            sizeof(overlong_tlvs)) != 0);
+}
+
+void test_request_encoding(void) {
+    static const uint8_t expected[] = {
+        0x01, 0x01, 0x00, 0x07,
+        0x10, 0x04, 0x00, 0x78, 0x56, 0x34, 0x12,
+    };
+
+    struct mm_qmi_request request;
+    uint8_t filler[MM_QMI_REQUEST_MAX_TLV_SIZE];
+
+    mm_qmi_request_init(&request, 0x0020);
+    mm_qmi_request_put_u8(&request, 0x01, 0x07);
+    mm_qmi_request_put_u32(&request, 0x10, 0x12345678);
+
+    MM_TEST_CHECK(!request.overflowed);
+    MM_TEST_CHECK(request.length == sizeof(expected));
+    MM_TEST_CHECK(!memcmp(request.frame + MM_QMI_QMUX_HEADER_SIZE +
+            MM_QMI_SDU_HEADER_SIZE, expected, sizeof(expected)));
+
+    /* A TLV that doesn't fit is dropped, and the request marked unusable. */
+    memset(filler, 0, sizeof(filler));
+    mm_qmi_request_put(&request, 0x11, filler, sizeof(filler));
+
+    MM_TEST_CHECK(request.overflowed);
+    MM_TEST_CHECK(request.length == sizeof(expected));
+}
+
+void test_result_codes(void) {
+    static const uint8_t success[] = {
+        0x02, 0x01, 0x00, 0x2D, 0x00, 0x07, 0x00,
+        0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+
+    static const uint8_t failure[] = {
+        0x02, 0x01, 0x00, 0x2D, 0x00, 0x07, 0x00,
+        0x02, 0x04, 0x00, 0x01, 0x00, 0x1A, 0x00,
+    };
+
+    static const uint8_t missing[] = {
+        0x02, 0x01, 0x00, 0x2D, 0x00, 0x00, 0x00,
+    };
+
+    struct mm_qmi_message message;
+
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, success,
+            sizeof(success)) == 0);
+    MM_TEST_CHECK(mm_qmi_message_get_result(&message) == eQCWWAN_ERR_NONE);
+
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, failure,
+            sizeof(failure)) == 0);
+    MM_TEST_CHECK(mm_qmi_message_get_result(&message) ==
+            eQCWWAN_ERR_QMI_OFFSET + 0x1A);
+
+    MM_TEST_CHECK(mm_qmi_message_parse(&message, missing,
+            sizeof(missing)) == 0);
+    MM_TEST_CHECK(mm_qmi_message_get_result(&message) ==
+            eQCWWAN_ERR_GENERAL);
+}
+
+/* Good frames either side of garbage must all still be delivered. */
+void test_resync_after_bad_frame(void) {
+    static const uint8_t garbage[] = {0x7E, 0x01, 0x02, 0x00, 0xFF, 0x00};
+    uint8_t buf[64];
+    unsigned count;
+    size_t length;
+    int fds[2];
+
+    if (pipe(fds)) {
+        perror("pipe");
+        mm_test_failures++;
+        return;
+    }
+
+    memset(&engine, 0, sizeof(engine));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    engine.fd = fds[0];
+
+    count = 0;
+    engine.clients[0].callback = count_indication;
+    engine.clients[0].context = &count;
+    engine.clients[0].service = TEST_SERVICE;
+    engine.clients[0].client_id = TEST_CLIENT_ID;
+    engine.clients[0].in_use = true;
+
+    length = build_indication(buf, TEST_INDICATION);
+    memcpy(buf + length, garbage, sizeof(garbage));
+    length += sizeof(garbage);
+    length += build_indication(buf + length, TEST_INDICATION);
+
+    MM_TEST_CHECK(write(fds[1], buf, length) == (ssize_t) length);
+    MM_TEST_CHECK(mm_qmi_engine_dispatch(&engine) == 0);
+    MM_TEST_CHECK(count == 2);
+    MM_TEST_CHECK(engine.rx_start == engine.rx_end);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    test_find_tlv();
+    test_parse_rejects_bad_lengths();
+    test_request_encoding();
+    test_result_codes();
+    test_resync_after_bad_frame();
+
+    return MM_TEST_RESULT();
+}
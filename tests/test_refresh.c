@@ -0,0 +1,218 @@
+/*
+ * tests/test_refresh.c: Tests for the session lifetime estimator
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+/* Included, so that every test can start from no known lifetimes. */
+#include "refresh.c"
+
+#include "mm_test.h"
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define HOUR_MS (3600ULL * 1000U)
+#define MINUTE_MS (60ULL * 1000U)
+
+/* Any reason the network gives, i.e. not REFRESH_REASON_CLIENT_END. */
+#define NETWORK_REASON 3U
+
+static void forget_lifetimes(void);
+
+/* Out of line, so that tests called once from main() still read it. */
+__attribute__(( noinline ))
+static uint64_t now_us(void);
+
+static void remove_directory(const char *);
+
+static void test_estimate(void);
+static void test_failed_refresh(void);
+static void test_is_due(void);
+static void test_load(void);
+
+void forget_lifetimes(void) {
+    memset(refresh.lifetimes_ms, 0, sizeof(refresh.lifetimes_ms));
+    refresh.next = refresh.count = 0;
+    refresh.lifetime_ms = 0;
+}
+
+uint64_t now_us(void) {
+    return mm_time_monotonic_us();
+}
+
+void remove_directory(const char *directory) {
+    char path[PATH_MAX + 256];
+    struct dirent *entry;
+    DIR *dir;
+
+    if ((dir = opendir(directory)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s", directory,
+                        entry->d_name);
+
+                unlink(path);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    rmdir(directory);
+}
+
+void test_estimate(void) {
+    uint64_t lifetime_ms;
+
+    forget_lifetimes();
+
+    /* Ended by us, or too short to be anything but coverage. */
+    mm_refresh_record_session(REFRESH_REASON_CLIENT_END, 24 * HOUR_MS, 0);
+    mm_refresh_record_session(REFRESH_REASON_NONE, 24 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 30 * MINUTE_MS, 0);
+    MM_TEST_CHECK(refresh.count == 0);
+
+    /* Two that agree aren't enough; a third within 5% is. */
+    mm_refresh_record_session(NETWORK_REASON, 24 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 10 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 24 * HOUR_MS + 30 * MINUTE_MS,
+            0);
+    MM_TEST_CHECK(!mm_refresh_get_lifetime(&lifetime_ms));
+
+    mm_refresh_record_session(NETWORK_REASON, 23 * HOUR_MS + 50 * MINUTE_MS,
+            0);
+    MM_TEST_CHECK(mm_refresh_get_lifetime(&lifetime_ms));
+    MM_TEST_CHECK(lifetime_ms == 23 * HOUR_MS + 50 * MINUTE_MS);
+
+    /* Only the last few are kept: enough outliers push the group out. */
+    mm_refresh_record_session(NETWORK_REASON, 2 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 4 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 6 * HOUR_MS, 0);
+    mm_refresh_record_session(NETWORK_REASON, 8 * HOUR_MS, 0);
+    MM_TEST_CHECK(mm_refresh_get_lifetime(&lifetime_ms));
+
+    mm_refresh_record_session(NETWORK_REASON, 12 * HOUR_MS, 0);
+    MM_TEST_CHECK(!mm_refresh_get_lifetime(&lifetime_ms));
+}
+
+/* A replacement ended at the old session's lifetime didn't take. */
+void test_failed_refresh(void) {
+    unsigned i;
+
+    forget_lifetimes();
+
+    for (i = 0; i < MM_REFRESH_MIN_AGREEING; i++) {
+        MM_TEST_CHECK(!mm_refresh_record_session(NETWORK_REASON,
+                24 * HOUR_MS, 0));
+    }
+
+    MM_TEST_CHECK(mm_refresh_record_session(NETWORK_REASON,
+            30 * MINUTE_MS, 24 * HOUR_MS - 30 * MINUTE_MS));
+
+    /* ... and counts towards the lifetime at its full age. */
+    MM_TEST_CHECK(refresh.count == MM_REFRESH_MIN_AGREEING + 1);
+    MM_TEST_CHECK(refresh.lifetimes_ms[MM_REFRESH_MIN_AGREEING] ==
+            24 * HOUR_MS);
+
+    MM_TEST_CHECK(!mm_refresh_record_session(NETWORK_REASON,
+            2 * HOUR_MS, 12 * HOUR_MS));
+    MM_TEST_CHECK(!mm_refresh_record_session(REFRESH_REASON_CLIENT_END,
+            30 * MINUTE_MS, 24 * HOUR_MS - 30 * MINUTE_MS));
+}
+
+void test_is_due(void) {
+    struct mm_refresh_tracker tracker;
+    struct timespec ts = {0, 2000000L};
+    uint64_t started_us, lifetime_us;
+    unsigned i;
+
+    forget_lifetimes();
+    memset(&tracker, 0, sizeof(tracker));
+    started_us = now_us();
+
+    /* Nothing is due without a known lifetime. */
+    MM_TEST_CHECK(!mm_refresh_is_due(&tracker, started_us - 1000, 0));
+
+    for (i = 0; i < MM_REFRESH_MIN_AGREEING; i++) {
+        mm_refresh_record_session(NETWORK_REASON, 24 * HOUR_MS, 0);
+    }
+
+    lifetime_us = 24 * HOUR_MS * 1000U;
+
+    /* Too young: not yet within the window before the lifetime. */
+    MM_TEST_CHECK(!mm_refresh_is_due(&tracker, started_us - lifetime_us / 2,
+            0));
+
+    /* Within the window, but busy, then quiet. */
+    started_us = now_us();
+    MM_TEST_CHECK(!mm_refresh_is_due(&tracker, started_us - lifetime_us +
+            10 * MINUTE_MS * 1000U, 0));
+
+    nanosleep(&ts, NULL);
+    MM_TEST_CHECK(!mm_refresh_is_due(&tracker, started_us - lifetime_us +
+            10 * MINUTE_MS * 1000U, UINT32_MAX));
+
+    nanosleep(&ts, NULL);
+    MM_TEST_CHECK(mm_refresh_is_due(&tracker, started_us - lifetime_us +
+            10 * MINUTE_MS * 1000U, UINT32_MAX));
+
+    /* Having asked once, don't ask again until the retry interval. */
+    nanosleep(&ts, NULL);
+    MM_TEST_CHECK(!mm_refresh_is_due(&tracker, started_us - lifetime_us +
+            10 * MINUTE_MS * 1000U, UINT32_MAX));
+
+    /* Within the margin, it's due even without a sample to go on. */
+    memset(&tracker, 0, sizeof(tracker));
+    MM_TEST_CHECK(mm_refresh_is_due(&tracker, started_us - lifetime_us +
+            MINUTE_MS * 1000U, 0));
+}
+
+/* Lifetimes are seeded from the sessions in the history store. */
+void test_load(void) {
+    char directory[] = "/tmp/mm-refresh-test.XXXXXX";
+    uint64_t lifetime_ms;
+    unsigned i;
+
+    forget_lifetimes();
+    MM_TEST_CHECK(mkdtemp(directory) != NULL);
+    MM_TEST_CHECK(mm_tsdb_open(directory) == 0);
+
+    for (i = 0; i < MM_REFRESH_MIN_AGREEING; i++) {
+        mm_tsdb_append(MM_TSDB_SERIES_SESSION, MM_TSDB_TAG_IPV4,
+                NETWORK_REASON, (int64_t) (12 * HOUR_MS));
+    }
+
+    /* IPv6 sessions, and ones we ended, don't count. */
+    mm_tsdb_append(MM_TSDB_SERIES_SESSION, MM_TSDB_TAG_IPV6,
+            NETWORK_REASON, (int64_t) (6 * HOUR_MS));
+    mm_tsdb_append(MM_TSDB_SERIES_SESSION, MM_TSDB_TAG_IPV4,
+            REFRESH_REASON_CLIENT_END, (int64_t) (6 * HOUR_MS));
+
+    mm_tsdb_close();
+
+    MM_TEST_CHECK(mm_refresh_load(directory) == 0);
+    MM_TEST_CHECK(refresh.count == MM_REFRESH_MIN_AGREEING);
+    MM_TEST_CHECK(mm_refresh_get_lifetime(&lifetime_ms));
+    MM_TEST_CHECK(lifetime_ms == 12 * HOUR_MS);
+
+    remove_directory(directory);
+}
+
+int main(void) {
+    test_estimate();
+    test_failed_refresh();
+    test_is_due();
+    test_load();
+
+    return MM_TEST_RESULT();
+}
@@ -0,0 +1,137 @@
+/*
+ * tests/test_slo.c: Tests for the rolling availability windows
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+/* Windows span hours: drive the internals with made-up times instead. */
+#include "slo.c"
+
+#include "mm_test.h"
+
+#include <time.h>
+
+#define HOUR_US (3600ULL * 1000000U)
+#define MINUTE_US (60ULL * 1000000U)
+
+/* Far enough from zero that no window reaches back past it. */
+#define T0_US (1000U * HOUR_US)
+
+static void sleep_ms(unsigned);
+
+static void test_long_outage_fills_window(void);
+static void test_session_events(void);
+static void test_uptime_and_expiry(void);
+
+void sleep_ms(unsigned milliseconds) {
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long) milliseconds * 1000000L;
+    while (nanosleep(&ts, &ts));
+}
+
+/* An outage longer than a window counts for all of it (within a slot). */
+void test_long_outage_fills_window(void) {
+    struct mm_slo_series series;
+    uint64_t slot_us = HOUR_US / MM_SLO_SLOTS;
+
+    memset(&series, 0, sizeof(series));
+    series.state = SLO_STATE_DOWN;
+    series.updated_us = T0_US + 7 * MINUTE_US;
+    accrue(&series, series.updated_us + 3 * HOUR_US);
+
+    MM_TEST_CHECK(series.windows[0].up_us == 0);
+    MM_TEST_CHECK(series.windows[0].down_us <= HOUR_US);
+    MM_TEST_CHECK(series.windows[0].down_us >= HOUR_US - slot_us);
+    MM_TEST_CHECK(series.windows[1].down_us == 3 * HOUR_US);
+}
+
+/* The public entry points, against the real clock. */
+void test_session_events(void) {
+    const struct mm_slo_window *window;
+    char *text = NULL;
+    size_t length;
+    FILE *f;
+
+    mm_slo_session_up(0, MM_SLO_FAMILY_IPV4);
+    mm_slo_session_down(0, MM_SLO_FAMILY_IPV4, true);
+    sleep_ms(20);
+    mm_slo_session_up(0, MM_SLO_FAMILY_IPV4);
+
+    /* Not an outage: no drop, and no downtime accrues while idle. */
+    mm_slo_session_down(0, MM_SLO_FAMILY_IPV4, false);
+    sleep_ms(200);
+    mm_slo_session_up(0, MM_SLO_FAMILY_IPV4);
+
+    /* Out of range modems are ignored. */
+    mm_slo_session_down(MM_HOTPLUG_MAX_MODEMS, MM_SLO_FAMILY_IPV4, true);
+
+    window = slo_series[0][MM_SLO_FAMILY_IPV4].windows;
+    MM_TEST_CHECK(window->drops == 1);
+    MM_TEST_CHECK(window->recoveries == 1);
+    MM_TEST_CHECK(window->recovery_ms >= 20);
+    MM_TEST_CHECK(window->down_us >= 20000);
+    MM_TEST_CHECK(window->down_us < 200000);
+    MM_TEST_CHECK(!slo_series[0][MM_SLO_FAMILY_IPV6].tracked);
+
+    if ((f = open_memstream(&text, &length)) == NULL) {
+        perror("open_memstream");
+        mm_test_failures++;
+        return;
+    }
+
+    mm_slo_write_metrics(f, NULL);
+    fclose(f);
+
+    MM_TEST_CHECK(strstr(text, "modem_monitor_slo_drops{modem=\"0\","
+            "family=\"ipv4\",window=\"1h\"} 1\n") != NULL);
+    MM_TEST_CHECK(strstr(text, "modem_monitor_slo_recovery_seconds_count{"
+            "modem=\"0\",family=\"ipv4\",window=\"7d\"} 1\n") != NULL);
+    MM_TEST_CHECK(strstr(text, "family=\"ipv6\"") == NULL);
+    free(text);
+}
+
+void test_uptime_and_expiry(void) {
+    struct mm_slo_series series;
+    uint64_t now_us;
+
+    memset(&series, 0, sizeof(series));
+    now_us = series.updated_us = T0_US;
+
+    series.state = SLO_STATE_UP;
+    accrue(&series, now_us += 30 * MINUTE_US);
+    series.state = SLO_STATE_DOWN;
+    accrue(&series, now_us += 10 * MINUTE_US);
+
+    MM_TEST_CHECK(series.windows[0].up_us == 30 * MINUTE_US);
+    MM_TEST_CHECK(series.windows[0].down_us == 10 * MINUTE_US);
+    MM_TEST_CHECK(series.windows[2].up_us == 30 * MINUTE_US);
+
+    /* Idle time adds nothing, but older slots still expire. */
+    series.state = SLO_STATE_IDLE;
+    accrue(&series, now_us += 2 * HOUR_US);
+
+    MM_TEST_CHECK(series.windows[0].up_us == 0);
+    MM_TEST_CHECK(series.windows[0].down_us == 0);
+    MM_TEST_CHECK(series.windows[1].up_us == 30 * MINUTE_US);
+    MM_TEST_CHECK(series.windows[1].down_us == 10 * MINUTE_US);
+
+    accrue(&series, now_us + 8 * 24 * HOUR_US);
+
+    MM_TEST_CHECK(series.windows[1].up_us == 0);
+    MM_TEST_CHECK(series.windows[2].up_us == 0);
+    MM_TEST_CHECK(series.windows[2].down_us == 0);
+}
+
+int main(void) {
+    test_long_outage_fills_window();
+    test_session_events();
+    test_uptime_and_expiry();
+
+    return MM_TEST_RESULT();
+}
@@ -0,0 +1,253 @@
+/*
+ * tests/test_tsdb.c: Tests for the on-disk time-series store
+ *
+ * modem-monitor: A WWAN modem monitoring and control daemon
+ * Copyright (C) 2024, Tyler J. Stachecki
+ *
+ * This file is subject to the terms and conditions defined in
+ * 'LICENSE', which is part of this source code package.
+ */
+
+#include "mm_test.h"
+#include "mm_tsdb.h"
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_COLLECTED 16U
+
+struct collected_samples {
+    struct mm_tsdb_sample samples[MAX_COLLECTED];
+    unsigned count, stop_after;
+};
+
+static int collect_sample(const struct mm_tsdb_sample *, void *);
+static void remove_directory(const char *);
+
+static void test_append_and_query(void);
+static void test_non_monotonic_bases(void);
+static void test_query_bounds(void);
+static void test_visitor_stops_query(void);
+
+static void write_segment(const char *, uint32_t, uint64_t,
+        const uint32_t *, unsigned);
+
+int collect_sample(const struct mm_tsdb_sample *sample, void *context) {
+    struct collected_samples *collected = context;
+
+    if (collected->count < MAX_COLLECTED) {
+        collected->samples[collected->count] = *sample;
+    }
+
+    collected->count++;
+    return collected->stop_after && collected->count >= collected->stop_after;
+}
+
+void remove_directory(const char *directory) {
+    char path[PATH_MAX + 256];
+    struct dirent *entry;
+    DIR *dir;
+
+    if ((dir = opendir(directory)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s", directory,
+                        entry->d_name);
+
+                unlink(path);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    rmdir(directory);
+}
+
+/* Samples are only visible once staged records are written out. */
+void test_append_and_query(void) {
+    struct collected_samples collected;
+    char directory[] = "/tmp/mm-tsdb-test.XXXXXX";
+
+    MM_TEST_CHECK(mkdtemp(directory) != NULL);
+    MM_TEST_CHECK(mm_tsdb_open(directory) == 0);
+
+    MM_TEST_CHECK(mm_tsdb_append(MM_TSDB_SERIES_SESSION,
+            MM_TSDB_TAG_IPV4, 1, 42) == 0);
+    MM_TEST_CHECK(mm_tsdb_append(MM_TSDB_SERIES_SIGNAL, 0, 0, -85) == 0);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 0, UINT64_MAX, collect_sample,
+            &collected) == 0);
+    MM_TEST_CHECK(collected.count == 0);
+
+    MM_TEST_CHECK(mm_tsdb_flush(true) == 0);
+    mm_tsdb_close();
+
+    /* Reopening resumes the same segment rather than starting another. */
+    MM_TEST_CHECK(mm_tsdb_open(directory) == 0);
+    MM_TEST_CHECK(mm_tsdb_append(MM_TSDB_SERIES_RX_BYTES, 0, 0,
+            INT64_MAX) == 0);
+    mm_tsdb_close();
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 0, UINT64_MAX, collect_sample,
+            &collected) == 0);
+
+    MM_TEST_CHECK(collected.count == 3);
+    MM_TEST_CHECK(collected.samples[0].series == MM_TSDB_SERIES_SESSION);
+    MM_TEST_CHECK(collected.samples[0].tag == MM_TSDB_TAG_IPV4);
+    MM_TEST_CHECK(collected.samples[0].aux == 1);
+    MM_TEST_CHECK(collected.samples[0].value == 42);
+    MM_TEST_CHECK(collected.samples[1].series == MM_TSDB_SERIES_SIGNAL);
+    MM_TEST_CHECK(collected.samples[1].value == -85);
+    MM_TEST_CHECK(collected.samples[2].series == MM_TSDB_SERIES_RX_BYTES);
+    MM_TEST_CHECK(collected.samples[2].value == INT64_MAX);
+    MM_TEST_CHECK(collected.samples[0].realtime_ms <=
+            collected.samples[1].realtime_ms);
+    MM_TEST_CHECK(collected.samples[1].realtime_ms <=
+            collected.samples[2].realtime_ms);
+
+    remove_directory(directory);
+}
+
+/* Without an RTC, a later segment can have an earlier base than its peers. */
+void test_non_monotonic_bases(void) {
+    static const uint32_t deltas[] = {0, 100};
+    struct collected_samples collected;
+    char directory[] = "/tmp/mm-tsdb-test.XXXXXX";
+
+    MM_TEST_CHECK(mkdtemp(directory) != NULL);
+    write_segment(directory, 0, 10000, deltas, 2);
+    write_segment(directory, 1, 1000, deltas, 2);
+    write_segment(directory, 2, 20000, deltas, 2);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 1000, 1100, collect_sample,
+            &collected) == 0);
+
+    MM_TEST_CHECK(collected.count == 2);
+    MM_TEST_CHECK(collected.samples[0].realtime_ms == 1000);
+    MM_TEST_CHECK(collected.samples[1].realtime_ms == 1100);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 10050, 20000, collect_sample,
+            &collected) == 0);
+
+    MM_TEST_CHECK(collected.count == 2);
+    MM_TEST_CHECK(collected.samples[0].realtime_ms == 10100);
+    MM_TEST_CHECK(collected.samples[1].realtime_ms == 20000);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 0, UINT64_MAX, collect_sample,
+            &collected) == 0);
+    MM_TEST_CHECK(collected.count == 6);
+
+    remove_directory(directory);
+}
+
+/* Both ends of the range are inclusive. */
+void test_query_bounds(void) {
+    static const uint32_t deltas[] = {0, 10, 20, 30, 40, 50, 60, 70};
+    struct collected_samples collected;
+    char directory[] = "/tmp/mm-tsdb-test.XXXXXX";
+
+    MM_TEST_CHECK(mkdtemp(directory) != NULL);
+    write_segment(directory, 0, 5000, deltas, 8);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 5020, 5040, collect_sample,
+            &collected) == 0);
+
+    MM_TEST_CHECK(collected.count == 3);
+    MM_TEST_CHECK(collected.samples[0].realtime_ms == 5020);
+    MM_TEST_CHECK(collected.samples[2].realtime_ms == 5040);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 5071, 6000, collect_sample,
+            &collected) == 0);
+    MM_TEST_CHECK(collected.count == 0);
+
+    memset(&collected, 0, sizeof(collected));
+    MM_TEST_CHECK(mm_tsdb_query(directory, 0, 4999, collect_sample,
+            &collected) == 0);
+    MM_TEST_CHECK(collected.count == 0);
+
+    remove_directory(directory);
+}
+
+void test_visitor_stops_query(void) {
+    static const uint32_t deltas[] = {0, 10, 20};
+    struct collected_samples collected;
+    char directory[] = "/tmp/mm-tsdb-test.XXXXXX";
+
+    MM_TEST_CHECK(mkdtemp(directory) != NULL);
+    write_segment(directory, 0, 0, deltas, 3);
+    write_segment(directory, 1, 100, deltas, 3);
+
+    memset(&collected, 0, sizeof(collected));
+    collected.stop_after = 2;
+
+    MM_TEST_CHECK(mm_tsdb_query(directory, 0, UINT64_MAX, collect_sample,
+            &collected) == 0);
+    MM_TEST_CHECK(collected.count == 2);
+
+    remove_directory(directory);
+}
+
+/* Lays out a segment by hand, as a prior boot would have left it. */
+void write_segment(const char *directory, uint32_t sequence,
+        uint64_t base_ms, const uint32_t *deltas, unsigned count) {
+    struct mm_tsdb_record *records;
+    struct mm_tsdb_header *header;
+    char path[PATH_MAX + 16];
+    unsigned i;
+    int fd;
+
+    if ((records = calloc(1, MM_TSDB_SEGMENT_SIZE)) == NULL) {
+        MM_TEST_CHECK(records != NULL);
+        return;
+    }
+
+    header = (struct mm_tsdb_header *) records;
+    header->magic = MM_TSDB_MAGIC;
+    header->version = MM_TSDB_VERSION;
+    header->record_size = sizeof(struct mm_tsdb_record);
+    header->base_ms = base_ms;
+
+    for (i = 0; i < count; i++) {
+        records[i + 1].delta_ms = deltas[i];
+        records[i + 1].series = MM_TSDB_SERIES_SIGNAL;
+        records[i + 1].value = (int64_t) i;
+    }
+
+    snprintf(path, sizeof(path), "%s/%08"PRIx32".seg", directory, sequence);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        MM_TEST_CHECK(write(fd, records, MM_TSDB_SEGMENT_SIZE) ==
+                (ssize_t) MM_TSDB_SEGMENT_SIZE);
+
+        close(fd);
+    }
+
+    MM_TEST_CHECK(fd >= 0);
+    free(records);
+}
+
+int main(void) {
+    test_append_and_query();
+    test_non_monotonic_bases();
+    test_query_bounds();
+    test_visitor_stops_query();
+
+    return MM_TEST_RESULT();
+}